@@ -65,6 +65,9 @@ local function print_stat(st, tabs)
   if st['deleted'] then
     print(string.format('%sDeleted: %s', tabs, print_num(st['deleted'])))
   end
+  if st['crypto_time'] then
+    print(string.format('%sCrypto time: %.3f sec', tabs, st['crypto_time']))
+  end
 end
 
 -- Sort by checked
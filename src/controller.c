@@ -59,6 +59,7 @@
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
 #define PATH_COUNTERS "/counters"
+#define PATH_MEMPOOL "/mempool"
 #define PATH_ERRORS "/errors"
 #define PATH_NEIGHBOURS "/neighbours"
 #define PATH_PLUGINS "/plugins"
@@ -2575,7 +2576,7 @@ rspamd_controller_handle_stat_common (
 	struct rspamd_controller_session *session = conn_ent->ud;
 	ucl_object_t *top, *sub;
 	gint i;
-	guint64 spam = 0, ham = 0;
+	guint64 spam = 0, ham = 0, re_hits, re_misses;
 	rspamd_mempool_stat_t mem_st;
 	struct rspamd_stat *stat, stat_copy;
 	struct rspamd_controller_worker_ctx *ctx;
@@ -2647,6 +2648,16 @@ rspamd_controller_handle_stat_common (
 		ucl_object_fromint (stat->control_connections_count),
 		"control_connections", 0, false);
 
+	if (rspamd_re_cache_get_shared_stat (session->cfg->re_cache,
+			&re_hits, &re_misses)) {
+		sub = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (sub, ucl_object_fromint (re_hits),
+				"hits", 0, false);
+		ucl_object_insert_key (sub, ucl_object_fromint (re_misses),
+				"misses", 0, false);
+		ucl_object_insert_key (top, sub, "re_cache_shared", 0, false);
+	}
+
 	ucl_object_insert_key (top,
 		ucl_object_fromint (mem_st.pools_allocated), "pools_allocated", 0,
 		false);
@@ -2668,6 +2679,8 @@ rspamd_controller_handle_stat_common (
 			mem_st.oversized_chunks), "chunks_oversized", 0, false);
 	ucl_object_insert_key (top,
 			ucl_object_fromint (mem_st.fragmented_size), "fragmented", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (mem_st.chunks_reused), "chunks_reused", 0, false);
 
 	if (do_reset) {
 		session->ctx->srv->stat->messages_scanned = 0;
@@ -2751,6 +2764,31 @@ rspamd_controller_handle_counters (
 	return 0;
 }
 
+/*
+ * Mempool command handler:
+ * request: /mempool
+ * headers: Password
+ * reply: json array of memory pools allocation sites
+ */
+static int
+rspamd_controller_handle_mempool (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	ucl_object_t *top;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	top = rspamd_mempool_sites_ucl ();
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	return 0;
+}
+
 static int
 rspamd_controller_handle_custom (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
@@ -3645,6 +3683,9 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 			rspamd_controller_handle_counters);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_MEMPOOL,
+			rspamd_controller_handle_mempool);
 	rspamd_http_router_add_path (ctx->http,
 			PATH_ERRORS,
 			rspamd_controller_handle_errors);
@@ -45,10 +45,20 @@
 #define DEFAULT_KEYPAIR_CACHE_SIZE 512
 #define DEFAULT_MASTER_TIMEOUT 10.0
 #define DEFAULT_UPDATES_MAXFAIL 3
+#define DEFAULT_UPDATES_BATCH 1024
 #define COOKIE_SIZE 128
 #define DEFAULT_MAX_BUCKETS 2000
 #define DEFAULT_BUCKET_TTL 3600
 #define DEFAULT_BUCKET_MASK 24
+#ifdef HAVE_RECVMMSG
+#define MSGVEC_LEN 16
+#else
+#define MSGVEC_LEN 1
+#endif
+#ifdef HAVE_SENDMMSG
+/* Maximum number of replies sent by a single sendmmsg call */
+#define REPLY_BATCH_LEN 64
+#endif
 
 static const gchar *local_db_name = "local";
 
@@ -110,6 +120,7 @@ struct fuzzy_key_stat {
 	guint64 added;
 	guint64 deleted;
 	guint64 errors;
+	gdouble crypto_time;
 	rspamd_lru_hash_t *last_ips;
 	ref_entry_t ref;
 };
@@ -167,8 +178,14 @@ struct rspamd_fuzzy_storage_ctx {
 	GArray *updates_pending;
 	guint updates_failed;
 	guint updates_maxfail;
+	/* Queue is flushed before sync timeout once it has this many updates */
+	guint updates_batch;
+	ev_timer updates_flush_ev;
 	/* Used to send data between workers */
 	gint peer_fd;
+	/* Replies flushed at the end of the event loop iteration */
+	GPtrArray *replies_pending;
+	ev_prepare replies_ev;
 
 	/* Ratelimits */
 	guint leaky_bucket_ttl;
@@ -224,6 +241,22 @@ struct fuzzy_key {
 	struct fuzzy_key_stat *stat;
 };
 
+/*
+ * Shared secrets computed for packets received by a single recvmmsg call:
+ * clients usually send several packets with the same ephemeral key
+ */
+struct fuzzy_nm_batch_elt {
+	guchar key_id[RSPAMD_FUZZY_KEYLEN];
+	guchar pubkey[32];
+	struct fuzzy_key *key;
+	guchar nm[rspamd_cryptobox_MAX_NMBYTES];
+};
+
+struct fuzzy_nm_batch {
+	struct fuzzy_nm_batch_elt elts[MSGVEC_LEN];
+	guint nelts;
+};
+
 struct rspamd_updates_cbdata {
 	GArray *updates_pending;
 	struct rspamd_fuzzy_storage_ctx *ctx;
@@ -233,6 +266,7 @@ struct rspamd_updates_cbdata {
 
 
 static void rspamd_fuzzy_write_reply (struct fuzzy_session *session);
+static void rspamd_fuzzy_queue_reply (struct fuzzy_session *session);
 static gboolean rspamd_fuzzy_process_updates_queue (
 		struct rspamd_fuzzy_storage_ctx *ctx,
 		const gchar *source, gboolean final);
@@ -553,6 +587,32 @@ rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx,
 	return FALSE;
 }
 
+static void
+rspamd_fuzzy_updates_flush_cb (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx =
+			(struct rspamd_fuzzy_storage_ctx *)w->data;
+
+	if (ctx->updates_pending->len >= ctx->updates_batch) {
+		rspamd_fuzzy_process_updates_queue (ctx, local_db_name, FALSE);
+	}
+}
+
+/*
+ * Commits a large enough queue on the next loop iteration, after replies for
+ * the current commands are sent, instead of waiting for sync timeout
+ */
+static void
+rspamd_fuzzy_maybe_flush_updates (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	if (ctx->worker->index == 0 && ctx->updates_batch > 0 &&
+			ctx->updates_pending->len >= ctx->updates_batch &&
+			!ev_is_active (&ctx->updates_flush_ev)) {
+		ev_timer_set (&ctx->updates_flush_ev, 0.0, 0.0);
+		ev_timer_start (ctx->event_loop, &ctx->updates_flush_ev);
+	}
+}
+
 static void
 rspamd_fuzzy_reply_io (EV_P_ ev_io *w, int revents)
 {
@@ -563,36 +623,40 @@ rspamd_fuzzy_reply_io (EV_P_ ev_io *w, int revents)
 	REF_RELEASE (session);
 }
 
-static void
-rspamd_fuzzy_write_reply (struct fuzzy_session *session)
+static gconstpointer
+rspamd_fuzzy_reply_data (struct fuzzy_session *session, gsize *plen)
 {
-	gssize r;
-	gsize len;
-	gconstpointer data;
-
 	if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
 				session->cmd_type == CMD_ENCRYPTED_SHINGLE) {
 		/* Encrypted reply */
-		data = &session->reply;
-
 		if (session->epoch > RSPAMD_FUZZY_EPOCH10) {
-			len = sizeof (session->reply);
+			*plen = sizeof (session->reply);
 		}
 		else {
-			len = sizeof (session->reply.hdr) + sizeof (session->reply.rep.v1);
+			*plen = sizeof (session->reply.hdr) + sizeof (session->reply.rep.v1);
 		}
+
+		return &session->reply;
 	}
-	else {
-		data = &session->reply.rep;
 
-		if (session->epoch > RSPAMD_FUZZY_EPOCH10) {
-			len = sizeof (session->reply.rep);
-		}
-		else {
-			len = sizeof (session->reply.rep.v1);
-		}
+	if (session->epoch > RSPAMD_FUZZY_EPOCH10) {
+		*plen = sizeof (session->reply.rep);
+	}
+	else {
+		*plen = sizeof (session->reply.rep.v1);
 	}
 
+	return &session->reply.rep;
+}
+
+static void
+rspamd_fuzzy_write_reply (struct fuzzy_session *session)
+{
+	gssize r;
+	gsize len;
+	gconstpointer data;
+
+	data = rspamd_fuzzy_reply_data (session, &len);
 	r = rspamd_inet_address_sendto (session->fd, data, len, 0,
 			session->addr);
 
@@ -611,6 +675,97 @@ rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 	}
 }
 
+#ifdef HAVE_SENDMMSG
+/*
+ * Sends pending replies using one sendmmsg call per socket, replies that
+ * could not be sent are written one by one (waiting for socket if needed)
+ */
+static void
+rspamd_fuzzy_flush_replies (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct mmsghdr msg[REPLY_BATCH_LEN];
+	struct iovec iovs[REPLY_BATCH_LEN];
+	struct fuzzy_session *session;
+	socklen_t slen;
+	guint i, j, nmsg;
+	gint fd, r;
+
+	ev_prepare_stop (ctx->event_loop, &ctx->replies_ev);
+
+	for (i = 0; i < ctx->replies_pending->len; ) {
+		session = g_ptr_array_index (ctx->replies_pending, i);
+		fd = session->fd;
+		memset (msg, 0, sizeof (msg));
+
+		for (j = i, nmsg = 0; j < ctx->replies_pending->len &&
+				nmsg < REPLY_BATCH_LEN; j ++, nmsg ++) {
+			session = g_ptr_array_index (ctx->replies_pending, j);
+
+			if (session->fd != fd) {
+				break;
+			}
+
+			iovs[nmsg].iov_base = (void *)rspamd_fuzzy_reply_data (session,
+					&iovs[nmsg].iov_len);
+			msg[nmsg].msg_hdr.msg_name = rspamd_inet_address_get_sa (
+					session->addr, &slen);
+			msg[nmsg].msg_hdr.msg_namelen = slen;
+			msg[nmsg].msg_hdr.msg_iov = &iovs[nmsg];
+			msg[nmsg].msg_hdr.msg_iovlen = 1;
+		}
+
+		do {
+			r = sendmmsg (fd, msg, nmsg, 0);
+		} while (r == -1 && errno == EINTR);
+
+		if (r == -1) {
+			r = 0;
+		}
+
+		/* Fallback to a single reply write */
+		for (i += r; i < j; i ++) {
+			rspamd_fuzzy_write_reply (g_ptr_array_index (ctx->replies_pending, i));
+		}
+	}
+
+	for (i = 0; i < ctx->replies_pending->len; i ++) {
+		session = g_ptr_array_index (ctx->replies_pending, i);
+		REF_RELEASE (session);
+	}
+
+	g_ptr_array_set_size (ctx->replies_pending, 0);
+}
+
+static void
+rspamd_fuzzy_replies_prepare (EV_P_ ev_prepare *w, int revents)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx =
+			(struct rspamd_fuzzy_storage_ctx *)w->data;
+
+	rspamd_fuzzy_flush_replies (ctx);
+}
+#endif
+
+static void
+rspamd_fuzzy_queue_reply (struct fuzzy_session *session)
+{
+#ifdef HAVE_SENDMMSG
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+
+	REF_RETAIN (session);
+	g_ptr_array_add (ctx->replies_pending, session);
+
+	if (ctx->replies_pending->len >= REPLY_BATCH_LEN) {
+		rspamd_fuzzy_flush_replies (ctx);
+	}
+	else if (!ev_is_active (&ctx->replies_ev)) {
+		ev_prepare_start (ctx->event_loop, &ctx->replies_ev);
+	}
+#else
+	rspamd_fuzzy_write_reply (session);
+#endif
+}
+
 static void
 rspamd_fuzzy_update_stats (struct rspamd_fuzzy_storage_ctx *ctx,
 		enum rspamd_fuzzy_epoch epoch,
@@ -679,6 +834,7 @@ rspamd_fuzzy_make_reply (struct rspamd_fuzzy_cmd *cmd,
 		gboolean encrypted, gboolean is_shingle)
 {
 	gsize len;
+	gdouble t1;
 
 	if (cmd) {
 		result->v1.tag = cmd->tag;
@@ -695,6 +851,7 @@ rspamd_fuzzy_make_reply (struct rspamd_fuzzy_cmd *cmd,
 
 		if (encrypted) {
 			/* We need also to encrypt reply */
+			t1 = rspamd_get_ticks (FALSE);
 			ottery_rand_bytes (session->reply.hdr.nonce,
 					sizeof (session->reply.hdr.nonce));
 
@@ -716,10 +873,14 @@ rspamd_fuzzy_make_reply (struct rspamd_fuzzy_cmd *cmd,
 					session->nm,
 					session->reply.hdr.mac,
 					RSPAMD_CRYPTOBOX_MODE_25519);
+
+			if (session->key_stat) {
+				session->key_stat->crypto_time += rspamd_get_ticks (FALSE) - t1;
+			}
 		}
 	}
 
-	rspamd_fuzzy_write_reply (session);
+	rspamd_fuzzy_queue_reply (session);
 }
 
 static gboolean
@@ -870,6 +1031,7 @@ rspamd_fuzzy_check_callback (struct rspamd_fuzzy_reply *result, void *ud)
 			}
 
 			g_array_append_val (session->ctx->updates_pending, up_cmd);
+			rspamd_fuzzy_maybe_flush_updates (session->ctx);
 		}
 		else {
 			/* We need to send request to the peer */
@@ -1076,6 +1238,7 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 						(gpointer)&up_cmd.cmd.normal;
 				memcpy (ptr, cmd, up_len);
 				g_array_append_val (session->ctx->updates_pending, up_cmd);
+				rspamd_fuzzy_maybe_flush_updates (session->ctx);
 			}
 			else {
 				/* We need to send request to the peer */
@@ -1161,60 +1324,100 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 	return ret;
 }
 
-static gboolean
-rspamd_fuzzy_decrypt_command (struct fuzzy_session *s, guchar *buf, gsize buflen)
+static struct fuzzy_nm_batch_elt *
+rspamd_fuzzy_nm_batch_lookup (struct fuzzy_session *s,
+		struct fuzzy_nm_batch *nm_batch,
+		const struct rspamd_fuzzy_encrypted_req_hdr *hdr)
 {
-	struct rspamd_fuzzy_encrypted_req_hdr hdr;
+	struct fuzzy_nm_batch_elt *elt;
 	struct rspamd_cryptobox_pubkey *rk;
 	struct fuzzy_key *key;
+	guint i;
 
-	if (s->ctx->default_key == NULL) {
-		msg_warn ("received encrypted request when encryption is not enabled");
-		return FALSE;
-	}
+	for (i = 0; i < nm_batch->nelts; i ++) {
+		elt = &nm_batch->elts[i];
 
-	if (buflen < sizeof (hdr)) {
-		msg_warn ("XXX: should not be reached");
-		return FALSE;
+		if (memcmp (elt->pubkey, hdr->pubkey, sizeof (elt->pubkey)) == 0 &&
+				memcmp (elt->key_id, hdr->key_id, sizeof (elt->key_id)) == 0) {
+			return elt;
+		}
 	}
 
-	memcpy (&hdr, buf, sizeof (hdr));
-	buf += sizeof (hdr);
-	buflen -= sizeof (hdr);
-
 	/* Try to find the desired key */
-	key = g_hash_table_lookup (s->ctx->keys, hdr.key_id);
+	key = g_hash_table_lookup (s->ctx->keys, hdr->key_id);
 
 	if (key == NULL) {
 		/* Unknown key, assume default one */
 		key = s->ctx->default_key;
 	}
 
-	s->key_stat = key->stat;
-
 	/* Now process keypair */
-	rk = rspamd_pubkey_from_bin (hdr.pubkey, sizeof (hdr.pubkey),
+	rk = rspamd_pubkey_from_bin (hdr->pubkey, sizeof (hdr->pubkey),
 			RSPAMD_KEYPAIR_KEX, RSPAMD_CRYPTOBOX_MODE_25519);
 
 	if (rk == NULL) {
 		msg_err ("bad key");
-		return FALSE;
+		return NULL;
 	}
 
 	rspamd_keypair_cache_process (s->ctx->keypair_cache, key->key, rk);
 
+	/* Batch is never overflowed as it has a slot per packet */
+	g_assert (nm_batch->nelts < G_N_ELEMENTS (nm_batch->elts));
+	elt = &nm_batch->elts[nm_batch->nelts ++];
+	memcpy (elt->key_id, hdr->key_id, sizeof (elt->key_id));
+	memcpy (elt->pubkey, hdr->pubkey, sizeof (elt->pubkey));
+	memcpy (elt->nm, rspamd_pubkey_get_nm (rk, key->key), sizeof (elt->nm));
+	elt->key = key;
+	rspamd_pubkey_unref (rk);
+
+	return elt;
+}
+
+static gboolean
+rspamd_fuzzy_decrypt_command (struct fuzzy_session *s, guchar *buf, gsize buflen,
+		struct fuzzy_nm_batch *nm_batch)
+{
+	struct rspamd_fuzzy_encrypted_req_hdr hdr;
+	struct fuzzy_nm_batch_elt *elt;
+	gdouble t1;
+
+	if (s->ctx->default_key == NULL) {
+		msg_warn ("received encrypted request when encryption is not enabled");
+		return FALSE;
+	}
+
+	if (buflen < sizeof (hdr)) {
+		msg_warn ("XXX: should not be reached");
+		return FALSE;
+	}
+
+	memcpy (&hdr, buf, sizeof (hdr));
+	buf += sizeof (hdr);
+	buflen -= sizeof (hdr);
+
+	t1 = rspamd_get_ticks (FALSE);
+	elt = rspamd_fuzzy_nm_batch_lookup (s, nm_batch, &hdr);
+
+	if (elt == NULL) {
+		return FALSE;
+	}
+
+	s->key_stat = elt->key->stat;
+
 	/* Now decrypt request */
 	if (!rspamd_cryptobox_decrypt_nm_inplace (buf, buflen, hdr.nonce,
-			rspamd_pubkey_get_nm (rk, key->key),
-			hdr.mac, RSPAMD_CRYPTOBOX_MODE_25519)) {
+			elt->nm, hdr.mac, RSPAMD_CRYPTOBOX_MODE_25519)) {
 		msg_err ("decryption failed");
-		rspamd_pubkey_unref (rk);
 
 		return FALSE;
 	}
 
-	memcpy (s->nm, rspamd_pubkey_get_nm (rk, key->key), sizeof (s->nm));
-	rspamd_pubkey_unref (rk);
+	memcpy (s->nm, elt->nm, sizeof (s->nm));
+
+	if (s->key_stat) {
+		s->key_stat->crypto_time += rspamd_get_ticks (FALSE) - t1;
+	}
 
 	return TRUE;
 }
@@ -1350,7 +1553,8 @@ rspamd_fuzzy_extensions_from_wire (struct fuzzy_session *s, guchar *buf, gsize b
 }
 
 static gboolean
-rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
+rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s,
+		struct fuzzy_nm_batch *nm_batch)
 {
 	enum rspamd_fuzzy_epoch epoch;
 	gboolean encrypted = FALSE;
@@ -1371,7 +1575,7 @@ rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 
 	if (encrypted) {
 		/* Decrypt first */
-		if (!rspamd_fuzzy_decrypt_command (s, buf, buflen)) {
+		if (!rspamd_fuzzy_decrypt_command (s, buf, buflen, nm_batch)) {
 			return FALSE;
 		}
 		else {
@@ -1467,11 +1671,6 @@ fuzzy_session_destroy (gpointer d)
 }
 
 #define FUZZY_INPUT_BUFLEN 1024
-#ifdef HAVE_RECVMMSG
-#define MSGVEC_LEN 16
-#else
-#define MSGVEC_LEN 1
-#endif
 
 /*
  * Accept new connection and construct task
@@ -1485,6 +1684,7 @@ accept_fuzzy_socket (EV_P_ ev_io *w, int revents)
 	guint64 *nerrors;
 	struct iovec iovs[MSGVEC_LEN];
 	guint8 bufs[MSGVEC_LEN][FUZZY_INPUT_BUFLEN];
+	struct fuzzy_nm_batch nm_batch;
 	struct sockaddr_storage peer_sa[MSGVEC_LEN];
 	socklen_t salen = sizeof (peer_sa[0]);
 #ifdef HAVE_RECVMMSG
@@ -1538,6 +1738,8 @@ accept_fuzzy_socket (EV_P_ ev_io *w, int revents)
 			r = 1; /* Assume that we have received a single message */
 #endif
 
+			nm_batch.nelts = 0;
+
 			for (int i = 0; i < r; i ++) {
 				session = g_malloc0 (sizeof (*session));
 				REF_INIT_RETAIN (session, fuzzy_session_destroy);
@@ -1555,7 +1757,7 @@ accept_fuzzy_socket (EV_P_ ev_io *w, int revents)
 #endif
 
 				if (rspamd_fuzzy_cmd_from_wire (iovs[i].iov_base,
-						msg_len, session)) {
+						msg_len, session, &nm_batch)) {
 					/* Check shingles count sanity */
 					rspamd_fuzzy_process_command (session);
 				}
@@ -1650,7 +1852,7 @@ rspamd_fuzzy_storage_reload (struct rspamd_main *rspamd_main,
 	memset (&rep, 0, sizeof (rep));
 	rep.type = RSPAMD_CONTROL_RELOAD;
 
-	if ((ctx->backend = rspamd_fuzzy_backend_create (ctx->event_loop,
+	if ((ctx->backend = rspamd_fuzzy_backend_create (ctx->event_loop, worker,
 			worker->cf->options, rspamd_main->cfg,
 			&err)) == NULL) {
 		msg_err ("cannot open backend after reload: %e", err);
@@ -1719,6 +1921,10 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			rspamd_snprintf (keyname, sizeof (keyname), "%8bs", k);
 
 			elt = rspamd_fuzzy_storage_stat_key (key_stat);
+			/* Time spent in decrypting requests and encrypting replies */
+			ucl_object_insert_key (elt,
+					ucl_object_fromdouble (key_stat->crypto_time),
+					"crypto_time", 0, false);
 
 			if (key_stat->last_ips && ip_stat) {
 				i = 0;
@@ -2053,6 +2259,7 @@ init_fuzzy (struct rspamd_config *cfg)
 			(rspamd_mempool_destruct_t)rspamd_lru_hash_destroy, ctx->errors_ips);
 	ctx->cfg = cfg;
 	ctx->updates_maxfail = DEFAULT_UPDATES_MAXFAIL;
+	ctx->updates_batch = DEFAULT_UPDATES_BATCH;
 	ctx->leaky_bucket_mask = DEFAULT_BUCKET_MASK;
 	ctx->leaky_bucket_ttl = DEFAULT_BUCKET_TTL;
 	ctx->max_buckets = DEFAULT_MAX_BUCKETS;
@@ -2155,6 +2362,14 @@ init_fuzzy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, updates_maxfail),
 			RSPAMD_CL_FLAG_UINT,
 			"Maximum number of updates to be failed before discarding");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"updates_batch",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, updates_batch),
+			RSPAMD_CL_FLAG_UINT,
+			"Commit updates once this many of them are queued (0 to commit on sync timeout only)");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"skip_hashes",
@@ -2251,6 +2466,8 @@ rspamd_fuzzy_peer_io (EV_P_ ev_io *w, int revents)
 			g_array_append_val (ctx->updates_pending, cmd);
 		}
 	}
+
+	rspamd_fuzzy_maybe_flush_updates (ctx);
 }
 
 static void
@@ -2335,6 +2552,14 @@ start_fuzzy (struct rspamd_worker *worker)
 	ctx->peer_fd = -1;
 	ctx->worker = worker;
 	ctx->cfg = worker->srv->cfg;
+	ctx->replies_pending = g_ptr_array_new ();
+	ctx->updates_flush_ev.data = ctx;
+	ev_timer_init (&ctx->updates_flush_ev, rspamd_fuzzy_updates_flush_cb,
+			0.0, 0.0);
+#ifdef HAVE_SENDMMSG
+	ctx->replies_ev.data = ctx;
+	ev_prepare_init (&ctx->replies_ev, rspamd_fuzzy_replies_prepare);
+#endif
 	ctx->resolver = rspamd_dns_resolver_init (worker->srv->logger,
 			ctx->event_loop,
 			worker->srv->cfg);
@@ -2350,7 +2575,7 @@ start_fuzzy (struct rspamd_worker *worker)
 	}
 
 
-	if ((ctx->backend = rspamd_fuzzy_backend_create (ctx->event_loop,
+	if ((ctx->backend = rspamd_fuzzy_backend_create (ctx->event_loop, worker,
 			worker->cf->options, cfg, &err)) == NULL) {
 		msg_err ("cannot open backend: %e", err);
 		if (err) {
@@ -2496,6 +2721,7 @@ start_fuzzy (struct rspamd_worker *worker)
 
 	ev_loop (ctx->event_loop, 0);
 	rspamd_worker_block_signals ();
+	ev_timer_stop (ctx->event_loop, &ctx->updates_flush_ev);
 
 	if (ctx->peer_fd != -1) {
 		if (worker->index == 0) {
@@ -2523,6 +2749,11 @@ start_fuzzy (struct rspamd_worker *worker)
 		g_array_free (ctx->updates_pending, TRUE);
 	}
 
+#ifdef HAVE_SENDMMSG
+	rspamd_fuzzy_flush_replies (ctx);
+#endif
+	g_ptr_array_free (ctx->replies_pending, TRUE);
+
 	if (ctx->keypair_cache) {
 		rspamd_keypair_cache_destroy (ctx->keypair_cache);
 	}
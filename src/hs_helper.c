@@ -57,6 +57,8 @@ struct hs_helper_ctx {
 	gboolean loaded;
 	gdouble max_time;
 	gdouble recompile_time;
+	gdouble compile_start;
+	guint compile_workers;
 	ev_timer recompile_timer;
 };
 
@@ -74,6 +76,11 @@ init_hs_helper (struct rspamd_config *cfg)
 	ctx->hs_dir = NULL;
 	ctx->max_time = default_max_time;
 	ctx->recompile_time = default_recompile_time;
+#ifdef HAVE_SC_NPROCESSORS_ONLN
+	ctx->compile_workers = MAX (1, sysconf (_SC_NPROCESSORS_ONLN) / 2);
+#else
+	ctx->compile_workers = 1;
+#endif
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -107,6 +114,14 @@ init_hs_helper (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct hs_helper_ctx, max_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Maximum time to wait for compilation of a single expression");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"compile_workers",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct hs_helper_ctx, compile_workers),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of processes used to compile changed classes");
 
 	return ctx;
 }
@@ -172,6 +187,41 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 		ret = FALSE;
 	}
 
+	globfree (&globbuf);
+
+	/* Shared mappings of databases, see mmap_hyperscan option */
+	memset (&globbuf, 0, sizeof (globbuf));
+	rspamd_snprintf (pattern, len, "%s%c%s", ctx->hs_dir, G_DIR_SEPARATOR, "*.hsmp*");
+	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			gchar *hs_path, *suffix;
+			gboolean stale;
+
+			hs_path = g_strdup (globbuf.gl_pathv[i]);
+			suffix = strrchr (hs_path, '.');
+			/* Temporary files are named as `<hash>.hsmp.<pid>` */
+			stale = strcmp (suffix, ".hsmp") != 0;
+
+			if (!stale) {
+				/* `<hash>.hsmp` -> `<hash>.hs` */
+				suffix[3] = '\0';
+				stale = forced || access (hs_path, R_OK) == -1;
+			}
+
+			g_free (hs_path);
+
+			if (stale && unlink (globbuf.gl_pathv[i]) == -1) {
+				msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
+						strerror (errno));
+				ret = FALSE;
+			}
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err ("glob %s failed: %s", pattern, strerror (errno));
+		ret = FALSE;
+	}
+
 	globfree (&globbuf);
 	g_free (pattern);
 
@@ -223,18 +273,25 @@ rspamd_rs_compile_cb (guint ncompiled, GError *err, void *cbd)
 	 * Do not send notification unless all other workers are started
 	 * XXX: now we just sleep for 5 seconds to ensure that
 	 */
+	if (err != NULL) {
+		msg_err ("cannot compile hyperscan tree: %e", err);
+	}
+
 	if (!ctx->loaded) {
 		when = 5.0; /* Postpone */
 		ctx->loaded = TRUE;
-		msg_info ("compiled %d regular expressions to the hyperscan tree, "
+		msg_info ("compiled %d regular expressions to the hyperscan tree "
+				  "in %.2f seconds, "
 				  "postpone loaded notification for %.0f seconds to avoid races",
 				ncompiled,
+				rspamd_get_ticks (FALSE) - ctx->compile_start,
 				when);
 	}
 	else {
-		msg_info ("compiled %d regular expressions to the hyperscan tree, "
-				  "send loaded notification",
-				ncompiled);
+		msg_info ("compiled %d regular expressions to the hyperscan tree "
+				  "in %.2f seconds, send loaded notification",
+				ncompiled,
+				rspamd_get_ticks (FALSE) - ctx->compile_start);
 	}
 
 	tm = g_malloc0 (sizeof (*tm));
@@ -258,9 +315,12 @@ rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 	}
 
 	hack_global_forced = forced; /* killmeplease */
+	ctx->compile_start = rspamd_get_ticks (FALSE);
 	rspamd_re_cache_compile_hyperscan (ctx->cfg->re_cache,
 			ctx->hs_dir, ctx->max_time, !forced,
+			ctx->compile_workers,
 			ctx->event_loop,
+			worker,
 			rspamd_rs_compile_cb,
 			(void *)worker);
 
@@ -222,6 +222,15 @@ rspamd_mime_part_detect_language (struct rspamd_task *task,
 	}
 }
 
+static inline void
+rspamd_mime_text_part_add_newline (struct rspamd_mime_text_part *part)
+{
+	/* Offset is converted to a pointer once stripped content is ready */
+	gpointer off = (gpointer)(goffset)part->utf_stripped_content->len;
+
+	rspamd_mempool_array_append (part->newlines, &off);
+}
+
 static void
 rspamd_strip_newlines_parse (struct rspamd_task *task,
 		const gchar *begin, const gchar *pe,
@@ -292,8 +301,7 @@ rspamd_strip_newlines_parse (struct rspamd_task *task,
 					g_byte_array_append (part->utf_stripped_content,
 							(const guint8 *)" ", 1);
 					crlf_added = TRUE;
-					g_ptr_array_add (part->newlines,
-							(((gpointer) (goffset) (part->utf_stripped_content->len))));
+					rspamd_mime_text_part_add_newline (part);
 				}
 
 				part->nlines ++;
@@ -326,8 +334,7 @@ rspamd_strip_newlines_parse (struct rspamd_task *task,
 				if (IS_PART_HTML (part) || !url_open_bracket) {
 					g_byte_array_append (part->utf_stripped_content,
 							(const guint8 *)" ", 1);
-					g_ptr_array_add (part->newlines,
-							(((gpointer) (goffset) (part->utf_stripped_content->len))));
+					rspamd_mime_text_part_add_newline (part);
 					crlf_added = TRUE;
 				}
 				else {
@@ -344,8 +351,7 @@ rspamd_strip_newlines_parse (struct rspamd_task *task,
 						crlf_added = TRUE;
 					}
 
-					g_ptr_array_add (part->newlines,
-							(((gpointer) (goffset) (part->utf_stripped_content->len))));
+					rspamd_mime_text_part_add_newline (part);
 				}
 
 				c = p + 1;
@@ -358,8 +364,7 @@ rspamd_strip_newlines_parse (struct rspamd_task *task,
 					g_byte_array_append (part->utf_stripped_content,
 							(const guint8 *)" ", 1);
 					crlf_added = TRUE;
-					g_ptr_array_add (part->newlines,
-							(((gpointer) (goffset) (part->utf_stripped_content->len))));
+					rspamd_mime_text_part_add_newline (part);
 				}
 
 				part->nlines++;
@@ -412,8 +417,7 @@ rspamd_strip_newlines_parse (struct rspamd_task *task,
 				part->nlines ++;
 
 				if (!crlf_added) {
-					g_ptr_array_add (part->newlines,
-							(((gpointer) (goffset) (part->utf_stripped_content->len))));
+					rspamd_mime_text_part_add_newline (part);
 				}
 
 				/* Skip initial spaces */
@@ -480,8 +484,7 @@ rspamd_strip_newlines_parse (struct rspamd_task *task,
 			if (!crlf_added) {
 				g_byte_array_append (part->utf_stripped_content,
 						(const guint8 *)" ", 1);
-				g_ptr_array_add (part->newlines,
-						(((gpointer) (goffset) (part->utf_stripped_content->len))));
+				rspamd_mime_text_part_add_newline (part);
 			}
 
 			part->nlines++;
@@ -506,7 +509,8 @@ rspamd_normalize_text_part (struct rspamd_task *task,
 	struct rspamd_process_exception *ex;
 	UErrorCode uc_err = U_ZERO_ERROR;
 
-	part->newlines = g_ptr_array_sized_new (128);
+	part->newlines = rspamd_mempool_array_new (task->task_pool,
+			sizeof (gpointer), 128);
 
 	if (IS_PART_EMPTY (part)) {
 		part->utf_stripped_content = g_byte_array_new ();
@@ -521,13 +525,15 @@ rspamd_normalize_text_part (struct rspamd_task *task,
 
 		for (i = 0; i < part->newlines->len; i ++) {
 			ex = rspamd_mempool_alloc (task->task_pool, sizeof (*ex));
-			off = (goffset)g_ptr_array_index (part->newlines, i);
-			g_ptr_array_index (part->newlines, i) = (gpointer)(goffset)
-					(part->utf_stripped_content->data + off);
+			off = (goffset)rspamd_mempool_array_index (part->newlines,
+					gpointer, i);
+			rspamd_mempool_array_index (part->newlines, gpointer, i) =
+					(gpointer)(goffset)(part->utf_stripped_content->data + off);
 			ex->pos = off;
 			ex->len = 0;
 			ex->type = RSPAMD_EXCEPTION_NEWLINE;
-			part->exceptions = g_list_prepend (part->exceptions, ex);
+			part->exceptions = rspamd_mempool_glist_prepend (task->task_pool,
+					part->exceptions, ex);
 		}
 	}
 
@@ -553,9 +559,6 @@ rspamd_normalize_text_part (struct rspamd_task *task,
 			part->utf_stripped_content);
 	rspamd_mempool_notify_alloc (task->task_pool,
 			part->utf_stripped_content->len);
-	rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t) rspamd_ptr_array_free_hard,
-			part->newlines);
 }
 
 #define MIN3(a, b, c) ((a) < (b) ? ((a) < (c) ? (a) : (c)) : ((b) < (c) ? (b) : (c)))
@@ -893,11 +896,9 @@ rspamd_message_process_text_part_maybe (struct rspamd_task *task,
 	}
 
 	if (text_part->exceptions) {
+		/* List cells are allocated in the task pool */
 		text_part->exceptions = g_list_sort (text_part->exceptions,
 				exceptions_compare_func);
-		rspamd_mempool_add_destructor (task->task_pool,
-				(rspamd_mempool_destruct_t)g_list_free,
-				text_part->exceptions);
 	}
 
 	rspamd_mime_part_create_words (task, text_part);
@@ -144,7 +144,7 @@ struct rspamd_mime_text_part {
 	GArray *utf_words;
 	UText utf_stripped_text; /* Used by libicu to represent the utf8 content */
 
-	GPtrArray *newlines;    /**< positions of newlines in text, relative to content*/
+	rspamd_mempool_array_t *newlines; /**< positions of newlines in text, relative to content*/
 	struct html_content *html;
 	GList *exceptions;    /**< list of offsets of urls						*/
 	struct rspamd_mime_part *mime_part;
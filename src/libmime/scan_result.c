@@ -35,11 +35,22 @@ INIT_LOG_MODULE(metric)
 /* Average symbols count to optimize hash allocation */
 static struct rspamd_counter_data symbols_count;
 
+static guint
+rspamd_symopt_hash_func (gconstpointer opt)
+{
+	return rspamd_symopt_hash (opt);
+}
+
+static gboolean
+rspamd_symopt_equal_func (gconstpointer o1, gconstpointer o2)
+{
+	return rspamd_symopt_equal (o1, o2);
+}
+
 static void
 rspamd_scan_result_dtor (gpointer d)
 {
 	struct rspamd_scan_result *r = (struct rspamd_scan_result *)d;
-	struct rspamd_symbol_result sres;
 
 	rspamd_set_counter_ema (&symbols_count, kh_size (r->symbols), 0.5);
 
@@ -47,11 +58,7 @@ rspamd_scan_result_dtor (gpointer d)
 		luaL_unref (r->task->cfg->lua_state, LUA_REGISTRYINDEX, r->symbol_cbref);
 	}
 
-	kh_foreach_value (r->symbols, sres, {
-		if (sres.options) {
-			kh_destroy (rspamd_options_hash, sres.options);
-		}
-	});
+	/* Symbols options are allocated in the task pool */
 	kh_destroy (rspamd_symbols_hash, r->symbols);
 	kh_destroy (rspamd_symbols_group_hash, r->sym_groups);
 }
@@ -186,6 +193,26 @@ rspamd_check_group_score (struct rspamd_task *task,
 #define DBL_EPSILON 2.2204460492503131e-16
 #endif
 
+/*
+ * Symbols used by composites that remove weight can lose their score in the
+ * end, so keep sums of such scores for the early termination
+ */
+static inline void
+rspamd_scan_result_track_removable (struct rspamd_scan_result *metric_res,
+		struct rspamd_symbol *sdef, gdouble diff)
+{
+	if (sdef == NULL || !(sdef->flags & RSPAMD_SYMBOL_FLAG_COMPOSITE_REMOVABLE)) {
+		return;
+	}
+
+	if (diff > 0) {
+		metric_res->removable_pos += diff;
+	}
+	else {
+		metric_res->removable_neg += diff;
+	}
+}
+
 static struct rspamd_symbol_result *
 insert_metric_result (struct rspamd_task *task,
 					  const gchar *symbol,
@@ -238,6 +265,11 @@ insert_metric_result (struct rspamd_task *task,
 
 		final_score = (*sdef->weight_ptr) * weight;
 
+		if (sdef->cache_item && task->cfg->cache) {
+			rspamd_symcache_item_check_multiplier (task->cfg->cache,
+					sdef->cache_item, weight);
+		}
+
 		PTR_ARRAY_FOREACH (sdef->groups, i, gr) {
 			k = kh_get (rspamd_symbols_group_hash, metric_res->sym_groups, gr);
 
@@ -372,6 +404,7 @@ insert_metric_result (struct rspamd_task *task,
 			if (!isnan (diff)) {
 				metric_res->score += diff;
 				metric_res->grow_factor = next_gf;
+				rspamd_scan_result_track_removable (metric_res, sdef, diff);
 
 				if (single) {
 					msg_debug_metric ("final score for single symbol %s = %.2f; %.2f diff",
@@ -450,6 +483,7 @@ insert_metric_result (struct rspamd_task *task,
 			metric_res->score += final_score;
 			metric_res->grow_factor = next_gf;
 			s->score = final_score;
+			rspamd_scan_result_track_removable (metric_res, sdef, final_score);
 
 			if (final_score > epsilon) {
 				metric_res->npositive ++;
@@ -673,8 +707,6 @@ rspamd_task_add_result_option (struct rspamd_task *task,
 	gboolean ret = FALSE;
 	gchar *opt_cpy = NULL;
 	gsize cpy_len;
-	khiter_t k;
-	gint r;
 
 	if (s && val) {
 		if (s->opts_len < 0) {
@@ -685,7 +717,8 @@ rspamd_task_add_result_option (struct rspamd_task *task,
 		}
 
 		if (!s->options) {
-			s->options = kh_init (rspamd_options_hash);
+			s->options = rspamd_mempool_hash_set_new (task->task_pool,
+					rspamd_symopt_hash_func, rspamd_symopt_equal_func, 0);
 		}
 
 		if (vlen + s->opts_len > task->cfg->max_opts_len) {
@@ -698,19 +731,18 @@ rspamd_task_add_result_option (struct rspamd_task *task,
 		}
 
 		if (!(s->sym && (s->sym->flags & RSPAMD_SYMBOL_FLAG_ONEPARAM)) &&
-				kh_size (s->options) < task->cfg->default_max_shots) {
+				s->options->nelts < task->cfg->default_max_shots) {
 			opt_cpy = rspamd_task_option_safe_copy (task, val, vlen, &cpy_len);
 			/* Append new options */
 			srch.option = (gchar *)opt_cpy;
 			srch.optlen = cpy_len;
-			k = kh_get (rspamd_options_hash, s->options, &srch);
 
-			if (k == kh_end (s->options)) {
+			if (rspamd_mempool_hash_set_lookup (s->options, &srch) == NULL) {
 				opt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*opt));
 				opt->optlen = cpy_len;
 				opt->option = opt_cpy;
 
-				kh_put (rspamd_options_hash, s->options, opt, &r);
+				rspamd_mempool_hash_set_add (s->options, opt);
 				DL_APPEND (s->opts_head, opt);
 
 				ret = TRUE;
@@ -29,14 +29,14 @@ enum rspamd_symbol_result_flags {
 	RSPAMD_SYMBOL_RESULT_IGNORED = (1 << 0)
 };
 
-struct kh_rspamd_options_hash_s;
+struct rspamd_mempool_hash_set_s;
 
 /**
  * Rspamd symbol
  */
 struct rspamd_symbol_result {
 	double score;                                  /**< symbol's score							*/
-	struct kh_rspamd_options_hash_s *options;         /**< list of symbol's options				*/
+	struct rspamd_mempool_hash_set_s *options;      /**< set of symbol's options				*/
 	struct rspamd_symbol_option *opts_head;        /**< head of linked list of options			*/
 	const gchar *name;
 	struct rspamd_symbol *sym;                     /**< symbol configuration					*/
@@ -79,6 +79,8 @@ struct rspamd_scan_result {
 	struct rspamd_passthrough_result *passthrough_result;
 	double positive_score;
 	double negative_score;
+	double removable_pos;                              /**< scores that composites could remove */
+	double removable_neg;
 	struct kh_rspamd_symbols_hash_s *symbols;            /**< symbols of metric						*/
 	struct kh_rspamd_symbols_group_hash_s *sym_groups; /**< groups of symbols						*/
 	struct rspamd_action_result *actions_limits;
@@ -27,8 +27,6 @@ rspamd_symopt_equal (const struct rspamd_symbol_option *o1,
 	return false;
 }
 
-KHASH_INIT (rspamd_options_hash, struct rspamd_symbol_option *, char,
-		0, rspamd_symopt_hash, rspamd_symopt_equal);
 /**
  * Result of metric processing
  */
@@ -48,6 +48,7 @@ struct worker_s;
 struct rspamd_external_libs_ctx;
 struct rspamd_cryptobox_pubkey;
 struct rspamd_dns_resolver;
+struct rspamd_composites_index;
 
 /**
  * Types of rspamd bind lines
@@ -131,6 +132,7 @@ enum rspamd_symbol_flags {
 	RSPAMD_SYMBOL_FLAG_UNGROUPPED = (1 << 3),
 	RSPAMD_SYMBOL_FLAG_DISABLED = (1 << 4),
 	RSPAMD_SYMBOL_FLAG_UNSCORED = (1 << 5),
+	RSPAMD_SYMBOL_FLAG_COMPOSITE_REMOVABLE = (1 << 6),
 };
 
 /**
@@ -152,12 +154,22 @@ struct rspamd_symbol {
 /**
  * Statfile config definition
  */
+/**
+ * Statfile counters kept in shared memory, so they are the same for all
+ * processes that use a statfile
+ */
+struct rspamd_statfile_shared_stat {
+	guint64 cache_hits;                             /**< values found in the backend's cache					*/
+	guint64 cache_misses;                           /**< values requested from the backend					*/
+};
+
 struct rspamd_statfile_config {
 	gchar *symbol;                                  /**< symbol of statfile									*/
 	gchar *label;                                   /**< label of this statfile								*/
 	ucl_object_t *opts;                             /**< other options										*/
 	gboolean is_spam;                               /**< spam flag											*/
 	struct rspamd_classifier_config *clcf;            /**< parent pointer of classifier configuration			*/
+	struct rspamd_statfile_shared_stat *shared_stat;  /**< counters shared between processes				*/
 	gpointer data;                                    /**< opaque data 										*/
 };
 
@@ -366,6 +378,8 @@ struct rspamd_config {
 	gboolean allow_raw_input;                       /**< scan messages with invalid mime					*/
 	gboolean disable_hyperscan;                     /**< disable hyperscan usage							*/
 	gboolean vectorized_hyperscan;                  /**< use vectorized hyperscan matching					*/
+	gboolean prefetch_hyperscan;                    /**< scan all message classes on the first regexp		*/
+	gboolean mmap_hyperscan;                        /**< share deserialized hyperscan databases via mmap	*/
 	gboolean enable_shutdown_workaround;            /**< enable workaround for legacy SA clients (exim)		*/
 	gboolean ignore_received;                       /**< Ignore data from the first received header			*/
 	gboolean enable_sessions_cache;                 /**< Enable session cache for debug						*/
@@ -416,6 +430,8 @@ struct rspamd_config {
 	ucl_object_t *doc_strings;                      /**< documentation strings for config options			*/
 	GPtrArray *c_modules;                           /**< list of C modules			*/
 	GHashTable *composite_symbols;                 /**< hash of composite symbols indexed by its name		*/
+	struct rspamd_composites_index *composites_index; /**< composites compiled to symbols cache ids		*/
+	guint composites_version;                       /**< changed when composites or groups are modified		*/
 	GList *classifiers;                             /**< list of all classifiers defined                    */
 	GList *statfiles;                               /**< list of all statfiles in config file order         */
 	GHashTable *classifiers_symbols;                /**< hashtable indexed by symbol name of classifiers    */
@@ -436,6 +452,10 @@ struct rspamd_config {
 	struct rspamd_symcache *cache;                    /**< symbols cache object								*/
 	gchar *cache_filename;                          /**< filename of cache file								*/
 	gdouble cache_reload_time;                      /**< how often cache reload should be performed			*/
+	gboolean cache_io_first;                        /**< start network bound symbols first					*/
+	gboolean cache_early_termination;               /**< stop filters when action cannot be changed			*/
+	gdouble cache_min_multiplier;                   /**< min dynamic weight assumed by early termination	*/
+	gdouble cache_max_multiplier;                   /**< max dynamic weight assumed by early termination	*/
 	gchar *checksum;                               /**< real checksum of config file						*/
 	gpointer lua_state;                             /**< pointer to lua state								*/
 	gpointer lua_thread_pool;                       /**< pointer to lua thread (coroutine) pool				*/
@@ -485,6 +505,8 @@ struct rspamd_config {
 	struct rspamd_redis_pool *redis_pool;            /**< redis connectiosn pool								*/
 
 	struct rspamd_re_cache *re_cache;                /**< static regexp cache								*/
+	guint re_cache_shared_size;                     /**< elements in shared regexp results cache			*/
+	gdouble re_cache_shared_ttl;                    /**< ttl of shared regexp results						*/
 
 	GHashTable *trusted_keys;                        /**< list of trusted public keys						*/
 
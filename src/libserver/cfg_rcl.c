@@ -1484,6 +1484,7 @@ rspamd_rcl_composite_handler (rspamd_mempool_t *pool,
 	g_hash_table_insert (cfg->composite_symbols,
 			(gpointer)composite_name,
 			composite);
+	cfg->composites_version ++;
 
 	if (new) {
 		rspamd_symcache_add_symbol (cfg->cache, composite_name, 0,
@@ -1830,6 +1831,30 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, cache_reload_time),
 				RSPAMD_CL_FLAG_TIME_FLOAT,
 				"How often cache reload should be performed");
+		rspamd_rcl_add_default_handler (sub,
+				"cache_io_first",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, cache_io_first),
+				0,
+				"Start network bound symbols as early as possible and defer CPU heavy symbols");
+		rspamd_rcl_add_default_handler (sub,
+				"cache_early_termination",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, cache_early_termination),
+				0,
+				"Stop checking filters when remaining symbols cannot change the action");
+		rspamd_rcl_add_default_handler (sub,
+				"cache_min_multiplier",
+				rspamd_rcl_parse_struct_double,
+				G_STRUCT_OFFSET (struct rspamd_config, cache_min_multiplier),
+				0,
+				"Minimum dynamic weight of symbols assumed by early termination");
+		rspamd_rcl_add_default_handler (sub,
+				"cache_max_multiplier",
+				rspamd_rcl_parse_struct_double,
+				G_STRUCT_OFFSET (struct rspamd_config, cache_max_multiplier),
+				0,
+				"Maximum dynamic weight of symbols assumed by early termination");
 		/* Old DNS configuration */
 		rspamd_rcl_add_default_handler (sub,
 				"dns_nameserver",
@@ -2065,6 +2090,30 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, vectorized_hyperscan),
 				0,
 				"Use hyperscan in vectorized mode (experimental)");
+		rspamd_rcl_add_default_handler (sub,
+				"prefetch_hyperscan",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, prefetch_hyperscan),
+				0,
+				"Scan hyperscan databases of all message-wide regexp classes on the first regexp request");
+		rspamd_rcl_add_default_handler (sub,
+				"mmap_hyperscan",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, mmap_hyperscan),
+				0,
+				"Load hyperscan databases to file mappings shared by all workers");
+		rspamd_rcl_add_default_handler (sub,
+				"re_cache_shared_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, re_cache_shared_size),
+				RSPAMD_CL_FLAG_UINT,
+				"Number of messages whose regexp results are shared between workers (0 to disable)");
+		rspamd_rcl_add_default_handler (sub,
+				"re_cache_shared_ttl",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, re_cache_shared_ttl),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"How long regexp results of a message are reused by other workers");
 		rspamd_rcl_add_default_handler (sub,
 				"cores_dir",
 				rspamd_rcl_parse_struct_string,
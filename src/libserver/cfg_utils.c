@@ -219,6 +219,9 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->log_error_elts = 10;
 	cfg->log_error_elt_maxlen = 1000;
 	cfg->cache_reload_time = 30.0;
+	cfg->cache_min_multiplier = 0.0;
+	cfg->cache_max_multiplier = 1.0;
+	cfg->re_cache_shared_ttl = 60.0;
 	cfg->max_lua_urls = 1024;
 	cfg->max_urls = cfg->max_lua_urls * 10;
 	cfg->max_recipients = 1024;
@@ -1069,6 +1072,12 @@ rspamd_config_new_statfile (struct rspamd_config *cfg,
 				sizeof (struct rspamd_statfile_config));
 	}
 
+	if (c->shared_stat == NULL) {
+		/* Statfiles are configured before workers are forked */
+		c->shared_stat = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+				sizeof (struct rspamd_statfile_shared_stat));
+	}
+
 	return c;
 }
 
@@ -1105,6 +1114,7 @@ rspamd_config_new_group (struct rspamd_config *cfg, const gchar *name)
 	}
 
 	g_hash_table_insert (cfg->groups, gr->name, gr);
+	cfg->composites_version ++;
 
 	return gr;
 }
@@ -1675,6 +1685,7 @@ rspamd_config_new_symbol (struct rspamd_config *cfg, const gchar *symbol,
 
 	sym_def->gr = sym_group;
 	g_hash_table_insert (sym_group->symbols, sym_def->name, sym_def);
+	cfg->composites_version ++;
 
 	if (!(sym_def->flags & RSPAMD_SYMBOL_FLAG_UNGROUPPED)) {
 		g_ptr_array_add (sym_def->groups, sym_group);
@@ -1727,6 +1738,7 @@ rspamd_config_add_symbol (struct rspamd_config *cfg,
 				}
 
 				g_hash_table_insert (sym_group->symbols, sym_def->name, sym_def);
+				cfg->composites_version ++;
 				sym_def->flags &= ~(RSPAMD_SYMBOL_FLAG_UNGROUPPED);
 				g_ptr_array_add (sym_def->groups, sym_group);
 			}
@@ -1805,6 +1817,7 @@ rspamd_config_add_symbol (struct rspamd_config *cfg,
 					g_hash_table_remove (sym_def->gr->symbols, sym_def->name);
 					sym_def->gr = sym_group;
 					g_hash_table_insert (sym_group->symbols, sym_def->name, sym_def);
+					cfg->composites_version ++;
 				}
 			}
 
@@ -1859,6 +1872,7 @@ rspamd_config_add_symbol_group (struct rspamd_config *cfg,
 			}
 
 			g_hash_table_insert (sym_group->symbols, sym_def->name, sym_def);
+			cfg->composites_version ++;
 			sym_def->flags &= ~(RSPAMD_SYMBOL_FLAG_UNGROUPPED);
 			g_ptr_array_add (sym_def->groups, sym_group);
 
@@ -43,12 +43,36 @@
 
 INIT_LOG_MODULE(composites)
 
+/*
+ * Composites compiled over symbols cache ids: every distinct symbol used in
+ * atoms has a slot that is used to find its result without hashing names,
+ * and there is an inverted index from slots to composites using them, so
+ * only composites with some of their atoms inserted are evaluated
+ */
+struct rspamd_composites_index {
+	guint version; /* Version of composites and groups used to build index */
+	guint nsize;
+	guint ncomposites; /* Max composite id + 1 */
+	guint nslots;
+	guint nids;
+	guint nvids;
+	gint *slot_by_id; /* Symcache id -> slot or -1 */
+	gint *slot_by_vid; /* Symcache virtual id -> slot or -1 */
+	gint *comp_slot; /* Composite id -> slot of its symbol or -1 */
+	guint *slot_offsets; /* Composites using slot `i` are in [offsets[i], offsets[i + 1]) */
+	guint *slot_composites;
+	guint8 *always; /* Composites that must be evaluated unconditionally */
+};
+
 struct composites_data {
 	struct rspamd_task *task;
 	struct rspamd_composite *composite;
 	struct rspamd_scan_result *metric_res;
 	GHashTable *symbols_to_remove;
 	guint8 *checked;
+	const struct rspamd_composites_index *idx;
+	struct rspamd_symbol_result **slots;
+	guint8 *pending;
 };
 
 struct rspamd_composite_option_match {
@@ -64,9 +88,23 @@ struct rspamd_composite_option_match {
 	struct rspamd_composite_option_match *prev, *next;
 };
 
+/* Symbol resolved at compile time */
+struct rspamd_composite_atom_sym {
+	const gchar *name;
+	gint slot; /* -1 if symbol is unknown for symbols cache */
+	struct rspamd_composite *ncomp; /* Symbol is another composite */
+	struct rspamd_symbol *sdef; /* Definition of a group member */
+};
+
 struct rspamd_composite_atom {
 	gchar *symbol;
 	struct rspamd_composite_option_match *opts;
+	/* Single symbol for plain atoms, matching group members for group atoms */
+	struct rspamd_composite_atom_sym *syms;
+	guint nsyms;
+	gboolean is_group;
+	/* Sign of score for `g+:` and `g-:` atoms, checked when matching */
+	gint sign;
 };
 
 enum rspamd_composite_action {
@@ -104,6 +142,15 @@ rspamd_composites_quark (void)
 	return g_quark_from_static_string ("composites");
 }
 
+static void
+rspamd_composite_atom_dtor (gpointer p)
+{
+	struct rspamd_composite_atom *atom = p;
+
+	/* Symbols are resolved for each build of the index */
+	g_free (atom->syms);
+}
+
 static rspamd_expression_atom_t *
 rspamd_composite_expr_parse (const gchar *line, gsize len,
 		rspamd_mempool_t *pool, gpointer ud, GError **err)
@@ -128,6 +175,7 @@ rspamd_composite_expr_parse (const gchar *line, gsize len,
 	res->str = line;
 
 	atom = rspamd_mempool_alloc0 (pool, sizeof (*atom));
+	rspamd_mempool_add_destructor (pool, rspamd_composite_atom_dtor, atom);
 
 	/* Now check for options combinations */
 	const gchar *obrace, *ebrace;
@@ -190,9 +238,20 @@ rspamd_composite_expr_parse (const gchar *line, gsize len,
 	return res;
 }
 
+static inline struct rspamd_symbol_result *
+rspamd_composite_find_symbol (struct composites_data *cd,
+		const struct rspamd_composite_atom_sym *asym)
+{
+	if (asym->slot >= 0) {
+		return cd->slots[asym->slot];
+	}
+
+	return rspamd_task_find_symbol_result (cd->task, asym->name, cd->metric_res);
+}
+
 static gdouble
 rspamd_composite_process_single_symbol (struct composites_data *cd,
-										const gchar *sym,
+										const struct rspamd_composite_atom_sym *asym,
 										struct rspamd_symbol_result **pms,
 										struct rspamd_composite_atom *atom)
 {
@@ -200,13 +259,12 @@ rspamd_composite_process_single_symbol (struct composites_data *cd,
 	gdouble rc = 0;
 	struct rspamd_composite *ncomp;
 	struct rspamd_task *task = cd->task;
+	const gchar *sym = asym->name;
 
-	if ((ms = rspamd_task_find_symbol_result (cd->task, sym, cd->metric_res)) == NULL) {
+	if ((ms = rspamd_composite_find_symbol (cd, asym)) == NULL) {
 		msg_debug_composites ("not found symbol %s in composite %s", sym,
 				cd->composite->sym);
-		if ((ncomp =
-				g_hash_table_lookup (cd->task->cfg->composite_symbols,
-						sym)) != NULL) {
+		if ((ncomp = asym->ncomp) != NULL) {
 
 			msg_debug_composites ("symbol %s for composite %s is another composite",
 					sym, cd->composite->sym);
@@ -225,16 +283,14 @@ rspamd_composite_process_single_symbol (struct composites_data *cd,
 				cd->composite = saved;
 				clrbit (cd->checked, cd->composite->id * 2);
 
-				ms = rspamd_task_find_symbol_result (cd->task, sym,
-						cd->metric_res);
+				ms = rspamd_composite_find_symbol (cd, asym);
 			}
 			else {
 				/*
 				 * XXX: in case of cyclic references this would return 0
 				 */
 				if (isset (cd->checked, ncomp->id * 2 + 1)) {
-					ms = rspamd_task_find_symbol_result (cd->task, sym,
-							cd->metric_res);
+					ms = rspamd_composite_find_symbol (cd, asym);
 				}
 			}
 		}
@@ -388,12 +444,10 @@ rspamd_composite_expr_process (void *ud,
 	struct rspamd_composite_atom *comp_atom = (struct rspamd_composite_atom *)atom->data;
 
 	struct rspamd_symbol_result *ms = NULL;
-	struct rspamd_symbols_group *gr;
 	struct rspamd_symbol *sdef;
 	struct rspamd_task *task = cd->task;
-	GHashTableIter it;
-	gpointer k, v;
 	gdouble rc = 0, max = 0;
+	guint i;
 
 	if (isset (cd->checked, cd->composite->id * 2)) {
 		/* We have already checked this composite, so just return its value */
@@ -416,134 +470,411 @@ rspamd_composite_expr_process (void *ud,
 		return rc;
 	}
 
-	sym = comp_atom->symbol;
-
-	while (*sym != '\0' && !g_ascii_isalnum (*sym)) {
-		sym ++;
-	}
-
-	if (strncmp (sym, "g:", 2) == 0) {
-		gr = g_hash_table_lookup (cd->task->cfg->groups, sym + 2);
+	/* Symbols are resolved when composites are compiled */
+	for (i = 0; i < comp_atom->nsyms; i ++) {
+		sdef = comp_atom->syms[i].sdef;
 
-		if (gr != NULL) {
-			g_hash_table_iter_init (&it, gr->symbols);
+		/* Scores can be changed after composites are compiled */
+		if (sdef && ((comp_atom->sign > 0 && sdef->score <= 0) ||
+				(comp_atom->sign < 0 && sdef->score >= 0))) {
+			continue;
+		}
 
-			while (g_hash_table_iter_next (&it, &k, &v)) {
-				sdef = v;
-				rc = rspamd_composite_process_single_symbol (cd, sdef->name, &ms,
-						comp_atom);
+		rc = rspamd_composite_process_single_symbol (cd, &comp_atom->syms[i],
+				&ms, comp_atom);
 
-				if (rc) {
-					rspamd_composite_process_symbol_removal (atom,
-							cd,
-							ms,
-							comp_atom->symbol);
+		if (rc) {
+			rspamd_composite_process_symbol_removal (atom,
+					cd,
+					ms,
+					comp_atom->symbol);
 
-					if (fabs (rc) > max) {
-						max = fabs (rc);
-					}
-				}
+			if (fabs (rc) > max) {
+				max = fabs (rc);
 			}
 		}
+	}
 
+	if (comp_atom->is_group) {
 		rc = max;
 	}
-	else if (strncmp (sym, "g+:", 3) == 0) {
-		/* Group, positive symbols only */
-		gr = g_hash_table_lookup (cd->task->cfg->groups, sym + 3);
 
-		if (gr != NULL) {
-			g_hash_table_iter_init (&it, gr->symbols);
+	msg_debug_composites ("final result for composite %s is %.2f",
+			cd->composite->sym, rc);
+
+	return rc;
+}
+
+/*
+ * We don't have preferences for composites
+ */
+static gint
+rspamd_composite_expr_priority (rspamd_expression_atom_t *atom)
+{
+	return 0;
+}
+
+static void
+rspamd_composite_expr_destroy (rspamd_expression_atom_t *atom)
+{
+	/* Composite atoms are destroyed just with the pool */
+}
 
-			while (g_hash_table_iter_next (&it, &k, &v)) {
-				sdef = v;
 
-				if (sdef->score > 0) {
-					rc = rspamd_composite_process_single_symbol (cd,
-							sdef->name,
-							&ms,
-							comp_atom);
+struct rspamd_composites_compile_cbdata {
+	struct rspamd_config *cfg;
+	struct rspamd_composite *comp;
+	GHashTable *slots; /* Symbol name -> slot + 1 */
+	GArray *slot_ids; /* Symcache id by slot, virtual ids are negative - 2 */
+	GArray *refs; /* Pairs of slot and composite id */
+	guint8 *always;
+};
 
-					if (rc) {
-						rspamd_composite_process_symbol_removal (atom,
-								cd,
-								ms,
-								comp_atom->symbol);
+static gint
+rspamd_composites_resolve_slot (struct rspamd_composites_compile_cbdata *cbd,
+		const gchar *name)
+{
+	gpointer found;
+	gint id, slot, ref[2];
 
-						if (fabs (rc) > max) {
-							max = fabs (rc);
-						}
-					}
-				}
-			}
+	found = g_hash_table_lookup (cbd->slots, name);
 
-			rc = max;
+	if (found) {
+		slot = GPOINTER_TO_INT (found) - 1;
+	}
+	else {
+		id = rspamd_symcache_find_symbol (cbd->cfg->cache, name);
+
+		if (id < 0) {
+			return -1;
+		}
+
+		if (rspamd_symcache_get_symbol_flags (cbd->cfg->cache, name) &
+				SYMBOL_TYPE_VIRTUAL) {
+			id = -id - 2;
 		}
+
+		slot = cbd->slot_ids->len;
+		g_array_append_val (cbd->slot_ids, id);
+		g_hash_table_insert (cbd->slots, (gpointer)name,
+				GINT_TO_POINTER (slot + 1));
+	}
+
+	ref[0] = slot;
+	ref[1] = cbd->comp->id;
+	g_array_append_vals (cbd->refs, ref, 2);
+
+	return slot;
+}
+
+static void
+rspamd_composites_add_atom_sym (struct rspamd_composites_compile_cbdata *cbd,
+		GArray *syms,
+		const gchar *name,
+		struct rspamd_symbol *sdef)
+{
+	struct rspamd_composite_atom_sym asym;
+
+	asym.name = name;
+	asym.sdef = sdef;
+	asym.ncomp = g_hash_table_lookup (cbd->cfg->composite_symbols, name);
+	asym.slot = rspamd_composites_resolve_slot (cbd, name);
+
+	if (asym.slot < 0 || asym.ncomp != NULL) {
+		/*
+		 * Symbol cannot be found by id or it is another composite that could
+		 * be inserted later in the same pass
+		 */
+		setbit (cbd->always, cbd->comp->id);
+	}
+
+	g_array_append_val (syms, asym);
+}
+
+static void
+rspamd_composites_compile_atom (rspamd_expression_atom_t *expr_atom,
+		gpointer ud)
+{
+	struct rspamd_composites_compile_cbdata *cbd = ud;
+	struct rspamd_composite_atom *atom = expr_atom->data;
+	struct rspamd_symbols_group *gr = NULL;
+	struct rspamd_symbol *sdef;
+	const gchar *sym;
+	GArray *syms;
+	GHashTableIter it;
+	gpointer k, v;
+	gint sign = 0;
+
+	sym = atom->symbol;
+
+	while (*sym != '\0' && !g_ascii_isalnum (*sym)) {
+		sym ++;
+	}
+
+	syms = g_array_new (FALSE, FALSE, sizeof (struct rspamd_composite_atom_sym));
+
+	if (strncmp (sym, "g:", 2) == 0) {
+		gr = g_hash_table_lookup (cbd->cfg->groups, sym + 2);
+		atom->is_group = TRUE;
+	}
+	else if (strncmp (sym, "g+:", 3) == 0) {
+		/* Group, positive symbols only */
+		gr = g_hash_table_lookup (cbd->cfg->groups, sym + 3);
+		atom->is_group = TRUE;
+		sign = 1;
 	}
 	else if (strncmp (sym, "g-:", 3) == 0) {
 		/* Group, negative symbols only */
-		gr = g_hash_table_lookup (cd->task->cfg->groups, sym + 3);
+		gr = g_hash_table_lookup (cbd->cfg->groups, sym + 3);
+		atom->is_group = TRUE;
+		sign = -1;
+	}
+	else {
+		rspamd_composites_add_atom_sym (cbd, syms, sym, NULL);
+	}
 
-		if (gr != NULL) {
-			g_hash_table_iter_init (&it, gr->symbols);
+	if (gr != NULL) {
+		g_hash_table_iter_init (&it, gr->symbols);
 
-			while (g_hash_table_iter_next (&it, &k, &v)) {
-				sdef = v;
+		/* All members are indexed, sign of their scores is checked later */
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			sdef = v;
+			rspamd_composites_add_atom_sym (cbd, syms, sdef->name, sdef);
+		}
+	}
 
-				if (sdef->score < 0) {
-					rc = rspamd_composite_process_single_symbol (cd,
-							sdef->name,
-							&ms,
-							comp_atom);
+	atom->sign = sign;
+	atom->nsyms = syms->len;
+	/* Replaces symbols of the previous index build */
+	g_free (atom->syms);
+	atom->syms = (struct rspamd_composite_atom_sym *)g_array_free (syms, FALSE);
+}
 
-					if (rc) {
-						rspamd_composite_process_symbol_removal (atom,
-								cd,
-								ms,
-								comp_atom->symbol);
+static gdouble
+rspamd_composites_empty_atom (gpointer ud, rspamd_expression_atom_t *atom)
+{
+	return 0;
+}
 
-						if (fabs (rc) > max) {
-							max = fabs (rc);
-						}
-					}
-				}
-			}
+static void
+rspamd_composites_index_free (struct rspamd_composites_index *idx)
+{
+	if (idx) {
+		g_free (idx->always);
+		g_free (idx->comp_slot);
+		g_free (idx->slot_by_id);
+		g_free (idx->slot_by_vid);
+		g_free (idx->slot_offsets);
+		g_free (idx->slot_composites);
+		g_free (idx);
+	}
+}
+
+static void
+rspamd_composites_index_dtor (gpointer p)
+{
+	struct rspamd_config *cfg = p;
+
+	rspamd_composites_index_free (cfg->composites_index);
+	cfg->composites_index = NULL;
+}
+
+static struct rspamd_composites_index *
+rspamd_composites_compile (struct rspamd_config *cfg)
+{
+	struct rspamd_composites_index *idx;
+	struct rspamd_composites_compile_cbdata cbd;
+	struct rspamd_composite *comp;
+	GHashTableIter it;
+	gpointer k, v;
+	gint id, *ref;
+	guint i, ncomposites = 0, nrefs;
+
+	g_hash_table_iter_init (&it, cfg->composite_symbols);
 
-			rc = max;
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		comp = v;
+		ncomposites = MAX (ncomposites, (guint)comp->id + 1);
+	}
+
+	idx = g_malloc0 (sizeof (*idx));
+	idx->version = cfg->composites_version;
+	idx->nsize = g_hash_table_size (cfg->composite_symbols);
+	idx->ncomposites = ncomposites;
+	idx->always = g_malloc0 (NBYTES (ncomposites));
+	idx->comp_slot = g_malloc (sizeof (gint) * (ncomposites + 1));
+
+	memset (&cbd, 0, sizeof (cbd));
+	cbd.cfg = cfg;
+	cbd.slots = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	cbd.slot_ids = g_array_new (FALSE, FALSE, sizeof (gint));
+	cbd.refs = g_array_new (FALSE, FALSE, sizeof (gint));
+	cbd.always = idx->always;
+
+	g_hash_table_iter_init (&it, cfg->composite_symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		comp = v;
+		cbd.comp = comp;
+		rspamd_expression_atom_foreach_full (comp->expr,
+				rspamd_composites_compile_atom, &cbd);
+
+		/* Composites like `!A` must be checked even if nothing is inserted */
+		if (rspamd_process_expression_closure (comp->expr,
+				rspamd_composites_empty_atom, RSPAMD_EXPRESSION_FLAG_NOOPT,
+				NULL, NULL) != 0) {
+			setbit (idx->always, comp->id);
 		}
 	}
-	else {
-		rc = rspamd_composite_process_single_symbol (cd, sym, &ms, comp_atom);
 
-		if (rc) {
-			rspamd_composite_process_symbol_removal (atom,
-					cd,
-					ms,
-					comp_atom->symbol);
+	/* Dense maps from symcache ids to slots */
+	idx->nslots = cbd.slot_ids->len;
+
+	for (i = 0; i < idx->nslots; i ++) {
+		id = g_array_index (cbd.slot_ids, gint, i);
+
+		if (id >= 0) {
+			idx->nids = MAX (idx->nids, (guint)id + 1);
+		}
+		else {
+			idx->nvids = MAX (idx->nvids, (guint)(-id - 2) + 1);
 		}
 	}
 
-	msg_debug_composites ("final result for composite %s is %.2f",
-			cd->composite->sym, rc);
+	idx->slot_by_id = g_malloc (sizeof (gint) * (idx->nids + 1));
+	idx->slot_by_vid = g_malloc (sizeof (gint) * (idx->nvids + 1));
+	memset (idx->slot_by_id, 0xff, sizeof (gint) * (idx->nids + 1));
+	memset (idx->slot_by_vid, 0xff, sizeof (gint) * (idx->nvids + 1));
 
-	return rc;
+	for (i = 0; i < idx->nslots; i ++) {
+		id = g_array_index (cbd.slot_ids, gint, i);
+
+		if (id >= 0) {
+			idx->slot_by_id[id] = i;
+		}
+		else {
+			idx->slot_by_vid[-id - 2] = i;
+		}
+	}
+
+	/* Inverted index from slots to composites */
+	nrefs = cbd.refs->len / 2;
+	idx->slot_offsets = g_malloc0 (sizeof (guint) * (idx->nslots + 1));
+	idx->slot_composites = g_malloc (sizeof (guint) * (nrefs + 1));
+
+	for (i = 0; i < nrefs; i ++) {
+		ref = &g_array_index (cbd.refs, gint, i * 2);
+		idx->slot_offsets[ref[0] + 1] ++;
+	}
+
+	for (i = 0; i < idx->nslots; i ++) {
+		idx->slot_offsets[i + 1] += idx->slot_offsets[i];
+	}
+
+	for (i = 0; i < nrefs; i ++) {
+		ref = &g_array_index (cbd.refs, gint, i * 2);
+		/* Use the start offset as a cursor and restore it afterwards */
+		idx->slot_composites[idx->slot_offsets[ref[0]] ++] = ref[1];
+	}
+
+	for (i = idx->nslots; i > 0; i --) {
+		idx->slot_offsets[i] = idx->slot_offsets[i - 1];
+	}
+
+	idx->slot_offsets[0] = 0;
+
+	/* Slots of composites symbols */
+	memset (idx->comp_slot, 0xff, sizeof (gint) * (ncomposites + 1));
+	g_hash_table_iter_init (&it, cfg->composite_symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		comp = v;
+		idx->comp_slot[comp->id] = GPOINTER_TO_INT (
+				g_hash_table_lookup (cbd.slots, comp->sym)) - 1;
+	}
+
+	msg_info_config ("compiled %ud composites, %ud symbols are used in atoms, "
+			"%ud references",
+			idx->nsize, idx->nslots, nrefs);
+
+	g_hash_table_unref (cbd.slots);
+	g_array_free (cbd.slot_ids, TRUE);
+	g_array_free (cbd.refs, TRUE);
+
+	return idx;
 }
 
-/*
- * We don't have preferences for composites
- */
-static gint
-rspamd_composite_expr_priority (rspamd_expression_atom_t *atom)
+static const struct rspamd_composites_index *
+rspamd_composites_get_index (struct rspamd_config *cfg)
 {
-	return 0;
+	/* Group atoms are expanded to members, so rebuild it if groups change */
+	if (cfg->composites_index == NULL) {
+		cfg->composites_index = rspamd_composites_compile (cfg);
+		rspamd_mempool_add_destructor (cfg->cfg_pool,
+				rspamd_composites_index_dtor, cfg);
+	}
+	else if (cfg->composites_index->version != cfg->composites_version) {
+		/* Nothing refers the old index after composites of a task are done */
+		rspamd_composites_index_free (cfg->composites_index);
+		cfg->composites_index = rspamd_composites_compile (cfg);
+	}
+
+	return cfg->composites_index;
 }
 
 static void
-rspamd_composite_expr_destroy (rspamd_expression_atom_t *atom)
+rspamd_composites_mark_inserted (struct composites_data *cd, gint slot,
+		struct rspamd_symbol_result *ms)
 {
-	/* Composite atoms are destroyed just with the pool */
+	const struct rspamd_composites_index *idx = cd->idx;
+	guint i;
+
+	cd->slots[slot] = ms;
+
+	for (i = idx->slot_offsets[slot]; i < idx->slot_offsets[slot + 1]; i ++) {
+		setbit (cd->pending, idx->slot_composites[i]);
+	}
 }
 
+static void
+composites_fill_slots (gpointer key, gpointer value, gpointer data)
+{
+	struct composites_data *cd = data;
+	const struct rspamd_composites_index *idx = cd->idx;
+	struct rspamd_symbol_result *ms = value;
+	struct rspamd_symcache_item *item = NULL;
+	gint id, slot = -1;
+	guint flags;
+
+	if (ms->sym) {
+		item = ms->sym->cache_item;
+	}
+
+	if (item != NULL) {
+		id = rspamd_symcache_item_id (item);
+		flags = rspamd_symcache_item_flags (item);
+	}
+	else {
+		/* Symbols with no score defined */
+		id = rspamd_symcache_find_symbol (cd->task->cfg->cache, key);
+		flags = rspamd_symcache_get_symbol_flags (cd->task->cfg->cache, key);
+	}
+
+	if (flags & SYMBOL_TYPE_VIRTUAL) {
+		if (id >= 0 && id < (gint)idx->nvids) {
+			slot = idx->slot_by_vid[id];
+		}
+	}
+	else {
+		if (id >= 0 && id < (gint)idx->nids) {
+			slot = idx->slot_by_id[id];
+		}
+	}
+
+	if (slot >= 0) {
+		rspamd_composites_mark_inserted (cd, slot, ms);
+	}
+}
 
 static void
 composites_foreach_callback (gpointer key, gpointer value, void *data)
@@ -586,6 +917,13 @@ composites_foreach_callback (gpointer key, gpointer value, void *data)
 			if (rc != 0) {
 				setbit (cd->checked, comp->id * 2 + 1);
 				rspamd_task_insert_result_single (cd->task, key, 1.0, NULL);
+
+				if (cd->idx->comp_slot[comp->id] >= 0) {
+					rspamd_composites_mark_inserted (cd,
+							cd->idx->comp_slot[comp->id],
+							rspamd_task_find_symbol_result (cd->task, key,
+									cd->metric_res));
+				}
 			}
 			else {
 				clrbit (cd->checked, comp->id * 2 + 1);
@@ -595,6 +933,21 @@ composites_foreach_callback (gpointer key, gpointer value, void *data)
 }
 
 
+/*
+ * Evaluates composites that have some of their symbols inserted
+ */
+static void
+composites_foreach_pending_callback (gpointer key, gpointer value, void *data)
+{
+	struct composites_data *cd = data;
+	struct rspamd_composite *comp = value;
+
+	if ((guint)comp->id < cd->idx->ncomposites &&
+			isset (cd->pending, comp->id)) {
+		composites_foreach_callback (key, value, data);
+	}
+}
+
 static void
 composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 {
@@ -683,14 +1036,24 @@ composites_metric_callback (struct rspamd_scan_result *metric_res,
 	cd->task = task;
 	cd->metric_res = metric_res;
 	cd->symbols_to_remove = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	cd->idx = rspamd_composites_get_index (task->cfg);
 	cd->checked =
 		rspamd_mempool_alloc0 (task->task_pool,
-			NBYTES (g_hash_table_size (task->cfg->composite_symbols) * 2));
+			NBYTES (cd->idx->ncomposites * 2));
+	cd->slots = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (*cd->slots) * (cd->idx->nslots + 1));
+	cd->pending = rspamd_mempool_alloc (task->task_pool,
+			NBYTES (cd->idx->ncomposites));
+	memcpy (cd->pending, cd->idx->always, NBYTES (cd->idx->ncomposites));
+
+	/* Find composites that have their symbols inserted */
+	rspamd_task_symbol_result_foreach (task, metric_res, composites_fill_slots,
+			cd);
 
 	/* Process hash table */
 	rspamd_symcache_composites_foreach (task,
 			task->cfg->cache,
-			composites_foreach_callback,
+			composites_foreach_pending_callback,
 			cd);
 
 	/* Remove symbols that are in composites */
@@ -733,3 +1096,99 @@ rspamd_composite_policy_from_str (const gchar *string)
 
 	return ret;
 }
+
+struct rspamd_composites_removable_cbdata {
+	struct rspamd_config *cfg;
+	struct rspamd_composite *comp;
+	gboolean found;
+};
+
+static void
+rspamd_composites_mark_removable_atom (rspamd_expression_atom_t *expr_atom,
+		gpointer ud)
+{
+	struct rspamd_composites_removable_cbdata *cbd = ud;
+	struct rspamd_composite_atom *atom = expr_atom->data;
+	struct rspamd_symbols_group *gr = NULL;
+	struct rspamd_symbol *sdef;
+	const gchar *sym = atom->symbol;
+	GHashTableIter it;
+	gpointer k, v;
+	gboolean remove_weight;
+
+	/* Same logic as in `rspamd_composite_process_symbol_removal` */
+	remove_weight = cbd->comp->policy != RSPAMD_COMPOSITE_POLICY_REMOVE_SYMBOL &&
+			cbd->comp->policy != RSPAMD_COMPOSITE_POLICY_LEAVE;
+
+	for (;; sym ++) {
+		if (*sym == '-') {
+			remove_weight = FALSE;
+		}
+		else if (*sym == '^') {
+			remove_weight = TRUE;
+		}
+		else if (*sym == '~') {
+			continue;
+		}
+		else {
+			break;
+		}
+	}
+
+	if (!remove_weight) {
+		return;
+	}
+
+	if (strncmp (sym, "g:", 2) == 0) {
+		gr = g_hash_table_lookup (cbd->cfg->groups, sym + 2);
+	}
+	else if (strncmp (sym, "g+:", 3) == 0 || strncmp (sym, "g-:", 3) == 0) {
+		gr = g_hash_table_lookup (cbd->cfg->groups, sym + 3);
+	}
+	else {
+		sdef = g_hash_table_lookup (cbd->cfg->symbols, sym);
+
+		if (sdef) {
+			sdef->flags |= RSPAMD_SYMBOL_FLAG_COMPOSITE_REMOVABLE;
+			cbd->found = TRUE;
+		}
+	}
+
+	if (gr != NULL) {
+		g_hash_table_iter_init (&it, gr->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			sdef = v;
+			sdef->flags |= RSPAMD_SYMBOL_FLAG_COMPOSITE_REMOVABLE;
+			cbd->found = TRUE;
+		}
+	}
+}
+
+gboolean
+rspamd_composites_mark_removable (struct rspamd_config *cfg)
+{
+	struct rspamd_composites_removable_cbdata cbd;
+	struct rspamd_symbol *sdef;
+	GHashTableIter it;
+	gpointer k, v;
+
+	g_hash_table_iter_init (&it, cfg->symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		sdef = v;
+		sdef->flags &= ~RSPAMD_SYMBOL_FLAG_COMPOSITE_REMOVABLE;
+	}
+
+	cbd.cfg = cfg;
+	cbd.found = FALSE;
+	g_hash_table_iter_init (&it, cfg->composite_symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		cbd.comp = v;
+		rspamd_expression_atom_foreach_full (cbd.comp->expr,
+				rspamd_composites_mark_removable_atom, &cbd);
+	}
+
+	return cbd.found;
+}
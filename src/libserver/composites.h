@@ -56,6 +56,15 @@ void rspamd_composites_process_task (struct rspamd_task *task);
 
 enum rspamd_composite_policy rspamd_composite_policy_from_str (const gchar *string);
 
+struct rspamd_config;
+/**
+ * Marks symbols which weight can be removed by some composite with
+ * `RSPAMD_SYMBOL_FLAG_COMPOSITE_REMOVABLE`
+ * @param cfg
+ * @return TRUE if there are such symbols
+ */
+gboolean rspamd_composites_mark_removable (struct rspamd_config *cfg);
+
 #ifdef  __cplusplus
 }
 #endif
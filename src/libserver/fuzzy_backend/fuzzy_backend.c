@@ -18,14 +18,18 @@
 #include "fuzzy_backend.h"
 #include "fuzzy_backend_sqlite.h"
 #include "fuzzy_backend_redis.h"
+#include "fuzzy_backend_memory.h"
 #include "cfg_file.h"
 #include "fuzzy_wire.h"
 
 #define DEFAULT_EXPIRE 172800L
+#define DEFAULT_SNAPSHOT_INTERVAL 600.0
+#define DEFAULT_CHECKPOINT_INTERVAL 5.0
 
 enum rspamd_fuzzy_backend_type {
 	RSPAMD_FUZZY_BACKEND_SQLITE = 0,
 	RSPAMD_FUZZY_BACKEND_REDIS = 1,
+	RSPAMD_FUZZY_BACKEND_MEMORY = 2,
 };
 
 static void* rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
@@ -52,6 +56,30 @@ static void rspamd_fuzzy_backend_expire_sqlite (struct rspamd_fuzzy_backend *bk,
 static void rspamd_fuzzy_backend_close_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
 
+static void* rspamd_fuzzy_backend_init_memory (struct rspamd_fuzzy_backend *bk,
+		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err);
+static void rspamd_fuzzy_backend_check_memory (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud,
+		void *subr_ud);
+static void rspamd_fuzzy_backend_update_memory (struct rspamd_fuzzy_backend *bk,
+		GArray *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
+		void *subr_ud);
+static void rspamd_fuzzy_backend_count_memory (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_count_cb cb, void *ud,
+		void *subr_ud);
+static void rspamd_fuzzy_backend_version_memory (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		rspamd_fuzzy_version_cb cb, void *ud,
+		void *subr_ud);
+static const gchar* rspamd_fuzzy_backend_id_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud);
+static void rspamd_fuzzy_backend_expire_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud);
+static void rspamd_fuzzy_backend_close_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud);
+
 struct rspamd_fuzzy_backend_subr {
 	void* (*init) (struct rspamd_fuzzy_backend *bk, const ucl_object_t *obj,
 			struct rspamd_config *cfg,
@@ -97,8 +125,18 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 		.id = rspamd_fuzzy_backend_id_redis,
 		.periodic = rspamd_fuzzy_backend_expire_redis,
 		.close = rspamd_fuzzy_backend_close_redis,
-	}
+	},
 #endif
+	[RSPAMD_FUZZY_BACKEND_MEMORY] = {
+		.init = rspamd_fuzzy_backend_init_memory,
+		.check = rspamd_fuzzy_backend_check_memory,
+		.update = rspamd_fuzzy_backend_update_memory,
+		.count = rspamd_fuzzy_backend_count_memory,
+		.version = rspamd_fuzzy_backend_version_memory,
+		.id = rspamd_fuzzy_backend_id_memory,
+		.periodic = rspamd_fuzzy_backend_expire_memory,
+		.close = rspamd_fuzzy_backend_close_memory,
+	},
 };
 
 struct rspamd_fuzzy_backend {
@@ -106,6 +144,7 @@ struct rspamd_fuzzy_backend {
 	gdouble expire;
 	gdouble sync;
 	struct ev_loop *event_loop;
+	struct rspamd_worker *worker;
 	rspamd_fuzzy_periodic_cb periodic_cb;
 	void *periodic_ud;
 	const struct rspamd_fuzzy_backend_subr *subr;
@@ -124,6 +163,8 @@ rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
 		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err)
 {
 	const ucl_object_t *elt;
+	const gchar *path;
+	gdouble checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
 
 	elt = ucl_object_lookup_any (obj, "hashfile", "hash_file", "file",
 			"database", NULL);
@@ -134,8 +175,15 @@ rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
 		return NULL;
 	}
 
-	return rspamd_fuzzy_backend_sqlite_open (ucl_object_tostring (elt),
-			FALSE, err);
+	path = ucl_object_tostring (elt);
+	elt = ucl_object_lookup (obj, "checkpoint_interval");
+
+	if (elt != NULL) {
+		checkpoint_interval = ucl_object_todouble (elt);
+	}
+
+	return rspamd_fuzzy_backend_sqlite_open (path, FALSE,
+			checkpoint_interval, err);
 }
 
 static void
@@ -269,9 +317,166 @@ rspamd_fuzzy_backend_close_sqlite (struct rspamd_fuzzy_backend *bk,
 	rspamd_fuzzy_backend_sqlite_close (sq);
 }
 
+static void*
+rspamd_fuzzy_backend_init_memory (struct rspamd_fuzzy_backend *bk,
+		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err)
+{
+	const ucl_object_t *elt;
+	const gchar *path;
+	gdouble snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+
+	/* Workers share hashes through the snapshot */
+	elt = ucl_object_lookup_any (obj, "snapshot", "snapshot_file", NULL);
+
+	if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				EINVAL, "missing memory backend snapshot path");
+		return NULL;
+	}
+
+	path = ucl_object_tostring (elt);
+
+	elt = ucl_object_lookup (obj, "snapshot_interval");
+
+	if (elt != NULL) {
+		snapshot_interval = ucl_object_todouble (elt);
+	}
+
+	return rspamd_fuzzy_backend_memory_open (path, snapshot_interval,
+			bk->event_loop, bk->worker, err);
+}
+
+static void
+rspamd_fuzzy_backend_check_memory (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *mem = subr_ud;
+	struct rspamd_fuzzy_reply rep;
+
+	rep = rspamd_fuzzy_backend_memory_check (mem, cmd, bk->expire);
+
+	if (cb) {
+		cb (&rep, ud);
+	}
+}
+
+static void
+rspamd_fuzzy_backend_update_memory (struct rspamd_fuzzy_backend *bk,
+		GArray *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *mem = subr_ud;
+	guint i;
+	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	gpointer ptr;
+	guint nupdates = 0, nadded = 0, ndeleted = 0, nextended = 0, nignored = 0;
+
+	for (i = 0; i < updates->len; i ++) {
+		io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+
+		if (io_cmd->is_shingle) {
+			cmd = &io_cmd->cmd.shingle.basic;
+			ptr = &io_cmd->cmd.shingle;
+		}
+		else {
+			cmd = &io_cmd->cmd.normal;
+			ptr = &io_cmd->cmd.normal;
+		}
+
+		if (cmd->cmd == FUZZY_WRITE) {
+			rspamd_fuzzy_backend_memory_add (mem, ptr);
+			nadded ++;
+			nupdates ++;
+		}
+		else if (cmd->cmd == FUZZY_DEL) {
+			rspamd_fuzzy_backend_memory_del (mem, ptr);
+			ndeleted ++;
+			nupdates ++;
+		}
+		else {
+			if (cmd->cmd == FUZZY_REFRESH) {
+				rspamd_fuzzy_backend_memory_refresh (mem, ptr);
+				nextended ++;
+			}
+			else {
+				nignored ++;
+			}
+		}
+	}
+
+	rspamd_fuzzy_backend_memory_finish_update (mem, src, nupdates > 0);
+
+	if (cb) {
+		cb (TRUE, nadded, ndeleted, nextended, nignored, ud);
+	}
+}
+
+static void
+rspamd_fuzzy_backend_count_memory (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_count_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *mem = subr_ud;
+	guint64 nhashes;
+
+	nhashes = rspamd_fuzzy_backend_memory_count (mem);
+
+	if (cb) {
+		cb (nhashes, ud);
+	}
+}
+
+static void
+rspamd_fuzzy_backend_version_memory (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		rspamd_fuzzy_version_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *mem = subr_ud;
+	guint64 rev;
+
+	rev = rspamd_fuzzy_backend_memory_version (mem, src);
+
+	if (cb) {
+		cb (rev, ud);
+	}
+}
+
+static const gchar*
+rspamd_fuzzy_backend_id_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *mem = subr_ud;
+
+	return rspamd_fuzzy_backend_memory_id (mem);
+}
+
+static void
+rspamd_fuzzy_backend_expire_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *mem = subr_ud;
+
+	rspamd_fuzzy_backend_memory_sync (mem, bk->expire, FALSE);
+}
+
+static void
+rspamd_fuzzy_backend_close_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *mem = subr_ud;
+
+	rspamd_fuzzy_backend_memory_close (mem);
+}
+
 
 struct rspamd_fuzzy_backend *
 rspamd_fuzzy_backend_create (struct ev_loop *ev_base,
+		struct rspamd_worker *worker,
 		const ucl_object_t *config,
 		struct rspamd_config *cfg,
 		GError **err)
@@ -291,6 +496,9 @@ rspamd_fuzzy_backend_create (struct ev_loop *ev_base,
 			else if (strcmp (ucl_object_tostring (elt), "redis") == 0) {
 				type = RSPAMD_FUZZY_BACKEND_REDIS;
 			}
+			else if (strcmp (ucl_object_tostring (elt), "memory") == 0) {
+				type = RSPAMD_FUZZY_BACKEND_MEMORY;
+			}
 			else {
 				g_set_error (err, rspamd_fuzzy_backend_quark (),
 						EINVAL, "invalid backend type: %s",
@@ -308,6 +516,7 @@ rspamd_fuzzy_backend_create (struct ev_loop *ev_base,
 
 	bk = g_malloc0 (sizeof (*bk));
 	bk->event_loop = ev_base;
+	bk->worker = worker;
 	bk->expire = expire;
 	bk->type = type;
 	bk->subr = &fuzzy_subrs[type];
@@ -25,6 +25,7 @@ extern "C" {
 #endif
 
 struct rspamd_fuzzy_backend;
+struct rspamd_worker;
 struct rspamd_config;
 
 /*
@@ -48,11 +49,13 @@ typedef gboolean (*rspamd_fuzzy_periodic_cb) (void *ud);
 /**
  * Open fuzzy backend
  * @param ev_base
+ * @param worker worker that owns the backend (may be NULL)
  * @param config
  * @param err
  * @return
  */
 struct rspamd_fuzzy_backend *rspamd_fuzzy_backend_create (struct ev_loop *ev_base,
+														  struct rspamd_worker *worker,
 														  const ucl_object_t *config,
 														  struct rspamd_config *cfg,
 														  GError **err);
@@ -0,0 +1,1624 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_backend_memory.h"
+#include "worker_util.h"
+#include "rspamd_control.h"
+#include "unix-std.h"
+#include "contrib/libucl/khash.h"
+#include <sys/wait.h>
+
+/*
+ * Hashes are kept in open addressed tables sharded by the first byte of
+ * digest, shingles are kept in per-position posting tables sharded by the
+ * top bits of a shingle. Sharding bounds the latency of a table rehash.
+ *
+ * Snapshot is an index that can be queried directly: processes that do
+ * not apply updates just map it, so all readers share the same pages.
+ * A new snapshot is published by renaming it over the old one and readers
+ * swap their mapping once they notice it. Lookups never keep references to
+ * the mapping across event loop iterations, so the old mapping is released
+ * immediately. The process that applies updates builds tables from the
+ * mapping in steps, so lookups are not blocked for the whole rebuild, and
+ * writes snapshots from a forked child that has a frozen copy of tables.
+ * Updates that arrive during a build are applied to the tables being built:
+ * hashes they touch are moved from the mapping ahead of the build and marked
+ * as done, so the build does not bring back their old versions.
+ *
+ * Like INSERT OR REPLACE in the sqlite backend, the newest hash owns a
+ * shingle and a shingle has no owner after its owner is deleted.
+ */
+#define RSPAMD_FUZZY_MEMORY_SHARDS_BITS 6
+#define RSPAMD_FUZZY_MEMORY_SHARDS (1u << RSPAMD_FUZZY_MEMORY_SHARDS_BITS)
+#define RSPAMD_FUZZY_MEMORY_DIGEST_SHARD(d) \
+	(((const guchar *)(d))[0] & (RSPAMD_FUZZY_MEMORY_SHARDS - 1))
+#define RSPAMD_FUZZY_MEMORY_SHINGLE_SHARD(h) \
+	((h) >> (64 - RSPAMD_FUZZY_MEMORY_SHARDS_BITS))
+#define RSPAMD_FUZZY_MEMORY_ALL_SHINGLES G_MAXUINT32
+#define RSPAMD_FUZZY_MEMORY_SET_DONE(a, i) ((a)[(i) / 8] |= (1u << ((i) % 8)))
+#define RSPAMD_FUZZY_MEMORY_IS_DONE(a, i) ((a)[(i) / 8] & (1u << ((i) % 8)))
+
+G_STATIC_ASSERT (RSPAMD_SHINGLE_SIZE <= 32);
+
+/* Common part of stored and mapped hashes */
+struct rspamd_fuzzy_memory_hash {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	gint64 value;
+	guint32 flag;
+	guint32 ts;
+};
+
+struct rspamd_fuzzy_memory_elt {
+	struct rspamd_fuzzy_memory_hash h;
+	guint64 *shingles;
+};
+
+static inline khint_t
+rspamd_fuzzy_memory_digest_hash (const guchar *digest)
+{
+	khint_t ret;
+
+	/* The first byte selects shard, so skip it */
+	memcpy (&ret, digest + sizeof (ret), sizeof (ret));
+
+	return ret;
+}
+
+static inline gboolean
+rspamd_fuzzy_memory_digest_equal (const guchar *d1, const guchar *d2)
+{
+	return memcmp (d1, d2, rspamd_cryptobox_HASHBYTES) == 0;
+}
+
+KHASH_INIT (rspamd_fuzzy_digests_hash, const guchar *,
+		struct rspamd_fuzzy_memory_elt *, 1,
+		rspamd_fuzzy_memory_digest_hash, rspamd_fuzzy_memory_digest_equal);
+KHASH_INIT (rspamd_fuzzy_shingles_hash, guint64,
+		struct rspamd_fuzzy_memory_elt *, 1,
+		kh_int64_hash_func, kh_int64_hash_equal);
+
+struct rspamd_fuzzy_memory_shard {
+	khash_t(rspamd_fuzzy_digests_hash) *digests;
+	khash_t(rspamd_fuzzy_shingles_hash) *shingles[RSPAMD_SHINGLE_SIZE];
+};
+
+struct rspamd_fuzzy_memory_tables {
+	struct rspamd_fuzzy_memory_shard shards[RSPAMD_FUZZY_MEMORY_SHARDS];
+	GHashTable *sources;
+	gsize count;
+};
+
+/*
+ * Snapshot format: header, sources, hashes, shingles of hashes, digests
+ * index and per-position shingles indexes. Indexes are linear probing
+ * tables of hash numbers (starting from 1) with load factor below 1/2
+ */
+static const gchar rspamd_fuzzy_memory_magic[8] = {'r', 's', 'f', 'z', 'm', 'e', 'm', '2'};
+
+struct rspamd_fuzzy_memory_snapshot_hdr {
+	gchar magic[8];
+	guint32 nsources;
+	guint32 sources_len;
+	guint64 nelts;
+	guint64 nshingled;
+	guint64 digest_slots;
+	guint64 shingle_slots;
+};
+
+struct rspamd_fuzzy_memory_snapshot_source {
+	guint32 len;
+	guint32 reserved;
+	gint64 version;
+};
+
+struct rspamd_fuzzy_memory_snapshot_elt {
+	struct rspamd_fuzzy_memory_hash h;
+	guint32 nshingles;
+	guint32 shingles_idx;
+};
+
+struct rspamd_fuzzy_memory_map {
+	gpointer map;
+	gsize len;
+	const struct rspamd_fuzzy_memory_snapshot_hdr *hdr;
+	const struct rspamd_fuzzy_memory_snapshot_elt *elts;
+	const guint64 *shingles;
+	const guint32 *digest_slots;
+	const guint32 *shingle_slots;
+	GHashTable *sources;
+};
+
+struct rspamd_fuzzy_backend_memory {
+	/* Either tables or map is set */
+	struct rspamd_fuzzy_memory_tables *tables;
+	struct rspamd_fuzzy_memory_map *map;
+	gchar *path;
+	gchar id[MEMPOOL_UID_LEN];
+	gsize expired;
+	gboolean dirty;
+	gdouble snapshot_interval;
+	time_t last_snapshot;
+	ino_t snapshot_ino;
+	time_t snapshot_mtime;
+	struct ev_loop *event_loop;
+	ev_stat snapshot_ev;
+	/* Tables being built from the map, swapped in when complete */
+	struct rspamd_fuzzy_memory_tables *building;
+	guint64 building_pos;
+	/* Map hashes after building_pos that were moved or deleted by updates */
+	guint8 *building_done;
+	guint64 building_ahead;
+	ev_timer promote_ev;
+	/* Child that writes a snapshot, 0 if none */
+	pid_t snapshot_pid;
+	struct rspamd_worker *worker;
+	gsize snapshot_count;
+	gdouble snapshot_start;
+	rspamd_mempool_t *pool;
+};
+
+static const gdouble snapshot_watch_interval = 5.0;
+static const guint32 max_source_len = 1024;
+/* Hashes moved from the map to tables per loop iteration */
+static const guint64 promote_step_size = 65536;
+static const gdouble promote_step_interval = 0.01;
+
+#define msg_err_fuzzy_backend(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_warn_fuzzy_backend(...)   rspamd_default_log_function (G_LOG_LEVEL_WARNING, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_fuzzy_backend(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_debug_fuzzy_backend(...)  rspamd_conditional_debug_fast (NULL, NULL, \
+       rspamd_fuzzy_memory_log_id, backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+INIT_LOG_MODULE(fuzzy_memory)
+
+static GQuark
+rspamd_fuzzy_backend_memory_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-memory-backend");
+}
+
+static struct rspamd_fuzzy_memory_tables *
+rspamd_fuzzy_memory_tables_new (void)
+{
+	struct rspamd_fuzzy_memory_tables *tables;
+	guint i, j;
+
+	tables = g_malloc0 (sizeof (*tables));
+
+	for (i = 0; i < RSPAMD_FUZZY_MEMORY_SHARDS; i ++) {
+		tables->shards[i].digests = kh_init (rspamd_fuzzy_digests_hash);
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			tables->shards[i].shingles[j] = kh_init (rspamd_fuzzy_shingles_hash);
+		}
+	}
+
+	tables->sources = g_hash_table_new_full (g_str_hash, g_str_equal,
+			g_free, g_free);
+
+	return tables;
+}
+
+static void
+rspamd_fuzzy_memory_elt_free (struct rspamd_fuzzy_memory_elt *elt)
+{
+	g_free (elt->shingles);
+	g_free (elt);
+}
+
+static void
+rspamd_fuzzy_memory_tables_free (struct rspamd_fuzzy_memory_tables *tables)
+{
+	struct rspamd_fuzzy_memory_elt *elt;
+	guint i, j;
+
+	for (i = 0; i < RSPAMD_FUZZY_MEMORY_SHARDS; i ++) {
+		kh_foreach_value (tables->shards[i].digests, elt, {
+			rspamd_fuzzy_memory_elt_free (elt);
+		});
+
+		kh_destroy (rspamd_fuzzy_digests_hash, tables->shards[i].digests);
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			kh_destroy (rspamd_fuzzy_shingles_hash, tables->shards[i].shingles[j]);
+		}
+	}
+
+	g_hash_table_unref (tables->sources);
+	g_free (tables);
+}
+
+static struct rspamd_fuzzy_memory_elt *
+rspamd_fuzzy_memory_find (struct rspamd_fuzzy_memory_tables *tables,
+		const guchar *digest)
+{
+	struct rspamd_fuzzy_memory_shard *shard;
+	khiter_t k;
+
+	shard = &tables->shards[RSPAMD_FUZZY_MEMORY_DIGEST_SHARD (digest)];
+	k = kh_get (rspamd_fuzzy_digests_hash, shard->digests, digest);
+
+	if (k != kh_end (shard->digests)) {
+		return kh_value (shard->digests, k);
+	}
+
+	return NULL;
+}
+
+static struct rspamd_fuzzy_memory_elt *
+rspamd_fuzzy_memory_find_shingle (struct rspamd_fuzzy_memory_tables *tables,
+		guint64 h, guint pos)
+{
+	khash_t(rspamd_fuzzy_shingles_hash) *htb;
+	khiter_t k;
+
+	htb = tables->shards[RSPAMD_FUZZY_MEMORY_SHINGLE_SHARD (h)].shingles[pos];
+	k = kh_get (rspamd_fuzzy_shingles_hash, htb, h);
+
+	if (k != kh_end (htb)) {
+		return kh_value (htb, k);
+	}
+
+	return NULL;
+}
+
+/*
+ * Inserts a new hash, it becomes the owner of shingles at positions set in
+ * `own_mask`
+ */
+static void
+rspamd_fuzzy_memory_insert (struct rspamd_fuzzy_memory_tables *tables,
+		struct rspamd_fuzzy_memory_elt *elt, guint32 own_mask)
+{
+	struct rspamd_fuzzy_memory_shard *shard;
+	khash_t(rspamd_fuzzy_shingles_hash) *htb;
+	khiter_t k;
+	gint r;
+	guint i;
+
+	shard = &tables->shards[RSPAMD_FUZZY_MEMORY_DIGEST_SHARD (elt->h.digest)];
+	k = kh_put (rspamd_fuzzy_digests_hash, shard->digests, elt->h.digest, &r);
+	kh_value (shard->digests, k) = elt;
+	tables->count ++;
+
+	if (elt->shingles) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			if (!(own_mask & (1u << i))) {
+				continue;
+			}
+
+			htb = tables->shards[
+					RSPAMD_FUZZY_MEMORY_SHINGLE_SHARD (elt->shingles[i])].shingles[i];
+			k = kh_put (rspamd_fuzzy_shingles_hash, htb, elt->shingles[i], &r);
+			kh_value (htb, k) = elt;
+		}
+	}
+}
+
+static void
+rspamd_fuzzy_memory_remove (struct rspamd_fuzzy_memory_tables *tables,
+		struct rspamd_fuzzy_memory_elt *elt)
+{
+	struct rspamd_fuzzy_memory_shard *shard;
+	khash_t(rspamd_fuzzy_shingles_hash) *htb;
+	khiter_t k;
+	guint i;
+
+	shard = &tables->shards[RSPAMD_FUZZY_MEMORY_DIGEST_SHARD (elt->h.digest)];
+	k = kh_get (rspamd_fuzzy_digests_hash, shard->digests, elt->h.digest);
+
+	if (k != kh_end (shard->digests)) {
+		kh_del (rspamd_fuzzy_digests_hash, shard->digests, k);
+		tables->count --;
+	}
+
+	if (elt->shingles) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			htb = tables->shards[
+					RSPAMD_FUZZY_MEMORY_SHINGLE_SHARD (elt->shingles[i])].shingles[i];
+			k = kh_get (rspamd_fuzzy_shingles_hash, htb, elt->shingles[i]);
+
+			if (k != kh_end (htb) && kh_value (htb, k) == elt) {
+				kh_del (rspamd_fuzzy_shingles_hash, htb, k);
+			}
+		}
+	}
+}
+
+static void
+rspamd_fuzzy_memory_map_free (struct rspamd_fuzzy_memory_map *map)
+{
+	munmap (map->map, map->len);
+	g_hash_table_unref (map->sources);
+	g_free (map);
+}
+
+static const struct rspamd_fuzzy_memory_snapshot_elt *
+rspamd_fuzzy_memory_map_find (struct rspamd_fuzzy_memory_map *map,
+		const guchar *digest)
+{
+	const struct rspamd_fuzzy_memory_snapshot_elt *selt;
+	guint64 mask = map->hdr->digest_slots - 1, slot, i;
+	guint32 idx;
+
+	slot = rspamd_fuzzy_memory_digest_hash (digest) & mask;
+
+	for (i = 0; i <= mask; i ++, slot = (slot + 1) & mask) {
+		idx = map->digest_slots[slot];
+
+		if (idx == 0 || idx > map->hdr->nelts) {
+			break;
+		}
+
+		selt = &map->elts[idx - 1];
+
+		if (rspamd_fuzzy_memory_digest_equal (selt->h.digest, digest)) {
+			return selt;
+		}
+	}
+
+	return NULL;
+}
+
+static const struct rspamd_fuzzy_memory_snapshot_elt *
+rspamd_fuzzy_memory_map_find_shingle (struct rspamd_fuzzy_memory_map *map,
+		guint64 h, guint pos)
+{
+	const struct rspamd_fuzzy_memory_snapshot_elt *selt;
+	const guint32 *slots;
+	guint64 mask = map->hdr->shingle_slots - 1, slot, i;
+	guint32 idx;
+
+	slots = map->shingle_slots + pos * map->hdr->shingle_slots;
+	slot = kh_int64_hash_func (h) & mask;
+
+	for (i = 0; i <= mask; i ++, slot = (slot + 1) & mask) {
+		idx = slots[slot];
+
+		if (idx == 0 || idx > map->hdr->nelts) {
+			break;
+		}
+
+		selt = &map->elts[idx - 1];
+
+		if (selt->nshingles != 0 && selt->shingles_idx < map->hdr->nshingled &&
+				map->shingles[selt->shingles_idx * RSPAMD_SHINGLE_SIZE + pos] == h) {
+			return selt;
+		}
+	}
+
+	return NULL;
+}
+
+static struct rspamd_fuzzy_memory_map *
+rspamd_fuzzy_backend_memory_map (struct rspamd_fuzzy_backend_memory *backend,
+		GError **err)
+{
+	struct rspamd_fuzzy_memory_map *map;
+	const struct rspamd_fuzzy_memory_snapshot_hdr *hdr;
+	const struct rspamd_fuzzy_memory_snapshot_source *ssrc;
+	const guchar *p, *end;
+	guint64 total;
+	struct stat st;
+	gint64 *pver;
+	guint i;
+	gint fd;
+
+	fd = rspamd_file_xopen (backend->path, O_RDONLY, 0, TRUE);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot open snapshot %s: %s", backend->path, strerror (errno));
+
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1 || st.st_size < (off_t)sizeof (*hdr)) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), EINVAL,
+				"invalid snapshot %s", backend->path);
+		close (fd);
+
+		return NULL;
+	}
+
+	map = g_malloc0 (sizeof (*map));
+	map->len = st.st_size;
+	map->map = mmap (NULL, map->len, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map->map == MAP_FAILED) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot mmap snapshot %s: %s", backend->path, strerror (errno));
+		g_free (map);
+
+		return NULL;
+	}
+
+	map->sources = g_hash_table_new_full (g_str_hash, g_str_equal,
+			g_free, g_free);
+	hdr = map->map;
+	map->hdr = hdr;
+
+	/* Indexes refer hashes by 32 bit numbers */
+	if (memcmp (hdr->magic, rspamd_fuzzy_memory_magic, sizeof (hdr->magic)) != 0 ||
+			hdr->nelts >= G_MAXUINT32 || hdr->nshingled > hdr->nelts ||
+			hdr->digest_slots <= hdr->nelts ||
+			hdr->digest_slots & (hdr->digest_slots - 1) ||
+			hdr->shingle_slots <= hdr->nshingled ||
+			hdr->shingle_slots & (hdr->shingle_slots - 1) ||
+			hdr->digest_slots > G_MAXUINT32 || hdr->shingle_slots > G_MAXUINT32 ||
+			hdr->sources_len % sizeof (guint64) != 0) {
+		goto err;
+	}
+
+	total = sizeof (*hdr) + hdr->sources_len +
+			hdr->nelts * sizeof (*map->elts) +
+			hdr->nshingled * RSPAMD_SHINGLE_SIZE * sizeof (*map->shingles) +
+			hdr->digest_slots * sizeof (*map->digest_slots) +
+			RSPAMD_SHINGLE_SIZE * hdr->shingle_slots * sizeof (*map->shingle_slots);
+
+	if (total != map->len) {
+		goto err;
+	}
+
+	p = (const guchar *)map->map + sizeof (*hdr);
+	end = p + hdr->sources_len;
+
+	for (i = 0; i < hdr->nsources; i ++) {
+		ssrc = (const struct rspamd_fuzzy_memory_snapshot_source *)p;
+
+		if (end - p < (gssize)sizeof (*ssrc) || ssrc->len == 0 ||
+				ssrc->len > max_source_len ||
+				end - p - sizeof (*ssrc) < ssrc->len) {
+			goto err;
+		}
+
+		pver = g_malloc (sizeof (*pver));
+		*pver = ssrc->version;
+		g_hash_table_replace (map->sources,
+				g_strndup ((const gchar *)(ssrc + 1), ssrc->len), pver);
+		p += sizeof (*ssrc) + ssrc->len;
+	}
+
+	map->elts = (const struct rspamd_fuzzy_memory_snapshot_elt *)end;
+	map->shingles = (const guint64 *)(map->elts + hdr->nelts);
+	map->digest_slots = (const guint32 *)(map->shingles +
+			hdr->nshingled * RSPAMD_SHINGLE_SIZE);
+	map->shingle_slots = map->digest_slots + hdr->digest_slots;
+
+	backend->snapshot_ino = st.st_ino;
+	backend->snapshot_mtime = st.st_mtime;
+
+	return map;
+
+err:
+	g_set_error (err, rspamd_fuzzy_backend_memory_quark (), EINVAL,
+			"truncated or corrupted snapshot %s", backend->path);
+	rspamd_fuzzy_memory_map_free (map);
+
+	return NULL;
+}
+
+/*
+ * Copies a hash from the map to the tables being built, it takes shingles that
+ * it owns in the map unless they are owned by hashes added during the build
+ */
+static struct rspamd_fuzzy_memory_elt *
+rspamd_fuzzy_backend_memory_copy_elt (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_memory_snapshot_elt *selt)
+{
+	struct rspamd_fuzzy_memory_map *map = backend->map;
+	struct rspamd_fuzzy_memory_elt *elt;
+	guint32 own_mask = 0;
+	guint i;
+
+	elt = g_malloc0 (sizeof (*elt));
+	memcpy (&elt->h, &selt->h, sizeof (elt->h));
+
+	if (selt->nshingles != 0 && selt->shingles_idx < map->hdr->nshingled) {
+		elt->shingles = g_malloc (sizeof (*elt->shingles) * RSPAMD_SHINGLE_SIZE);
+		memcpy (elt->shingles,
+				&map->shingles[selt->shingles_idx * RSPAMD_SHINGLE_SIZE],
+				sizeof (*elt->shingles) * RSPAMD_SHINGLE_SIZE);
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			if (rspamd_fuzzy_memory_map_find_shingle (map,
+					elt->shingles[i], i) == selt &&
+					rspamd_fuzzy_memory_find_shingle (backend->building,
+							elt->shingles[i], i) == NULL) {
+				own_mask |= 1u << i;
+			}
+		}
+	}
+
+	rspamd_fuzzy_memory_insert (backend->building, elt, own_mask);
+
+	return elt;
+}
+
+/*
+ * Returns TRUE if a map hash has not been moved to the tables being built yet
+ */
+static inline gboolean
+rspamd_fuzzy_backend_memory_pending (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_memory_snapshot_elt *selt)
+{
+	guint64 idx = selt - backend->map->elts;
+
+	return idx >= backend->building_pos &&
+			!RSPAMD_FUZZY_MEMORY_IS_DONE (backend->building_done, idx);
+}
+
+/*
+ * Moves up to `limit` hashes from the mapped snapshot to writable tables,
+ * tables replace the map when all hashes are moved
+ */
+static void
+rspamd_fuzzy_backend_memory_promote_step (struct rspamd_fuzzy_backend_memory *backend,
+		guint64 limit)
+{
+	struct rspamd_fuzzy_memory_tables *tables;
+	struct rspamd_fuzzy_memory_map *map = backend->map;
+	GHashTableIter it;
+	gpointer k, v;
+	gint64 *pver;
+	guint64 i, end;
+
+	if (backend->tables != NULL) {
+		return;
+	}
+
+	if (backend->building == NULL) {
+		backend->building = rspamd_fuzzy_memory_tables_new ();
+		backend->building_pos = 0;
+		backend->building_done = g_malloc0 (map->hdr->nelts / 8 + 1);
+		backend->building_ahead = 0;
+		g_hash_table_iter_init (&it, map->sources);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			pver = g_malloc (sizeof (*pver));
+			*pver = *(gint64 *)v;
+			g_hash_table_insert (backend->building->sources, g_strdup (k), pver);
+		}
+	}
+
+	tables = backend->building;
+	end = backend->building_pos + MIN (limit,
+			map->hdr->nelts - backend->building_pos);
+
+	for (i = backend->building_pos; i < end; i ++) {
+		if (RSPAMD_FUZZY_MEMORY_IS_DONE (backend->building_done, i)) {
+			/* Already moved or deleted by an update */
+			backend->building_ahead --;
+			continue;
+		}
+
+		if (rspamd_fuzzy_memory_find (tables, map->elts[i].h.digest) != NULL) {
+			continue;
+		}
+
+		rspamd_fuzzy_backend_memory_copy_elt (backend, &map->elts[i]);
+	}
+
+	backend->building_pos = end;
+
+	if (end < map->hdr->nelts) {
+		return;
+	}
+
+	if (backend->event_loop) {
+		ev_timer_stop (backend->event_loop, &backend->promote_ev);
+	}
+
+	msg_info_fuzzy_backend ("built tables for %Hz hashes from snapshot",
+			tables->count);
+	rspamd_fuzzy_memory_map_free (map);
+	g_free (backend->building_done);
+	backend->building_done = NULL;
+	backend->map = NULL;
+	backend->building = NULL;
+	backend->tables = tables;
+}
+
+/*
+ * Builds writable tables from the mapped snapshot, finishing a staged build
+ */
+static void
+rspamd_fuzzy_backend_memory_promote (struct rspamd_fuzzy_backend_memory *backend)
+{
+	rspamd_fuzzy_backend_memory_promote_step (backend, G_MAXUINT64);
+}
+
+static void
+rspamd_fuzzy_backend_memory_promote_cb (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_fuzzy_backend_memory *backend =
+			(struct rspamd_fuzzy_backend_memory *)w->data;
+
+	rspamd_fuzzy_backend_memory_promote_step (backend, promote_step_size);
+}
+
+/*
+ * Starts building tables in steps between loop iterations
+ */
+static void
+rspamd_fuzzy_backend_memory_promote_start (struct rspamd_fuzzy_backend_memory *backend)
+{
+	if (backend->tables != NULL) {
+		return;
+	}
+
+	if (backend->event_loop == NULL) {
+		rspamd_fuzzy_backend_memory_promote (backend);
+	}
+	else if (!ev_is_active (&backend->promote_ev)) {
+		ev_timer_start (backend->event_loop, &backend->promote_ev);
+	}
+}
+
+static void
+rspamd_fuzzy_backend_memory_promote_stop (struct rspamd_fuzzy_backend_memory *backend)
+{
+	if (backend->event_loop) {
+		ev_timer_stop (backend->event_loop, &backend->promote_ev);
+	}
+
+	if (backend->building) {
+		rspamd_fuzzy_memory_tables_free (backend->building);
+		g_free (backend->building_done);
+		backend->building = NULL;
+		backend->building_done = NULL;
+	}
+}
+
+/*
+ * Returns tables that accept updates: either the writable tables or the ones
+ * being built from the map
+ */
+static struct rspamd_fuzzy_memory_tables *
+rspamd_fuzzy_backend_memory_writable (struct rspamd_fuzzy_backend_memory *backend)
+{
+	rspamd_fuzzy_backend_memory_promote_start (backend);
+
+	if (backend->tables == NULL && backend->building == NULL) {
+		rspamd_fuzzy_backend_memory_promote_step (backend, 0);
+	}
+
+	return backend->tables ? backend->tables : backend->building;
+}
+
+/*
+ * Finds a hash to update, a hash that is still pending in the map is moved
+ * to the tables being built
+ */
+static struct rspamd_fuzzy_memory_elt *
+rspamd_fuzzy_backend_memory_find_writable (struct rspamd_fuzzy_backend_memory *backend,
+		struct rspamd_fuzzy_memory_tables *tables,
+		const guchar *digest)
+{
+	const struct rspamd_fuzzy_memory_snapshot_elt *selt;
+	struct rspamd_fuzzy_memory_elt *elt;
+	guint64 idx;
+
+	elt = rspamd_fuzzy_memory_find (tables, digest);
+
+	if (elt != NULL || tables != backend->building) {
+		return elt;
+	}
+
+	selt = rspamd_fuzzy_memory_map_find (backend->map, digest);
+
+	if (selt != NULL && rspamd_fuzzy_backend_memory_pending (backend, selt)) {
+		idx = selt - backend->map->elts;
+		elt = rspamd_fuzzy_backend_memory_copy_elt (backend, selt);
+		RSPAMD_FUZZY_MEMORY_SET_DONE (backend->building_done, idx);
+		backend->building_ahead ++;
+	}
+
+	return elt;
+}
+
+static guint64
+rspamd_fuzzy_memory_slots (guint64 nelts)
+{
+	guint64 slots = 16;
+
+	while (slots <= nelts * 2) {
+		slots <<= 1;
+	}
+
+	return slots;
+}
+
+static gboolean
+rspamd_fuzzy_backend_memory_snapshot (struct rspamd_fuzzy_backend_memory *backend,
+		GError **err)
+{
+	struct rspamd_fuzzy_memory_tables *tables = backend->tables;
+	struct rspamd_fuzzy_memory_snapshot_hdr hdr;
+	struct rspamd_fuzzy_memory_snapshot_source ssrc;
+	struct rspamd_fuzzy_memory_snapshot_elt selt;
+	struct rspamd_fuzzy_memory_elt *elt;
+	static const guchar pad[sizeof (guint64)];
+	guint32 *digest_slots, *shingle_slots, *slots;
+	GPtrArray *elts;
+	GHashTableIter it;
+	gpointer k, v;
+	struct stat st;
+	gboolean ok = TRUE;
+	gchar *tmp_path;
+	guint64 mask, slot, nshingled = 0;
+	guint i, j, sources_len = 0;
+	FILE *f;
+
+	/* Hash numbers are their positions in this array */
+	elts = g_ptr_array_sized_new (tables->count);
+
+	for (i = 0; i < RSPAMD_FUZZY_MEMORY_SHARDS; i ++) {
+		kh_foreach_value (tables->shards[i].digests, elt, {
+			g_ptr_array_add (elts, elt);
+
+			if (elt->shingles) {
+				nshingled ++;
+			}
+		});
+	}
+
+	g_hash_table_iter_init (&it, tables->sources);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		sources_len += sizeof (ssrc) + strlen (k);
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, rspamd_fuzzy_memory_magic, sizeof (hdr.magic));
+	hdr.nsources = g_hash_table_size (tables->sources);
+	hdr.sources_len = (sources_len + sizeof (guint64) - 1) &
+			~(sizeof (guint64) - 1);
+	hdr.nelts = elts->len;
+	hdr.nshingled = nshingled;
+	hdr.digest_slots = rspamd_fuzzy_memory_slots (elts->len);
+	hdr.shingle_slots = rspamd_fuzzy_memory_slots (nshingled);
+
+	digest_slots = g_malloc0 (hdr.digest_slots * sizeof (*digest_slots));
+	shingle_slots = g_malloc0 (RSPAMD_SHINGLE_SIZE * hdr.shingle_slots *
+			sizeof (*shingle_slots));
+
+	tmp_path = g_strdup_printf ("%s.tmp", backend->path);
+	f = fopen (tmp_path, "w");
+
+	if (f == NULL) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot create snapshot %s: %s", tmp_path, strerror (errno));
+		g_free (tmp_path);
+		g_free (digest_slots);
+		g_free (shingle_slots);
+		g_ptr_array_free (elts, TRUE);
+
+		return FALSE;
+	}
+
+	ok = fwrite (&hdr, sizeof (hdr), 1, f) == 1;
+	g_hash_table_iter_init (&it, tables->sources);
+
+	while (ok && g_hash_table_iter_next (&it, &k, &v)) {
+		memset (&ssrc, 0, sizeof (ssrc));
+		ssrc.len = strlen (k);
+		ssrc.version = *(gint64 *)v;
+		ok = fwrite (&ssrc, sizeof (ssrc), 1, f) == 1 &&
+				fwrite (k, ssrc.len, 1, f) == 1;
+	}
+
+	if (ok && hdr.sources_len > sources_len) {
+		ok = fwrite (pad, hdr.sources_len - sources_len, 1, f) == 1;
+	}
+
+	/* Hashes and digests index */
+	mask = hdr.digest_slots - 1;
+	nshingled = 0;
+
+	for (i = 0; ok && i < elts->len; i ++) {
+		elt = g_ptr_array_index (elts, i);
+		memset (&selt, 0, sizeof (selt));
+		memcpy (&selt.h, &elt->h, sizeof (selt.h));
+
+		if (elt->shingles) {
+			selt.nshingles = RSPAMD_SHINGLE_SIZE;
+			selt.shingles_idx = nshingled ++;
+		}
+
+		ok = fwrite (&selt, sizeof (selt), 1, f) == 1;
+
+		slot = rspamd_fuzzy_memory_digest_hash (elt->h.digest) & mask;
+
+		while (digest_slots[slot] != 0) {
+			slot = (slot + 1) & mask;
+		}
+
+		digest_slots[slot] = i + 1;
+	}
+
+	/* Shingles and shingles indexes */
+	mask = hdr.shingle_slots - 1;
+
+	for (i = 0; ok && i < elts->len; i ++) {
+		elt = g_ptr_array_index (elts, i);
+
+		if (elt->shingles == NULL) {
+			continue;
+		}
+
+		ok = fwrite (elt->shingles, sizeof (*elt->shingles) * RSPAMD_SHINGLE_SIZE,
+				1, f) == 1;
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			/* Only the owner of a shingle is indexed */
+			if (rspamd_fuzzy_memory_find_shingle (tables,
+					elt->shingles[j], j) != elt) {
+				continue;
+			}
+
+			slots = shingle_slots + j * hdr.shingle_slots;
+			slot = kh_int64_hash_func (elt->shingles[j]) & mask;
+
+			while (slots[slot] != 0) {
+				slot = (slot + 1) & mask;
+			}
+
+			slots[slot] = i + 1;
+		}
+	}
+
+	if (ok) {
+		ok = fwrite (digest_slots, hdr.digest_slots * sizeof (*digest_slots),
+				1, f) == 1 &&
+				fwrite (shingle_slots, RSPAMD_SHINGLE_SIZE * hdr.shingle_slots *
+						sizeof (*shingle_slots), 1, f) == 1;
+	}
+
+	g_free (digest_slots);
+	g_free (shingle_slots);
+	g_ptr_array_free (elts, TRUE);
+
+	if (ok) {
+		ok = fflush (f) == 0 && fsync (fileno (f)) != -1 &&
+				fstat (fileno (f), &st) != -1;
+	}
+
+	if (ok) {
+		ok = fclose (f) == 0;
+	}
+	else {
+		fclose (f);
+	}
+
+	if (!ok || rename (tmp_path, backend->path) == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot write snapshot %s: %s", backend->path, strerror (errno));
+		unlink (tmp_path);
+		g_free (tmp_path);
+
+		return FALSE;
+	}
+
+	/* Do not reload our own snapshot */
+	backend->snapshot_ino = st.st_ino;
+	backend->snapshot_mtime = st.st_mtime;
+	g_free (tmp_path);
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_backend_memory_on_stat (struct ev_loop *loop, ev_stat *w,
+		int revents)
+{
+	struct rspamd_fuzzy_backend_memory *backend =
+			(struct rspamd_fuzzy_backend_memory *)w->data;
+	struct rspamd_fuzzy_memory_map *map;
+	GError *err = NULL;
+
+	if (w->attr.st_nlink == 0 || (w->attr.st_ino == backend->snapshot_ino &&
+			w->attr.st_mtime == backend->snapshot_mtime)) {
+		return;
+	}
+
+	if (backend->snapshot_pid != 0) {
+		/* Likely our own snapshot that has not been collected yet */
+		return;
+	}
+
+	if (backend->dirty) {
+		/* Unsaved updates are more recent than a foreign snapshot */
+		msg_info_fuzzy_backend ("ignore modified snapshot %s: there are "
+				"unsaved updates", backend->path);
+		return;
+	}
+
+	map = rspamd_fuzzy_backend_memory_map (backend, &err);
+
+	if (map == NULL) {
+		msg_warn_fuzzy_backend ("cannot reload snapshot: %e", err);
+		g_error_free (err);
+
+		return;
+	}
+
+	if (backend->tables) {
+		rspamd_fuzzy_memory_tables_free (backend->tables);
+		backend->tables = NULL;
+	}
+
+	/* Staged build refers the old map */
+	rspamd_fuzzy_backend_memory_promote_stop (backend);
+
+	if (backend->map) {
+		rspamd_fuzzy_memory_map_free (backend->map);
+	}
+
+	backend->map = map;
+	msg_info_fuzzy_backend ("switched to snapshot %s with %L hashes",
+			backend->path, map->hdr->nelts);
+}
+
+struct rspamd_fuzzy_backend_memory *
+rspamd_fuzzy_backend_memory_open (const gchar *path,
+		gdouble snapshot_interval,
+		struct ev_loop *ev_base,
+		struct rspamd_worker *worker,
+		GError **err)
+{
+	struct rspamd_fuzzy_backend_memory *backend;
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash_out[rspamd_cryptobox_HASHBYTES];
+	const gchar *id_str = path ? path : "memory";
+
+	backend = g_malloc0 (sizeof (*backend));
+	backend->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"fuzzy_backend", 0);
+	backend->snapshot_interval = snapshot_interval;
+	backend->last_snapshot = time (NULL);
+	backend->worker = worker;
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, id_str, strlen (id_str));
+	rspamd_cryptobox_hash_final (&st, hash_out);
+	rspamd_snprintf (backend->id, sizeof (backend->id), "%xs", hash_out);
+	memcpy (backend->pool->tag.uid, backend->id, sizeof (backend->pool->tag.uid));
+
+	if (path != NULL) {
+		backend->path = g_strdup (path);
+
+		if (access (path, F_OK) != -1) {
+			backend->map = rspamd_fuzzy_backend_memory_map (backend, err);
+
+			if (backend->map == NULL) {
+				rspamd_fuzzy_backend_memory_close (backend);
+
+				return NULL;
+			}
+
+			msg_info_fuzzy_backend ("mapped %L hashes from %s",
+					backend->map->hdr->nelts, path);
+		}
+
+		if (ev_base != NULL) {
+			backend->event_loop = ev_base;
+			ev_stat_init (&backend->snapshot_ev,
+					rspamd_fuzzy_backend_memory_on_stat,
+					backend->path, snapshot_watch_interval);
+			backend->snapshot_ev.data = backend;
+			ev_stat_start (ev_base, &backend->snapshot_ev);
+			ev_timer_init (&backend->promote_ev,
+					rspamd_fuzzy_backend_memory_promote_cb,
+					promote_step_interval, promote_step_interval);
+			backend->promote_ev.data = backend;
+		}
+	}
+
+	if (backend->map == NULL) {
+		backend->tables = rspamd_fuzzy_memory_tables_new ();
+	}
+
+	return backend;
+}
+
+static const struct rspamd_fuzzy_memory_hash *
+rspamd_fuzzy_backend_memory_find_hash (struct rspamd_fuzzy_backend_memory *backend,
+		const guchar *digest)
+{
+	const struct rspamd_fuzzy_memory_snapshot_elt *selt;
+	struct rspamd_fuzzy_memory_elt *elt;
+
+	if (backend->tables) {
+		elt = rspamd_fuzzy_memory_find (backend->tables, digest);
+
+		return elt ? &elt->h : NULL;
+	}
+
+	if (backend->building) {
+		elt = rspamd_fuzzy_memory_find (backend->building, digest);
+
+		if (elt != NULL) {
+			return &elt->h;
+		}
+	}
+
+	selt = rspamd_fuzzy_memory_map_find (backend->map, digest);
+
+	/* Hashes that are not pending are either built or deleted */
+	if (selt == NULL || (backend->building &&
+			!rspamd_fuzzy_backend_memory_pending (backend, selt))) {
+		return NULL;
+	}
+
+	return &selt->h;
+}
+
+static const struct rspamd_fuzzy_memory_hash *
+rspamd_fuzzy_backend_memory_find_shingle (struct rspamd_fuzzy_backend_memory *backend,
+		guint64 h, guint pos)
+{
+	const struct rspamd_fuzzy_memory_snapshot_elt *selt;
+	struct rspamd_fuzzy_memory_elt *elt;
+
+	if (backend->tables) {
+		elt = rspamd_fuzzy_memory_find_shingle (backend->tables, h, pos);
+
+		return elt ? &elt->h : NULL;
+	}
+
+	if (backend->building) {
+		elt = rspamd_fuzzy_memory_find_shingle (backend->building, h, pos);
+
+		if (elt != NULL) {
+			return &elt->h;
+		}
+	}
+
+	selt = rspamd_fuzzy_memory_map_find_shingle (backend->map, h, pos);
+
+	if (selt == NULL || (backend->building &&
+			!rspamd_fuzzy_backend_memory_pending (backend, selt))) {
+		return NULL;
+	}
+
+	return &selt->h;
+}
+
+static gint
+rspamd_fuzzy_memory_hash_ptr_cmp (const void *a, const void *b)
+{
+	guintptr ia = *(guintptr *)a, ib = *(guintptr *)b;
+
+	return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
+
+struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_memory_check (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	const struct rspamd_fuzzy_memory_hash *elt, *sel, *found[RSPAMD_SHINGLE_SIZE];
+	guint i, cur_cnt, max_cnt;
+
+	memset (&rep, 0, sizeof (rep));
+	memcpy (rep.digest, cmd->digest, sizeof (rep.digest));
+
+	if (backend == NULL) {
+		return rep;
+	}
+
+	/* Try direct match first of all */
+	elt = rspamd_fuzzy_backend_memory_find_hash (backend, cmd->digest);
+
+	if (elt != NULL) {
+		if (time (NULL) - elt->ts > expire) {
+			msg_debug_fuzzy_backend ("requested hash has been expired");
+		}
+		else {
+			rep.v1.value = elt->value;
+			rep.v1.prob = 1.0;
+			rep.v1.flag = elt->flag;
+			rep.ts = elt->ts;
+		}
+	}
+	else if (cmd->shingles_count > 0) {
+		/* Fuzzy match: the most frequent hash among shingles wins */
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			found[i] = rspamd_fuzzy_backend_memory_find_shingle (backend,
+					shcmd->sgl.hashes[i], i);
+		}
+
+		qsort (found, RSPAMD_SHINGLE_SIZE, sizeof (found[0]),
+				rspamd_fuzzy_memory_hash_ptr_cmp);
+		sel = NULL;
+		max_cnt = 0;
+		cur_cnt = 0;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			if (found[i] == NULL) {
+				continue;
+			}
+
+			if (i > 0 && found[i] == found[i - 1]) {
+				cur_cnt ++;
+			}
+			else {
+				cur_cnt = 1;
+			}
+
+			if (cur_cnt > max_cnt) {
+				max_cnt = cur_cnt;
+				sel = found[i];
+			}
+		}
+
+		if (sel != NULL) {
+			rep.v1.prob = (float)max_cnt / (float)RSPAMD_SHINGLE_SIZE;
+
+			if (rep.v1.prob > 0.5) {
+				msg_debug_fuzzy_backend (
+						"found fuzzy hash with probability %.2f",
+						rep.v1.prob);
+
+				if (time (NULL) - sel->ts > expire) {
+					msg_debug_fuzzy_backend (
+							"requested hash has been expired");
+					rep.v1.prob = 0.0;
+				}
+				else {
+					rep.ts = sel->ts;
+					memcpy (rep.digest, sel->digest, sizeof (rep.digest));
+					rep.v1.value = sel->value;
+					rep.v1.flag = sel->flag;
+				}
+			}
+			else {
+				/* Otherwise we assume that as error */
+				rep.v1.value = 0;
+			}
+		}
+	}
+
+	return rep;
+}
+
+gboolean
+rspamd_fuzzy_backend_memory_add (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct rspamd_fuzzy_memory_tables *tables;
+	struct rspamd_fuzzy_memory_elt *elt;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	tables = rspamd_fuzzy_backend_memory_writable (backend);
+	elt = rspamd_fuzzy_backend_memory_find_writable (backend, tables,
+			cmd->digest);
+
+	if (elt != NULL) {
+		if (elt->h.flag == cmd->flag) {
+			/* We need to increase weight */
+			elt->h.value += cmd->value;
+		}
+		else {
+			/* We need to relearn actually */
+			elt->h.value = cmd->value;
+			elt->h.flag = cmd->flag;
+		}
+
+		elt->h.ts = time (NULL);
+	}
+	else {
+		elt = g_malloc0 (sizeof (*elt));
+		memcpy (elt->h.digest, cmd->digest, sizeof (elt->h.digest));
+		elt->h.value = cmd->value;
+		elt->h.flag = cmd->flag;
+		elt->h.ts = time (NULL);
+
+		if (cmd->shingles_count > 0) {
+			shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+			elt->shingles = g_malloc (sizeof (shcmd->sgl.hashes));
+			memcpy (elt->shingles, shcmd->sgl.hashes, sizeof (shcmd->sgl.hashes));
+		}
+
+		/* The newest hash owns its shingles */
+		rspamd_fuzzy_memory_insert (tables, elt,
+				RSPAMD_FUZZY_MEMORY_ALL_SHINGLES);
+	}
+
+	backend->dirty = TRUE;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_backend_memory_del (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct rspamd_fuzzy_memory_tables *tables;
+	struct rspamd_fuzzy_memory_elt *elt;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	tables = rspamd_fuzzy_backend_memory_writable (backend);
+	elt = rspamd_fuzzy_backend_memory_find_writable (backend, tables,
+			cmd->digest);
+
+	if (elt == NULL) {
+		/* Hash is missing */
+		return FALSE;
+	}
+
+	rspamd_fuzzy_memory_remove (tables, elt);
+	rspamd_fuzzy_memory_elt_free (elt);
+	backend->dirty = TRUE;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_backend_memory_refresh (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct rspamd_fuzzy_memory_elt *elt;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	elt = rspamd_fuzzy_backend_memory_find_writable (backend,
+			rspamd_fuzzy_backend_memory_writable (backend), cmd->digest);
+
+	if (elt == NULL) {
+		return FALSE;
+	}
+
+	elt->h.ts = time (NULL);
+	backend->dirty = TRUE;
+
+	return TRUE;
+}
+
+void
+rspamd_fuzzy_backend_memory_finish_update (struct rspamd_fuzzy_backend_memory *backend,
+		const gchar *source, gboolean version_bump)
+{
+	struct rspamd_fuzzy_memory_tables *tables;
+	gint64 *pver;
+
+	if (backend == NULL || !version_bump) {
+		return;
+	}
+
+	tables = rspamd_fuzzy_backend_memory_writable (backend);
+	pver = g_hash_table_lookup (tables->sources, source);
+
+	if (pver == NULL) {
+		pver = g_malloc0 (sizeof (*pver));
+		g_hash_table_insert (tables->sources, g_strdup (source), pver);
+	}
+
+	(*pver) ++;
+	backend->dirty = TRUE;
+}
+
+/*
+ * Tells the main process about the child that writes a snapshot, so it is
+ * accounted like other children of workers
+ */
+static void
+rspamd_fuzzy_backend_memory_notify_main (struct rspamd_fuzzy_backend_memory *backend,
+		pid_t cpid, gint state)
+{
+	struct rspamd_srv_command srv_cmd;
+
+	if (backend->worker == NULL || backend->event_loop == NULL) {
+		return;
+	}
+
+	memset (&srv_cmd, 0, sizeof (srv_cmd));
+	srv_cmd.type = RSPAMD_SRV_ON_FORK;
+	srv_cmd.cmd.on_fork.state = state;
+	srv_cmd.cmd.on_fork.cpid = cpid;
+	srv_cmd.cmd.on_fork.ppid = getpid ();
+	rspamd_srv_send_command (backend->worker, backend->event_loop, &srv_cmd, -1,
+			NULL, NULL);
+}
+
+/*
+ * Collects the child that writes a snapshot, returns FALSE if it is running
+ */
+static gboolean
+rspamd_fuzzy_backend_memory_snapshot_wait (struct rspamd_fuzzy_backend_memory *backend,
+		gboolean block)
+{
+	struct stat st;
+	pid_t ret;
+	gint status = 0;
+
+	if (backend->snapshot_pid == 0) {
+		return TRUE;
+	}
+
+	do {
+		ret = waitpid (backend->snapshot_pid, &status, block ? 0 : WNOHANG);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == 0) {
+		return FALSE;
+	}
+
+	rspamd_fuzzy_backend_memory_notify_main (backend, backend->snapshot_pid,
+			child_dead);
+
+	if (ret == -1 && errno != ECHILD) {
+		msg_err_fuzzy_backend ("cannot wait for snapshot process %P: %s",
+				backend->snapshot_pid, strerror (errno));
+		backend->snapshot_pid = 0;
+		backend->dirty = TRUE;
+
+		return TRUE;
+	}
+
+	if (ret != -1 && (!WIFEXITED (status) || WEXITSTATUS (status) != 0)) {
+		msg_err_fuzzy_backend ("snapshot process %P has failed, status: %d",
+				backend->snapshot_pid, status);
+		backend->snapshot_pid = 0;
+		backend->dirty = TRUE;
+
+		return TRUE;
+	}
+
+	backend->snapshot_pid = 0;
+
+	/* Do not reload our own snapshot */
+	if (stat (backend->path, &st) != -1) {
+		backend->snapshot_ino = st.st_ino;
+		backend->snapshot_mtime = st.st_mtime;
+	}
+
+	msg_info_fuzzy_backend ("saved %Hz hashes to %s in %.3f seconds",
+			backend->snapshot_count, backend->path,
+			rspamd_get_ticks (FALSE) - backend->snapshot_start);
+
+	return TRUE;
+}
+
+/*
+ * Writes snapshot from a child process, so neither the file writes nor fsync
+ * block the event loop; the child sees tables as they were at fork
+ */
+static gboolean
+rspamd_fuzzy_backend_memory_snapshot_start (struct rspamd_fuzzy_backend_memory *backend,
+		gboolean force)
+{
+	GError *err = NULL;
+	gdouble t1, t2;
+	pid_t pid = -1;
+
+	t1 = rspamd_get_ticks (FALSE);
+
+	if (!force) {
+		pid = fork ();
+	}
+
+	switch (pid) {
+	case 0:
+		if (backend->worker) {
+			rspamd_log_on_fork (backend->worker->cf->type,
+					backend->worker->srv->cfg, backend->worker->srv->logger);
+		}
+
+		if (!rspamd_fuzzy_backend_memory_snapshot (backend, &err)) {
+			msg_err_fuzzy_backend ("cannot save snapshot: %e", err);
+			g_error_free (err);
+			_exit (EXIT_FAILURE);
+		}
+
+		_exit (EXIT_SUCCESS);
+	case -1:
+		if (!force) {
+			msg_warn_fuzzy_backend ("cannot fork to save snapshot: %s; "
+					"save it in process", strerror (errno));
+		}
+
+		if (!rspamd_fuzzy_backend_memory_snapshot (backend, &err)) {
+			msg_err_fuzzy_backend ("cannot save snapshot: %e", err);
+			g_error_free (err);
+
+			return FALSE;
+		}
+
+		t2 = rspamd_get_ticks (FALSE);
+		backend->dirty = FALSE;
+		msg_info_fuzzy_backend ("saved %Hz hashes to %s in %.3f seconds",
+				backend->tables->count, backend->path, t2 - t1);
+		break;
+	default:
+		rspamd_fuzzy_backend_memory_notify_main (backend, pid, child_create);
+		backend->snapshot_pid = pid;
+		backend->snapshot_count = backend->tables->count;
+		backend->snapshot_start = t1;
+		/* Updates after this point need one more snapshot */
+		backend->dirty = FALSE;
+		break;
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_backend_memory_sync (struct rspamd_fuzzy_backend_memory *backend,
+		gint64 expire, gboolean force)
+{
+	struct rspamd_fuzzy_memory_elt *elt;
+	time_t now;
+	gint64 expire_lim;
+	gsize nexpired = 0;
+	guint i;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	now = time (NULL);
+
+	/* Perform expire, only the process that applies updates does that */
+	if (expire > 0) {
+		/* Tables are built between loop iterations, expire on the next sync */
+		rspamd_fuzzy_backend_memory_promote_start (backend);
+	}
+
+	if (expire > 0 && backend->tables) {
+		expire_lim = now - expire;
+
+		for (i = 0; i < RSPAMD_FUZZY_MEMORY_SHARDS; i ++) {
+			kh_foreach_value (backend->tables->shards[i].digests, elt, {
+				if (elt->h.ts < expire_lim) {
+					rspamd_fuzzy_memory_remove (backend->tables, elt);
+					rspamd_fuzzy_memory_elt_free (elt);
+					nexpired ++;
+				}
+			});
+		}
+
+		if (nexpired > 0) {
+			backend->expired += nexpired;
+			backend->dirty = TRUE;
+			msg_info_fuzzy_backend ("expired %Hz hashes", nexpired);
+		}
+	}
+
+	if (!rspamd_fuzzy_backend_memory_snapshot_wait (backend, force)) {
+		/* Previous snapshot is still being written */
+		return TRUE;
+	}
+
+	if (backend->path && backend->dirty && backend->tables &&
+			(force || now - backend->last_snapshot >= backend->snapshot_interval)) {
+		backend->last_snapshot = now;
+
+		return rspamd_fuzzy_backend_memory_snapshot_start (backend, force);
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_fuzzy_backend_memory_close (struct rspamd_fuzzy_backend_memory *backend)
+{
+	if (backend != NULL) {
+		if (backend->event_loop) {
+			ev_stat_stop (backend->event_loop, &backend->snapshot_ev);
+		}
+
+		if (backend->building) {
+			/* Tables being built have updates that must be saved */
+			rspamd_fuzzy_backend_memory_promote (backend);
+		}
+
+		rspamd_fuzzy_backend_memory_promote_stop (backend);
+
+		if (backend->tables) {
+			rspamd_fuzzy_backend_memory_sync (backend, 0, TRUE);
+			rspamd_fuzzy_memory_tables_free (backend->tables);
+		}
+
+		if (backend->map) {
+			rspamd_fuzzy_memory_map_free (backend->map);
+		}
+
+		if (backend->path != NULL) {
+			g_free (backend->path);
+		}
+
+		if (backend->pool) {
+			rspamd_mempool_delete (backend->pool);
+		}
+
+		g_free (backend);
+	}
+}
+
+gsize
+rspamd_fuzzy_backend_memory_count (struct rspamd_fuzzy_backend_memory *backend)
+{
+	if (backend == NULL) {
+		return 0;
+	}
+
+	if (backend->tables) {
+		return backend->tables->count;
+	}
+
+	if (backend->building) {
+		/* Built hashes and hashes that are still pending in the map */
+		return backend->building->count + backend->map->hdr->nelts -
+				backend->building_pos - backend->building_ahead;
+	}
+
+	return backend->map->hdr->nelts;
+}
+
+gint64
+rspamd_fuzzy_backend_memory_version (struct rspamd_fuzzy_backend_memory *backend,
+		const gchar *source)
+{
+	gint64 *pver;
+
+	if (backend == NULL) {
+		return 0;
+	}
+
+	if (backend->tables) {
+		pver = g_hash_table_lookup (backend->tables->sources, source);
+	}
+	else if (backend->building) {
+		pver = g_hash_table_lookup (backend->building->sources, source);
+	}
+	else {
+		pver = g_hash_table_lookup (backend->map->sources, source);
+	}
+
+	return pver ? *pver : 0;
+}
+
+const gchar *
+rspamd_fuzzy_backend_memory_id (struct rspamd_fuzzy_backend_memory *backend)
+{
+	return backend != NULL ? backend->id : NULL;
+}
@@ -0,0 +1,107 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_FUZZY_BACKEND_MEMORY_H
+#define RSPAMD_FUZZY_BACKEND_MEMORY_H
+
+#include "config.h"
+#include "fuzzy_wire.h"
+#include "contrib/libev/ev.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+struct rspamd_fuzzy_backend_memory;
+struct rspamd_worker;
+
+/**
+ * Open in-memory fuzzy backend
+ * @param path snapshot file, hashes are loaded from it if it exists (may be NULL)
+ * @param snapshot_interval minimum interval between snapshots
+ * @param ev_base event loop used to watch snapshots written by other processes
+ * @param worker worker that announces snapshot processes to the main process (may be NULL)
+ * @param err error pointer
+ * @return backend structure or NULL
+ */
+struct rspamd_fuzzy_backend_memory *rspamd_fuzzy_backend_memory_open (
+		const gchar *path,
+		gdouble snapshot_interval,
+		struct ev_loop *ev_base,
+		struct rspamd_worker *worker,
+		GError **err);
+
+/**
+ * Check specified fuzzy in the backend
+ * @param backend
+ * @param cmd
+ * @return reply with probability and weight
+ */
+struct rspamd_fuzzy_reply rspamd_fuzzy_backend_memory_check (
+		struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_cmd *cmd,
+		gint64 expire);
+
+/**
+ * Add digest to the storage
+ */
+gboolean rspamd_fuzzy_backend_memory_add (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_cmd *cmd);
+
+/**
+ * Delete digest from the storage
+ */
+gboolean rspamd_fuzzy_backend_memory_del (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_cmd *cmd);
+
+/**
+ * Update timestamp of the existing digest
+ */
+gboolean rspamd_fuzzy_backend_memory_refresh (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_cmd *cmd);
+
+/**
+ * Finish updates from the specified source
+ */
+void rspamd_fuzzy_backend_memory_finish_update (struct rspamd_fuzzy_backend_memory *backend,
+		const gchar *source, gboolean version_bump);
+
+/**
+ * Expire old hashes and write snapshot if it is due, snapshots are written
+ * by a child process unless `force` is set
+ * @param backend
+ * @param expire
+ * @param force write snapshot in process even if snapshot interval has not passed
+ * @return
+ */
+gboolean rspamd_fuzzy_backend_memory_sync (struct rspamd_fuzzy_backend_memory *backend,
+		gint64 expire, gboolean force);
+
+/**
+ * Close storage
+ * @param backend
+ */
+void rspamd_fuzzy_backend_memory_close (struct rspamd_fuzzy_backend_memory *backend);
+
+gsize rspamd_fuzzy_backend_memory_count (struct rspamd_fuzzy_backend_memory *backend);
+
+gint64 rspamd_fuzzy_backend_memory_version (struct rspamd_fuzzy_backend_memory *backend,
+		const gchar *source);
+
+const gchar *rspamd_fuzzy_backend_memory_id (struct rspamd_fuzzy_backend_memory *backend);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
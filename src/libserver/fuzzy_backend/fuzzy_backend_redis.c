@@ -29,6 +29,7 @@
 #define REDIS_DEFAULT_PORT 6379
 #define REDIS_DEFAULT_OBJECT "fuzzy"
 #define REDIS_DEFAULT_TIMEOUT 2.0
+#define REDIS_DEFAULT_BATCH_SIZE 64
 
 #define msg_err_redis_session(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "fuzzy_redis", session->backend->id, \
@@ -58,6 +59,12 @@ struct rspamd_fuzzy_backend_redis {
 	struct rspamd_redis_pool *pool;
 	gdouble timeout;
 	gint conf_ref;
+	/* Checks collected within batch window are resolved by a single script */
+	gdouble batch_window;
+	guint batch_size;
+	GPtrArray *pending_checks;
+	ev_timer batch_ev;
+	struct ev_loop *event_loop;
 	ref_entry_t ref;
 };
 
@@ -65,7 +72,14 @@ enum rspamd_fuzzy_redis_command {
 	RSPAMD_FUZZY_REDIS_COMMAND_COUNT,
 	RSPAMD_FUZZY_REDIS_COMMAND_VERSION,
 	RSPAMD_FUZZY_REDIS_COMMAND_UPDATES,
-	RSPAMD_FUZZY_REDIS_COMMAND_CHECK
+	RSPAMD_FUZZY_REDIS_COMMAND_CHECK,
+	RSPAMD_FUZZY_REDIS_COMMAND_CHECK_BATCH
+};
+
+struct rspamd_fuzzy_redis_check_elt {
+	const struct rspamd_fuzzy_cmd *cmd;
+	rspamd_fuzzy_check_cb cb;
+	void *ud;
 };
 
 struct rspamd_fuzzy_redis_session {
@@ -97,8 +111,47 @@ struct rspamd_fuzzy_redis_session {
 	gsize *argv_lens;
 	struct upstream *up;
 	guchar found_digest[rspamd_cryptobox_HASHBYTES];
+	/* Checks resolved by this session in the batch mode */
+	GPtrArray *checks;
 };
 
+/*
+ * KEYS: for each check the key of its digest followed by its shingles keys,
+ * ARGV[1]: prefix, then the number of shingles keys per check. Returns value,
+ * flag, timestamp, number of matched shingles (0 for the direct match) and
+ * the digest matched by shingles per check. The key of a hash matched by
+ * shingles is known only from shingles values, so it cannot be declared.
+ */
+static const gchar *redis_check_script =
+	"local prefix = ARGV[1]\n"
+	"local res = {}\n"
+	"local k = 1\n"
+	"for i = 2, #ARGV do\n"
+	"  local nsh = tonumber(ARGV[i])\n"
+	"  local r = redis.call('HMGET', KEYS[k], 'V', 'F', 'C')\n"
+	"  local votes, digest = 0, false\n"
+	"  if (not r[1] or not r[2]) and nsh > 0 then\n"
+	"    local sgl = redis.call('MGET', unpack(KEYS, k + 1, k + nsh))\n"
+	"    local cnt, sel = {}, nil\n"
+	"    for j = 1, nsh do\n"
+	"      local d = sgl[j]\n"
+	"      if d then\n"
+	"        cnt[d] = (cnt[d] or 0) + 1\n"
+	"        if not sel or cnt[d] > cnt[sel] then sel = d end\n"
+	"      end\n"
+	"    end\n"
+	"    if sel and cnt[sel] > nsh / 2 then\n"
+	"      votes, digest = cnt[sel], sel\n"
+	"      r = redis.call('HMGET', prefix .. sel, 'V', 'F', 'C')\n"
+	"    end\n"
+	"  end\n"
+	"  res[#res + 1] = {r[1], r[2], r[3], votes, digest}\n"
+	"  k = k + 1 + nsh\n"
+	"end\n"
+	"return res\n";
+
+static gchar redis_check_script_sha[RSPAMD_REDIS_SCRIPT_SHA_LEN];
+
 static inline struct upstream_list *
 rspamd_redis_get_servers (struct rspamd_fuzzy_backend_redis *ctx,
 						  const gchar *what)
@@ -162,6 +215,10 @@ rspamd_fuzzy_redis_session_dtor (struct rspamd_fuzzy_redis_session *session,
 	ev_timer_stop (session->event_loop, &session->timeout);
 	rspamd_fuzzy_redis_session_free_args (session);
 
+	if (session->checks) {
+		g_ptr_array_free (session->checks, TRUE);
+	}
+
 	REF_RELEASE (session->backend);
 	g_free (session);
 }
@@ -179,6 +236,10 @@ rspamd_fuzzy_backend_redis_dtor (struct rspamd_fuzzy_backend_redis *backend)
 		g_free (backend->id);
 	}
 
+	if (backend->pending_checks) {
+		g_ptr_array_free (backend->pending_checks, TRUE);
+	}
+
 	g_free (backend);
 }
 
@@ -237,6 +298,27 @@ rspamd_fuzzy_backend_init_redis (struct rspamd_fuzzy_backend *bk,
 	}
 
 	backend->conf_ref = conf_ref;
+	backend->batch_size = REDIS_DEFAULT_BATCH_SIZE;
+
+	elt = ucl_object_lookup (obj, "batch_window");
+	if (elt != NULL) {
+		backend->batch_window = ucl_object_todouble (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "batch_size");
+	if (elt != NULL && ucl_object_toint (elt) > 0) {
+		backend->batch_size = ucl_object_toint (elt);
+	}
+
+	if (backend->batch_window > 0) {
+		backend->pending_checks = g_ptr_array_new_full (backend->batch_size,
+				g_free);
+
+		if (redis_check_script_sha[0] == '\0') {
+			rspamd_redis_script_sha (redis_check_script,
+					redis_check_script_sha);
+		}
+	}
 
 	/* Check some common table values */
 	lua_rawgeti (L, LUA_REGISTRYINDEX, conf_ref);
@@ -609,6 +691,280 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 	rspamd_fuzzy_redis_session_dtor (session, FALSE);
 }
 
+static void
+rspamd_fuzzy_redis_batch_fail (GPtrArray *checks)
+{
+	struct rspamd_fuzzy_redis_check_elt *elt;
+	struct rspamd_fuzzy_reply rep;
+	guint i;
+
+	PTR_ARRAY_FOREACH (checks, i, elt) {
+		if (elt->cb) {
+			memset (&rep, 0, sizeof (rep));
+			memcpy (rep.digest, elt->cmd->digest, sizeof (rep.digest));
+			elt->cb (&rep, elt->ud);
+		}
+	}
+}
+
+static gint
+rspamd_fuzzy_redis_batch_call (struct rspamd_fuzzy_redis_session *session,
+		gboolean by_sha);
+
+static void
+rspamd_fuzzy_redis_batch_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+	struct rspamd_fuzzy_redis_check_elt *elt;
+	redisReply *reply = r, *res, *cur;
+	struct rspamd_fuzzy_reply rep;
+	guint i;
+
+	ev_timer_stop (session->event_loop, &session->timeout);
+
+	if (c->err == 0) {
+		rspamd_upstream_ok (session->up);
+
+		if (reply->type == REDIS_REPLY_ERROR && reply->str != NULL &&
+				strncmp (reply->str, "NOSCRIPT", 8) == 0 &&
+				rspamd_fuzzy_redis_batch_call (session, FALSE) == REDIS_OK) {
+			/* Script is loaded by this call, do not free session */
+			return;
+		}
+
+		PTR_ARRAY_FOREACH (session->checks, i, elt) {
+			memset (&rep, 0, sizeof (rep));
+			memcpy (rep.digest, elt->cmd->digest, sizeof (rep.digest));
+
+			if (reply->type == REDIS_REPLY_ARRAY && i < reply->elements &&
+					reply->element[i]->type == REDIS_REPLY_ARRAY &&
+					reply->element[i]->elements == 5) {
+				res = reply->element[i];
+
+				if (res->element[0]->type == REDIS_REPLY_STRING &&
+						res->element[1]->type == REDIS_REPLY_STRING) {
+					rep.v1.value = strtoul (res->element[0]->str, NULL, 10);
+					rep.v1.flag = strtoul (res->element[1]->str, NULL, 10);
+					cur = res->element[2];
+
+					if (cur->type == REDIS_REPLY_STRING) {
+						rep.ts = strtoul (cur->str, NULL, 10);
+					}
+
+					cur = res->element[3];
+
+					if (cur->type == REDIS_REPLY_INTEGER && cur->integer > 0) {
+						rep.v1.prob = ((float)cur->integer) / RSPAMD_SHINGLE_SIZE;
+					}
+					else {
+						rep.v1.prob = 1.0;
+					}
+
+					cur = res->element[4];
+
+					if (cur->type == REDIS_REPLY_STRING) {
+						memcpy (rep.digest, cur->str,
+								MIN (sizeof (rep.digest), cur->len));
+					}
+				}
+			}
+
+			if (elt->cb) {
+				elt->cb (&rep, elt->ud);
+			}
+		}
+
+		if (reply->type != REDIS_REPLY_ARRAY) {
+			msg_err_redis_session ("cannot check hashes on %s: %s",
+					rspamd_inet_address_to_string_pretty (rspamd_upstream_addr_cur (session->up)),
+					reply->type == REDIS_REPLY_ERROR ? reply->str : "bad reply");
+		}
+	}
+	else {
+		rspamd_fuzzy_redis_batch_fail (session->checks);
+
+		if (c->errstr) {
+			msg_err_redis_session ("error getting hashes on %s: %s",
+					rspamd_inet_address_to_string_pretty (rspamd_upstream_addr_cur (session->up)),
+					c->errstr);
+		}
+
+		rspamd_upstream_fail (session->up, FALSE,  strerror (errno));
+	}
+
+	rspamd_fuzzy_redis_session_dtor (session, FALSE);
+}
+
+/*
+ * Calls the check script by its digest or, if Redis has not seen it yet,
+ * by its body
+ */
+static gint
+rspamd_fuzzy_redis_batch_call (struct rspamd_fuzzy_redis_session *session,
+		gboolean by_sha)
+{
+	gint ret;
+
+	g_free (session->argv[0]);
+	g_free (session->argv[1]);
+
+	if (by_sha) {
+		session->argv[0] = g_strdup ("EVALSHA");
+		session->argv[1] = g_strdup (redis_check_script_sha);
+	}
+	else {
+		session->argv[0] = g_strdup ("EVAL");
+		session->argv[1] = g_strdup (redis_check_script);
+	}
+
+	session->argv_lens[0] = strlen (session->argv[0]);
+	session->argv_lens[1] = strlen (session->argv[1]);
+
+	g_assert (session->ctx != NULL);
+	ret = redisAsyncCommandArgv (session->ctx,
+			rspamd_fuzzy_redis_batch_callback,
+			session, session->nargs,
+			(const gchar **)session->argv, session->argv_lens);
+
+	if (ret == REDIS_OK) {
+		/* Add timeout */
+		session->timeout.data = session;
+		ev_now_update_if_cheap ((struct ev_loop *)session->event_loop);
+		ev_timer_init (&session->timeout,
+				rspamd_fuzzy_redis_timeout,
+				session->backend->timeout, 0.0);
+		ev_timer_start (session->event_loop, &session->timeout);
+	}
+
+	return ret;
+}
+
+/*
+ * Sends all pending checks to Redis as a single script call, that also
+ * performs shingles voting, so each check requires a single round trip
+ */
+static void
+rspamd_fuzzy_redis_batch_flush (struct rspamd_fuzzy_backend_redis *backend)
+{
+	struct rspamd_fuzzy_redis_session *session;
+	struct rspamd_fuzzy_redis_check_elt *elt;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct upstream *up;
+	struct upstream_list *ups;
+	rspamd_inet_addr_t *addr;
+	GPtrArray *checks;
+	GString *key;
+	guint i, j, cur, init_len, nkeys;
+
+	ev_timer_stop (backend->event_loop, &backend->batch_ev);
+
+	if (backend->pending_checks->len == 0) {
+		return;
+	}
+
+	checks = backend->pending_checks;
+	backend->pending_checks = g_ptr_array_new_full (backend->batch_size,
+			g_free);
+	ups = rspamd_redis_get_servers (backend, "read_servers");
+
+	if (!ups) {
+		rspamd_fuzzy_redis_batch_fail (checks);
+		g_ptr_array_free (checks, TRUE);
+
+		return;
+	}
+
+	session = g_malloc0 (sizeof (*session));
+	session->backend = backend;
+	REF_RETAIN (session->backend);
+	session->command = RSPAMD_FUZZY_REDIS_COMMAND_CHECK_BATCH;
+	session->checks = checks;
+	session->event_loop = backend->event_loop;
+
+	/* Digest key and shingles keys of each check */
+	nkeys = checks->len;
+
+	PTR_ARRAY_FOREACH (checks, i, elt) {
+		if (elt->cmd->shingles_count > 0) {
+			nkeys += RSPAMD_SHINGLE_SIZE;
+		}
+	}
+
+	/* EVALSHA, sha, numkeys, keys, prefix and shingles count per check */
+	session->nargs = 3 + nkeys + 1 + checks->len;
+	session->argv = g_malloc0 (sizeof (gchar *) * session->nargs);
+	session->argv_lens = g_malloc0 (sizeof (gsize) * session->nargs);
+	session->argv[2] = g_strdup_printf ("%u", nkeys);
+	session->argv_lens[2] = strlen (session->argv[2]);
+	init_len = strlen (backend->redis_object);
+	cur = 3;
+
+	PTR_ARRAY_FOREACH (checks, i, elt) {
+		session->argv[cur] = g_malloc (init_len + sizeof (elt->cmd->digest));
+		memcpy (session->argv[cur], backend->redis_object, init_len);
+		memcpy (session->argv[cur] + init_len, elt->cmd->digest,
+				sizeof (elt->cmd->digest));
+		session->argv_lens[cur ++] = init_len + sizeof (elt->cmd->digest);
+
+		if (elt->cmd->shingles_count > 0) {
+			shcmd = (const struct rspamd_fuzzy_shingle_cmd *)elt->cmd;
+
+			for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+				key = g_string_sized_new (init_len + 2 + 2 +
+						sizeof ("18446744073709551616"));
+				rspamd_printf_gstring (key, "%s_%d_%uL", backend->redis_object,
+						j, shcmd->sgl.hashes[j]);
+				session->argv[cur] = key->str;
+				session->argv_lens[cur ++] = key->len;
+				g_string_free (key, FALSE); /* Do not free underlying array */
+			}
+		}
+	}
+
+	session->argv[cur] = g_strdup (backend->redis_object);
+	session->argv_lens[cur ++] = init_len;
+
+	PTR_ARRAY_FOREACH (checks, i, elt) {
+		session->argv[cur] = g_strdup (elt->cmd->shingles_count > 0 ?
+				G_STRINGIFY (RSPAMD_SHINGLE_SIZE) : "0");
+		session->argv_lens[cur] = strlen (session->argv[cur]);
+		cur ++;
+	}
+
+	up = rspamd_upstream_get (ups,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+
+	session->up = up;
+	addr = rspamd_upstream_addr_next (up);
+	g_assert (addr != NULL);
+	session->ctx = rspamd_redis_pool_connect (backend->pool,
+			backend->dbname, backend->password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (session->ctx == NULL) {
+		rspamd_upstream_fail (up, TRUE, strerror (errno));
+		rspamd_fuzzy_redis_batch_fail (checks);
+		rspamd_fuzzy_redis_session_dtor (session, TRUE);
+	}
+	else if (rspamd_fuzzy_redis_batch_call (session, TRUE) != REDIS_OK) {
+		rspamd_fuzzy_redis_batch_fail (checks);
+		rspamd_fuzzy_redis_session_dtor (session, TRUE);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_batch_timer (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_fuzzy_backend_redis *backend =
+			(struct rspamd_fuzzy_backend_redis *)w->data;
+
+	rspamd_fuzzy_redis_batch_flush (backend);
+}
+
 void
 rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 		const struct rspamd_fuzzy_cmd *cmd,
@@ -625,6 +981,33 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 
 	g_assert (backend != NULL);
 
+	if (backend->pending_checks) {
+		struct rspamd_fuzzy_redis_check_elt *elt;
+
+		elt = g_malloc (sizeof (*elt));
+		elt->cmd = cmd;
+		elt->cb = cb;
+		elt->ud = ud;
+		g_ptr_array_add (backend->pending_checks, elt);
+
+		if (backend->event_loop == NULL) {
+			backend->event_loop = rspamd_fuzzy_backend_event_base (bk);
+			backend->batch_ev.data = backend;
+			ev_timer_init (&backend->batch_ev, rspamd_fuzzy_redis_batch_timer,
+					backend->batch_window, 0.0);
+		}
+
+		if (backend->pending_checks->len >= backend->batch_size) {
+			rspamd_fuzzy_redis_batch_flush (backend);
+		}
+		else if (!ev_is_active (&backend->batch_ev)) {
+			ev_timer_set (&backend->batch_ev, backend->batch_window, 0.0);
+			ev_timer_start (backend->event_loop, &backend->batch_ev);
+		}
+
+		return;
+	}
+
 	ups = rspamd_redis_get_servers (backend, "read_servers");
 	if (!ups) {
 		if (cb) {
@@ -1624,5 +2007,11 @@ rspamd_fuzzy_backend_close_redis (struct rspamd_fuzzy_backend *bk,
 
 	g_assert (backend != NULL);
 
+	if (backend->pending_checks && backend->event_loop) {
+		ev_timer_stop (backend->event_loop, &backend->batch_ev);
+		rspamd_fuzzy_redis_batch_fail (backend->pending_checks);
+		g_ptr_array_set_size (backend->pending_checks, 0);
+	}
+
 	REF_RELEASE (backend);
 }
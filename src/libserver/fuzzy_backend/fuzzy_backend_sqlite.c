@@ -29,10 +29,18 @@ struct rspamd_fuzzy_backend_sqlite {
 	gsize count;
 	gsize expired;
 	rspamd_mempool_t *pool;
+	/* WAL checkpoints are done by a separate thread if enabled */
+	GThread *checkpoint_thread;
+	GMutex checkpoint_mtx;
+	GCond checkpoint_cond;
+	gdouble checkpoint_interval;
+	gboolean checkpoint_stop;
 };
 
 static const gdouble sql_sleep_time = 0.1;
 static const guint max_retries = 10;
+/* Wal frames after which the writer checkpoints on commit itself */
+#define RSPAMD_FUZZY_BACKEND_WAL_MAX_FRAMES 16384
 
 #define msg_err_fuzzy_backend(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         backend->pool->tag.tagname, backend->pool->tag.uid, \
@@ -92,6 +100,7 @@ enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_UPDATE,
 	RSPAMD_FUZZY_BACKEND_UPDATE_FLAG,
 	RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
+	RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
 	RSPAMD_FUZZY_BACKEND_CHECK,
 	RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
 	RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID,
@@ -166,6 +175,23 @@ static struct rspamd_fuzzy_stmts {
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
+	{
+		/* All shingles of a digest are inserted by a single statement */
+		.idx = RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
+		.sql = "INSERT OR REPLACE INTO shingles(value, number, digest_id) "
+				"VALUES "
+				"(?1, 0, ?33), (?2, 1, ?33), (?3, 2, ?33), (?4, 3, ?33), "
+				"(?5, 4, ?33), (?6, 5, ?33), (?7, 6, ?33), (?8, 7, ?33), "
+				"(?9, 8, ?33), (?10, 9, ?33), (?11, 10, ?33), (?12, 11, ?33), "
+				"(?13, 12, ?33), (?14, 13, ?33), (?15, 14, ?33), (?16, 15, ?33), "
+				"(?17, 16, ?33), (?18, 17, ?33), (?19, 18, ?33), (?20, 19, ?33), "
+				"(?21, 20, ?33), (?22, 21, ?33), (?23, 22, ?33), (?24, 23, ?33), "
+				"(?25, 24, ?33), (?26, 25, ?33), (?27, 26, ?33), (?28, 27, ?33), "
+				"(?29, 28, ?33), (?30, 29, ?33), (?31, 30, ?33), (?32, 31, ?33);",
+		.args = "GI",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_CHECK,
 		.sql = "SELECT value, time, flag FROM digests WHERE digest==?1;",
@@ -245,6 +271,8 @@ static struct rspamd_fuzzy_stmts {
 	},
 };
 
+G_STATIC_ASSERT (RSPAMD_SHINGLE_SIZE == 32);
+
 static GQuark
 rspamd_fuzzy_backend_sqlite_quark (void)
 {
@@ -301,8 +329,9 @@ rspamd_fuzzy_backend_sqlite_run_stmt (struct rspamd_fuzzy_backend_sqlite *backen
 	int retcode;
 	va_list ap;
 	sqlite3_stmt *stmt;
-	int i;
+	int i, j, pos;
 	const char *argtypes;
+	const guint64 *shingles;
 	guint retries = 0;
 	struct timespec ts;
 
@@ -332,23 +361,31 @@ rspamd_fuzzy_backend_sqlite_run_stmt (struct rspamd_fuzzy_backend_sqlite *backen
 	sqlite3_reset (stmt);
 	va_start (ap, idx);
 
-	for (i = 0; argtypes[i] != '\0'; i++) {
+	for (i = 0, pos = 1; argtypes[i] != '\0'; i++) {
 		switch (argtypes[i]) {
 		case 'T':
-			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), -1,
+			sqlite3_bind_text (stmt, pos++, va_arg (ap, const char*), -1,
 					SQLITE_STATIC);
 			break;
 		case 'I':
-			sqlite3_bind_int64 (stmt, i + 1, va_arg (ap, gint64));
+			sqlite3_bind_int64 (stmt, pos++, va_arg (ap, gint64));
 			break;
 		case 'S':
-			sqlite3_bind_int (stmt, i + 1, va_arg (ap, gint));
+			sqlite3_bind_int (stmt, pos++, va_arg (ap, gint));
 			break;
 		case 'D':
 			/* Special case for digests variable */
-			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), 64,
+			sqlite3_bind_text (stmt, pos++, va_arg (ap, const char*), 64,
 					SQLITE_STATIC);
 			break;
+		case 'G':
+			/* Special case for all shingles of a digest */
+			shingles = va_arg (ap, const guint64 *);
+
+			for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+				sqlite3_bind_int64 (stmt, pos++, shingles[j]);
+			}
+			break;
 		}
 	}
 
@@ -458,9 +495,101 @@ rspamd_fuzzy_backend_sqlite_open_db (const gchar *path, GError **err)
 	return bk;
 }
 
+/*
+ * Runs passive checkpoints using its own connection, so neither lookups nor
+ * update transactions wait for the wal file to be copied to the database
+ */
+static gpointer
+rspamd_fuzzy_backend_sqlite_checkpoint_thread (gpointer ud)
+{
+	struct rspamd_fuzzy_backend_sqlite *backend = ud;
+	sqlite3 *db;
+	gint64 deadline;
+	gint wal_frames, wal_checkpointed;
+
+	if (sqlite3_open_v2 (backend->path, &db,
+			SQLITE_OPEN_READWRITE|SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_PRIVATECACHE,
+			NULL) != SQLITE_OK) {
+		sqlite3_close (db);
+
+		return NULL;
+	}
+
+	g_mutex_lock (&backend->checkpoint_mtx);
+
+	while (!backend->checkpoint_stop) {
+		deadline = g_get_monotonic_time () +
+				backend->checkpoint_interval * G_TIME_SPAN_SECOND;
+
+		while (!backend->checkpoint_stop &&
+				g_cond_wait_until (&backend->checkpoint_cond,
+						&backend->checkpoint_mtx, deadline));
+
+		if (backend->checkpoint_stop) {
+			break;
+		}
+
+		g_mutex_unlock (&backend->checkpoint_mtx);
+		sqlite3_wal_checkpoint_v2 (db, NULL, SQLITE_CHECKPOINT_PASSIVE,
+				&wal_frames, &wal_checkpointed);
+		g_mutex_lock (&backend->checkpoint_mtx);
+	}
+
+	g_mutex_unlock (&backend->checkpoint_mtx);
+	sqlite3_close (db);
+
+	return NULL;
+}
+
+/*
+ * Automatic checkpoints are disabled while the checkpoint thread runs, so
+ * the writer checkpoints on commit only if the wal file has grown over
+ * this bound (e.g. when the thread is locked out of the database)
+ */
+static int
+rspamd_fuzzy_backend_sqlite_wal_hook (void *ud, sqlite3 *db,
+		const char *dbname, int nframes)
+{
+	gint wal_frames, wal_checkpointed;
+
+	if (nframes >= RSPAMD_FUZZY_BACKEND_WAL_MAX_FRAMES) {
+		sqlite3_wal_checkpoint_v2 (db, dbname, SQLITE_CHECKPOINT_PASSIVE,
+				&wal_frames, &wal_checkpointed);
+	}
+
+	return SQLITE_OK;
+}
+
+/*
+ * Checkpoint thread is started by the first update, so only the process
+ * that writes to the database (the first fuzzy worker) runs it
+ */
+static void
+rspamd_fuzzy_backend_sqlite_start_checkpoints (
+		struct rspamd_fuzzy_backend_sqlite *backend)
+{
+	if (sqlite3_exec (backend->db, "PRAGMA wal_autocheckpoint = 0;",
+			NULL, NULL, NULL) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot disable wal autocheckpoint: %s; "
+				"checkpoints are done on commit",
+				sqlite3_errmsg (backend->db));
+		backend->checkpoint_interval = 0;
+
+		return;
+	}
+
+	sqlite3_wal_hook (backend->db, rspamd_fuzzy_backend_sqlite_wal_hook,
+			backend);
+	g_mutex_init (&backend->checkpoint_mtx);
+	g_cond_init (&backend->checkpoint_cond);
+	backend->checkpoint_thread = g_thread_new ("fuzzy_checkpoint",
+			rspamd_fuzzy_backend_sqlite_checkpoint_thread, backend);
+}
+
 struct rspamd_fuzzy_backend_sqlite *
 rspamd_fuzzy_backend_sqlite_open (const gchar *path,
 		gboolean vacuum,
+		gdouble checkpoint_interval,
 		GError **err)
 {
 	struct rspamd_fuzzy_backend_sqlite *backend;
@@ -484,6 +613,8 @@ rspamd_fuzzy_backend_sqlite_open (const gchar *path,
 
 	rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_COUNT);
 
+	backend->checkpoint_interval = MAX (checkpoint_interval, 0);
+
 	return backend;
 }
 
@@ -651,6 +782,10 @@ rspamd_fuzzy_backend_sqlite_prepare_update (struct rspamd_fuzzy_backend_sqlite *
 		return FALSE;
 	}
 
+	if (backend->checkpoint_interval > 0 && backend->checkpoint_thread == NULL) {
+		rspamd_fuzzy_backend_sqlite_start_checkpoints (backend);
+	}
+
 	rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
 			RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
 
@@ -729,20 +864,29 @@ rspamd_fuzzy_backend_sqlite_add (struct rspamd_fuzzy_backend_sqlite *backend,
 				id = sqlite3_last_insert_rowid (backend->db);
 				shcmd = (const struct rspamd_fuzzy_shingle_cmd *) cmd;
 
-				for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-					rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
-							RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
-							shcmd->sgl.hashes[i], (gint64)i, id);
-					msg_debug_fuzzy_backend ("add shingle %d -> %L: %L",
-							i,
-							shcmd->sgl.hashes[i],
-							id);
-
-					if (rc != SQLITE_OK) {
-						msg_warn_fuzzy_backend ("cannot add shingle %d -> "
-								"%L: %L: %s", i,
+				rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+						RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
+						shcmd->sgl.hashes, id);
+				msg_debug_fuzzy_backend ("add %d shingles -> %L",
+						RSPAMD_SHINGLE_SIZE, id);
+
+				if (rc != SQLITE_OK) {
+					/* Fall back to inserting shingles one by one */
+					for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+						rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+								RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
+								shcmd->sgl.hashes[i], (gint64)i, id);
+						msg_debug_fuzzy_backend ("add shingle %d -> %L: %L",
+								i,
 								shcmd->sgl.hashes[i],
-								id, sqlite3_errmsg (backend->db));
+								id);
+
+						if (rc != SQLITE_OK) {
+							msg_warn_fuzzy_backend ("cannot add shingle %d -> "
+									"%L: %L: %s", i,
+									shcmd->sgl.hashes[i],
+									id, sqlite3_errmsg (backend->db));
+						}
 					}
 				}
 			}
@@ -788,7 +932,7 @@ rspamd_fuzzy_backend_sqlite_finish_update (struct rspamd_fuzzy_backend_sqlite *b
 					RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK);
 			return FALSE;
 		}
-		else {
+		else if (backend->checkpoint_thread == NULL) {
 			if (!rspamd_sqlite3_sync (backend->db, &wal_frames, &wal_checkpointed)) {
 				msg_warn_fuzzy_backend ("cannot commit checkpoint: %s",
 						sqlite3_errmsg (backend->db));
@@ -997,6 +1141,16 @@ void
 rspamd_fuzzy_backend_sqlite_close (struct rspamd_fuzzy_backend_sqlite *backend)
 {
 	if (backend != NULL) {
+		if (backend->checkpoint_thread != NULL) {
+			g_mutex_lock (&backend->checkpoint_mtx);
+			backend->checkpoint_stop = TRUE;
+			g_cond_signal (&backend->checkpoint_cond);
+			g_mutex_unlock (&backend->checkpoint_mtx);
+			g_thread_join (backend->checkpoint_thread);
+			g_mutex_clear (&backend->checkpoint_mtx);
+			g_cond_clear (&backend->checkpoint_cond);
+		}
+
 		if (backend->db != NULL) {
 			rspamd_fuzzy_backend_sqlite_close_stmts (backend);
 			sqlite3_close (backend->db);
@@ -28,11 +28,14 @@ struct rspamd_fuzzy_backend_sqlite;
 /**
  * Open fuzzy backend
  * @param path file to open (legacy file will be converted automatically)
+ * @param checkpoint_interval if positive, wal checkpoints are done by a
+ * separate thread with this interval instead of on each update commit
  * @param err error pointer
  * @return backend structure or NULL
  */
 struct rspamd_fuzzy_backend_sqlite *rspamd_fuzzy_backend_sqlite_open (const gchar *path,
 																	  gboolean vacuum,
+																	  gdouble checkpoint_interval,
 																	  GError **err);
 
 /**
@@ -2529,7 +2529,7 @@ rspamd_html_check_displayed_url (rspamd_mempool_t *pool,
 		ex->type = RSPAMD_EXCEPTION_URL;
 		ex->ptr = url;
 
-		*exceptions = g_list_prepend (*exceptions,
+		*exceptions = rspamd_mempool_glist_prepend (pool, *exceptions,
 				ex);
 	}
 
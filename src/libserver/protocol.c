@@ -1478,6 +1478,12 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 		ucl_object_insert_key (top,
 				ucl_object_fromdouble (task->time_real_finish - task->task_timestamp),
 				"time_real", 0, false);
+
+		if (rspamd_symcache_get_early_skipped (task) > 0) {
+			ucl_object_insert_key (top,
+					ucl_object_fromint (rspamd_symcache_get_early_skipped (task)),
+					"symbols_skipped", 0, false);
+		}
 	}
 
 	if (flags & RSPAMD_PROTOCOL_DKIM) {
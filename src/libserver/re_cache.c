@@ -24,6 +24,8 @@
 #include "libutil/regexp.h"
 #include "lua/lua_common.h"
 #include "libstat/stat_api.h"
+#include "libserver/worker_util.h"
+#include "libserver/rspamd_control.h"
 #include "contrib/uthash/utlist.h"
 
 #include "khash.h"
@@ -76,8 +78,8 @@ INIT_LOG_MODULE(re_cache)
 
 #ifdef WITH_HYPERSCAN
 #define RSPAMD_HS_MAGIC_LEN (sizeof (rspamd_hs_magic))
-static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '1'},
-		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '1'};
+static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '2'},
+		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '2'};
 #endif
 
 
@@ -89,6 +91,9 @@ struct rspamd_re_class {
 	gsize type_len;
 	GHashTable *re;
 	rspamd_cryptobox_hash_state_t *st;
+	/* Cache ids of regexps ordered by their content, used as hyperscan ids */
+	gint *re_ids;
+	guint nre;
 
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 
@@ -97,6 +102,9 @@ struct rspamd_re_class {
 	hs_scratch_t *hs_scratch;
 	gint *hs_ids;
 	guint nhs;
+	/* If hs_db points to a shared mapping instead of the heap */
+	gpointer hs_db_map;
+	gsize hs_db_map_len;
 #endif
 };
 
@@ -113,6 +121,26 @@ struct rspamd_re_cache_elt {
 
 KHASH_INIT (lua_selectors_hash, gchar *, int, 1, kh_str_hash_func, kh_str_hash_equal);
 
+/*
+ * Results of a single message stored in shared memory, followed by
+ * the checked bitmap and the results array of the runtime
+ */
+struct rspamd_re_cache_shared_elt {
+	gint seq; /* Odd while the element is being written */
+	guint nre;
+	gdouble ts;
+	guchar digest[16];
+};
+
+struct rspamd_re_cache_shared {
+	guint hits;
+	guint misses;
+	guint nelts;
+	gsize elt_size;
+	gdouble ttl;
+	guchar *elts;
+};
+
 struct rspamd_re_cache {
 	GHashTable *re_classes;
 
@@ -123,10 +151,14 @@ struct rspamd_re_cache {
 	guint max_re_data;
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 	lua_State *L;
+	struct rspamd_re_cache_shared *shared;
+	guchar *shared_mask; /* Regexps that depend on the message content only */
 #ifdef WITH_HYPERSCAN
 	enum rspamd_hyperscan_status hyperscan_loaded;
 	gboolean disable_hyperscan;
 	gboolean vectorized_hyperscan;
+	gboolean prefetch_hyperscan;
+	gboolean mmap_hyperscan;
 	hs_platform_info_t plt;
 #endif
 };
@@ -147,6 +179,11 @@ struct rspamd_re_runtime {
 	struct rspamd_re_cache *cache;
 	struct rspamd_re_cache_stat stat;
 	gboolean has_hs;
+	gboolean prefetched;
+	gboolean shared_checked;
+	gboolean shared_hit;
+	gdouble ts;
+	guchar digest[16];
 };
 
 static GQuark
@@ -172,6 +209,23 @@ rspamd_re_cache_class_id (enum rspamd_re_type type,
 	return rspamd_cryptobox_fast_hash_final (&st);
 }
 
+#ifdef WITH_HYPERSCAN
+static void
+rspamd_re_cache_free_hs_db (struct rspamd_re_class *re_class)
+{
+	if (re_class->hs_db_map) {
+		munmap (re_class->hs_db_map, re_class->hs_db_map_len);
+		re_class->hs_db_map = NULL;
+		re_class->hs_db_map_len = 0;
+	}
+	else if (re_class->hs_db) {
+		hs_free_database (re_class->hs_db);
+	}
+
+	re_class->hs_db = NULL;
+}
+#endif
+
 static void
 rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 {
@@ -193,10 +247,13 @@ rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 			g_free (re_class->type_data);
 		}
 
-#ifdef WITH_HYPERSCAN
-		if (re_class->hs_db) {
-			hs_free_database (re_class->hs_db);
+		if (re_class->re_ids) {
+			g_free (re_class->re_ids);
 		}
+
+#ifdef WITH_HYPERSCAN
+		rspamd_re_cache_free_hs_db (re_class);
+
 		if (re_class->hs_scratch) {
 			hs_free_scratch (re_class->hs_scratch);
 		}
@@ -216,6 +273,10 @@ rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 
 	kh_destroy (lua_selectors_hash, cache->selectors);
 
+	if (cache->shared_mask) {
+		g_free (cache->shared_mask);
+	}
+
 	g_hash_table_unref (cache->re_classes);
 	g_ptr_array_free (cache->re, TRUE);
 	g_free (cache);
@@ -365,6 +426,166 @@ rspamd_re_cache_sort_func (gconstpointer a, gconstpointer b)
 			rspamd_regexp_get_id ((*re2)->re));
 }
 
+static void
+rspamd_re_cache_init_shared (struct rspamd_re_cache *cache,
+		struct rspamd_config *cfg)
+{
+	struct rspamd_re_cache_shared *shared;
+	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_class *re_class;
+	guint i;
+
+	/* Selectors may depend on anything in a task, so they are never shared */
+	cache->shared_mask = g_malloc0 (NBYTES (cache->nre));
+
+	for (i = 0; i < cache->re->len; i ++) {
+		elt = g_ptr_array_index (cache->re, i);
+		re_class = rspamd_regexp_get_class (elt->re);
+
+		if (re_class->type != RSPAMD_RE_SELECTOR) {
+			setbit (cache->shared_mask, i);
+		}
+	}
+
+	/* Shared memory is allocated before workers are forked */
+	shared = rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (*shared));
+	shared->nelts = cfg->re_cache_shared_size;
+	shared->ttl = cfg->re_cache_shared_ttl;
+	shared->elt_size = sizeof (struct rspamd_re_cache_shared_elt) +
+			NBYTES (cache->nre) + cache->nre;
+	/* Keep elements aligned */
+	shared->elt_size = (shared->elt_size + 7) & ~((gsize)7);
+	shared->elts = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			shared->elt_size * shared->nelts);
+	cache->shared = shared;
+
+	msg_info_re_cache ("use shared regexp results cache: %ud elements, "
+			"%z bytes, %.1f seconds ttl",
+			shared->nelts, shared->elt_size * shared->nelts, shared->ttl);
+}
+
+static inline struct rspamd_re_cache_shared_elt *
+rspamd_re_cache_shared_elt (struct rspamd_re_cache_shared *shared,
+		const guchar *digest)
+{
+	guint64 h;
+
+	/* Digest is a hash itself */
+	memcpy (&h, digest, sizeof (h));
+
+	return (struct rspamd_re_cache_shared_elt *)(shared->elts +
+			(h % shared->nelts) * shared->elt_size);
+}
+
+/*
+ * Loads results for the same message scanned recently by any worker
+ */
+static gboolean
+rspamd_re_cache_shared_lookup (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt)
+{
+	struct rspamd_re_cache *cache = rt->cache;
+	struct rspamd_re_cache_shared *shared = cache->shared;
+	struct rspamd_re_cache_shared_elt *elt;
+	const guchar *data;
+	guchar hash_out[rspamd_cryptobox_HASHBYTES];
+	gint seq;
+
+	/*
+	 * Message digest covers only parts and subject, whilst regexps can match
+	 * any header or raw content, so results are keyed by the whole message
+	 */
+	rspamd_cryptobox_hash (hash_out, task->msg.begin, task->msg.len, NULL, 0);
+	memcpy (rt->digest, hash_out, sizeof (rt->digest));
+	rt->ts = task->task_timestamp;
+	elt = rspamd_re_cache_shared_elt (shared, rt->digest);
+	data = ((const guchar *)elt) + sizeof (*elt);
+	seq = g_atomic_int_get (&elt->seq);
+
+	if (!(seq & 1) && elt->nre == cache->nre &&
+			elt->ts + shared->ttl >= rt->ts &&
+			memcmp (elt->digest, rt->digest, sizeof (rt->digest)) == 0) {
+		memcpy (rt->checked, data, NBYTES (cache->nre));
+		memcpy (rt->results, data + NBYTES (cache->nre), cache->nre);
+
+		if (g_atomic_int_get (&elt->seq) == seq) {
+			g_atomic_int_inc ((gint *)&shared->hits);
+			rt->shared_hit = TRUE;
+			msg_debug_re_task ("loaded regexp results for message %*xs from "
+					"the shared cache", (gint)sizeof (rt->digest), rt->digest);
+
+			return TRUE;
+		}
+
+		/* Element has been concurrently rewritten */
+		memset (rt->checked, 0, NBYTES (cache->nre));
+		memset (rt->results, 0, cache->nre);
+	}
+
+	g_atomic_int_inc ((gint *)&shared->misses);
+
+	return FALSE;
+}
+
+static void
+rspamd_re_cache_shared_store (struct rspamd_re_runtime *rt)
+{
+	struct rspamd_re_cache *cache = rt->cache;
+	struct rspamd_re_cache_shared_elt *elt;
+	guchar *data;
+	gint seq;
+	guint i;
+
+	elt = rspamd_re_cache_shared_elt (cache->shared, rt->digest);
+	seq = g_atomic_int_get (&elt->seq);
+
+	/* Another worker is writing this element, do not wait for it */
+	if ((seq & 1) || !g_atomic_int_compare_and_exchange (&elt->seq,
+			seq, seq + 1)) {
+		return;
+	}
+
+	data = ((guchar *)elt) + sizeof (*elt);
+	elt->nre = cache->nre;
+	elt->ts = rt->ts;
+	memcpy (elt->digest, rt->digest, sizeof (elt->digest));
+
+	for (i = 0; i < NBYTES (cache->nre); i ++) {
+		data[i] = rt->checked[i] & cache->shared_mask[i];
+	}
+
+	memcpy (data + NBYTES (cache->nre), rt->results, cache->nre);
+
+	for (i = 0; i < cache->nre; i ++) {
+		if (!isset (cache->shared_mask, i)) {
+			data[NBYTES (cache->nre) + i] = 0;
+		}
+	}
+
+	g_atomic_int_set (&elt->seq, seq + 2);
+}
+
+gboolean
+rspamd_re_cache_get_shared_stat (struct rspamd_re_cache *cache,
+		guint64 *hits, guint64 *misses)
+{
+	g_assert (cache != NULL);
+
+	if (cache->shared == NULL) {
+		return FALSE;
+	}
+
+	if (hits) {
+		*hits = (guint)g_atomic_int_get ((gint *)&cache->shared->hits);
+	}
+
+	if (misses) {
+		*misses = (guint)g_atomic_int_get ((gint *)&cache->shared->misses);
+	}
+
+	return TRUE;
+}
+
 void
 rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 {
@@ -382,6 +603,19 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 	rspamd_cryptobox_hash_init (&st_global, NULL, 0);
 	/* Resort all regexps */
 	g_ptr_array_sort (cache->re, rspamd_re_cache_sort_func);
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+
+		if (re_class->re_ids) {
+			g_free (re_class->re_ids);
+		}
+
+		re_class->re_ids = g_malloc (sizeof (*re_class->re_ids) *
+				g_hash_table_size (re_class->re));
+		re_class->nre = 0;
+	}
 
 	for (i = 0; i < cache->re->len; i ++) {
 		elt = g_ptr_array_index (cache->re, i);
@@ -389,6 +623,8 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 		re_class = rspamd_regexp_get_class (re);
 		g_assert (re_class != NULL);
 		rspamd_regexp_set_cache_id (re, i);
+		/* As regexps are sorted by content, so are they within a class */
+		re_class->re_ids[re_class->nre ++] = i;
 
 		if (re_class->st == NULL) {
 			(void) !posix_memalign ((void **)&re_class->st, _Alignof (rspamd_cryptobox_hash_state_t),
@@ -426,9 +662,11 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 				sizeof (fl));
 		rspamd_cryptobox_hash_update (&st_global, (const guchar *) &fl,
 				sizeof (fl));
-		/* Numberic order */
-		rspamd_cryptobox_hash_update (re_class->st, (const guchar *)&i,
-				sizeof (i));
+		/*
+		 * Numeric order is used for the global hash only: class hashes
+		 * depend on the content of a class, so a database of a class can be
+		 * reused when regexps of other classes are changed
+		 */
 		rspamd_cryptobox_hash_update (&st_global, (const guchar *)&i,
 				sizeof (i));
 	}
@@ -444,14 +682,6 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 		re_class = v;
 
 		if (re_class->st) {
-			/*
-			 * We finally update all classes with the number of expressions
-			 * in the cache to ensure that if even a single re has been changed
-			 * we won't be broken due to id mismatch
-			 */
-			rspamd_cryptobox_hash_update (re_class->st,
-					(gpointer)&cache->re->len,
-					sizeof (cache->re->len));
 			rspamd_cryptobox_hash_final (re_class->st, hash_out);
 			rspamd_snprintf (re_class->hash, sizeof (re_class->hash), "%*xs",
 					(gint) rspamd_cryptobox_HASHBYTES, hash_out);
@@ -462,12 +692,18 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 
 	cache->L = cfg->lua_state;
 
+	if (cfg->re_cache_shared_size > 0 && cache->nre > 0) {
+		rspamd_re_cache_init_shared (cache, cfg);
+	}
+
 #ifdef WITH_HYPERSCAN
 	const gchar *platform = "generic";
 	rspamd_fstring_t *features = rspamd_fstring_new ();
 
 	cache->disable_hyperscan = cfg->disable_hyperscan;
 	cache->vectorized_hyperscan = cfg->vectorized_hyperscan;
+	cache->prefetch_hyperscan = cfg->prefetch_hyperscan;
+	cache->mmap_hyperscan = cfg->mmap_hyperscan;
 
 	g_assert (hs_populate_platform (&cache->plt) == HS_SUCCESS);
 
@@ -605,6 +841,7 @@ rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 #ifdef WITH_HYPERSCAN
 struct rspamd_re_hyperscan_cbdata {
 	struct rspamd_re_runtime *rt;
+	struct rspamd_re_class *re_class;
 	const guchar **ins;
 	const guint *lens;
 	guint count;
@@ -627,6 +864,8 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 
 	rt = cbdata->rt;
 	task = cbdata->task;
+	/* Hyperscan ids are positions of regexps in a class */
+	id = cbdata->re_class->re_ids[id];
 	pcre_elt = g_ptr_array_index (rt->cache->re, id);
 	maxhits = rspamd_regexp_get_maxhits (pcre_elt->re);
 
@@ -740,6 +979,7 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 			for (i = 0; i < count; i++) {
 				cbdata.ins = &in[i];
 				cbdata.re = re;
+				cbdata.re_class = re_class;
 				cbdata.rt = rt;
 				cbdata.lens = &lens[i];
 				cbdata.count = 1;
@@ -759,6 +999,7 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 		else {
 			cbdata.ins = in;
 			cbdata.re = re;
+			cbdata.re_class = re_class;
 			cbdata.rt = rt;
 			cbdata.lens = lens;
 			cbdata.count = 1;
@@ -1043,209 +1284,143 @@ rspamd_re_cache_process_headers_list (struct rspamd_task *task,
 }
 
 /*
- * Calculates the specified regexp for the specified class if it's not calculated
+ * Selects data for the classes that do not depend on a specific regexp
+ * (i.e. everything except headers and selectors). Returns TRUE if vectors
+ * have been allocated, and they must be freed by a caller
  */
-static guint
-rspamd_re_cache_exec_re (struct rspamd_task *task,
-		struct rspamd_re_runtime *rt,
-		rspamd_regexp_t *re,
+static gboolean
+rspamd_re_cache_get_class_data (struct rspamd_task *task,
 		struct rspamd_re_class *re_class,
-		gboolean is_strong)
+		const guchar ***pscvec,
+		guint **plenvec,
+		guint *pcnt,
+		gboolean *praw)
 {
-	guint ret = 0, i, re_id;
 	struct rspamd_mime_header *rh;
+	struct rspamd_mime_text_part *text_part;
+	struct rspamd_url *url;
 	const gchar *in;
 	const guchar **scvec;
 	guint *lenvec;
-	gboolean raw = FALSE, processed_hyperscan = FALSE;
-	struct rspamd_mime_text_part *text_part;
-	struct rspamd_mime_part *mime_part;
-	struct rspamd_url *url;
-	guint len, cnt;
-	const gchar *class_name;
-
-	class_name = rspamd_re_cache_type_to_string (re_class->type);
-	msg_debug_re_task ("start check re type: %s: /%s/",
-			class_name,
-			rspamd_regexp_get_pattern (re));
-	re_id = rspamd_regexp_get_cache_id (re);
+	gboolean raw = FALSE;
+	guint len, cnt, i;
 
 	switch (re_class->type) {
-	case RSPAMD_RE_HEADER:
-	case RSPAMD_RE_RAWHEADER:
-		/* Get list of specified headers */
-		rh = rspamd_message_get_header_array (task,
-				re_class->type_data);
-
-		if (rh) {
-			ret = rspamd_re_cache_process_headers_list (task, rt, re,
-					re_class, rh, is_strong, &processed_hyperscan);
-			msg_debug_re_task ("checked header(%s) regexp: %s -> %d",
-					(const char *)re_class->type_data,
-					rspamd_regexp_get_pattern (re),
-					ret);
-		}
-		break;
 	case RSPAMD_RE_ALLHEADER:
 		raw = TRUE;
-		in = MESSAGE_FIELD (task, raw_headers_content).begin;
-		len = MESSAGE_FIELD (task, raw_headers_content).len;
-		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task, (const guchar **)&in, &len, 1, raw, &processed_hyperscan);
-		msg_debug_re_task ("checked allheader regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
-		break;
-	case RSPAMD_RE_MIMEHEADER:
-		PTR_ARRAY_FOREACH (MESSAGE_FIELD (task, parts), i, mime_part) {
-			rh = rspamd_message_get_header_from_hash (mime_part->raw_headers,
-					re_class->type_data);
-
-			if (rh) {
-				ret += rspamd_re_cache_process_headers_list (task, rt, re,
-						re_class, rh, is_strong, &processed_hyperscan);
-			}
-			msg_debug_re_task ("checked mime header(%s) regexp: %s -> %d",
-					(const char *)re_class->type_data,
-					rspamd_regexp_get_pattern (re),
-					ret);
-		}
+		cnt = 1;
+		scvec = g_malloc (sizeof (*scvec));
+		lenvec = g_malloc (sizeof (*lenvec));
+		scvec[0] = (guchar *)MESSAGE_FIELD (task, raw_headers_content).begin;
+		lenvec[0] = MESSAGE_FIELD (task, raw_headers_content).len;
 		break;
 	case RSPAMD_RE_MIME:
 	case RSPAMD_RE_RAWMIME:
 		/* Iterate through text parts */
-		if (MESSAGE_FIELD (task, text_parts)->len > 0) {
-			cnt = MESSAGE_FIELD (task, text_parts)->len;
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
-
-			PTR_ARRAY_FOREACH (MESSAGE_FIELD (task, text_parts), i, text_part) {
-				/* Select data for regexp */
-				if (re_class->type == RSPAMD_RE_RAWMIME) {
-					if (text_part->raw.len == 0) {
-						len = 0;
-						in = "";
-					}
-					else {
-						in = text_part->raw.begin;
-						len = text_part->raw.len;
-					}
+		if (MESSAGE_FIELD (task, text_parts)->len == 0) {
+			return FALSE;
+		}
 
-					raw = TRUE;
+		cnt = MESSAGE_FIELD (task, text_parts)->len;
+		scvec = g_malloc (sizeof (*scvec) * cnt);
+		lenvec = g_malloc (sizeof (*lenvec) * cnt);
+
+		PTR_ARRAY_FOREACH (MESSAGE_FIELD (task, text_parts), i, text_part) {
+			/* Select data for regexp */
+			if (re_class->type == RSPAMD_RE_RAWMIME) {
+				if (text_part->raw.len == 0) {
+					len = 0;
+					in = "";
 				}
 				else {
-					/* Skip empty parts */
-					if (IS_PART_EMPTY (text_part)) {
-						len = 0;
-						in = "";
-					}
-					else {
-						/* Check raw flags */
-						if (!IS_PART_UTF (text_part)) {
-							raw = TRUE;
-						}
+					in = text_part->raw.begin;
+					len = text_part->raw.len;
+				}
 
-						in = text_part->utf_content->data;
-						len = text_part->utf_content->len;
-					}
+				raw = TRUE;
+			}
+			else {
+				/* Skip empty parts */
+				if (IS_PART_EMPTY (text_part)) {
+					len = 0;
+					in = "";
 				}
+				else {
+					/* Check raw flags */
+					if (!IS_PART_UTF (text_part)) {
+						raw = TRUE;
+					}
 
-				scvec[i] = (guchar *) in;
-				lenvec[i] = len;
+					in = text_part->utf_content->data;
+					len = text_part->utf_content->len;
+				}
 			}
 
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, cnt, raw, &processed_hyperscan);
-			msg_debug_re_task ("checked mime regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+			scvec[i] = (guchar *) in;
+			lenvec[i] = len;
 		}
 		break;
 	case RSPAMD_RE_URL:
 		cnt = kh_size (MESSAGE_FIELD (task, urls));
 
-		if (cnt > 0) {
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
-			i = 0;
-			raw = FALSE;
-
-			kh_foreach_key (MESSAGE_FIELD (task, urls), url, {
-				if ((url->protocol & PROTOCOL_MAILTO)) {
-					continue;
-				}
-				in = url->string;
-				len = url->urllen;
-
-				if (len > 0 && !(url->flags & RSPAMD_URL_FLAG_IMAGE)) {
-					scvec[i] = (guchar *) in;
-					lenvec[i++] = len;
-				}
-			});
+		if (cnt == 0) {
+			return FALSE;
+		}
 
-#if 0
-			g_hash_table_iter_init (&it, MESSAGE_FIELD (task, emails));
+		scvec = g_malloc (sizeof (*scvec) * cnt);
+		lenvec = g_malloc (sizeof (*lenvec) * cnt);
+		i = 0;
 
-			while (g_hash_table_iter_next (&it, &k, &v)) {
-				url = v;
-				in = url->string;
-				len = url->urllen;
+		kh_foreach_key (MESSAGE_FIELD (task, urls), url, {
+			if ((url->protocol & PROTOCOL_MAILTO)) {
+				continue;
+			}
+			in = url->string;
+			len = url->urllen;
 
-				if (len > 0 && !(url->flags & RSPAMD_URL_FLAG_IMAGE)) {
-					scvec[i] = (guchar *) in;
-					lenvec[i++] = len;
-				}
+			if (len > 0 && !(url->flags & RSPAMD_URL_FLAG_IMAGE)) {
+				scvec[i] = (guchar *) in;
+				lenvec[i++] = len;
 			}
-#endif
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, i, raw, &processed_hyperscan);
-			msg_debug_re_task ("checked url regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
-		}
+		});
+
+		cnt = i;
 		break;
 	case RSPAMD_RE_EMAIL:
 		cnt = kh_size (MESSAGE_FIELD (task, urls));
 
-		if (cnt > 0) {
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
-			i = 0;
-			raw = FALSE;
+		if (cnt == 0) {
+			return FALSE;
+		}
 
-			kh_foreach_key (MESSAGE_FIELD (task, urls), url, {
+		scvec = g_malloc (sizeof (*scvec) * cnt);
+		lenvec = g_malloc (sizeof (*lenvec) * cnt);
+		i = 0;
 
-				if (!(url->protocol & PROTOCOL_MAILTO)) {
-					continue;
-				}
-				if (url->userlen == 0 || url->hostlen == 0) {
-					continue;
-				}
+		kh_foreach_key (MESSAGE_FIELD (task, urls), url, {
 
-				in = rspamd_url_user_unsafe (url);
-				len = url->userlen + 1 + url->hostlen;
-				scvec[i] = (guchar *) in;
-				lenvec[i++] = len;
-			});
+			if (!(url->protocol & PROTOCOL_MAILTO)) {
+				continue;
+			}
+			if (url->userlen == 0 || url->hostlen == 0) {
+				continue;
+			}
 
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, i, raw, &processed_hyperscan);
-			msg_debug_re_task ("checked email regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
-		}
+			in = rspamd_url_user_unsafe (url);
+			len = url->userlen + 1 + url->hostlen;
+			scvec[i] = (guchar *) in;
+			lenvec[i++] = len;
+		});
+
+		cnt = i;
 		break;
 	case RSPAMD_RE_BODY:
 		raw = TRUE;
-		in = task->msg.begin;
-		len = task->msg.len;
-
-		ret = rspamd_re_cache_process_regexp_data (rt, re, task,
-				(const guchar **)&in, &len, 1, raw, &processed_hyperscan);
-		msg_debug_re_task ("checked rawbody regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
+		cnt = 1;
+		scvec = g_malloc (sizeof (*scvec));
+		lenvec = g_malloc (sizeof (*lenvec));
+		scvec[0] = (guchar *)task->msg.begin;
+		lenvec[0] = task->msg.len;
 		break;
 	case RSPAMD_RE_SABODY:
 		/* According to SA docs:
@@ -1290,13 +1465,6 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 				lenvec[i + 1] = 0;
 			}
 		}
-
-		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task, scvec, lenvec, cnt, raw, &processed_hyperscan);
-		msg_debug_re_task ("checked sa body regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
-		g_free (scvec);
-		g_free (lenvec);
 		break;
 	case RSPAMD_RE_SARAWBODY:
 		/* According to SA docs:
@@ -1306,79 +1474,133 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		 * Multiline expressions will need to be used to match strings that are
 		 * broken by line breaks.
 		 */
-		if (MESSAGE_FIELD (task, text_parts)->len > 0) {
-			cnt = MESSAGE_FIELD (task, text_parts)->len;
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
+		if (MESSAGE_FIELD (task, text_parts)->len == 0) {
+			return FALSE;
+		}
 
-			for (i = 0; i < cnt; i++) {
-				text_part = g_ptr_array_index (MESSAGE_FIELD (task, text_parts), i);
+		cnt = MESSAGE_FIELD (task, text_parts)->len;
+		scvec = g_malloc (sizeof (*scvec) * cnt);
+		lenvec = g_malloc (sizeof (*lenvec) * cnt);
 
-				if (text_part->parsed.len > 0) {
-					scvec[i] = (guchar *)text_part->parsed.begin;
-					lenvec[i] = text_part->parsed.len;
+		for (i = 0; i < cnt; i++) {
+			text_part = g_ptr_array_index (MESSAGE_FIELD (task, text_parts), i);
 
-					if (!IS_PART_UTF (text_part)) {
-						raw = TRUE;
-					}
-				}
-				else {
-					scvec[i] = (guchar *)"";
-					lenvec[i] = 0;
+			if (text_part->parsed.len > 0) {
+				scvec[i] = (guchar *)text_part->parsed.begin;
+				lenvec[i] = text_part->parsed.len;
+
+				if (!IS_PART_UTF (text_part)) {
+					raw = TRUE;
 				}
 			}
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, cnt, raw, &processed_hyperscan);
-			msg_debug_re_task ("checked sa rawbody regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+			else {
+				scvec[i] = (guchar *)"";
+				lenvec[i] = 0;
+			}
 		}
 		break;
 	case RSPAMD_RE_WORDS:
 	case RSPAMD_RE_STEMWORDS:
 	case RSPAMD_RE_RAWWORDS:
-		if (MESSAGE_FIELD (task, text_parts)->len > 0) {
-			cnt = 0;
-			raw = FALSE;
+		cnt = 0;
 
-			PTR_ARRAY_FOREACH (MESSAGE_FIELD (task, text_parts), i, text_part) {
-				if (text_part->utf_words) {
-					cnt += text_part->utf_words->len;
-				}
+		PTR_ARRAY_FOREACH (MESSAGE_FIELD (task, text_parts), i, text_part) {
+			if (text_part->utf_words) {
+				cnt += text_part->utf_words->len;
 			}
+		}
+
+		if (task->meta_words && task->meta_words->len > 0) {
+			cnt += task->meta_words->len;
+		}
+
+		if (cnt == 0) {
+			return FALSE;
+		}
+
+		scvec = g_malloc (sizeof (*scvec) * cnt);
+		lenvec = g_malloc (sizeof (*lenvec) * cnt);
 
-			if (task->meta_words && task->meta_words->len > 0) {
-				cnt += task->meta_words->len;
+		cnt = 0;
+
+		PTR_ARRAY_FOREACH (MESSAGE_FIELD (task, text_parts), i, text_part) {
+			if (text_part->utf_words) {
+				cnt = rspamd_process_words_vector (text_part->utf_words,
+						scvec, lenvec, re_class, cnt, &raw);
 			}
+		}
 
-			if (cnt > 0) {
-				scvec = g_malloc (sizeof (*scvec) * cnt);
-				lenvec = g_malloc (sizeof (*lenvec) * cnt);
+		if (task->meta_words) {
+			cnt = rspamd_process_words_vector (task->meta_words,
+					scvec, lenvec, re_class, cnt, &raw);
+		}
+		break;
+	default:
+		return FALSE;
+	}
 
-				cnt = 0;
+	*pscvec = scvec;
+	*plenvec = lenvec;
+	*pcnt = cnt;
+	*praw = raw;
 
-				PTR_ARRAY_FOREACH (MESSAGE_FIELD (task, text_parts), i, text_part) {
-					if (text_part->utf_words) {
-						cnt = rspamd_process_words_vector (text_part->utf_words,
-								scvec, lenvec, re_class, cnt, &raw);
-					}
-				}
+	return TRUE;
+}
 
-				if (task->meta_words) {
-					cnt = rspamd_process_words_vector (task->meta_words,
-							scvec, lenvec, re_class, cnt, &raw);
-				}
+/*
+ * Calculates the specified regexp for the specified class if it's not calculated
+ */
+static guint
+rspamd_re_cache_exec_re (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re,
+		struct rspamd_re_class *re_class,
+		gboolean is_strong)
+{
+	guint ret = 0, i, re_id;
+	struct rspamd_mime_header *rh;
+	const guchar **scvec;
+	guint *lenvec;
+	gboolean raw = FALSE, processed_hyperscan = FALSE;
+	struct rspamd_mime_part *mime_part;
+	guint cnt;
+	const gchar *class_name;
+
+	class_name = rspamd_re_cache_type_to_string (re_class->type);
+	msg_debug_re_task ("start check re type: %s: /%s/",
+			class_name,
+			rspamd_regexp_get_pattern (re));
+	re_id = rspamd_regexp_get_cache_id (re);
+
+	switch (re_class->type) {
+	case RSPAMD_RE_HEADER:
+	case RSPAMD_RE_RAWHEADER:
+		/* Get list of specified headers */
+		rh = rspamd_message_get_header_array (task,
+				re_class->type_data);
 
-				ret = rspamd_re_cache_process_regexp_data (rt, re,
-						task, scvec, lenvec, cnt, raw, &processed_hyperscan);
+		if (rh) {
+			ret = rspamd_re_cache_process_headers_list (task, rt, re,
+					re_class, rh, is_strong, &processed_hyperscan);
+			msg_debug_re_task ("checked header(%s) regexp: %s -> %d",
+					(const char *)re_class->type_data,
+					rspamd_regexp_get_pattern (re),
+					ret);
+		}
+		break;
+	case RSPAMD_RE_MIMEHEADER:
+		PTR_ARRAY_FOREACH (MESSAGE_FIELD (task, parts), i, mime_part) {
+			rh = rspamd_message_get_header_from_hash (mime_part->raw_headers,
+					re_class->type_data);
 
-				msg_debug_re_task ("checked sa words regexp: %s -> %d",
-						rspamd_regexp_get_pattern (re), ret);
-				g_free (scvec);
-				g_free (lenvec);
+			if (rh) {
+				ret += rspamd_re_cache_process_headers_list (task, rt, re,
+						re_class, rh, is_strong, &processed_hyperscan);
 			}
+			msg_debug_re_task ("checked mime header(%s) regexp: %s -> %d",
+					(const char *)re_class->type_data,
+					rspamd_regexp_get_pattern (re),
+					ret);
 		}
 		break;
 	case RSPAMD_RE_SELECTOR:
@@ -1400,6 +1622,18 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		msg_err_task ("regexp of class invalid has been called: %s",
 				rspamd_regexp_get_pattern (re));
 		break;
+	default:
+		if (rspamd_re_cache_get_class_data (task, re_class, &scvec, &lenvec,
+				&cnt, &raw)) {
+			ret = rspamd_re_cache_process_regexp_data (rt, re,
+					task, scvec, lenvec, cnt, raw, &processed_hyperscan);
+			msg_debug_re_task ("checked %s regexp: %s -> %d",
+					class_name,
+					rspamd_regexp_get_pattern (re), ret);
+			g_free (scvec);
+			g_free (lenvec);
+		}
+		break;
 	}
 
 #if WITH_HYPERSCAN
@@ -1413,6 +1647,149 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 	return rt->results[re_id];
 }
 
+#ifdef WITH_HYPERSCAN
+/*
+ * Scans data over the whole hyperscan database of a class
+ */
+static gboolean
+rspamd_re_cache_scan_class (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt,
+		struct rspamd_re_class *re_class,
+		const guchar **in, guint *lens,
+		guint count)
+{
+	struct rspamd_re_hyperscan_cbdata cbdata;
+	guint i;
+
+	for (i = 0; i < count; i ++) {
+		if (rt->cache->max_re_data > 0 && lens[i] > rt->cache->max_re_data) {
+			lens[i] = rt->cache->max_re_data;
+		}
+
+		rt->stat.bytes_scanned += lens[i];
+	}
+
+	cbdata.re = NULL;
+	cbdata.re_class = re_class;
+	cbdata.rt = rt;
+	cbdata.task = task;
+
+	if (!rt->cache->vectorized_hyperscan) {
+		for (i = 0; i < count; i++) {
+			cbdata.ins = &in[i];
+			cbdata.lens = &lens[i];
+			cbdata.count = 1;
+
+			if ((hs_scan (re_class->hs_db, in[i], lens[i], 0,
+					re_class->hs_scratch,
+					rspamd_re_cache_hyperscan_cb, &cbdata)) != HS_SUCCESS) {
+				return FALSE;
+			}
+		}
+	}
+	else {
+		cbdata.ins = in;
+		cbdata.lens = lens;
+		cbdata.count = count;
+
+		if ((hs_scan_vector (re_class->hs_db, (const char **)in, lens, count, 0,
+				re_class->hs_scratch,
+				rspamd_re_cache_hyperscan_cb, &cbdata)) != HS_SUCCESS) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Runs hyperscan databases of all message-wide classes in a single pass
+ * ordered by the underlying data, so the message body, the raw text parts
+ * and the decoded text parts are each walked while they are still hot in
+ * cache instead of being revisited lazily by every class
+ */
+static void
+rspamd_re_cache_prefetch (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt)
+{
+	static const enum rspamd_re_type prefetch_order[] = {
+		/* Raw message and its slices */
+		RSPAMD_RE_BODY,
+		RSPAMD_RE_ALLHEADER,
+		RSPAMD_RE_RAWMIME,
+		/* Decoded text parts */
+		RSPAMD_RE_SARAWBODY,
+		RSPAMD_RE_MIME,
+		RSPAMD_RE_SABODY,
+		/* Words of the text parts */
+		RSPAMD_RE_WORDS,
+		RSPAMD_RE_RAWWORDS,
+		RSPAMD_RE_STEMWORDS,
+		/* Urls */
+		RSPAMD_RE_URL,
+		RSPAMD_RE_EMAIL,
+	};
+	struct rspamd_re_class *classes[G_N_ELEMENTS (prefetch_order)], *re_class;
+	const guchar **scvec;
+	guint *lenvec, cnt, i, j, nscanned = 0;
+	gboolean raw;
+	GHashTableIter it;
+	gpointer k, v;
+
+	memset (classes, 0, sizeof (classes));
+	g_hash_table_iter_init (&it, rt->cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+
+		if (re_class->hs_db == NULL || re_class->nhs == 0) {
+			continue;
+		}
+
+		for (j = 0; j < G_N_ELEMENTS (prefetch_order); j ++) {
+			if (prefetch_order[j] == re_class->type) {
+				/* These types have no type data, so there is one class per type */
+				classes[j] = re_class;
+				break;
+			}
+		}
+	}
+
+	for (j = 0; j < G_N_ELEMENTS (prefetch_order); j ++) {
+		re_class = classes[j];
+
+		if (re_class == NULL) {
+			continue;
+		}
+
+		if (!rspamd_re_cache_get_class_data (task, re_class, &scvec, &lenvec,
+				&cnt, &raw)) {
+			continue;
+		}
+
+		if (cnt > 0 && !(raw && re_class->has_utf8)) {
+			if (rspamd_re_cache_scan_class (task, rt, re_class, scvec, lenvec,
+					cnt)) {
+				rspamd_re_cache_finish_class (task, rt, re_class,
+						rspamd_re_cache_type_to_string (re_class->type));
+				nscanned ++;
+			}
+		}
+		else if (cnt == 0) {
+			/* No data: all hyperscan regexps are not matched */
+			for (i = 0; i < re_class->nhs; i++) {
+				setbit (rt->checked, re_class->hs_ids[i]);
+			}
+		}
+
+		g_free (scvec);
+		g_free (lenvec);
+	}
+
+	msg_debug_re_task ("prefetched %ud hyperscan classes", nscanned);
+}
+#endif
+
 gint
 rspamd_re_cache_process (struct rspamd_task *task,
 		rspamd_regexp_t *re,
@@ -1446,6 +1823,34 @@ rspamd_re_cache_process (struct rspamd_task *task,
 		return rt->results[re_id];
 	}
 	else {
+		if (cache->shared && !rt->shared_checked && task->message) {
+			rt->shared_checked = TRUE;
+
+			if (rspamd_re_cache_shared_lookup (task, rt)) {
+				/*
+				 * Classes have been scanned for the same message, prefetching
+				 * them again would add their hits to the loaded results
+				 */
+				rt->prefetched = TRUE;
+
+				if (isset (rt->checked, re_id)) {
+					rt->stat.regexp_fast_cached ++;
+					return rt->results[re_id];
+				}
+			}
+		}
+
+#ifdef WITH_HYPERSCAN
+		if (cache->prefetch_hyperscan && rt->has_hs && !rt->prefetched &&
+				!cache->disable_hyperscan && task->message) {
+			rt->prefetched = TRUE;
+			rspamd_re_cache_prefetch (task, rt);
+
+			if (isset (rt->checked, re_id)) {
+				return rt->results[re_id];
+			}
+		}
+#endif
 		/* Slow path */
 		re_class = rspamd_regexp_get_class (re);
 
@@ -1486,6 +1891,10 @@ rspamd_re_cache_runtime_destroy (struct rspamd_re_runtime *rt)
 {
 	g_assert (rt != NULL);
 
+	if (rt->cache->shared && rt->shared_checked && !rt->shared_hit) {
+		rspamd_re_cache_shared_store (rt);
+	}
+
 	if (rt->sel_cache) {
 		struct rspamd_re_selector_result sr;
 
@@ -1762,7 +2171,14 @@ rspamd_re_cache_is_finite (struct rspamd_re_cache *cache,
 
 #ifdef WITH_HYPERSCAN
 struct rspamd_re_cache_hs_compile_cbdata {
-	GHashTableIter it;
+	GPtrArray *pending; /* Classes with no valid database */
+	guint cur;
+	pid_t *workers;
+	guint nworkers;
+	guint nfailed;
+	struct rspamd_worker *worker;
+	ev_timer *timer;
+	struct ev_loop *event_loop;
 	struct rspamd_re_cache *cache;
 	const char *cache_dir;
 	gdouble max_time;
@@ -1773,30 +2189,86 @@ struct rspamd_re_cache_hs_compile_cbdata {
 };
 
 static void
-rspamd_re_cache_compile_err (EV_P_ ev_timer *w, GError *err,
+rspamd_re_cache_compile_done (EV_P_ ev_timer *w, GError *err,
 		struct rspamd_re_cache_hs_compile_cbdata *cbdata)
 {
 	ev_timer_stop (EV_A_ w);
 	cbdata->cb (cbdata->total, err, cbdata->cbd);
+	g_ptr_array_free (cbdata->pending, TRUE);
+
+	if (cbdata->workers) {
+		g_free (cbdata->workers);
+	}
+
 	g_free (w);
 	g_free (cbdata);
-	g_error_free (err);
+
+	if (err) {
+		g_error_free (err);
+	}
 }
 
-static void
-rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
+static const gchar *
+rspamd_re_cache_class_descr (struct rspamd_re_class *re_class,
+		gchar *buf, gsize buflen)
 {
-	struct rspamd_re_cache_hs_compile_cbdata *cbdata =
-			(struct rspamd_re_cache_hs_compile_cbdata *)w->data;
-	GHashTableIter cit;
-	gpointer k, v;
-	struct rspamd_re_class *re_class;
-	gchar path[PATH_MAX], npath[PATH_MAX];
+	if (re_class->type_len > 0) {
+		rspamd_snprintf (buf, buflen, "%s(%*s)",
+				rspamd_re_cache_type_to_string (re_class->type),
+				(gint) re_class->type_len - 1,
+				re_class->type_data);
+	}
+	else {
+		rspamd_snprintf (buf, buflen, "%s",
+				rspamd_re_cache_type_to_string (re_class->type));
+	}
+
+	return buf;
+}
+
+/*
+ * Returns number of regexps stored in a hyperscan file or -1 on error
+ */
+static gint
+rspamd_re_cache_hs_file_nre (const gchar *path)
+{
+	gint fd, n = -1;
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		return -1;
+	}
+
+	if (lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (hs_platform_info_t),
+			SEEK_SET) == -1 || read (fd, &n, sizeof (n)) != sizeof (n)) {
+		n = -1;
+	}
+
+	close (fd);
+
+	return n;
+}
+
+/*
+ * Compiles and stores hyperscan database of a single class
+ */
+static gboolean
+rspamd_re_cache_compile_class (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
+		const gchar *cache_dir,
+		gdouble max_time,
+		guint *ncompiled,
+		GError **err)
+{
+	gchar path[PATH_MAX], npath[PATH_MAX], descr[128];
 	hs_database_t *test_db;
 	gint fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
+	guint j;
 	rspamd_cryptobox_fast_hash_state_t crc_st;
 	guint64 crc;
 	rspamd_regexp_t *re;
+	struct rspamd_re_cache_elt *elt;
 	hs_compile_error_t *hs_errors;
 	guint *hs_flags = NULL;
 	const hs_expr_ext_t **hs_exts = NULL;
@@ -1804,81 +2276,30 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 	gchar *hs_serialized;
 	gsize serialized_len;
 	struct iovec iov[7];
-	struct rspamd_re_cache *cache;
-	GError *err;
-
-	cache = cbdata->cache;
-
-	if (!g_hash_table_iter_next (&cbdata->it, &k, &v)) {
-		/* All done */
-		ev_timer_stop (EV_A_ w);
-		cbdata->cb (cbdata->total, NULL, cbdata->cbd);
-		g_free (w);
-		g_free (cbdata);
-
-		return;
-	}
-
-	re_class = v;
-	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cbdata->cache_dir,
-			G_DIR_SEPARATOR, re_class->hash);
-
-	if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE)) {
-
-		fd = open (path, O_RDONLY, 00600);
-
-		/* Read number of regexps */
-		g_assert (fd != -1);
-		lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET);
-		g_assert (read (fd, &n, sizeof (n)) == sizeof (n));
-		close (fd);
-
-		if (re_class->type_len > 0) {
-			if (!cbdata->silent) {
-				msg_info_re_cache (
-						"skip already valid class %s(%*s) to cache %6s, %d regexps",
-						rspamd_re_cache_type_to_string (re_class->type),
-						(gint) re_class->type_len - 1,
-						re_class->type_data,
-						re_class->hash,
-						n);
-			}
-		}
-		else {
-			if (!cbdata->silent) {
-				msg_info_re_cache (
-						"skip already valid class %s to cache %6s, %d regexps",
-						rspamd_re_cache_type_to_string (re_class->type),
-						re_class->hash,
-						n);
-			}
-		}
-
-		ev_timer_again (EV_A_ w);
-		return;
-	}
+	gdouble t1, t2;
 
-	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cbdata->cache_dir,
+	t1 = rspamd_get_ticks (FALSE);
+	rspamd_re_cache_class_descr (re_class, descr, sizeof (descr));
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cache_dir,
 			G_DIR_SEPARATOR, re_class->hash);
 	fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
 
 	if (fd == -1) {
-		err = g_error_new (rspamd_re_cache_quark (), errno,
+		g_set_error (err, rspamd_re_cache_quark (), errno,
 				"cannot open file %s: %s", path, strerror (errno));
-		rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
-		return;
+		return FALSE;
 	}
 
-	g_hash_table_iter_init (&cit, re_class->re);
-	n = g_hash_table_size (re_class->re);
+	n = re_class->nre;
 	hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
 	hs_ids = g_malloc (sizeof (*hs_ids) * n);
 	hs_pats = g_malloc (sizeof (*hs_pats) * n);
 	hs_exts = g_malloc0 (sizeof (*hs_exts) * n);
 	i = 0;
 
-	while (g_hash_table_iter_next (&cit, &k, &v)) {
-		re = v;
+	for (j = 0; j < re_class->nre; j ++) {
+		elt = g_ptr_array_index (cache->re, re_class->re_ids[j]);
+		re = elt->re;
 
 		pcre_flags = rspamd_regexp_get_pcre_flags (re);
 		re_flags = rspamd_regexp_get_flags (re);
@@ -1930,9 +2351,10 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 			/* The approximation operation might take a significant
 			 * amount of time, so we need to check if it's finite
 			 */
-			if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], cbdata->max_time)) {
+			if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], max_time)) {
 				hs_flags[i] |= HS_FLAG_PREFILTER;
-				hs_ids[i] = rspamd_regexp_get_cache_id (re);
+				/* Position in class instead of cache id, see re_ids */
+				hs_ids[i] = j;
 				hs_pats[i] = pat;
 				i++;
 			}
@@ -1941,7 +2363,7 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 			}
 		}
 		else {
-			hs_ids[i] = rspamd_regexp_get_cache_id (re);
+			hs_ids[i] = j;
 			hs_pats[i] = pat;
 			i ++;
 			hs_free_database (test_db);
@@ -1950,184 +2372,333 @@ rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
 	/* Adjust real re number */
 	n = i;
 
-	if (n > 0) {
-		/* Create the hs tree */
-		if (hs_compile_ext_multi ((const char **)hs_pats,
-				hs_flags,
-				hs_ids,
-				hs_exts,
-				n,
-				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
-				&cache->plt,
-				&test_db,
-				&hs_errors) != HS_SUCCESS) {
+	if (n == 0) {
+		g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+				"no suitable regular expressions %s (%d original): "
+				"remove temporary file %s",
+				descr,
+				(gint)re_class->nre,
+				path);
 
+		g_free (hs_flags);
+		g_free (hs_ids);
+		g_free (hs_pats);
+		g_free (hs_exts);
+		unlink (path);
+		close (fd);
 
-			g_free (hs_flags);
-			g_free (hs_ids);
+		return FALSE;
+	}
 
-			for (guint j = 0; j < i; j ++) {
-				g_free (hs_pats[j]);
-			}
+	/* Create the hs tree */
+	if (hs_compile_ext_multi ((const char **)hs_pats,
+			hs_flags,
+			hs_ids,
+			hs_exts,
+			n,
+			cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+			&cache->plt,
+			&test_db,
+			&hs_errors) != HS_SUCCESS) {
+
+		g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+				"cannot create tree of regexp when processing '%s': %s",
+				hs_errors->expression >= 0 ? hs_pats[hs_errors->expression] : "",
+				hs_errors->message);
 
-			g_free (hs_pats);
-			g_free (hs_exts);
-			close (fd);
-			unlink (path);
-			hs_free_compile_error (hs_errors);
-
-			err = g_error_new (rspamd_re_cache_quark (), EINVAL,
-					"cannot create tree of regexp when processing '%s': %s",
-					hs_pats[hs_errors->expression], hs_errors->message);
-			rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
-
-			return;
-		}
+		g_free (hs_flags);
+		g_free (hs_ids);
 
-		for (guint j = 0; j < i; j ++) {
+		for (j = 0; j < (guint)n; j ++) {
 			g_free (hs_pats[j]);
 		}
 
 		g_free (hs_pats);
 		g_free (hs_exts);
+		close (fd);
+		unlink (path);
+		hs_free_compile_error (hs_errors);
 
-		if (hs_serialize_database (test_db, &hs_serialized,
-				&serialized_len) != HS_SUCCESS) {
-			err = g_error_new (rspamd_re_cache_quark (),
-					errno,
-					"cannot serialize tree of regexp for %s",
-					re_class->hash);
+		return FALSE;
+	}
 
-			close (fd);
-			unlink (path);
-			g_free (hs_ids);
-			g_free (hs_flags);
-			hs_free_database (test_db);
+	for (j = 0; j < (guint)n; j ++) {
+		g_free (hs_pats[j]);
+	}
 
-			rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
-			return;
-		}
+	g_free (hs_pats);
+	g_free (hs_exts);
+
+	if (hs_serialize_database (test_db, &hs_serialized,
+			&serialized_len) != HS_SUCCESS) {
+		g_set_error (err, rspamd_re_cache_quark (),
+				errno,
+				"cannot serialize tree of regexp for %s",
+				re_class->hash);
 
+		close (fd);
+		unlink (path);
+		g_free (hs_ids);
+		g_free (hs_flags);
 		hs_free_database (test_db);
 
-		/*
-		 * Magic - 8 bytes
-		 * Platform - sizeof (platform)
-		 * n - number of regexps
-		 * n * <regexp ids>
-		 * n * <regexp flags>
-		 * crc - 8 bytes checksum
-		 * <hyperscan blob>
-		 */
-		rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
-		/* IDs -> Flags -> Hs blob */
-		rspamd_cryptobox_fast_hash_update (&crc_st,
-				hs_ids, sizeof (*hs_ids) * n);
-		rspamd_cryptobox_fast_hash_update (&crc_st,
-				hs_flags, sizeof (*hs_flags) * n);
-		rspamd_cryptobox_fast_hash_update (&crc_st,
-				hs_serialized, serialized_len);
-		crc = rspamd_cryptobox_fast_hash_final (&crc_st);
-
-		if (cache->vectorized_hyperscan) {
-			iov[0].iov_base = (void *) rspamd_hs_magic_vector;
-		}
-		else {
-			iov[0].iov_base = (void *) rspamd_hs_magic;
-		}
-
-		iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
-		iov[1].iov_base = &cache->plt;
-		iov[1].iov_len = sizeof (cache->plt);
-		iov[2].iov_base = &n;
-		iov[2].iov_len = sizeof (n);
-		iov[3].iov_base = hs_ids;
-		iov[3].iov_len = sizeof (*hs_ids) * n;
-		iov[4].iov_base = hs_flags;
-		iov[4].iov_len = sizeof (*hs_flags) * n;
-		iov[5].iov_base = &crc;
-		iov[5].iov_len = sizeof (crc);
-		iov[6].iov_base = hs_serialized;
-		iov[6].iov_len = serialized_len;
-
-		if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
-			err = g_error_new (rspamd_re_cache_quark (),
-					errno,
-					"cannot serialize tree of regexp to %s: %s",
-					path, strerror (errno));
-			close (fd);
-			unlink (path);
-			g_free (hs_ids);
-			g_free (hs_flags);
-			g_free (hs_serialized);
+		return FALSE;
+	}
 
-			rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
-			return;
-		}
+	hs_free_database (test_db);
 
-		if (re_class->type_len > 0) {
-			msg_info_re_cache (
-					"compiled class %s(%*s) to cache %6s, %d/%d regexps",
-					rspamd_re_cache_type_to_string (re_class->type),
-					(gint) re_class->type_len - 1,
-					re_class->type_data,
-					re_class->hash,
-					n,
-					(gint)g_hash_table_size (re_class->re));
-		}
-		else {
-			msg_info_re_cache (
-					"compiled class %s to cache %6s, %d/%d regexps",
-					rspamd_re_cache_type_to_string (re_class->type),
-					re_class->hash,
-					n,
-					(gint)g_hash_table_size (re_class->re));
-		}
-
-		cbdata->total += n;
+	/*
+	 * Magic - 8 bytes
+	 * Platform - sizeof (platform)
+	 * n - number of regexps
+	 * n * <regexp ids>
+	 * n * <regexp flags>
+	 * crc - 8 bytes checksum
+	 * <hyperscan blob>
+	 */
+	rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
+	/* IDs -> Flags -> Hs blob */
+	rspamd_cryptobox_fast_hash_update (&crc_st,
+			hs_ids, sizeof (*hs_ids) * n);
+	rspamd_cryptobox_fast_hash_update (&crc_st,
+			hs_flags, sizeof (*hs_flags) * n);
+	rspamd_cryptobox_fast_hash_update (&crc_st,
+			hs_serialized, serialized_len);
+	crc = rspamd_cryptobox_fast_hash_final (&crc_st);
+
+	if (cache->vectorized_hyperscan) {
+		iov[0].iov_base = (void *) rspamd_hs_magic_vector;
+	}
+	else {
+		iov[0].iov_base = (void *) rspamd_hs_magic;
+	}
 
-		g_free (hs_serialized);
+	iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
+	iov[1].iov_base = &cache->plt;
+	iov[1].iov_len = sizeof (cache->plt);
+	iov[2].iov_base = &n;
+	iov[2].iov_len = sizeof (n);
+	iov[3].iov_base = hs_ids;
+	iov[3].iov_len = sizeof (*hs_ids) * n;
+	iov[4].iov_base = hs_flags;
+	iov[4].iov_len = sizeof (*hs_flags) * n;
+	iov[5].iov_base = &crc;
+	iov[5].iov_len = sizeof (crc);
+	iov[6].iov_base = hs_serialized;
+	iov[6].iov_len = serialized_len;
+
+	if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
+		g_set_error (err, rspamd_re_cache_quark (),
+				errno,
+				"cannot serialize tree of regexp to %s: %s",
+				path, strerror (errno));
+		close (fd);
+		unlink (path);
 		g_free (hs_ids);
 		g_free (hs_flags);
+		g_free (hs_serialized);
 
-		/* Now rename temporary file to the new .hs file */
-		rspamd_snprintf (npath, sizeof (path), "%s%c%s.hs", cbdata->cache_dir,
-				G_DIR_SEPARATOR, re_class->hash);
+		return FALSE;
+	}
 
-		if (rename (path, npath) == -1) {
-			err = g_error_new (rspamd_re_cache_quark (),
-					errno,
-					"cannot rename %s to %s: %s",
-					path, npath, strerror (errno));
-			unlink (path);
-			close (fd);
+	g_free (hs_serialized);
+	g_free (hs_ids);
+	g_free (hs_flags);
 
-			rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
-			return;
-		}
+	/* Now rename temporary file to the new .hs file */
+	rspamd_snprintf (npath, sizeof (npath), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
 
-		close (fd);
-	}
-	else {
-		err = g_error_new (rspamd_re_cache_quark (),
+	if (rename (path, npath) == -1) {
+		g_set_error (err, rspamd_re_cache_quark (),
 				errno,
-				"no suitable regular expressions %s (%d original): "
-				"remove temporary file %s",
-				rspamd_re_cache_type_to_string (re_class->type),
-				(gint)g_hash_table_size (re_class->re),
-				path);
-
+				"cannot rename %s to %s: %s",
+				path, npath, strerror (errno));
 		unlink (path);
 		close (fd);
-		rspamd_re_cache_compile_err (EV_A_ w, err, cbdata);
+
+		return FALSE;
+	}
+
+	close (fd);
+	t2 = rspamd_get_ticks (FALSE);
+
+	msg_info_re_cache (
+			"compiled class %s to cache %6s, %d/%d regexps in %.3f seconds",
+			descr,
+			re_class->hash,
+			n,
+			(gint)re_class->nre,
+			t2 - t1);
+
+	*ncompiled = n;
+
+	return TRUE;
+}
+
+static void
+rspamd_re_cache_compile_timer_cb (EV_P_ ev_timer *w, int revents )
+{
+	struct rspamd_re_cache_hs_compile_cbdata *cbdata =
+			(struct rspamd_re_cache_hs_compile_cbdata *)w->data;
+	struct rspamd_re_class *re_class;
+	GError *err = NULL;
+	guint n = 0;
+
+	if (cbdata->cur >= cbdata->pending->len) {
+		/* All done */
+		rspamd_re_cache_compile_done (EV_A_ w, NULL, cbdata);
+
+		return;
+	}
+
+	re_class = g_ptr_array_index (cbdata->pending, cbdata->cur);
+	cbdata->cur ++;
+
+	if (!rspamd_re_cache_compile_class (cbdata->cache, re_class,
+			cbdata->cache_dir, cbdata->max_time, &n, &err)) {
+		rspamd_re_cache_compile_done (EV_A_ w, err, cbdata);
 
 		return;
 	}
 
+	cbdata->total += n;
+
 	/* Continue process */
 	ev_timer_again (EV_A_ w);
 }
 
+/*
+ * Body of a compile process: it compiles each nworkers-th pending class
+ */
+static void
+rspamd_re_cache_compile_worker (struct rspamd_re_cache_hs_compile_cbdata *cbdata,
+		guint idx)
+{
+	struct rspamd_re_cache *cache = cbdata->cache;
+	struct rspamd_re_class *re_class;
+	GError *err = NULL;
+	gboolean failed = FALSE;
+	guint i, n;
+
+	rspamd_log_on_fork (cbdata->worker->cf->type, cbdata->worker->srv->cfg,
+			cbdata->worker->srv->logger);
+	/* Drop parent's signal handlers */
+	g_hash_table_remove_all (cbdata->worker->signal_events);
+	setproctitle ("hs compile process");
+
+	for (i = idx; i < cbdata->pending->len; i += cbdata->nworkers) {
+		re_class = g_ptr_array_index (cbdata->pending, i);
+
+		if (!rspamd_re_cache_compile_class (cache, re_class,
+				cbdata->cache_dir, cbdata->max_time, &n, &err)) {
+			msg_err_re_cache ("cannot compile class %6s: %e",
+					re_class->hash, err);
+			g_error_free (err);
+			err = NULL;
+			failed = TRUE;
+		}
+	}
+
+	_exit (failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static void
+rspamd_re_cache_compile_notify_main (struct rspamd_re_cache_hs_compile_cbdata *cbdata,
+		pid_t cpid, gint state)
+{
+	struct rspamd_srv_command srv_cmd;
+
+	memset (&srv_cmd, 0, sizeof (srv_cmd));
+	srv_cmd.type = RSPAMD_SRV_ON_FORK;
+	srv_cmd.cmd.on_fork.state = state;
+	srv_cmd.cmd.on_fork.cpid = cpid;
+	srv_cmd.cmd.on_fork.ppid = getpid ();
+	rspamd_srv_send_command (cbdata->worker, cbdata->event_loop, &srv_cmd, -1,
+			NULL, NULL);
+}
+
+static void
+rspamd_re_cache_compile_workers_done (struct rspamd_re_cache_hs_compile_cbdata *cbdata)
+{
+	struct rspamd_re_cache *cache = cbdata->cache;
+	struct rspamd_re_class *re_class;
+	gchar path[PATH_MAX];
+	GError *err = NULL;
+	guint i, missing = 0;
+	gint n;
+
+	/* Count what has been compiled by children */
+	for (i = 0; i < cbdata->pending->len; i ++) {
+		re_class = g_ptr_array_index (cbdata->pending, i);
+		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cbdata->cache_dir,
+				G_DIR_SEPARATOR, re_class->hash);
+		n = rspamd_re_cache_hs_file_nre (path);
+
+		if (n > 0) {
+			cbdata->total += n;
+		}
+		else {
+			missing ++;
+		}
+	}
+
+	if (cbdata->nfailed > 0) {
+		err = g_error_new (rspamd_re_cache_quark (), EINVAL,
+				"%ud of %ud compile processes failed, %ud classes are not compiled",
+				cbdata->nfailed, cbdata->nworkers, missing);
+	}
+	else {
+		msg_info_re_cache ("compiled %ud classes using %ud processes",
+				cbdata->pending->len, cbdata->nworkers);
+	}
+
+	rspamd_re_cache_compile_done (cbdata->event_loop, cbdata->timer, err, cbdata);
+}
+
+static gboolean
+rspamd_re_cache_compile_cld_handler (struct rspamd_worker_signal_handler *sigh,
+		void *ud)
+{
+	struct rspamd_re_cache_hs_compile_cbdata *cbdata =
+			(struct rspamd_re_cache_hs_compile_cbdata *)ud;
+	guint i, running = 0;
+	gint rc, status;
+
+	/* Signals can be merged, so check all our children */
+	for (i = 0; i < cbdata->nworkers; i ++) {
+		if (cbdata->workers[i] <= 0) {
+			continue;
+		}
+
+		rc = waitpid (cbdata->workers[i], &status, WNOHANG);
+
+		if (rc == 0 || (rc == -1 && errno == EINTR)) {
+			running ++;
+			continue;
+		}
+
+		if (rc == -1 || !WIFEXITED (status) ||
+				WEXITSTATUS (status) != EXIT_SUCCESS) {
+			cbdata->nfailed ++;
+		}
+
+		rspamd_re_cache_compile_notify_main (cbdata, cbdata->workers[i],
+				child_dead);
+		cbdata->workers[i] = -1;
+	}
+
+	if (running > 0) {
+		/* Wait more */
+		return TRUE;
+	}
+
+	rspamd_re_cache_compile_workers_done (cbdata);
+
+	/* We are done with this SIGCHLD */
+	return FALSE;
+}
+
 #endif
 
 gint
@@ -2135,7 +2706,9 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 								   const char *cache_dir,
 								   gdouble max_time,
 								   gboolean silent,
+								   guint nworkers,
 								   struct ev_loop *event_loop,
+								   struct rspamd_worker *worker,
 								   void (*cb)(guint ncompiled, GError *err, void *cbd),
 								   void *cbd)
 {
@@ -2145,21 +2718,96 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 #ifndef WITH_HYPERSCAN
 	return -1;
 #else
-	static ev_timer *timer;
 	static const ev_tstamp timer_interval = 0.1;
+	ev_timer *timer;
 	struct rspamd_re_cache_hs_compile_cbdata *cbdata;
+	struct rspamd_re_class *re_class;
+	GHashTableIter it;
+	gpointer k, v;
+	gchar path[PATH_MAX], descr[128];
+	guint i, running;
+	pid_t cld;
 
 	cbdata = g_malloc0 (sizeof (*cbdata));
-	g_hash_table_iter_init (&cbdata->it, cache->re_classes);
+	cbdata->pending = g_ptr_array_new ();
 	cbdata->cache = cache;
 	cbdata->cache_dir = cache_dir;
 	cbdata->cb = cb;
 	cbdata->cbd = cbd;
+	cbdata->worker = worker;
+	cbdata->event_loop = event_loop;
 	cbdata->max_time = max_time;
 	cbdata->silent = silent;
 	cbdata->total = 0;
+
+	/* Databases are named by the content hash of a class, so reuse valid ones */
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+				G_DIR_SEPARATOR, re_class->hash);
+
+		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE)) {
+			if (!silent) {
+				msg_info_re_cache (
+						"skip already valid class %s to cache %6s, %d regexps",
+						rspamd_re_cache_class_descr (re_class, descr, sizeof (descr)),
+						re_class->hash,
+						rspamd_re_cache_hs_file_nre (path));
+			}
+		}
+		else {
+			g_ptr_array_add (cbdata->pending, re_class);
+		}
+	}
+
 	timer = g_malloc0 (sizeof (*timer));
-	timer->data = (void *)cbdata; /* static */
+	timer->data = (void *)cbdata;
+	cbdata->timer = timer;
+
+	if (worker != NULL && nworkers > 1 && cbdata->pending->len > 1) {
+		nworkers = MIN (nworkers, cbdata->pending->len);
+		cbdata->nworkers = nworkers;
+		cbdata->workers = g_malloc0 (sizeof (*cbdata->workers) * nworkers);
+		running = 0;
+
+		for (i = 0; i < nworkers; i ++) {
+			cld = fork ();
+
+			if (cld == 0) {
+				rspamd_re_cache_compile_worker (cbdata, i);
+			}
+			else if (cld == -1) {
+				msg_err_re_cache ("cannot fork compile process: %s",
+						strerror (errno));
+				cbdata->workers[i] = -1;
+				cbdata->nfailed ++;
+			}
+			else {
+				cbdata->workers[i] = cld;
+				rspamd_re_cache_compile_notify_main (cbdata, cld, child_create);
+				running ++;
+			}
+		}
+
+		if (running == 0) {
+			rspamd_re_cache_compile_workers_done (cbdata);
+
+			return 0;
+		}
+
+		msg_info_re_cache ("compile %ud hyperscan classes using %ud processes",
+				cbdata->pending->len, running);
+		/*
+		 * Children are reaped from the event loop; the handler checks
+		 * all children as there could be an exit before the first signal
+		 */
+		rspamd_worker_set_signal_handler (SIGCHLD, worker, event_loop,
+				rspamd_re_cache_compile_cld_handler, cbdata);
+
+		return 0;
+	}
 
 	ev_timer_init (timer, rspamd_re_cache_compile_timer_cb,
 			timer_interval, timer_interval);
@@ -2364,6 +3012,214 @@ rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 }
 
 
+#ifdef WITH_HYPERSCAN
+/*
+ * Header of a deserialized database shared between processes, the database
+ * itself follows it so it is aligned as hyperscan requires
+ */
+struct rspamd_re_cache_hs_map_hdr {
+	guchar magic[RSPAMD_HS_MAGIC_LEN];
+	guint64 crc; /* crc of the serialized database file */
+	guint64 db_len;
+	guchar padding[40];
+};
+
+G_STATIC_ASSERT (sizeof (struct rspamd_re_cache_hs_map_hdr) == 64);
+
+static gboolean
+rspamd_re_cache_check_hs_map (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
+		const gchar *path, guint64 crc)
+{
+	struct rspamd_re_cache_hs_map_hdr *hdr;
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 || (gsize)st.st_size <= sizeof (*hdr)) {
+		close (fd);
+		return FALSE;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_err_re_cache ("cannot mmap %s: %s", path, strerror (errno));
+		return FALSE;
+	}
+
+	hdr = (struct rspamd_re_cache_hs_map_hdr *)map;
+
+	if (memcmp (hdr->magic, cache->vectorized_hyperscan ?
+			rspamd_hs_magic_vector : rspamd_hs_magic, sizeof (hdr->magic)) != 0 ||
+			hdr->crc != crc ||
+			hdr->db_len != st.st_size - sizeof (*hdr)) {
+		msg_debug_re_cache ("outdated shared hs database in %s", path);
+		munmap (map, st.st_size);
+
+		return FALSE;
+	}
+
+	re_class->hs_db = (hs_database_t *)(((guchar *)map) + sizeof (*hdr));
+	re_class->hs_db_map = map;
+	re_class->hs_db_map_len = st.st_size;
+
+	return TRUE;
+}
+
+/*
+ * Places the deserialized database to a file mapping shared by all
+ * processes instead of deserializing it to the private heap memory
+ */
+static gboolean
+rspamd_re_cache_mmap_hs_db (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
+		const gchar *cache_dir,
+		const guchar *serialized, gsize serialized_len,
+		guint64 crc)
+{
+	gchar path[PATH_MAX], tmp_path[PATH_MAX];
+	struct rspamd_re_cache_hs_map_hdr *hdr;
+	gsize db_len, map_len;
+	gpointer map;
+	gint fd, ret;
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hsmp", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+
+	if (rspamd_re_cache_check_hs_map (cache, re_class, path, crc)) {
+		msg_debug_re_cache ("use shared hs database from %s", path);
+		return TRUE;
+	}
+
+	/* Create a new mapping: the first process that loads a database does it */
+	if ((ret = hs_serialized_database_size (serialized, serialized_len,
+			&db_len)) != HS_SUCCESS) {
+		msg_err_re_cache ("cannot get size of hs database %s: %d",
+				re_class->hash, ret);
+		return FALSE;
+	}
+
+	rspamd_snprintf (tmp_path, sizeof (tmp_path), "%s%c%s.hsmp.%P",
+			cache_dir, G_DIR_SEPARATOR, re_class->hash, getpid ());
+	fd = open (tmp_path, O_CREAT|O_TRUNC|O_EXCL|O_RDWR, 00600);
+
+	if (fd == -1) {
+		msg_err_re_cache ("cannot create %s: %s", tmp_path, strerror (errno));
+		return FALSE;
+	}
+
+	map_len = sizeof (*hdr) + db_len;
+
+	/*
+	 * Allocate blocks now: writing to a sparse file on a full disk
+	 * causes SIGBUS instead of an error
+	 */
+	if ((ret = rspamd_fallocate (fd, 0, map_len)) != 0) {
+		msg_err_re_cache ("cannot allocate %z bytes for %s: %s", map_len,
+				tmp_path, strerror (ret == -1 ? errno : ret));
+		close (fd);
+		unlink (tmp_path);
+
+		return FALSE;
+	}
+
+	/* No-op unless fallocate is unavailable on this system */
+	if (ftruncate (fd, map_len) == -1) {
+		msg_err_re_cache ("cannot truncate %s: %s", tmp_path, strerror (errno));
+		close (fd);
+		unlink (tmp_path);
+
+		return FALSE;
+	}
+
+	map = mmap (NULL, map_len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_err_re_cache ("cannot mmap %s: %s", tmp_path, strerror (errno));
+		unlink (tmp_path);
+
+		return FALSE;
+	}
+
+	hdr = (struct rspamd_re_cache_hs_map_hdr *)map;
+
+	if ((ret = hs_deserialize_database_at (serialized, serialized_len,
+			(hs_database_t *)(((guchar *)map) + sizeof (*hdr)))) != HS_SUCCESS) {
+		msg_err_re_cache ("cannot deserialize hs database to %s: %d",
+				tmp_path, ret);
+		munmap (map, map_len);
+		unlink (tmp_path);
+
+		return FALSE;
+	}
+
+	memcpy (hdr->magic, cache->vectorized_hyperscan ?
+			rspamd_hs_magic_vector : rspamd_hs_magic, sizeof (hdr->magic));
+	hdr->crc = crc;
+	hdr->db_len = db_len;
+
+	munmap (map, map_len);
+
+	/*
+	 * Publish the database only if no other process has done it while we
+	 * were writing it, link fails if the canonical file exists
+	 */
+	if (link (tmp_path, path) == -1) {
+		if (errno != EEXIST) {
+			msg_err_re_cache ("cannot link %s to %s: %s", tmp_path, path,
+					strerror (errno));
+			unlink (tmp_path);
+
+			return FALSE;
+		}
+
+		if (rspamd_re_cache_check_hs_map (cache, re_class, path, crc)) {
+			msg_debug_re_cache ("use shared hs database from %s created by "
+					"another process", path);
+			unlink (tmp_path);
+
+			return TRUE;
+		}
+
+		/* Outdated database, replace it */
+		if (rename (tmp_path, path) == -1) {
+			msg_err_re_cache ("cannot rename %s to %s: %s", tmp_path, path,
+					strerror (errno));
+			unlink (tmp_path);
+
+			return FALSE;
+		}
+	}
+	else {
+		unlink (tmp_path);
+	}
+
+	/*
+	 * Map the canonical file, so processes that have raced with us use
+	 * the same pages
+	 */
+	if (!rspamd_re_cache_check_hs_map (cache, re_class, path, crc)) {
+		msg_err_re_cache ("cannot map created hs database %s", path);
+
+		return FALSE;
+	}
+
+	msg_info_re_cache ("created shared hs database %s of %z bytes",
+			path, db_len);
+
+	return TRUE;
+}
+#endif
+
 enum rspamd_hyperscan_status
 rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir, bool try_load)
@@ -2382,6 +3238,7 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 	struct rspamd_re_class *re_class;
 	struct rspamd_re_cache_elt *elt;
 	struct stat st;
+	guint64 crc;
 	gboolean has_valid = FALSE, all_valid = FALSE;
 
 	g_hash_table_iter_init (&it, cache->re_classes);
@@ -2450,15 +3307,14 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 
 			/* Skip crc */
 			p += n * sizeof (*hs_ids) + sizeof (guint64);
+			memcpy (&crc, p - sizeof (crc), sizeof (crc));
 
 			/* Cleanup */
 			if (re_class->hs_scratch != NULL) {
 				hs_free_scratch (re_class->hs_scratch);
 			}
 
-			if (re_class->hs_db != NULL) {
-				hs_free_database (re_class->hs_db);
-			}
+			rspamd_re_cache_free_hs_db (re_class);
 
 			if (re_class->hs_ids) {
 				g_free (re_class->hs_ids);
@@ -2468,8 +3324,16 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			re_class->hs_scratch = NULL;
 			re_class->hs_db = NULL;
 
-			if ((ret = hs_deserialize_database (p, end - p, &re_class->hs_db))
-					!= HS_SUCCESS) {
+			if (cache->mmap_hyperscan &&
+					rspamd_re_cache_mmap_hs_db (cache, re_class, cache_dir,
+							p, end - p, crc)) {
+				ret = HS_SUCCESS;
+			}
+			else {
+				ret = hs_deserialize_database (p, end - p, &re_class->hs_db);
+			}
+
+			if (ret != HS_SUCCESS) {
 				if (!try_load) {
 					msg_err_re_cache ("bad hs database in %s: %d", path, ret);
 				}
@@ -2498,7 +3362,8 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			 * specify that they should be matched using hyperscan
 			 */
 			for (i = 0; i < n; i ++) {
-				g_assert ((gint)cache->re->len > hs_ids[i] && hs_ids[i] >= 0);
+				g_assert ((gint)re_class->nre > hs_ids[i] && hs_ids[i] >= 0);
+				hs_ids[i] = re_class->re_ids[hs_ids[i]];
 				elt = g_ptr_array_index (cache->re, hs_ids[i]);
 
 				if (hs_flags[i] & HS_FLAG_PREFILTER) {
@@ -116,6 +116,13 @@ struct rspamd_re_runtime *rspamd_re_cache_runtime_new (struct rspamd_re_cache *c
 const struct rspamd_re_cache_stat *
 rspamd_re_cache_get_stat (struct rspamd_re_runtime *rt);
 
+/**
+ * Get hits and misses of the shared results cache
+ * @return FALSE if the shared cache is not enabled
+ */
+gboolean rspamd_re_cache_get_shared_stat (struct rspamd_re_cache *cache,
+										  guint64 *hits, guint64 *misses);
+
 /**
  * Process regexp runtime and return the result for a specific regexp
  * @param task task object
@@ -170,14 +177,19 @@ const gchar *rspamd_re_cache_type_to_string (enum rspamd_re_type type);
 enum rspamd_re_type rspamd_re_cache_type_from_string (const char *str);
 
 struct ev_loop;
+struct rspamd_worker;
 /**
- * Compile expressions to the hyperscan tree and store in the `cache_dir`
+ * Compile expressions to the hyperscan tree and store in the `cache_dir`.
+ * Only classes with no valid database are compiled, using up to `nworkers`
+ * processes forked from `worker`; with no worker they are compiled in place
  */
 gint rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 										const char *cache_dir,
 										gdouble max_time,
 										gboolean silent,
+										guint nworkers,
 										struct ev_loop *event_loop,
+										struct rspamd_worker *worker,
 										void (*cb)(guint ncompiled, GError *err, void *cbd),
 										void *cbd);
 
@@ -23,6 +23,8 @@
 #include "contrib/hiredis/adapters/libev.h"
 #include "cryptobox.h"
 #include "logger.h"
+#include "str_util.h"
+#include <openssl/evp.h>
 
 struct rspamd_redis_pool_elt;
 
@@ -570,3 +572,14 @@ rspamd_redis_type_to_string (int type)
 
 	return ret;
 }
+
+void
+rspamd_redis_script_sha (const gchar *script, gchar *out)
+{
+	guchar digest[EVP_MAX_MD_SIZE];
+	guint dlen = 0;
+
+	EVP_Digest (script, strlen (script), digest, &dlen, EVP_sha1 (), NULL);
+	out[rspamd_encode_hex_buf (digest, dlen, out,
+			RSPAMD_REDIS_SCRIPT_SHA_LEN)] = '\0';
+}
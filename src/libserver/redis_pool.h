@@ -85,6 +85,16 @@ void rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool);
  */
 const gchar *rspamd_redis_type_to_string (int type);
 
+/* Length of a hex encoded SHA1 digest of a script including trailing zero */
+#define RSPAMD_REDIS_SCRIPT_SHA_LEN 41
+
+/**
+ * Writes hex encoded SHA1 digest of a Lua script as expected by EVALSHA
+ * @param script zero terminated script body
+ * @param out buffer of RSPAMD_REDIS_SCRIPT_SHA_LEN bytes
+ */
+void rspamd_redis_script_sha (const gchar *script, gchar *out);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -524,6 +524,16 @@ rspamd_control_finish_handler (struct rspamd_http_connection *conn,
 
 		session->is_reply = TRUE;
 
+		if (rspamd_ftok_cstr_equal (&srch, "/mempool", TRUE)) {
+			/* Allocation sites are shared between processes, no need to ask workers */
+			ucl_object_t *rep = rspamd_mempool_sites_ucl ();
+
+			rspamd_control_send_ucl (session, rep);
+			ucl_object_unref (rep);
+
+			return 0;
+		}
+
 		for (i = 0; i < G_N_ELEMENTS (cmd_matches); i++) {
 			if (rspamd_ftok_casecmp (&srch, &cmd_matches[i].name) == 0) {
 				session->cmd.type = cmd_matches[i].type;
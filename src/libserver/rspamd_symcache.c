@@ -19,6 +19,7 @@
 #include "message.h"
 #include "rspamd_symcache.h"
 #include "cfg_file.h"
+#include "composites.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
 #include "contrib/t1ha/t1ha.h"
@@ -53,19 +54,32 @@
 
 INIT_LOG_MODULE(symcache)
 
-#define CHECK_START_BIT(checkpoint, dyn_item) \
-	((dyn_item)->started)
-#define SET_START_BIT(checkpoint, dyn_item) \
-	(dyn_item)->started = 1
-#define CLR_START_BIT(checkpoint, dyn_item) \
-	(dyn_item)->started = 0
-
-#define CHECK_FINISH_BIT(checkpoint, dyn_item) \
-	((dyn_item)->finished)
-#define SET_FINISH_BIT(checkpoint, dyn_item) \
-	(dyn_item)->finished = 1
-#define CLR_FINISH_BIT(checkpoint, dyn_item) \
-	(dyn_item)->finished = 0
+/* Per-task state is stored as packed bitsets indexed by item id */
+#define BITSET_WORDS(n) (((n) + 63u) / 64u)
+#define BITSET_WORD(id) ((id) / 64u)
+#define BITSET_MASK(id) (G_GUINT64_CONSTANT(1) << ((id) % 64u))
+#define CHECK_BIT(bs, id) (((bs)[BITSET_WORD(id)] & BITSET_MASK(id)) != 0)
+#define SET_BIT(bs, id) (bs)[BITSET_WORD(id)] |= BITSET_MASK(id)
+#define CLR_BIT(bs, id) (bs)[BITSET_WORD(id)] &= ~BITSET_MASK(id)
+
+#define CHECK_START_BIT(checkpoint, id) CHECK_BIT((checkpoint)->started, id)
+#define SET_START_BIT(checkpoint, id) SET_BIT((checkpoint)->started, id)
+#define CLR_START_BIT(checkpoint, id) CLR_BIT((checkpoint)->started, id)
+
+#define CHECK_FINISH_BIT(checkpoint, id) CHECK_BIT((checkpoint)->finished, id)
+#define SET_FINISH_BIT(checkpoint, id) SET_BIT((checkpoint)->finished, id)
+#define CLR_FINISH_BIT(checkpoint, id) CLR_BIT((checkpoint)->finished, id)
+
+/* Marks item as finished and removes its score from the remaining bounds */
+#define SET_FINISH_BIT_ACCOUNTED(checkpoint, id) do { \
+	if (!CHECK_FINISH_BIT (checkpoint, id)) { \
+		SET_FINISH_BIT (checkpoint, id); \
+		rspamd_symcache_account_finished (checkpoint, id); \
+	} \
+} while (0)
+
+/* Number of skip masks cached for `rspamd_symcache_disable_all_symbols` */
+#define SYMCACHE_DISABLE_MASKS_CACHED 4
 static const guchar rspamd_symcache_magic[8] = {'r', 's', 'c', 2, 0, 0, 0, 0 };
 
 struct rspamd_symcache_header {
@@ -75,12 +89,65 @@ struct rspamd_symcache_header {
 	guchar unused[128];
 };
 
+enum symcache_plan_stage {
+	SYMCACHE_PLAN_PREFILTERS_EMPTY = 0,
+	SYMCACHE_PLAN_PREFILTERS,
+	SYMCACHE_PLAN_FILTERS,
+	SYMCACHE_PLAN_POSTFILTERS,
+	SYMCACHE_PLAN_IDEMPOTENT,
+	SYMCACHE_PLAN_MAX,
+};
+
+/*
+ * Compiled execution plan: it is built on each resort and is used by the
+ * per-task walk instead of the items themselves. All arrays are allocated
+ * in a single block right after this structure. Per-item arrays are indexed
+ * by item id, `order` contains ids of items for all stages laid out
+ * contiguously, `stages` has offsets of each stage in `order`.
+ * Dependencies are stored as flat lists of ids, where item `id` owns
+ * elements from `deps_offsets[id]` to `deps_offsets[id + 1]`
+ */
 struct symcache_order {
-	GPtrArray *d;
+	guint nitems;
+	guint stages[SYMCACHE_PLAN_MAX + 1];
+	struct rspamd_symcache_item **items; /* Cold data */
+	symbol_func_t *funcs;
+	gpointer *user_data;
+	/* Max positive and negative score that each filter could insert */
+	gdouble *score_pos;
+	gdouble *score_neg;
+	/* Filters which score cannot be bounded */
+	guint64 *unbounded;
+	/* Cost model bitsets, updated on each refresh */
+	guint64 *network;
+	guint64 *cpu_heavy;
+	guint *order;
+	guint *flags;
+	gint *priorities;
+	guint *deps_offsets;
+	guint *deps;
+	guint *rdeps_offsets;
+	guint *rdeps;
+	/* Lazily built bitsets of items to disable for a specific skip mask */
+	struct {
+		guint skip_mask;
+		guint64 *bits;
+	} disable_masks[SYMCACHE_DISABLE_MASKS_CACHED];
+	/* Sums of score bounds for filters and for items executed after them */
+	gdouble filters_pos;
+	gdouble filters_neg;
+	gdouble late_pos;
+	gdouble late_neg;
+	guint filters_unbounded;
+	/* Some item executed after filters cannot be bounded */
+	gboolean late_unbounded;
 	guint id;
 	ref_entry_t ref;
 };
 
+#define SYMCACHE_PLAN_STAGE_START(ord, stage) ((ord)->stages[(stage)])
+#define SYMCACHE_PLAN_STAGE_END(ord, stage) ((ord)->stages[(stage) + 1])
+
 /*
  * This structure is optimised to store ids list:
  * - If the first element is -1 then use dynamic part, else use static part
@@ -132,6 +199,8 @@ struct rspamd_symcache_item {
 	guint order;
 	gint id;
 	gint frequency_peaks;
+	/* Symbols have been inserted with a multiplier out of the assumed range */
+	gboolean dynamic_weight;
 	/* Settings ids */
 	struct rspamd_symcache_id_list allowed_ids;
 	/* Allows execution but not symbols insertion */
@@ -171,18 +240,12 @@ struct rspamd_symcache {
 	gdouble reload_time;
 	gdouble last_profile;
 	gint peak_cb;
+	gboolean io_first;
+	gboolean early_termination;
+	/* Some item has left the bounds of the current plan */
+	gboolean bounds_stale;
 };
 
-struct rspamd_symcache_dynamic_item {
-	guint16 start_msec; /* Relative to task time */
-	unsigned started:1;
-	unsigned finished:1;
-	/* unsigned pad:14; */
-	guint32 async_events;
-};
-
-
-
 struct cache_dependency {
 	struct rspamd_symcache_item *item; /* Real dependency */
 	gchar *sym; /* Symbolic dep name */
@@ -202,7 +265,6 @@ struct delayed_cache_condition {
 };
 
 struct cache_savepoint {
-	guint version;
 	guint items_inflight;
 	gboolean profile;
 	gboolean has_slow;
@@ -210,12 +272,39 @@ struct cache_savepoint {
 
 	struct rspamd_scan_result *rs;
 	gdouble lim;
+	/* Score that unfinished filters could still add */
+	gdouble remaining_pos;
+	gdouble remaining_neg;
+	guint remaining_unbounded;
+	/* Filters that were not executed as the action had been decided */
+	guint early_skipped;
 
 	struct rspamd_symcache_item *cur_item;
 	struct symcache_order *order;
-	struct rspamd_symcache_dynamic_item dynamic_items[];
+
+	/*
+	 * Dynamic state of items, all arrays are allocated in a single chunk
+	 * with the savepoint itself and indexed by item id
+	 */
+	guint nitems;
+	guint nwords;
+	guint64 *started;
+	guint64 *finished;
+	guint32 *async_events;
+	guint16 *start_msec; /* Relative to task time */
 };
 
+static inline void
+rspamd_symcache_account_finished (struct cache_savepoint *checkpoint, guint id)
+{
+	checkpoint->remaining_pos -= checkpoint->order->score_pos[id];
+	checkpoint->remaining_neg -= checkpoint->order->score_neg[id];
+
+	if (CHECK_BIT (checkpoint->order->unbounded, id)) {
+		checkpoint->remaining_unbounded --;
+	}
+}
+
 struct rspamd_cache_refresh_cbdata {
 	gdouble last_resort;
 	ev_timer resort_ev;
@@ -231,6 +320,15 @@ struct rspamd_cache_refresh_cbdata {
 /* Enable profile at least once per this amount of messages processed */
 #define PROFILE_PROBABILITY (0.01)
 
+/* Minimum number of profiled executions to consider item as network bound */
+#define NETWORK_MIN_SAMPLES (10)
+/* Part of executions with async events pending for network bound items */
+#define NETWORK_ASYNC_RATIO (0.5)
+/* Decay execution counters when they grow more than this value */
+#define NETWORK_DECAY_SAMPLES (10000)
+/* Average time (ms) for item to be considered as CPU heavy */
+#define CPU_HEAVY_TIME (1.0)
+
 /* weight, frequency, time */
 #define TIME_ALPHA (1.0)
 #define WEIGHT_ALPHA (0.1)
@@ -245,7 +343,7 @@ static gboolean rspamd_symcache_check_symbol (struct rspamd_task *task,
 		struct cache_savepoint *checkpoint);
 static gboolean rspamd_symcache_check_deps (struct rspamd_task *task,
 		struct rspamd_symcache *cache,
-		struct rspamd_symcache_item *item,
+		guint id,
 		struct cache_savepoint *checkpoint,
 		guint recursion,
 		gboolean check_only);
@@ -258,8 +356,14 @@ static void
 rspamd_symcache_order_dtor (gpointer p)
 {
 	struct symcache_order *ord = p;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (ord->disable_masks); i ++) {
+		if (ord->disable_masks[i].bits) {
+			g_free (ord->disable_masks[i].bits);
+		}
+	}
 
-	g_ptr_array_free (ord->d, TRUE);
 	g_free (ord);
 }
 
@@ -277,26 +381,386 @@ rspamd_id_cmp (const void * a, const void * b)
 	return (*(guint32*)a - *(guint32*)b);
 }
 
+static inline guint
+rspamd_symcache_count_deps (GPtrArray *deps)
+{
+	struct cache_dependency *dep;
+	guint i, cnt = 0;
+
+	if (deps) {
+		PTR_ARRAY_FOREACH (deps, i, dep) {
+			if (dep->item != NULL) {
+				cnt ++;
+			}
+		}
+	}
+
+	return cnt;
+}
+
+static void
+rspamd_symcache_plan_add_stage (struct symcache_order *ord,
+		enum symcache_plan_stage stage,
+		GPtrArray *items,
+		guint *pos)
+{
+	struct rspamd_symcache_item *it;
+	guint i;
+
+	ord->stages[stage] = *pos;
+
+	PTR_ARRAY_FOREACH (items, i, it) {
+		ord->order[(*pos) ++] = it->id;
+	}
+
+	ord->stages[stage + 1] = *pos;
+}
+
+/*
+ * Returns a bitset of items that should be disabled when all items but
+ * those matching `skip_mask` are disabled
+ */
+static const guint64 *
+rspamd_symcache_plan_disable_mask (struct symcache_order *ord,
+		guint skip_mask)
+{
+	guint i, id;
+	guint64 *bits;
+
+	for (i = 0; i < G_N_ELEMENTS (ord->disable_masks); i ++) {
+		if (ord->disable_masks[i].bits == NULL) {
+			break;
+		}
+
+		if (ord->disable_masks[i].skip_mask == skip_mask) {
+			return ord->disable_masks[i].bits;
+		}
+	}
+
+	bits = g_malloc0 (BITSET_WORDS (ord->nitems) * sizeof (guint64));
+
+	for (id = 0; id < ord->nitems; id ++) {
+		if (!(ord->flags[id] & skip_mask)) {
+			SET_BIT (bits, id);
+		}
+	}
+
+	if (i == G_N_ELEMENTS (ord->disable_masks)) {
+		/* Evict the oldest one */
+		g_free (ord->disable_masks[0].bits);
+		memmove (&ord->disable_masks[0], &ord->disable_masks[1],
+				sizeof (ord->disable_masks[0]) * (i - 1));
+		i --;
+	}
+
+	ord->disable_masks[i].skip_mask = skip_mask;
+	ord->disable_masks[i].bits = bits;
+
+	return bits;
+}
+
+static void
+rspamd_symcache_plan_reset_masks (struct symcache_order *ord)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (ord->disable_masks); i ++) {
+		if (ord->disable_masks[i].bits) {
+			g_free (ord->disable_masks[i].bits);
+			ord->disable_masks[i].bits = NULL;
+		}
+	}
+}
+
+static void
+rspamd_symcache_plan_refresh_item (struct symcache_order *ord,
+		struct rspamd_symcache_item *it)
+{
+	if (ord == NULL || it->is_virtual || it->id < 0 ||
+			(guint)it->id >= ord->nitems || ord->items[it->id] != it) {
+		return;
+	}
+
+	if (ord->flags[it->id] != (guint)it->type) {
+		ord->flags[it->id] = it->type;
+		rspamd_symcache_plan_reset_masks (ord);
+	}
+
+	ord->priorities[it->id] = it->priority;
+}
+
+/*
+ * Uses items statistics to split filters into network bound ones (those
+ * that usually wait for async events) and CPU heavy ones
+ */
+static void
+rspamd_symcache_plan_update_costs (struct symcache_order *ord)
+{
+	struct rspamd_symcache_item *it;
+	const struct rspamd_symcache_item_stat *st;
+	guint id;
+
+	memset (ord->network, 0, BITSET_WORDS (ord->nitems) * sizeof (guint64));
+	memset (ord->cpu_heavy, 0, BITSET_WORDS (ord->nitems) * sizeof (guint64));
+
+	for (id = 0; id < ord->nitems; id ++) {
+		it = ord->items[id];
+		st = it->st;
+
+		if (!it->is_filter || (it->type & SYMBOL_TYPE_CLASSIFIER)) {
+			continue;
+		}
+
+		if (st->exec_hits >= NETWORK_MIN_SAMPLES &&
+				(gdouble)st->async_hits / (gdouble)st->exec_hits >=
+				NETWORK_ASYNC_RATIO) {
+			SET_BIT (ord->network, id);
+		}
+		else if (st->avg_time >= CPU_HEAVY_TIME) {
+			/* Avg time of network items includes waiting, so check it after */
+			SET_BIT (ord->cpu_heavy, id);
+		}
+	}
+}
+
+/*
+ * Calculates the range of score each filter could add to the result, assuming
+ * that every symbol is inserted at most nshots times with a dynamic multiplier
+ * within the configured range. Virtual symbols are accounted in their parents,
+ * classifiers, composites and postfilters are executed after filters and are
+ * accounted together
+ */
+static void
+rspamd_symcache_plan_add_bound (struct rspamd_symcache *cache,
+		struct symcache_order *ord,
+		struct rspamd_symcache_item *it)
+{
+	struct rspamd_symcache_item *owner = it;
+	struct rspamd_symbol *s;
+	gdouble lo, hi;
+	gboolean unbounded;
+
+	if (it->type & (SYMBOL_TYPE_GHOST|SYMBOL_TYPE_SKIPPED)) {
+		return;
+	}
+
+	s = g_hash_table_lookup (cache->cfg->symbols, it->symbol);
+
+	if (s == NULL || s->weight_ptr == NULL || *s->weight_ptr == 0) {
+		return;
+	}
+
+	if (it->is_virtual) {
+		/* Virtual items have their own ids space */
+		if (it->specific.virtual.parent < 0 ||
+				it->specific.virtual.parent >= (gint)ord->nitems) {
+			return;
+		}
+
+		owner = ord->items[it->specific.virtual.parent];
+	}
+
+	if (owner->type & (SYMBOL_TYPE_PREFILTER|SYMBOL_TYPE_IDEMPOTENT)) {
+		/* Already executed or cannot change metric */
+		return;
+	}
+
+	/* Any number of insertions or multipliers out of range */
+	unbounded = s->nshots <= 0 || it->dynamic_weight;
+	/* Sign of each shot is defined by the signs of multiplier and weight */
+	lo = MIN (*s->weight_ptr * cache->cfg->cache_min_multiplier,
+			*s->weight_ptr * cache->cfg->cache_max_multiplier);
+	hi = MAX (*s->weight_ptr * cache->cfg->cache_min_multiplier,
+			*s->weight_ptr * cache->cfg->cache_max_multiplier);
+	lo = MIN (lo, 0) * s->nshots;
+	hi = MAX (hi, 0) * s->nshots;
+
+	if (owner->is_filter && !(owner->type & SYMBOL_TYPE_CLASSIFIER)) {
+		if (unbounded) {
+			SET_BIT (ord->unbounded, owner->id);
+		}
+		else {
+			ord->score_pos[owner->id] += hi;
+			ord->score_neg[owner->id] += lo;
+		}
+	}
+	else {
+		if (unbounded) {
+			ord->late_unbounded = TRUE;
+		}
+		else {
+			ord->late_pos += hi;
+			ord->late_neg += lo;
+		}
+	}
+}
+
+static void
+rspamd_symcache_plan_update_bounds (struct rspamd_symcache *cache,
+		struct symcache_order *ord)
+{
+	struct rspamd_symcache_item *it;
+	guint i, id;
+
+	memset (ord->score_pos, 0, ord->nitems * sizeof (gdouble));
+	memset (ord->score_neg, 0, ord->nitems * sizeof (gdouble));
+	memset (ord->unbounded, 0, BITSET_WORDS (ord->nitems) * sizeof (guint64));
+	ord->filters_pos = 0;
+	ord->filters_neg = 0;
+	ord->late_pos = 0;
+	ord->late_neg = 0;
+	ord->filters_unbounded = 0;
+	ord->late_unbounded = FALSE;
+
+	/* Results keep track of scores that composites could remove */
+	rspamd_composites_mark_removable (cache->cfg);
+
+	for (id = 0; id < ord->nitems; id ++) {
+		rspamd_symcache_plan_add_bound (cache, ord, ord->items[id]);
+	}
+
+	PTR_ARRAY_FOREACH (cache->virtual, i, it) {
+		rspamd_symcache_plan_add_bound (cache, ord, it);
+	}
+
+	for (i = SYMCACHE_PLAN_STAGE_START (ord, SYMCACHE_PLAN_FILTERS);
+			i < SYMCACHE_PLAN_STAGE_END (ord, SYMCACHE_PLAN_FILTERS); i++) {
+		id = ord->order[i];
+		ord->filters_pos += ord->score_pos[id];
+		ord->filters_neg += ord->score_neg[id];
+	}
+
+	/* Each of them is accounted once it is finished or disabled */
+	for (id = 0; id < ord->nitems; id ++) {
+		if (CHECK_BIT (ord->unbounded, id)) {
+			ord->filters_unbounded ++;
+		}
+	}
+}
+
+/*
+ * Compiles the execution plan for the specified filters order
+ */
 static struct symcache_order *
 rspamd_symcache_order_new (struct rspamd_symcache *cache,
-		gsize nelts)
+		GPtrArray *filters)
 {
 	struct symcache_order *ord;
+	struct rspamd_symcache_item *it;
+	struct cache_dependency *dep;
+	guint nitems, norder, ndeps = 0, nrdeps = 0, i, j, pos;
+	gsize sz;
+	guchar *p;
+
+	nitems = cache->items_by_id->len;
+	norder = cache->prefilters_empty->len + cache->prefilters->len +
+			filters->len + cache->postfilters->len + cache->idempotent->len;
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, it) {
+		ndeps += rspamd_symcache_count_deps (it->deps);
+		nrdeps += rspamd_symcache_count_deps (it->rdeps);
+	}
+
+	sz = sizeof (*ord) +
+			nitems * (sizeof (*ord->items) + sizeof (*ord->funcs) +
+					sizeof (*ord->user_data)) +
+			nitems * sizeof (gdouble) * 2 +
+			BITSET_WORDS (nitems) * sizeof (guint64) * 3 +
+			norder * sizeof (guint) +
+			nitems * (sizeof (guint) + sizeof (gint)) +
+			(nitems + 1) * sizeof (guint) * 2 +
+			(ndeps + nrdeps) * sizeof (guint);
+
+	ord = g_malloc0 (sz);
+	p = (guchar *)(ord + 1);
+	/* Pointers go first to keep alignment */
+	ord->items = (struct rspamd_symcache_item **)p;
+	p += nitems * sizeof (*ord->items);
+	ord->funcs = (symbol_func_t *)p;
+	p += nitems * sizeof (*ord->funcs);
+	ord->user_data = (gpointer *)p;
+	p += nitems * sizeof (*ord->user_data);
+	ord->score_pos = (gdouble *)p;
+	p += nitems * sizeof (gdouble);
+	ord->score_neg = (gdouble *)p;
+	p += nitems * sizeof (gdouble);
+	ord->unbounded = (guint64 *)p;
+	p += BITSET_WORDS (nitems) * sizeof (guint64);
+	ord->network = (guint64 *)p;
+	p += BITSET_WORDS (nitems) * sizeof (guint64);
+	ord->cpu_heavy = (guint64 *)p;
+	p += BITSET_WORDS (nitems) * sizeof (guint64);
+	ord->order = (guint *)p;
+	p += norder * sizeof (guint);
+	ord->flags = (guint *)p;
+	p += nitems * sizeof (guint);
+	ord->priorities = (gint *)p;
+	p += nitems * sizeof (gint);
+	ord->deps_offsets = (guint *)p;
+	p += (nitems + 1) * sizeof (guint);
+	ord->rdeps_offsets = (guint *)p;
+	p += (nitems + 1) * sizeof (guint);
+	ord->deps = (guint *)p;
+	p += ndeps * sizeof (guint);
+	ord->rdeps = (guint *)p;
+	g_assert (p + nrdeps * sizeof (guint) == (guchar *)ord + sz);
+
+	ord->nitems = nitems;
+	ndeps = 0;
+	nrdeps = 0;
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, it) {
+		ord->items[i] = it;
+		ord->funcs[i] = it->specific.normal.func;
+		ord->user_data[i] = it->specific.normal.user_data;
+		ord->flags[i] = it->type;
+		ord->priorities[i] = it->priority;
+
+		ord->deps_offsets[i] = ndeps;
+
+		if (it->deps) {
+			PTR_ARRAY_FOREACH (it->deps, j, dep) {
+				if (dep->item != NULL) {
+					ord->deps[ndeps ++] = dep->item->id;
+				}
+			}
+		}
+
+		ord->rdeps_offsets[i] = nrdeps;
+
+		if (it->rdeps) {
+			PTR_ARRAY_FOREACH (it->rdeps, j, dep) {
+				if (dep->item != NULL) {
+					ord->rdeps[nrdeps ++] = dep->item->id;
+				}
+			}
+		}
+	}
+
+	ord->deps_offsets[nitems] = ndeps;
+	ord->rdeps_offsets[nitems] = nrdeps;
+
+	pos = 0;
+	rspamd_symcache_plan_add_stage (ord, SYMCACHE_PLAN_PREFILTERS_EMPTY,
+			cache->prefilters_empty, &pos);
+	rspamd_symcache_plan_add_stage (ord, SYMCACHE_PLAN_PREFILTERS,
+			cache->prefilters, &pos);
+	rspamd_symcache_plan_add_stage (ord, SYMCACHE_PLAN_FILTERS,
+			filters, &pos);
+	rspamd_symcache_plan_add_stage (ord, SYMCACHE_PLAN_POSTFILTERS,
+			cache->postfilters, &pos);
+	rspamd_symcache_plan_add_stage (ord, SYMCACHE_PLAN_IDEMPOTENT,
+			cache->idempotent, &pos);
+
+	rspamd_symcache_plan_update_costs (ord);
+	rspamd_symcache_plan_update_bounds (cache, ord);
 
-	ord = g_malloc0 (sizeof (*ord));
-	ord->d = g_ptr_array_sized_new (nelts);
 	ord->id = cache->id;
 	REF_INIT_RETAIN (ord, rspamd_symcache_order_dtor);
 
 	return ord;
 }
 
-static inline struct rspamd_symcache_dynamic_item*
-rspamd_symcache_get_dynamic (struct cache_savepoint *checkpoint,
-							 struct rspamd_symcache_item *item)
-{
-	return &checkpoint->dynamic_items[item->id];
-}
 
 static inline struct rspamd_symcache_item *
 rspamd_symcache_find_filter (struct rspamd_symcache *cache,
@@ -492,17 +956,18 @@ static void
 rspamd_symcache_resort (struct rspamd_symcache *cache)
 {
 	struct symcache_order *ord;
+	GPtrArray *filters;
 	guint i;
 	guint64 total_hits = 0;
 	struct rspamd_symcache_item *it;
 
-	ord = rspamd_symcache_order_new (cache, cache->filters->len);
+	filters = g_ptr_array_sized_new (cache->filters->len);
 
 	for (i = 0; i < cache->filters->len; i ++) {
 		it = g_ptr_array_index (cache->filters, i);
 		total_hits += it->st->total_hits;
 		it->order = 0;
-		g_ptr_array_add (ord->d, it);
+		g_ptr_array_add (filters, it);
 	}
 
 	/* Topological sort, intended to be O(N) but my implementation
@@ -512,7 +977,7 @@ rspamd_symcache_resort (struct rspamd_symcache *cache)
 	 * can be more complicated than linear - O(N^2) for specially
 	 * crafted data. But I don't care.
 	 */
-	PTR_ARRAY_FOREACH (ord->d, i, it) {
+	PTR_ARRAY_FOREACH (filters, i, it) {
 		if (it->order == 0) {
 			rspamd_symcache_tsort_visit (cache, it, 1);
 		}
@@ -522,8 +987,10 @@ rspamd_symcache_resort (struct rspamd_symcache *cache)
 	 * Now we have all sorted and can do some heuristical sort, keeping
 	 * topological order invariant
 	 */
-	g_ptr_array_sort_with_data (ord->d, cache_logic_cmp, cache);
+	g_ptr_array_sort_with_data (filters, cache_logic_cmp, cache);
 	cache->total_hits = total_hits;
+	ord = rspamd_symcache_order_new (cache, filters);
+	g_ptr_array_free (filters, TRUE);
 
 	if (cache->items_by_order) {
 		REF_RELEASE (cache->items_by_order);
@@ -1363,6 +1830,8 @@ rspamd_symcache_init (struct rspamd_symcache *cache)
 	g_assert (cache != NULL);
 
 	cache->reload_time = cache->cfg->cache_reload_time;
+	cache->io_first = cache->cfg->cache_io_first;
+	cache->early_termination = cache->cfg->cache_early_termination;
 
 	/* Just in-memory cache */
 	if (cache->cfg->cache_filename == NULL) {
@@ -1488,6 +1957,7 @@ rspamd_symcache_validate (struct rspamd_symcache *cache,
 	gpointer k, v;
 	struct rspamd_symbol *sym_def;
 	gboolean ignore_symbol = FALSE, ret = TRUE;
+	guint i;
 
 	if (cache == NULL) {
 		msg_err ("empty cache is invalid");
@@ -1536,6 +2006,15 @@ rspamd_symcache_validate (struct rspamd_symcache *cache,
 		}
 	}
 
+	/* Priorities, flags and scores might be changed, so update the execution plan */
+	if (cache->items_by_order) {
+		PTR_ARRAY_FOREACH (cache->items_by_id, i, item) {
+			rspamd_symcache_plan_refresh_item (cache->items_by_order, item);
+		}
+
+		rspamd_symcache_plan_update_bounds (cache, cache->items_by_order);
+	}
+
 	return ret;
 }
 
@@ -1578,6 +2057,101 @@ rspamd_symcache_metric_limit (struct rspamd_task *task,
 	return FALSE;
 }
 
+/*
+ * Return true if no remaining filter can change the action of the task:
+ * there is no action threshold between the minimum and the maximum score
+ * that could be reached
+ */
+static gboolean
+rspamd_symcache_action_decided (struct rspamd_task *task,
+		struct rspamd_symcache *cache,
+		struct cache_savepoint *cp)
+{
+	struct rspamd_scan_result *res = task->result;
+	const struct symcache_order *plan = cp->order;
+	struct rspamd_action_result *lim;
+	gdouble lo, hi, sc;
+	guint i;
+
+	if (!cache->early_termination || res == NULL ||
+			(task->flags & RSPAMD_TASK_FLAG_PASS_ALL)) {
+		return FALSE;
+	}
+
+	if (res->passthrough_result != NULL || task->cfg->grow_factor > 1.0) {
+		/* Score is not additive */
+		return FALSE;
+	}
+
+	if (task->settings && ucl_object_lookup (task->settings, "scores")) {
+		/* Scores are redefined for this task */
+		return FALSE;
+	}
+
+	if (plan->late_unbounded || cp->remaining_unbounded > 0 ||
+			cache->bounds_stale) {
+		return FALSE;
+	}
+
+	/*
+	 * Composites evaluated later can remove weight of symbols inserted so
+	 * far, the result keeps the sums of such scores
+	 */
+	lo = res->score + MIN (cp->remaining_neg, 0) + plan->late_neg -
+			res->removable_pos;
+	hi = res->score + MAX (cp->remaining_pos, 0) + plan->late_pos -
+			res->removable_neg;
+
+	for (i = 0; i < res->nactions; i ++) {
+		lim = &res->actions_limits[i];
+		sc = lim->cur_limit;
+
+		if (isnan (sc) ||
+				(lim->action->flags & (RSPAMD_ACTION_NO_THRESHOLD|RSPAMD_ACTION_HAM))) {
+			continue;
+		}
+
+		if (lo < sc && hi >= sc) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Stops execution of filters that are not yet started
+ */
+static void
+rspamd_symcache_terminate_filters (struct rspamd_task *task,
+		struct cache_savepoint *checkpoint)
+{
+	const struct symcache_order *plan = checkpoint->order;
+	guint i, id;
+
+	for (i = SYMCACHE_PLAN_STAGE_START (plan, SYMCACHE_PLAN_FILTERS);
+			i < SYMCACHE_PLAN_STAGE_END (plan, SYMCACHE_PLAN_FILTERS); i++) {
+		id = plan->order[i];
+
+		if (!CHECK_START_BIT (checkpoint, id) &&
+				!(plan->flags[id] & SYMBOL_TYPE_CLASSIFIER)) {
+			SET_START_BIT (checkpoint, id);
+			SET_FINISH_BIT_ACCOUNTED (checkpoint, id);
+			checkpoint->early_skipped ++;
+		}
+	}
+
+	if (checkpoint->profile) {
+		msg_info_task ("action has been decided at score %.2f, skip %ud filters",
+				task->result->score, checkpoint->early_skipped);
+	}
+	else {
+		msg_debug_cache_task ("action has been decided at score %.2f, "
+				"skip %ud filters",
+				task->result->score, checkpoint->early_skipped);
+	}
+}
+
 static inline gboolean
 rspamd_symcache_check_id_list (const struct rspamd_symcache_id_list *ls, guint32 id)
 {
@@ -1723,10 +2297,10 @@ rspamd_symcache_check_symbol (struct rspamd_task *task,
 	struct rspamd_task **ptask;
 	lua_State *L;
 	gboolean check = TRUE;
-	struct rspamd_symcache_dynamic_item *dyn_item =
-			rspamd_symcache_get_dynamic (checkpoint, item);
+	const struct symcache_order *plan = checkpoint->order;
+	guint id = item->id;
 
-	if (item->type & (SYMBOL_TYPE_CLASSIFIER|SYMBOL_TYPE_COMPOSITE)) {
+	if (plan->flags[id] & (SYMBOL_TYPE_CLASSIFIER|SYMBOL_TYPE_COMPOSITE)) {
 		/* Classifiers are special :( */
 		return TRUE;
 	}
@@ -1740,16 +2314,17 @@ rspamd_symcache_check_symbol (struct rspamd_task *task,
 	}
 
 	g_assert (!item->is_virtual);
-	g_assert (item->specific.normal.func != NULL);
-	if (CHECK_START_BIT (checkpoint, dyn_item)) {
+	g_assert (plan->funcs[id] != NULL);
+
+	if (CHECK_START_BIT (checkpoint, id)) {
 		/*
 		 * This can actually happen when deps span over different layers
 		 */
-		return CHECK_FINISH_BIT (checkpoint, dyn_item);
+		return CHECK_FINISH_BIT (checkpoint, id);
 	}
 
 	/* Check has been started */
-	SET_START_BIT (checkpoint, dyn_item);
+	SET_START_BIT (checkpoint, id);
 
 	if (!rspamd_symcache_is_item_allowed (task, item, TRUE)) {
 		check = FALSE;
@@ -1785,23 +2360,32 @@ rspamd_symcache_check_symbol (struct rspamd_task *task,
 
 		if (checkpoint->profile) {
 			ev_now_update_if_cheap (task->event_loop);
-			dyn_item->start_msec = (ev_now (task->event_loop) -
+			checkpoint->start_msec[id] = (ev_now (task->event_loop) -
 					checkpoint->profile_start) * 1e3;
 		}
 
-		dyn_item->async_events = 0;
+		checkpoint->async_events[id] = 0;
 		checkpoint->cur_item = item;
 		checkpoint->items_inflight ++;
 		/* Callback now must finalize itself */
-		item->specific.normal.func (task, item, item->specific.normal.user_data);
+		plan->funcs[id] (task, item, plan->user_data[id]);
 		checkpoint->cur_item = NULL;
 
+		if (checkpoint->profile) {
+			/* Feed cost model used to schedule network bound items */
+			g_atomic_int_inc (&item->st->exec_hits);
+
+			if (checkpoint->async_events[id] > 0) {
+				g_atomic_int_inc (&item->st->async_hits);
+			}
+		}
+
 		if (checkpoint->items_inflight == 0) {
 
 			return TRUE;
 		}
 
-		if (dyn_item->async_events == 0 && !CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+		if (checkpoint->async_events[id] == 0 && !CHECK_FINISH_BIT (checkpoint, id)) {
 			msg_err_cache ("critical error: item %s has no async events pending, "
 						   "but it is not finalised", item->symbol);
 			g_assert_not_reached ();
@@ -1810,7 +2394,7 @@ rspamd_symcache_check_symbol (struct rspamd_task *task,
 		return FALSE;
 	}
 	else {
-		SET_FINISH_BIT (checkpoint, dyn_item);
+		SET_FINISH_BIT_ACCOUNTED (checkpoint, id);
 	}
 
 	return TRUE;
@@ -1819,92 +2403,77 @@ rspamd_symcache_check_symbol (struct rspamd_task *task,
 static gboolean
 rspamd_symcache_check_deps (struct rspamd_task *task,
 		struct rspamd_symcache *cache,
-		struct rspamd_symcache_item *item,
+		guint id,
 		struct cache_savepoint *checkpoint,
 		guint recursion,
 		gboolean check_only)
 {
-	struct cache_dependency *dep;
-	guint i;
+	const struct symcache_order *plan = checkpoint->order;
+	guint i, dep_id;
 	gboolean ret = TRUE;
 	static const guint max_recursion = 20;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 
 	if (recursion > max_recursion) {
 		msg_err_task ("cyclic dependencies: maximum check level %ud exceed when "
-				"checking dependencies for %s", max_recursion, item->symbol);
+				"checking dependencies for %s", max_recursion,
+				plan->items[id]->symbol);
 
 		return TRUE;
 	}
 
-	if (item->deps != NULL && item->deps->len > 0) {
-		for (i = 0; i < item->deps->len; i ++) {
-			dep = g_ptr_array_index (item->deps, i);
+	for (i = plan->deps_offsets[id]; i < plan->deps_offsets[id + 1]; i ++) {
+		dep_id = plan->deps[i];
 
-			if (dep->item == NULL) {
-				/* Assume invalid deps as done */
-				msg_debug_cache_task ("symbol %d(%s) has invalid dependencies on %d(%s)",
-						item->id, item->symbol, dep->id, dep->sym);
-				continue;
-			}
-
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, dep->item);
-
-			if (!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
-				if (!CHECK_START_BIT (checkpoint, dyn_item)) {
-					/* Not started */
-					if (!check_only) {
-						if (!rspamd_symcache_check_deps (task, cache,
-								dep->item,
-								checkpoint,
-								recursion + 1,
-								check_only)) {
+		if (!CHECK_FINISH_BIT (checkpoint, dep_id)) {
+			if (!CHECK_START_BIT (checkpoint, dep_id)) {
+				/* Not started */
+				if (!check_only) {
+					if (!rspamd_symcache_check_deps (task, cache,
+							dep_id,
+							checkpoint,
+							recursion + 1,
+							check_only)) {
 
-							ret = FALSE;
-							msg_debug_cache_task ("delayed dependency %d(%s) for "
-											"symbol %d(%s)",
-									dep->id, dep->sym, item->id, item->symbol);
-						}
-						else if (!rspamd_symcache_check_symbol (task, cache,
-								dep->item,
-								checkpoint)) {
-							/* Now started, but has events pending */
-							ret = FALSE;
-							msg_debug_cache_task ("started check of %d(%s) symbol "
-											"as dep for "
-											"%d(%s)",
-									dep->id, dep->sym, item->id, item->symbol);
-						}
-						else {
-							msg_debug_cache_task ("dependency %d(%s) for symbol %d(%s) is "
-									"already processed",
-									dep->id, dep->sym, item->id, item->symbol);
-						}
+						ret = FALSE;
+						msg_debug_cache_task ("delayed dependency %d for "
+											  "symbol %d",
+								dep_id, id);
 					}
-					else {
-						msg_debug_cache_task ("dependency %d(%s) for symbol %d(%s) "
-										"cannot be started now",
-								dep->id, dep->sym,
-								item->id, item->symbol);
+					else if (!rspamd_symcache_check_symbol (task, cache,
+							plan->items[dep_id],
+							checkpoint)) {
+						/* Now started, but has events pending */
 						ret = FALSE;
+						msg_debug_cache_task ("started check of %d symbol "
+											  "as dep for %d",
+								dep_id, id);
+					}
+					else {
+						msg_debug_cache_task ("dependency %d for symbol %d is "
+											  "already processed",
+								dep_id, id);
 					}
 				}
 				else {
-					/* Started but not finished */
-					msg_debug_cache_task ("dependency %d(%s) for symbol %d(%s) is "
-									"still executing",
-							dep->id, dep->sym,
-							item->id, item->symbol);
+					msg_debug_cache_task ("dependency %d for symbol %d "
+										  "cannot be started now",
+							dep_id, id);
 					ret = FALSE;
 				}
 			}
 			else {
-				msg_debug_cache_task ("dependency %d(%s) for symbol %d(%s) is already "
-						"checked",
-						dep->id, dep->sym,
-						item->id, item->symbol);
+				/* Started but not finished */
+				msg_debug_cache_task ("dependency %d for symbol %d is "
+									  "still executing",
+						dep_id, id);
+				ret = FALSE;
 			}
 		}
+		else {
+			msg_debug_cache_task ("dependency %d for symbol %d is already "
+								  "checked",
+					dep_id, id);
+		}
 	}
 
 	return ret;
@@ -1915,6 +2484,8 @@ rspamd_symcache_make_checkpoint (struct rspamd_task *task,
 		struct rspamd_symcache *cache)
 {
 	struct cache_savepoint *checkpoint;
+	guint nitems, nwords;
+	guchar *p;
 
 	if (cache->items_by_order->id != cache->id) {
 		/*
@@ -1926,13 +2497,30 @@ rspamd_symcache_make_checkpoint (struct rspamd_task *task,
 		rspamd_symcache_resort (cache);
 	}
 
+	g_assert (cache->items_by_order != NULL);
+	nitems = cache->items_by_order->nitems;
+	nwords = BITSET_WORDS (nitems);
+
+	/* Savepoint, 2 bitsets and counters are allocated as a single chunk */
 	checkpoint = rspamd_mempool_alloc0 (task->task_pool,
 			sizeof (*checkpoint) +
-			sizeof (struct rspamd_symcache_dynamic_item) * cache->items_by_id->len);
+			nwords * sizeof (guint64) * 2 +
+			nitems * (sizeof (guint32) + sizeof (guint16)));
+	p = (guchar *)(checkpoint + 1);
+	checkpoint->nitems = nitems;
+	checkpoint->nwords = nwords;
+	checkpoint->started = (guint64 *)p;
+	p += nwords * sizeof (guint64);
+	checkpoint->finished = (guint64 *)p;
+	p += nwords * sizeof (guint64);
+	checkpoint->async_events = (guint32 *)p;
+	p += nitems * sizeof (guint32);
+	checkpoint->start_msec = (guint16 *)p;
 
-	g_assert (cache->items_by_order != NULL);
-	checkpoint->version = cache->items_by_order->d->len;
 	checkpoint->order = cache->items_by_order;
+	checkpoint->remaining_pos = checkpoint->order->filters_pos;
+	checkpoint->remaining_neg = checkpoint->order->filters_neg;
+	checkpoint->remaining_unbounded = checkpoint->order->filters_unbounded;
 	REF_RETAIN (checkpoint->order);
 	rspamd_mempool_add_destructor (task->task_pool,
 			rspamd_symcache_order_unref, checkpoint->order);
@@ -2052,16 +2640,49 @@ rspamd_symcache_process_settings (struct rspamd_task *task,
 	return FALSE;
 }
 
+/*
+ * Starts all network bound filters that have their dependencies satisfied
+ */
+static void
+rspamd_symcache_start_network_items (struct rspamd_task *task,
+		struct rspamd_symcache *cache,
+		struct cache_savepoint *checkpoint)
+{
+	const struct symcache_order *plan = checkpoint->order;
+	guint i, id;
+
+	for (i = SYMCACHE_PLAN_STAGE_START (plan, SYMCACHE_PLAN_FILTERS);
+			i < SYMCACHE_PLAN_STAGE_END (plan, SYMCACHE_PLAN_FILTERS); i++) {
+		id = plan->order[i];
+
+		if (!CHECK_BIT (plan->network, id) || CHECK_START_BIT (checkpoint, id)) {
+			continue;
+		}
+
+		if (RSPAMD_TASK_IS_SKIPPED (task) || checkpoint->has_slow) {
+			return;
+		}
+
+		/* Do not start any dependencies here, they are CPU bound usually */
+		if (!rspamd_symcache_check_deps (task, cache, id, checkpoint, 0, TRUE)) {
+			continue;
+		}
+
+		msg_debug_cache_task ("start network bound item %d(%s) early",
+				id, plan->items[id]->symbol);
+		rspamd_symcache_check_symbol (task, cache, plan->items[id], checkpoint);
+	}
+}
+
 gboolean
 rspamd_symcache_process_symbols (struct rspamd_task *task,
 								 struct rspamd_symcache *cache,
 								 gint stage)
 {
-	struct rspamd_symcache_item *item = NULL;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 	struct cache_savepoint *checkpoint;
-	gint i;
-	gboolean all_done = TRUE;
+	const struct symcache_order *plan;
+	guint i, id, pass;
+	gboolean all_done = TRUE, limit_reached;
 	gint saved_priority;
 	guint start_events_pending;
 
@@ -2075,6 +2696,7 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 		checkpoint = task->checkpoint;
 	}
 
+	plan = checkpoint->order;
 	msg_debug_cache_task ("symbols processing stage at pass: %d", stage);
 	start_events_pending = rspamd_session_events_pending (task->s);
 
@@ -2084,16 +2706,16 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 		saved_priority = G_MININT;
 		all_done = TRUE;
 
-		for (i = 0; i < (gint) cache->prefilters_empty->len; i++) {
-			item = g_ptr_array_index (cache->prefilters_empty, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
+		for (i = SYMCACHE_PLAN_STAGE_START (plan, SYMCACHE_PLAN_PREFILTERS_EMPTY);
+				i < SYMCACHE_PLAN_STAGE_END (plan, SYMCACHE_PLAN_PREFILTERS_EMPTY); i++) {
+			id = plan->order[i];
 
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
 			}
 
-			if (!CHECK_START_BIT (checkpoint, dyn_item) &&
-				!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_START_BIT (checkpoint, id) &&
+				!CHECK_FINISH_BIT (checkpoint, id)) {
 
 				if (checkpoint->has_slow) {
 					/* Delay */
@@ -2103,10 +2725,10 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 				}
 				/* Check priorities */
 				if (saved_priority == G_MININT) {
-					saved_priority = item->priority;
+					saved_priority = plan->priorities[id];
 				}
 				else {
-					if (item->priority < saved_priority &&
+					if (plan->priorities[id] < saved_priority &&
 						rspamd_session_events_pending (task->s) > start_events_pending) {
 						/*
 						 * Delay further checks as we have higher
@@ -2116,7 +2738,7 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 					}
 				}
 
-				rspamd_symcache_check_symbol (task, cache, item,
+				rspamd_symcache_check_symbol (task, cache, plan->items[id],
 						checkpoint);
 				all_done = FALSE;
 			}
@@ -2129,16 +2751,16 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 		saved_priority = G_MININT;
 		all_done = TRUE;
 
-		for (i = 0; i < (gint) cache->prefilters->len; i++) {
-			item = g_ptr_array_index (cache->prefilters, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
+		for (i = SYMCACHE_PLAN_STAGE_START (plan, SYMCACHE_PLAN_PREFILTERS);
+				i < SYMCACHE_PLAN_STAGE_END (plan, SYMCACHE_PLAN_PREFILTERS); i++) {
+			id = plan->order[i];
 
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
 			}
 
-			if (!CHECK_START_BIT (checkpoint, dyn_item) &&
-				!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_START_BIT (checkpoint, id) &&
+				!CHECK_FINISH_BIT (checkpoint, id)) {
 				/* Check priorities */
 				if (checkpoint->has_slow) {
 					/* Delay */
@@ -2148,10 +2770,10 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 				}
 
 				if (saved_priority == G_MININT) {
-					saved_priority = item->priority;
+					saved_priority = plan->priorities[id];
 				}
 				else {
-					if (item->priority < saved_priority &&
+					if (plan->priorities[id] < saved_priority &&
 						rspamd_session_events_pending (task->s) > start_events_pending) {
 						/*
 						 * Delay further checks as we have higher
@@ -2161,7 +2783,7 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 					}
 				}
 
-				rspamd_symcache_check_symbol (task, cache, item,
+				rspamd_symcache_check_symbol (task, cache, plan->items[id],
 						checkpoint);
 				all_done = FALSE;
 			}
@@ -2171,51 +2793,86 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 
 	case RSPAMD_TASK_STAGE_FILTERS:
 		all_done = TRUE;
+		limit_reached = FALSE;
+
+		if (cache->io_first) {
+			/* Send all network requests we can before doing CPU work */
+			rspamd_symcache_start_network_items (task, cache, checkpoint);
 
-		for (i = 0; i < (gint) checkpoint->version; i++) {
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
 			}
 
-			item = g_ptr_array_index (checkpoint->order->d, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
+			if (checkpoint->has_slow) {
+				/* Delay */
+				checkpoint->has_slow = FALSE;
 
-			if (item->type & SYMBOL_TYPE_CLASSIFIER) {
-				continue;
+				return FALSE;
 			}
+		}
 
-			if (!CHECK_START_BIT (checkpoint, dyn_item)) {
-				all_done = FALSE;
-
-				if (!rspamd_symcache_check_deps (task, cache, item,
-						checkpoint, 0, FALSE)) {
+		/*
+		 * In io_first mode the first pass skips CPU heavy items, so they are
+		 * executed when network requests are already in flight
+		 */
+		for (pass = cache->io_first ? 0 : 1; pass < 2 && !limit_reached; pass ++) {
+			for (i = SYMCACHE_PLAN_STAGE_START (plan, SYMCACHE_PLAN_FILTERS);
+					i < SYMCACHE_PLAN_STAGE_END (plan, SYMCACHE_PLAN_FILTERS); i++) {
+				if (RSPAMD_TASK_IS_SKIPPED (task)) {
+					return TRUE;
+				}
 
-					msg_debug_cache_task ("blocked execution of %d(%s) unless deps are "
-										  "resolved",
-							item->id, item->symbol);
+				id = plan->order[i];
 
+				if (plan->flags[id] & SYMBOL_TYPE_CLASSIFIER) {
 					continue;
 				}
 
-				rspamd_symcache_check_symbol (task, cache, item,
-						checkpoint);
+				if (!CHECK_START_BIT (checkpoint, id)) {
+					all_done = FALSE;
 
-				if (checkpoint->has_slow) {
-					/* Delay */
-					checkpoint->has_slow = FALSE;
+					if (pass == 0 && CHECK_BIT (plan->cpu_heavy, id)) {
+						continue;
+					}
 
-					return FALSE;
+					if (!rspamd_symcache_check_deps (task, cache, id,
+							checkpoint, 0, FALSE)) {
+
+						msg_debug_cache_task ("blocked execution of %d unless deps are "
+											  "resolved",
+								id);
+
+						continue;
+					}
+
+					rspamd_symcache_check_symbol (task, cache, plan->items[id],
+							checkpoint);
+
+					if (checkpoint->has_slow) {
+						/* Delay */
+						checkpoint->has_slow = FALSE;
+
+						return FALSE;
+					}
 				}
-			}
 
-			if (!(item->type & SYMBOL_TYPE_FINE)) {
-				if (rspamd_symcache_metric_limit (task, checkpoint)) {
-					msg_info_task ("task has already scored more than %.2f, so do "
-								   "not "
-								   "plan more checks",
-							checkpoint->rs->score);
-					all_done = TRUE;
-					break;
+				if (!(plan->flags[id] & SYMBOL_TYPE_FINE)) {
+					if (rspamd_symcache_metric_limit (task, checkpoint)) {
+						msg_info_task ("task has already scored more than %.2f, so do "
+									   "not "
+									   "plan more checks",
+								checkpoint->rs->score);
+						all_done = TRUE;
+						limit_reached = TRUE;
+						break;
+					}
+
+					if (rspamd_symcache_action_decided (task, cache, checkpoint)) {
+						rspamd_symcache_terminate_filters (task, checkpoint);
+						all_done = TRUE;
+						limit_reached = TRUE;
+						break;
+					}
 				}
 			}
 		}
@@ -2227,16 +2884,16 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 		saved_priority = G_MININT;
 		all_done = TRUE;
 
-		for (i = 0; i < (gint) cache->postfilters->len; i++) {
+		for (i = SYMCACHE_PLAN_STAGE_START (plan, SYMCACHE_PLAN_POSTFILTERS);
+				i < SYMCACHE_PLAN_STAGE_END (plan, SYMCACHE_PLAN_POSTFILTERS); i++) {
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
 			}
 
-			item = g_ptr_array_index (cache->postfilters, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
+			id = plan->order[i];
 
-			if (!CHECK_START_BIT (checkpoint, dyn_item) &&
-				!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_START_BIT (checkpoint, id) &&
+				!CHECK_FINISH_BIT (checkpoint, id)) {
 				/* Check priorities */
 				all_done = FALSE;
 
@@ -2248,10 +2905,10 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 				}
 
 				if (saved_priority == G_MININT) {
-					saved_priority = item->priority;
+					saved_priority = plan->priorities[id];
 				}
 				else {
-					if (item->priority > saved_priority &&
+					if (plan->priorities[id] > saved_priority &&
 						rspamd_session_events_pending (task->s) > start_events_pending) {
 						/*
 						 * Delay further checks as we have higher
@@ -2262,7 +2919,7 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 					}
 				}
 
-				rspamd_symcache_check_symbol (task, cache, item,
+				rspamd_symcache_check_symbol (task, cache, plan->items[id],
 						checkpoint);
 			}
 		}
@@ -2273,12 +2930,12 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 		/* Check for postfilters */
 		saved_priority = G_MININT;
 
-		for (i = 0; i < (gint) cache->idempotent->len; i++) {
-			item = g_ptr_array_index (cache->idempotent, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
+		for (i = SYMCACHE_PLAN_STAGE_START (plan, SYMCACHE_PLAN_IDEMPOTENT);
+				i < SYMCACHE_PLAN_STAGE_END (plan, SYMCACHE_PLAN_IDEMPOTENT); i++) {
+			id = plan->order[i];
 
-			if (!CHECK_START_BIT (checkpoint, dyn_item) &&
-				!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_START_BIT (checkpoint, id) &&
+				!CHECK_FINISH_BIT (checkpoint, id)) {
 				/* Check priorities */
 				if (checkpoint->has_slow) {
 					/* Delay */
@@ -2288,10 +2945,10 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 				}
 
 				if (saved_priority == G_MININT) {
-					saved_priority = item->priority;
+					saved_priority = plan->priorities[id];
 				}
 				else {
-					if (item->priority > saved_priority &&
+					if (plan->priorities[id] > saved_priority &&
 						rspamd_session_events_pending (task->s) > start_events_pending) {
 						/*
 						 * Delay further checks as we have higher
@@ -2300,7 +2957,7 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 						return FALSE;
 					}
 				}
-				rspamd_symcache_check_symbol (task, cache, item,
+				rspamd_symcache_check_symbol (task, cache, plan->items[id],
 						checkpoint);
 			}
 		}
@@ -2428,6 +3085,53 @@ rspamd_symcache_call_peak_cb (struct ev_loop *ev_base,
 	}
 }
 
+/*
+ * Scores might be changed at runtime, so the score bounds of the plan are
+ * rechecked periodically. Tasks keep references to the current plan, hence
+ * a new plan is compiled if bounds differ
+ */
+static void
+rspamd_symcache_refresh_bounds (struct rspamd_symcache *cache)
+{
+	struct symcache_order *ord = cache->items_by_order, *nord;
+	GPtrArray *filters;
+	guint i;
+
+	if (ord == NULL || ord->id != cache->id) {
+		return;
+	}
+
+	filters = g_ptr_array_sized_new (SYMCACHE_PLAN_STAGE_END (ord, SYMCACHE_PLAN_FILTERS) -
+			SYMCACHE_PLAN_STAGE_START (ord, SYMCACHE_PLAN_FILTERS));
+
+	for (i = SYMCACHE_PLAN_STAGE_START (ord, SYMCACHE_PLAN_FILTERS);
+			i < SYMCACHE_PLAN_STAGE_END (ord, SYMCACHE_PLAN_FILTERS); i++) {
+		g_ptr_array_add (filters, ord->items[ord->order[i]]);
+	}
+
+	nord = rspamd_symcache_order_new (cache, filters);
+	g_ptr_array_free (filters, TRUE);
+
+	/* Items out of bounds are accounted in the new plan */
+	cache->bounds_stale = FALSE;
+
+	if (nord->late_pos != ord->late_pos || nord->late_neg != ord->late_neg ||
+			nord->late_unbounded != ord->late_unbounded ||
+			memcmp (nord->unbounded, ord->unbounded,
+					BITSET_WORDS (ord->nitems) * sizeof (guint64)) != 0 ||
+			memcmp (nord->score_pos, ord->score_pos,
+					ord->nitems * sizeof (gdouble)) != 0 ||
+			memcmp (nord->score_neg, ord->score_neg,
+					ord->nitems * sizeof (gdouble)) != 0) {
+		msg_info_cache ("scores have been changed, recompile symbols cache plan");
+		cache->items_by_order = nord;
+		REF_RELEASE (ord);
+	}
+	else {
+		REF_RELEASE (nord);
+	}
+}
+
 static void
 rspamd_symcache_resort_cb (EV_P_ ev_timer *w, int revents)
 {
@@ -2499,6 +3203,11 @@ rspamd_symcache_resort_cb (EV_P_ ev_timer *w, int revents)
 
 			item->last_count = item->st->total_hits;
 
+			if (item->st->exec_hits > NETWORK_DECAY_SAMPLES) {
+				g_atomic_int_set (&item->st->exec_hits, item->st->exec_hits / 2);
+				g_atomic_int_set (&item->st->async_hits, item->st->async_hits / 2);
+			}
+
 			if (item->cd->number > 0) {
 				if (item->type & (SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_NORMAL)) {
 					item->st->avg_time = item->cd->mean;
@@ -2513,6 +3222,14 @@ rspamd_symcache_resort_cb (EV_P_ ev_timer *w, int revents)
 		cbdata->last_resort = cur_ticks;
 		/* We don't do actual sorting due to topological guarantees */
 	}
+
+	if (cache->io_first && cache->items_by_order) {
+		rspamd_symcache_plan_update_costs (cache->items_by_order);
+	}
+
+	if (cache->early_termination) {
+		rspamd_symcache_refresh_bounds (cache);
+	}
 }
 
 static void
@@ -2691,9 +3408,9 @@ rspamd_symcache_disable_all_symbols (struct rspamd_task *task,
 									 guint skip_mask)
 {
 	struct cache_savepoint *checkpoint;
-	guint i;
-	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
+	const guint64 *mask;
+	guint64 newly;
+	guint i, j;
 
 	if (task->checkpoint == NULL) {
 		checkpoint = rspamd_symcache_make_checkpoint (task, cache);
@@ -2703,13 +3420,18 @@ rspamd_symcache_disable_all_symbols (struct rspamd_task *task,
 		checkpoint = task->checkpoint;
 	}
 
-	/* Enable for squeezed symbols */
-	PTR_ARRAY_FOREACH (cache->items_by_id, i, item) {
-		dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
+	mask = rspamd_symcache_plan_disable_mask (checkpoint->order, skip_mask);
 
-		if (!(item->type & (skip_mask))) {
-			SET_FINISH_BIT (checkpoint, dyn_item);
-			SET_START_BIT (checkpoint, dyn_item);
+	/* Disable all symbols but those matching skip mask word by word */
+	for (i = 0; i < checkpoint->nwords; i ++) {
+		newly = mask[i] & ~checkpoint->finished[i];
+		checkpoint->finished[i] |= mask[i];
+		checkpoint->started[i] |= mask[i];
+
+		for (j = 0; newly != 0; j ++, newly >>= 1) {
+			if (newly & 1) {
+				rspamd_symcache_account_finished (checkpoint, i * 64 + j);
+			}
 		}
 	}
 }
@@ -2720,7 +3442,6 @@ rspamd_symcache_disable_symbol_checkpoint (struct rspamd_task *task,
 {
 	struct cache_savepoint *checkpoint;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 
 	if (task->checkpoint == NULL) {
 		checkpoint = rspamd_symcache_make_checkpoint (task, cache);
@@ -2733,9 +3454,8 @@ rspamd_symcache_disable_symbol_checkpoint (struct rspamd_task *task,
 	item = rspamd_symcache_find_filter (cache, symbol, true);
 
 	if (item) {
-		dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-		SET_FINISH_BIT (checkpoint, dyn_item);
-		SET_START_BIT (checkpoint, dyn_item);
+		SET_FINISH_BIT_ACCOUNTED (checkpoint, item->id);
+		SET_START_BIT (checkpoint, item->id);
 		msg_debug_cache_task ("disable execution of %s", symbol);
 	}
 	else {
@@ -2749,7 +3469,6 @@ rspamd_symcache_enable_symbol_checkpoint (struct rspamd_task *task,
 {
 	struct cache_savepoint *checkpoint;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 
 	if (task->checkpoint == NULL) {
 		checkpoint = rspamd_symcache_make_checkpoint (task, cache);
@@ -2762,9 +3481,8 @@ rspamd_symcache_enable_symbol_checkpoint (struct rspamd_task *task,
 	item = rspamd_symcache_find_filter (cache, symbol, true);
 
 	if (item) {
-		dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-		dyn_item->finished = 0;
-		dyn_item->started = 0;
+		CLR_FINISH_BIT (checkpoint, item->id);
+		CLR_START_BIT (checkpoint, item->id);
 		msg_debug_cache_task ("enable execution of %s", symbol);
 	}
 	else {
@@ -2796,7 +3514,6 @@ rspamd_symcache_is_checked (struct rspamd_task *task,
 {
 	struct cache_savepoint *checkpoint;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 
 	g_assert (cache != NULL);
 	g_assert (symbol != NULL);
@@ -2812,8 +3529,7 @@ rspamd_symcache_is_checked (struct rspamd_task *task,
 	item = rspamd_symcache_find_filter (cache, symbol, true);
 
 	if (item) {
-		dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-		return dyn_item->started;
+		return CHECK_START_BIT (checkpoint, item->id);
 	}
 
 	return FALSE;
@@ -2868,7 +3584,6 @@ rspamd_symcache_is_symbol_enabled (struct rspamd_task *task,
 {
 	struct cache_savepoint *checkpoint;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 	lua_State *L;
 	struct rspamd_task **ptask;
 	gboolean ret = TRUE;
@@ -2888,8 +3603,7 @@ rspamd_symcache_is_symbol_enabled (struct rspamd_task *task,
 				ret = FALSE;
 			}
 			else {
-				dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-				if (CHECK_START_BIT (checkpoint, dyn_item)) {
+				if (CHECK_START_BIT (checkpoint, item->id)) {
 					ret = FALSE;
 				}
 				else {
@@ -2931,7 +3645,6 @@ rspamd_symcache_enable_symbol (struct rspamd_task *task,
 {
 	struct cache_savepoint *checkpoint;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 	gboolean ret = FALSE;
 
 	g_assert (cache != NULL);
@@ -2943,12 +3656,10 @@ rspamd_symcache_enable_symbol (struct rspamd_task *task,
 		item = rspamd_symcache_find_filter (cache, symbol, true);
 
 		if (item) {
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-
-			if (!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_FINISH_BIT (checkpoint, item->id)) {
 				ret = TRUE;
-				CLR_START_BIT (checkpoint, dyn_item);
-				CLR_FINISH_BIT (checkpoint, dyn_item);
+				CLR_START_BIT (checkpoint, item->id);
+				CLR_FINISH_BIT (checkpoint, item->id);
 			}
 			else {
 				msg_debug_task ("cannot enable symbol %s: already started", symbol);
@@ -2967,7 +3678,6 @@ rspamd_symcache_disable_symbol (struct rspamd_task *task,
 {
 	struct cache_savepoint *checkpoint;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 	gboolean ret = FALSE;
 
 	g_assert (cache != NULL);
@@ -2979,15 +3689,13 @@ rspamd_symcache_disable_symbol (struct rspamd_task *task,
 		item = rspamd_symcache_find_filter (cache, symbol, true);
 
 		if (item) {
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-
-			if (!CHECK_START_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_START_BIT (checkpoint, item->id)) {
 				ret = TRUE;
-				SET_START_BIT (checkpoint, dyn_item);
-				SET_FINISH_BIT (checkpoint, dyn_item);
+				SET_START_BIT (checkpoint, item->id);
+				SET_FINISH_BIT_ACCOUNTED (checkpoint, item->id);
 			}
 			else {
-				if (!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+				if (!CHECK_FINISH_BIT (checkpoint, item->id)) {
 					msg_warn_task ("cannot disable symbol %s: already started",
 							symbol);
 				}
@@ -3047,6 +3755,38 @@ rspamd_symcache_set_cur_item (struct rspamd_task *task,
 	return ex;
 }
 
+static void
+rspamd_symcache_process_rdeps (struct rspamd_task *task,
+		struct rspamd_symcache_item *item,
+		struct cache_savepoint *checkpoint)
+{
+	const struct symcache_order *plan = checkpoint->order;
+	guint i, rdep_id;
+
+	for (i = plan->rdeps_offsets[item->id]; i < plan->rdeps_offsets[item->id + 1];
+			i ++) {
+		rdep_id = plan->rdeps[i];
+
+		if (!CHECK_START_BIT (checkpoint, rdep_id)) {
+			msg_debug_cache_task ("check item %d rdep of %s ",
+					rdep_id, item->symbol);
+
+			if (!rspamd_symcache_check_deps (task, task->cfg->cache,
+					rdep_id,
+					checkpoint, 0, FALSE)) {
+				msg_debug_cache_task ("blocked execution of %d rdep of %s "
+									  "unless deps are resolved",
+						rdep_id, item->symbol);
+			}
+			else {
+				rspamd_symcache_check_symbol (task, task->cfg->cache,
+						plan->items[rdep_id],
+						checkpoint);
+			}
+		}
+	}
+}
+
 struct rspamd_symcache_delayed_cbdata {
 	struct rspamd_symcache_item *item;
 	struct rspamd_task *task;
@@ -3075,10 +3815,7 @@ rspamd_symcache_delayed_item_cb (EV_P_ ev_timer *w, int what)
 			(struct rspamd_symcache_delayed_cbdata *)w->data;
 	struct rspamd_symcache_item *item;
 	struct rspamd_task *task;
-	struct cache_dependency *rdep;
 	struct cache_savepoint *checkpoint;
-	struct rspamd_symcache_dynamic_item *dyn_item;
-	guint i;
 
 	item = cbd->item;
 	task = cbd->task;
@@ -3090,28 +3827,7 @@ rspamd_symcache_delayed_item_cb (EV_P_ ev_timer *w, int what)
 			rspamd_symcache_delayed_item_fin, cbd);
 
 	/* Process all reverse dependencies */
-	PTR_ARRAY_FOREACH (item->rdeps, i, rdep) {
-		if (rdep->item) {
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, rdep->item);
-			if (!CHECK_START_BIT (checkpoint, dyn_item)) {
-				msg_debug_cache_task ("check item %d(%s) rdep of %s ",
-						rdep->item->id, rdep->item->symbol, item->symbol);
-
-				if (!rspamd_symcache_check_deps (task, task->cfg->cache,
-						rdep->item,
-						checkpoint, 0, FALSE)) {
-					msg_debug_cache_task ("blocked execution of %d(%s) rdep of %s "
-										  "unless deps are resolved",
-							rdep->item->id, rdep->item->symbol, item->symbol);
-				}
-				else {
-					rspamd_symcache_check_symbol (task, task->cfg->cache,
-							rdep->item,
-							checkpoint);
-				}
-			}
-		}
-	}
+	rspamd_symcache_process_rdeps (task, item, checkpoint);
 }
 
 static void
@@ -3136,18 +3852,14 @@ rspamd_symcache_finalize_item (struct rspamd_task *task,
 							   struct rspamd_symcache_item *item)
 {
 	struct cache_savepoint *checkpoint = task->checkpoint;
-	struct cache_dependency *rdep;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 	gdouble diff;
-	guint i;
 	gboolean enable_slow_timer = FALSE;
 	const gdouble slow_diff_limit = 300;
 
 	/* Sanity checks */
 	g_assert (checkpoint->items_inflight > 0);
-	dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
 
-	if (dyn_item->async_events > 0) {
+	if (checkpoint->async_events[item->id] > 0) {
 		/*
 		 * XXX: Race condition
 		 *
@@ -3158,20 +3870,21 @@ rspamd_symcache_finalize_item (struct rspamd_task *task,
 		 */
 		msg_debug_cache_task ("postpone finalisation of %s(%d) as there are %d "
 							  "async events pendning",
-							  item->symbol, item->id, dyn_item->async_events);
+							  item->symbol, item->id,
+							  checkpoint->async_events[item->id]);
 
 		return;
 	}
 
 	msg_debug_cache_task ("process finalize for item %s(%d)", item->symbol, item->id);
-	SET_FINISH_BIT (checkpoint, dyn_item);
+	SET_FINISH_BIT_ACCOUNTED (checkpoint, item->id);
 	checkpoint->items_inflight --;
 	checkpoint->cur_item = NULL;
 
 	if (checkpoint->profile) {
 		ev_now_update_if_cheap (task->event_loop);
 		diff = ((ev_now (task->event_loop) - checkpoint->profile_start) * 1e3 -
-				dyn_item->start_msec);
+				checkpoint->start_msec[item->id]);
 
 		if (diff > slow_diff_limit) {
 
@@ -3232,28 +3945,7 @@ rspamd_symcache_finalize_item (struct rspamd_task *task,
 	}
 
 	/* Process all reverse dependencies */
-	PTR_ARRAY_FOREACH (item->rdeps, i, rdep) {
-		if (rdep->item) {
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, rdep->item);
-			if (!CHECK_START_BIT (checkpoint, dyn_item)) {
-				msg_debug_cache_task ("check item %d(%s) rdep of %s ",
-						rdep->item->id, rdep->item->symbol, item->symbol);
-
-				if (!rspamd_symcache_check_deps (task, task->cfg->cache,
-						rdep->item,
-						checkpoint, 0, FALSE)) {
-					msg_debug_cache_task ("blocked execution of %d(%s) rdep of %s "
-						   "unless deps are resolved",
-							rdep->item->id, rdep->item->symbol, item->symbol);
-				}
-				else {
-					rspamd_symcache_check_symbol (task, task->cfg->cache,
-							rdep->item,
-							checkpoint);
-				}
-			}
-		}
-	}
+	rspamd_symcache_process_rdeps (task, item, checkpoint);
 }
 
 guint
@@ -3262,14 +3954,14 @@ rspamd_symcache_item_async_inc_full (struct rspamd_task *task,
 								const gchar *subsystem,
 								const gchar *loc)
 {
-	struct rspamd_symcache_dynamic_item *dyn_item;
 	struct cache_savepoint *checkpoint = task->checkpoint;
 
-	dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
 	msg_debug_cache_task ("increase async events counter for %s(%d) = %d + 1; "
 					   "subsystem %s (%s)",
-			item->symbol, item->id, dyn_item->async_events, subsystem, loc);
-	return ++dyn_item->async_events;
+			item->symbol, item->id, checkpoint->async_events[item->id],
+			subsystem, loc);
+
+	return ++checkpoint->async_events[item->id];
 }
 
 guint
@@ -3278,16 +3970,15 @@ rspamd_symcache_item_async_dec_full (struct rspamd_task *task,
 								const gchar *subsystem,
 								const gchar *loc)
 {
-	struct rspamd_symcache_dynamic_item *dyn_item;
 	struct cache_savepoint *checkpoint = task->checkpoint;
 
-	dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
 	msg_debug_cache_task ("decrease async events counter for %s(%d) = %d - 1; "
 					   "subsystem %s (%s)",
-			item->symbol, item->id, dyn_item->async_events, subsystem, loc);
-	g_assert (dyn_item->async_events > 0);
+			item->symbol, item->id, checkpoint->async_events[item->id],
+			subsystem, loc);
+	g_assert (checkpoint->async_events[item->id] > 0);
 
-	return --dyn_item->async_events;
+	return --checkpoint->async_events[item->id];
 }
 
 gboolean
@@ -3319,6 +4010,7 @@ rspamd_symcache_add_symbol_flags (struct rspamd_symcache *cache,
 
 	if (item) {
 		item->type |= flags;
+		rspamd_symcache_plan_refresh_item (cache->items_by_order, item);
 
 		return TRUE;
 	}
@@ -3340,6 +4032,7 @@ rspamd_symcache_set_symbol_flags (struct rspamd_symcache *cache,
 
 	if (item) {
 		item->type = flags;
+		rspamd_symcache_plan_refresh_item (cache->items_by_order, item);
 
 		return TRUE;
 	}
@@ -3373,20 +4066,17 @@ rspamd_symcache_composites_foreach (struct rspamd_task *task,
 {
 	guint i;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 
 	if (task->checkpoint == NULL) {
 		return;
 	}
 
 	PTR_ARRAY_FOREACH (cache->composites, i, item) {
-		dyn_item = rspamd_symcache_get_dynamic (task->checkpoint, item);
-
-		if (!CHECK_START_BIT (task->checkpoint, dyn_item)) {
+		if (!CHECK_START_BIT (task->checkpoint, item->id)) {
 			/* Cannot do it due to 2 passes */
-			/* SET_START_BIT (task->checkpoint, dyn_item); */
+			/* SET_START_BIT (task->checkpoint, item->id); */
 			func (item->symbol, item->specific.normal.user_data, fd);
-			SET_FINISH_BIT (task->checkpoint, dyn_item);
+			SET_FINISH_BIT (task->checkpoint, item->id);
 		}
 	}
 }
@@ -3713,6 +4403,12 @@ rspamd_symcache_item_name (struct rspamd_symcache_item *item)
 	return item ? item->symbol : NULL;
 }
 
+gint
+rspamd_symcache_item_id (struct rspamd_symcache_item *item)
+{
+	return item ? item->id : -1;
+}
+
 const struct rspamd_symcache_item_stat *
 rspamd_symcache_item_stat (struct rspamd_symcache_item *item)
 {
@@ -3783,6 +4479,36 @@ rspamd_symcache_item_get_rdeps (struct rspamd_symcache_item *item)
 	return NULL;
 }
 
+guint
+rspamd_symcache_get_early_skipped (struct rspamd_task *task)
+{
+	struct cache_savepoint *checkpoint = task->checkpoint;
+
+	if (checkpoint == NULL) {
+		return 0;
+	}
+
+	return checkpoint->early_skipped;
+}
+
+void
+rspamd_symcache_item_check_multiplier (struct rspamd_symcache *cache,
+		struct rspamd_symcache_item *item, gdouble mult)
+{
+	if (item->dynamic_weight || (mult >= cache->cfg->cache_min_multiplier &&
+			mult <= cache->cfg->cache_max_multiplier)) {
+		return;
+	}
+
+	msg_info_cache ("symbol %s is inserted with multiplier %.2f out of the "
+			"range [%.2f, %.2f], do not bound its score",
+			item->symbol, mult, cache->cfg->cache_min_multiplier,
+			cache->cfg->cache_max_multiplier);
+	item->dynamic_weight = TRUE;
+	/* Plan is rebuilt on the next refresh, do not terminate until then */
+	cache->bounds_stale = TRUE;
+}
+
 void
 rspamd_symcache_enable_profile (struct rspamd_task *task)
 {
@@ -77,6 +77,9 @@ struct rspamd_symcache_item_stat {
 	struct rspamd_counter_data frequency_counter;
 	gdouble avg_frequency;
 	gdouble stddev_frequency;
+	/* Profiled executions and how many of them had async events pending */
+	guint exec_hits;
+	guint async_hits;
 };
 
 /**
@@ -533,6 +536,13 @@ gint rspamd_symcache_item_flags (struct rspamd_symcache_item *item);
  * @return
  */
 const gchar* rspamd_symcache_item_name (struct rspamd_symcache_item *item);
+/**
+ * Returns cache item id (-1 if item is NULL), virtual items have their own
+ * ids space
+ * @param item
+ * @return
+ */
+gint rspamd_symcache_item_id (struct rspamd_symcache_item *item);
 /**
  * Returns the current item stat
  * @param item
@@ -569,6 +579,24 @@ const GPtrArray* rspamd_symcache_item_get_rdeps (
 		struct rspamd_symcache_item *item);
 
 
+/**
+ * Returns number of filters that were not executed as the action of the task
+ * had been decided before (`cache_early_termination` option)
+ * @param task
+ * @return
+ */
+guint rspamd_symcache_get_early_skipped (struct rspamd_task *task);
+
+/**
+ * Checks dynamic weight multiplier of a symbol inserted by some item, if it is
+ * out of the configured range the item is not bounded by early termination
+ * @param cache
+ * @param item
+ * @param mult
+ */
+void rspamd_symcache_item_check_multiplier (struct rspamd_symcache *cache,
+		struct rspamd_symcache_item *item, gdouble mult);
+
 /**
  * Enable profiling for task (e.g. when a slow rule has been found)
  * @param task
@@ -266,7 +266,7 @@ struct url_callback_data {
 	gboolean prefix_added;
 	guint newline_idx;
 	GArray *matchers;
-	GPtrArray *newlines;
+	rspamd_mempool_array_t *newlines;
 	const gchar *start;
 	const gchar *fin;
 	const gchar *end;
@@ -2991,11 +2991,13 @@ rspamd_url_trie_callback (struct rspamd_multipattern *mp,
 	m.m_len = match_pos - match_start;
 
 	if (cb->newlines && cb->newlines->len > 0) {
-		newline_pos = g_ptr_array_index (cb->newlines, cb->newline_idx);
+		newline_pos = rspamd_mempool_array_index (cb->newlines, const gchar *,
+				cb->newline_idx);
 
 		while (pos > newline_pos && cb->newline_idx < cb->newlines->len) {
 			cb->newline_idx ++;
-			newline_pos = g_ptr_array_index (cb->newlines, cb->newline_idx);
+			newline_pos = rspamd_mempool_array_index (cb->newlines,
+					const gchar *, cb->newline_idx);
 		}
 
 		if (pos > newline_pos) {
@@ -3003,7 +3005,8 @@ rspamd_url_trie_callback (struct rspamd_multipattern *mp,
 		}
 
 		if (cb->newline_idx > 0) {
-			m.prev_newline_pos = g_ptr_array_index (cb->newlines,
+			m.prev_newline_pos = rspamd_mempool_array_index (cb->newlines,
+					const gchar *,
 					cb->newline_idx - 1);
 		}
 	}
@@ -3148,18 +3151,21 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 
 	/* Find the next newline after our pos */
 	if (cb->newlines && cb->newlines->len > 0) {
-		newline_pos = g_ptr_array_index (cb->newlines, cb->newline_idx);
+		newline_pos = rspamd_mempool_array_index (cb->newlines, const gchar *,
+				cb->newline_idx);
 
 		while (pos > newline_pos && cb->newline_idx < cb->newlines->len - 1) {
 			cb->newline_idx ++;
-			newline_pos = g_ptr_array_index (cb->newlines, cb->newline_idx);
+			newline_pos = rspamd_mempool_array_index (cb->newlines,
+					const gchar *, cb->newline_idx);
 		}
 
 		if (pos > newline_pos) {
 			newline_pos = NULL;
 		}
 		if (cb->newline_idx > 0) {
-			m.prev_newline_pos = g_ptr_array_index (cb->newlines,
+			m.prev_newline_pos = rspamd_mempool_array_index (cb->newlines,
+					const gchar *,
 					cb->newline_idx - 1);
 		}
 	}
@@ -3359,7 +3365,7 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 		g_ptr_array_add (cbd->part->mime_part->urls, url);
 	}
 
-	cbd->part->exceptions = g_list_prepend (
+	cbd->part->exceptions = rspamd_mempool_glist_prepend (task->task_pool,
 			cbd->part->exceptions,
 			ex);
 
@@ -3401,7 +3407,7 @@ rspamd_url_find_multiple (rspamd_mempool_t *pool,
 						  const gchar *in,
 						  gsize inlen,
 						  enum rspamd_url_find_type how,
-						  GPtrArray *nlines,
+						  rspamd_mempool_array_t *nlines,
 						  url_insert_function func,
 						  gpointer ud)
 {
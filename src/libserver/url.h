@@ -198,7 +198,7 @@ typedef gboolean (*url_insert_function) (struct rspamd_url *url,
 void rspamd_url_find_multiple (rspamd_mempool_t *pool,
 							   const gchar *in, gsize inlen,
 							   enum rspamd_url_find_type how,
-							   GPtrArray *nlines,
+							   rspamd_mempool_array_t *nlines,
 							   url_insert_function func,
 							   gpointer ud);
 
@@ -47,6 +47,13 @@ struct rspamd_stat_backend {
 								gint id,
 								gpointer ctx);
 
+	/*
+	 * Optional: resolves tokens for `nrt` statfiles of this backend in one
+	 * pass over tokens, filling tok->values[ids[i]] from runtimes[i]
+	 */
+	gboolean (*process_tokens_batch) (struct rspamd_task *task, GPtrArray *tokens,
+									  const gint *ids, gpointer *runtimes, guint nrt);
+
 	gboolean (*finalize_process) (struct rspamd_task *task,
 								  gpointer runtime, gpointer ctx);
 
@@ -113,6 +120,9 @@ struct rspamd_stat_backend {
 
 RSPAMD_STAT_BACKEND_DEF(mmaped_file);
 
+gboolean rspamd_mmaped_file_process_tokens_batch (struct rspamd_task *task,
+		GPtrArray *tokens, const gint *ids, gpointer *runtimes, guint nrt);
+
 RSPAMD_STAT_BACKEND_DEF(sqlite3);
 
 #ifdef WITH_HIREDIS
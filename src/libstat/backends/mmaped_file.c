@@ -55,6 +55,43 @@ struct stat_file_block {
 	double value;                           /**< double value                       */
 };
 
+/**
+ * Bucket of data in statfile version 1.3, occupies exactly one cache line:
+ * a token is stored in one of two buckets selected by its hashes
+ */
+#define STATFILE_BUCKET_SLOTS 3
+
+struct stat_file_bucket {
+	guint32 seq;                            /**< odd while slots are being written	*/
+	guint32 hash1[STATFILE_BUCKET_SLOTS];   /**< hash1 of slots, 0 if slot is free	*/
+	guint32 hash2[STATFILE_BUCKET_SLOTS];   /**< hash2 of slots						*/
+	guint32 reserved[3];                    /**< padding to a cache line			*/
+	double value[STATFILE_BUCKET_SLOTS];    /**< values of slots					*/
+};
+
+G_STATIC_ASSERT (sizeof (struct stat_file_bucket) == 64);
+
+/* Buckets are aligned to cache lines from the beginning of a file */
+#define STATFILE_BUCKETS_OFFSET ((sizeof (struct stat_file_header) + \
+	sizeof (struct stat_file_section) + 63) & ~((gsize)63))
+
+/* How many tokens ahead are prefetched when looking up */
+#define STATFILE_PREFETCH_DISTANCE 16
+
+#ifdef __GNUC__
+#define STATFILE_PREFETCH(p) __builtin_prefetch ((p), 0, 1)
+#define STATFILE_BARRIER() __sync_synchronize ()
+#else
+#define STATFILE_PREFETCH(p) do {} while (0)
+#define STATFILE_BARRIER() do {} while (0)
+#endif
+
+/*
+ * How many times a bucket that is being rewritten is read again, a writer
+ * that has died in the middle of an update must not block scanners forever
+ */
+#define STATFILE_READ_RETRIES 1024
+
 /**
  * Statistic file
  */
@@ -79,17 +116,22 @@ typedef struct {
 	off_t seek_pos;                         /**< current seek position				*/
 	struct stat_file_section cur_section;   /**< current section					*/
 	size_t len;                             /**< length of file(in bytes)			*/
+	gboolean bucketed;                      /**< version 1.3 layout					*/
 	struct rspamd_statfile_config *cf;
 } rspamd_mmaped_file_t;
 
 
 #define RSPAMD_STATFILE_VERSION {'1', '2'}
+#define RSPAMD_STATFILE_VERSION_BUCKETS {'1', '3'}
 #define BACKUP_SUFFIX ".old"
 
 static void rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 	   rspamd_mmaped_file_t *file,
 	   guint32 h1, guint32 h2, double value);
 
+static rspamd_mmaped_file_t * rspamd_mmaped_file_map (rspamd_mempool_t *pool,
+		const gchar *filename, size_t size,
+		struct rspamd_statfile_config *stcf);
 rspamd_mmaped_file_t * rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 		const gchar *filename, size_t size,
 		struct rspamd_statfile_config *stcf);
@@ -99,6 +141,139 @@ gint rspamd_mmaped_file_create (const gchar *filename, size_t size,
 gint rspamd_mmaped_file_close_file (rspamd_mempool_t *pool,
 		rspamd_mmaped_file_t * file);
 
+static inline struct stat_file_bucket *
+rspamd_mmaped_file_bucket (rspamd_mmaped_file_t *file, guint32 h)
+{
+	return ((struct stat_file_bucket *)((u_char *)file->map + file->seek_pos)) +
+			h % file->cur_section.length;
+}
+
+static double
+rspamd_mmaped_file_get_bucket_value (rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2)
+{
+	struct stat_file_bucket *buckets[2];
+	guint i, j, retries;
+	guint32 seq;
+	double value;
+	gboolean found;
+
+	buckets[0] = rspamd_mmaped_file_bucket (file, h1);
+	buckets[1] = rspamd_mmaped_file_bucket (file, h2);
+
+	for (j = 0; j < G_N_ELEMENTS (buckets); j ++) {
+		/*
+		 * Seqlock read: slots are consistent if the sequence of a bucket
+		 * is even and has not changed while they were read
+		 */
+		for (retries = 0; retries < STATFILE_READ_RETRIES; retries ++) {
+			seq = (guint32)g_atomic_int_get ((gint *)&buckets[j]->seq);
+
+			if (seq & 1) {
+				continue;
+			}
+
+			STATFILE_BARRIER ();
+			found = FALSE;
+			value = 0;
+
+			for (i = 0; i < STATFILE_BUCKET_SLOTS; i ++) {
+				if (buckets[j]->hash1[i] == h1 && buckets[j]->hash2[i] == h2) {
+					value = buckets[j]->value[i];
+					found = TRUE;
+					break;
+				}
+			}
+
+			STATFILE_BARRIER ();
+
+			if ((guint32)g_atomic_int_get ((gint *)&buckets[j]->seq) == seq) {
+				if (found) {
+					return value;
+				}
+
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void
+rspamd_mmaped_file_set_bucket_value (rspamd_mempool_t *pool,
+		rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2, double value)
+{
+	struct stat_file_bucket *buckets[2], *bucket = NULL;
+	struct stat_file_header *header;
+	guint i, j, slot = 0;
+	double min = G_MAXDOUBLE;
+
+	header = (struct stat_file_header *)file->map;
+	buckets[0] = rspamd_mmaped_file_bucket (file, h1);
+	buckets[1] = rspamd_mmaped_file_bucket (file, h2);
+
+	/* Existing token */
+	for (j = 0; j < G_N_ELEMENTS (buckets); j ++) {
+		for (i = 0; i < STATFILE_BUCKET_SLOTS; i ++) {
+			if (buckets[j]->hash1[i] == h1 && buckets[j]->hash2[i] == h2) {
+				bucket = buckets[j];
+				slot = i;
+
+				goto write;
+			}
+		}
+	}
+
+	/* Free slot or the slot with the minimum value to expire */
+	for (j = 0; j < G_N_ELEMENTS (buckets); j ++) {
+		for (i = 0; i < STATFILE_BUCKET_SLOTS; i ++) {
+			if (buckets[j]->hash1[i] == 0 && buckets[j]->hash2[i] == 0) {
+				bucket = buckets[j];
+				slot = i;
+				header->used_blocks++;
+
+				goto write;
+			}
+
+			if (buckets[j]->value[i] < min) {
+				bucket = buckets[j];
+				slot = i;
+				min = buckets[j]->value[i];
+			}
+		}
+	}
+
+	msg_debug_pool ("%s: buckets of token %ud:%ud are full, expire token "
+			"with value %.2f", file->filename, h1, h2, min);
+
+write:
+	/*
+	 * Scanners read buckets without locking, so the sequence of a bucket
+	 * is odd while its slot is rewritten
+	 */
+	g_atomic_int_inc ((gint *)&bucket->seq);
+	STATFILE_BARRIER ();
+	bucket->hash1[slot] = h1;
+	bucket->hash2[slot] = h2;
+	bucket->value[slot] = value;
+	STATFILE_BARRIER ();
+	g_atomic_int_inc ((gint *)&bucket->seq);
+}
+
+static inline void
+rspamd_mmaped_file_prefetch_token (rspamd_mmaped_file_t *file,
+		rspamd_token_t *tok)
+{
+	guint32 h1, h2;
+
+	memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
+	memcpy (&h2, ((guchar *)&tok->data) + sizeof (h1), sizeof (h2));
+	STATFILE_PREFETCH (rspamd_mmaped_file_bucket (file, h1));
+	STATFILE_PREFETCH (rspamd_mmaped_file_bucket (file, h2));
+}
+
 double
 rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
 	guint32 h1,
@@ -112,6 +287,10 @@ rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
 		return 0;
 	}
 
+	if (file->bucketed) {
+		return rspamd_mmaped_file_get_bucket_value (file, h1, h2);
+	}
+
 	blocknum = h1 % file->cur_section.length;
 	c = (u_char *) file->map + file->seek_pos + blocknum *
 		sizeof (struct stat_file_block);
@@ -147,6 +326,11 @@ rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 		return;
 	}
 
+	if (file->bucketed) {
+		rspamd_mmaped_file_set_bucket_value (pool, file, h1, h2, value);
+		return;
+	}
+
 	blocknum = h1 % file->cur_section.length;
 	header = (struct stat_file_header *)file->map;
 	c = (u_char *) file->map + file->seek_pos + blocknum *
@@ -322,6 +506,10 @@ rspamd_mmaped_file_get_total (rspamd_mmaped_file_t *file)
 	/* If total blocks is 0 we have old version of header, so set total blocks correctly */
 	if (header->total_blocks == 0) {
 		header->total_blocks = file->cur_section.length;
+
+		if (file->bucketed) {
+			header->total_blocks *= STATFILE_BUCKET_SLOTS;
+		}
 	}
 
 	return header->total_blocks;
@@ -333,7 +521,9 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 {
 	struct stat_file *f;
 	gchar *c;
-	static gchar valid_version[] = RSPAMD_STATFILE_VERSION;
+	static gchar valid_version[] = RSPAMD_STATFILE_VERSION,
+			buckets_version[] = RSPAMD_STATFILE_VERSION_BUCKETS;
+	gsize unit;
 
 
 	if (!file || !file->map) {
@@ -360,6 +550,9 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	if (*c == 1 && *(c + 1) == 0) {
 		return -1;
 	}
+	else if (memcmp (c, buckets_version, sizeof (buckets_version)) == 0) {
+		file->bucketed = TRUE;
+	}
 	else if (memcmp (c, valid_version, sizeof (valid_version)) != 0) {
 		/* Unknown version */
 		msg_info_pool ("file %s has invalid version %c.%c",
@@ -372,21 +565,70 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	/* Check first section and set new offset */
 	file->cur_section.code = f->section.code;
 	file->cur_section.length = f->section.length;
-	if (file->cur_section.length * sizeof (struct stat_file_block) >
-		file->len) {
-		msg_info_pool ("file %s is truncated: %z, must be %z",
+
+	if (file->bucketed) {
+		unit = sizeof (struct stat_file_bucket);
+		file->seek_pos = STATFILE_BUCKETS_OFFSET;
+	}
+	else {
+		unit = sizeof (struct stat_file_block);
+		file->seek_pos = sizeof (struct stat_file) -
+				sizeof (struct stat_file_block);
+	}
+
+	/* Section length comes from the file, so it must not overflow */
+	if (file->cur_section.length == 0 || file->len < (gsize)file->seek_pos ||
+			file->cur_section.length > (file->len - file->seek_pos) / unit) {
+		msg_info_pool ("file %s is truncated: %z, has %uL blocks",
 			file->filename,
 			file->len,
-			file->cur_section.length * sizeof (struct stat_file_block));
+			file->cur_section.length);
 		return -1;
 	}
-	file->seek_pos = sizeof (struct stat_file) -
-		sizeof (struct stat_file_block);
 
 	return 0;
 }
 
 
+static void
+rspamd_mmaped_file_copy_blocks (rspamd_mempool_t *pool,
+		rspamd_mmaped_file_t *old,
+		rspamd_mmaped_file_t *new)
+{
+	struct stat_file_block *block;
+	struct stat_file_bucket *bucket;
+	guint64 i;
+	guint j;
+
+	if (old->bucketed) {
+		bucket = (struct stat_file_bucket *)((u_char *)old->map + old->seek_pos);
+
+		for (i = 0; i < old->cur_section.length; i ++, bucket ++) {
+			for (j = 0; j < STATFILE_BUCKET_SLOTS; j ++) {
+				if (bucket->hash1[j] != 0 && bucket->value[j] != 0) {
+					rspamd_mmaped_file_set_block_common (pool, new,
+							bucket->hash1[j], bucket->hash2[j],
+							bucket->value[j]);
+				}
+			}
+		}
+	}
+	else {
+		block = (struct stat_file_block *)((u_char *)old->map + old->seek_pos);
+
+		for (i = 0; i < old->cur_section.length; i ++, block ++) {
+			if (block->hash1 != 0 && block->value != 0) {
+				rspamd_mmaped_file_set_block_common (pool, new,
+						block->hash1, block->hash2, block->value);
+			}
+		}
+	}
+}
+
+/*
+ * Builds the resized file aside and renames it over the old one, so the
+ * processes that have the old file mapped keep reading it until reopen
+ */
 static rspamd_mmaped_file_t *
 rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 		const gchar *filename,
@@ -394,20 +636,17 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 		size_t size,
 		struct rspamd_statfile_config *stcf)
 {
-	gchar *backup, *lock;
-	gint fd, lock_fd;
+	gchar *tmp, *lock;
+	gint lock_fd;
 	rspamd_mmaped_file_t *new, *old = NULL;
-	u_char *map, *pos;
-	struct stat_file_block *block;
 	struct stat_file_header *header, *nh;
+	struct stat st;
 	struct timespec sleep_ts = {
 			.tv_sec = 0,
 			.tv_nsec = 1000000
 	};
 
-	if (size <
-		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
-		sizeof (block)) {
+	if (size < STATFILE_BUCKETS_OFFSET + sizeof (struct stat_file_bucket)) {
 		msg_err_pool ("file %s is too small to carry any statistic: %z",
 			filename,
 			size);
@@ -432,98 +671,71 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 		}
 	}
 
-	backup = g_strconcat (filename, ".old", NULL);
-	if (rename (filename, backup) == -1) {
-		msg_err_pool ("cannot rename %s to %s: %s", filename, backup, strerror (
-				errno));
-		g_free (backup);
-		unlink (lock);
-		g_free (lock);
-		close (lock_fd);
-
-		return NULL;
-	}
-
-	old = rspamd_mmaped_file_open (pool, backup, old_size, stcf);
+	old = rspamd_mmaped_file_map (pool, filename, old_size, stcf);
 
 	if (old == NULL) {
-		msg_warn_pool ("old file %s is invalid mmapped file, just move it",
-				backup);
+		msg_warn_pool ("old file %s is invalid mmapped file, recreate it",
+				filename);
 	}
 
-	/* We need to release our lock here */
-	unlink (lock);
-	close (lock_fd);
-	g_free (lock);
-
-	/* Now create new file with required size */
-	if (rspamd_mmaped_file_create (filename, size, stcf, pool) != 0) {
-		msg_err_pool ("cannot create new file");
-		rspamd_mmaped_file_close (old);
-		g_free (backup);
+	tmp = g_strconcat (filename, ".new", NULL);
+	new = NULL;
 
-		return NULL;
+	if (rspamd_mmaped_file_create (tmp, size, stcf, pool) != 0 ||
+			stat (tmp, &st) == -1 ||
+			(new = rspamd_mmaped_file_map (pool, tmp, st.st_size, stcf)) == NULL) {
+		msg_err_pool ("cannot create new file %s", tmp);
+		goto err;
 	}
 
-	new = rspamd_mmaped_file_open (pool, filename, size, stcf);
-
 	if (old) {
-		/* Now open new file and start copying */
-		fd = open (backup, O_RDONLY);
-		if (fd == -1 || new == NULL) {
-			if (fd != -1) {
-				close (fd);
-			}
+		rspamd_mmaped_file_copy_blocks (pool, old, new);
 
-			msg_err_pool ("cannot open file: %s", strerror (errno));
-			rspamd_mmaped_file_close (old);
-			g_free (backup);
-			return NULL;
-		}
-
-
-
-		/* Now start reading blocks from old statfile */
-		if ((map =
-				mmap (NULL, old_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
-			msg_err_pool ("cannot mmap file: %s", strerror (errno));
-			close (fd);
-			rspamd_mmaped_file_close (old);
-			g_free (backup);
-			return NULL;
-		}
-
-		pos = map + (sizeof (struct stat_file) - sizeof (struct stat_file_block));
-
-		if (pos - map < (gssize)old_size) {
-			while ((gssize)old_size - (pos - map) >= (gssize)sizeof (struct stat_file_block)) {
-				block = (struct stat_file_block *)pos;
-				if (block->hash1 != 0 && block->value != 0) {
-					rspamd_mmaped_file_set_block_common (pool,
-							new, block->hash1,
-							block->hash2, block->value);
-				}
-				pos += sizeof (block);
-			}
-		}
-
-		header = (struct stat_file_header *)map;
+		header = (struct stat_file_header *)old->map;
 		rspamd_mmaped_file_set_revision (new, header->revision, header->rev_time);
 		nh = new->map;
 		/* Copy tokenizer configuration */
 		memcpy (nh->unused, header->unused, sizeof (header->unused));
 		nh->tokenizer_conf_len = header->tokenizer_conf_len;
+	}
 
-		munmap (map, old_size);
-		close (fd);
+	msync (new->map, new->len, MS_SYNC);
+
+	if (rename (tmp, filename) == -1) {
+		msg_err_pool ("cannot rename %s to %s: %s", tmp, filename,
+				strerror (errno));
+		goto err;
+	}
+
+	rspamd_strlcpy (new->filename, filename, sizeof (new->filename));
+
+	if (old) {
 		rspamd_mmaped_file_close_file (pool, old);
 	}
 
-	unlink (backup);
-	g_free (backup);
+	unlink (lock);
+	close (lock_fd);
+	g_free (lock);
+	g_free (tmp);
 
 	return new;
 
+err:
+	if (new) {
+		rspamd_mmaped_file_close_file (pool, new);
+	}
+
+	if (old) {
+		rspamd_mmaped_file_close_file (pool, old);
+	}
+
+	unlink (tmp);
+	unlink (lock);
+	close (lock_fd);
+	g_free (lock);
+	g_free (tmp);
+
+	return NULL;
 }
 
 /*
@@ -563,7 +775,6 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 		struct rspamd_statfile_config *stcf)
 {
 	struct stat st;
-	rspamd_mmaped_file_t *new_file;
 	gchar *lock;
 	gint lock_fd;
 
@@ -597,6 +808,16 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 			size);
 	}
 
+	return rspamd_mmaped_file_map (pool, filename, st.st_size, stcf);
+}
+
+static rspamd_mmaped_file_t *
+rspamd_mmaped_file_map (rspamd_mempool_t *pool,
+		const gchar *filename, size_t size,
+		struct rspamd_statfile_config *stcf)
+{
+	rspamd_mmaped_file_t *new_file;
+
 	new_file = g_malloc0 (sizeof (rspamd_mmaped_file_t));
 	if ((new_file->fd = open (filename, O_RDWR)) == -1) {
 		msg_info_pool ("cannot open file %s, error %d, %s",
@@ -608,7 +829,7 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 	}
 
 	if ((new_file->map =
-		mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
 		new_file->fd, 0)) == MAP_FAILED) {
 		close (new_file->fd);
 		msg_info_pool ("cannot mmap file %s, error %d, %s",
@@ -621,13 +842,13 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 	}
 
 	rspamd_strlcpy (new_file->filename, filename, sizeof (new_file->filename));
-	new_file->len = st.st_size;
+	new_file->len = size;
 	/* Try to lock pages in RAM */
 
 	/* Acquire lock for this operation */
 	if (!rspamd_file_lock (new_file->fd, FALSE)) {
 		close (new_file->fd);
-		munmap (new_file->map, st.st_size);
+		munmap (new_file->map, size);
 		msg_info_pool ("cannot lock file %s, error %d, %s",
 				filename,
 				errno,
@@ -639,7 +860,7 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 	if (rspamd_mmaped_file_check (pool, new_file) == -1) {
 		close (new_file->fd);
 		rspamd_file_unlock (new_file->fd, FALSE);
-		munmap (new_file->map, st.st_size);
+		munmap (new_file->map, size);
 		g_free (new_file);
 		return NULL;
 	}
@@ -682,7 +903,7 @@ rspamd_mmaped_file_create (const gchar *filename,
 {
 	struct stat_file_header header = {
 		.magic = {'r', 's', 'd'},
-		.version = RSPAMD_STATFILE_VERSION,
+		.version = RSPAMD_STATFILE_VERSION_BUCKETS,
 		.padding = {0, 0, 0},
 		.revision = 0,
 		.rev_time = 0,
@@ -691,11 +912,12 @@ rspamd_mmaped_file_create (const gchar *filename,
 	struct stat_file_section section = {
 		.code = STATFILE_SECTION_COMMON,
 	};
-	struct stat_file_block block = { 0, 0, 0 };
+	struct stat_file_bucket bucket;
 	struct rspamd_stat_tokenizer *tokenizer;
 	gint fd, lock_fd;
 	guint buflen = 0, nblocks;
 	gchar *buf = NULL, *lock;
+	gchar pad[STATFILE_BUCKETS_OFFSET - sizeof (header) - sizeof (section)];
 	struct stat sb;
 	gpointer tok_conf;
 	gsize tok_conf_len;
@@ -704,15 +926,16 @@ rspamd_mmaped_file_create (const gchar *filename,
 			.tv_nsec = 1000000
 	};
 
-	if (size <
-		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
-		sizeof (block)) {
+	if (size < STATFILE_BUCKETS_OFFSET + sizeof (bucket)) {
 		msg_err_pool ("file %s is too small to carry any statistic: %z",
 			filename,
 			size);
 		return -1;
 	}
 
+	memset (&bucket, 0, sizeof (bucket));
+	memset (pad, 0, sizeof (pad));
+
 	lock = g_strconcat (filename, ".lock", NULL);
 	lock_fd = open (lock, O_WRONLY|O_CREAT|O_EXCL, 00600);
 
@@ -740,10 +963,8 @@ rspamd_mmaped_file_create (const gchar *filename,
 create:
 
 	msg_debug_pool ("create statfile %s of size %l", filename, (long)size);
-	nblocks =
-		(size - sizeof (struct stat_file_header) -
-		sizeof (struct stat_file_section)) / sizeof (struct stat_file_block);
-	header.total_blocks = nblocks;
+	nblocks = (size - STATFILE_BUCKETS_OFFSET) / sizeof (struct stat_file_bucket);
+	header.total_blocks = (guint64)nblocks * STATFILE_BUCKET_SLOTS;
 
 	if ((fd =
 		open (filename, O_RDWR | O_TRUNC | O_CREAT, S_IWUSR | S_IRUSR)) == -1) {
@@ -760,7 +981,7 @@ create:
 
 	rspamd_fallocate (fd,
 		0,
-		sizeof (header) + sizeof (section) + sizeof (block) * nblocks);
+		STATFILE_BUCKETS_OFFSET + sizeof (bucket) * nblocks);
 
 	header.create_time = (guint64) time (NULL);
 	g_assert (stcf->clcf != NULL);
@@ -786,7 +1007,8 @@ create:
 	}
 
 	section.length = (guint64) nblocks;
-	if (write (fd, &section, sizeof (section)) == -1) {
+	if (write (fd, &section, sizeof (section)) == -1 ||
+			write (fd, pad, sizeof (pad)) == -1) {
 		msg_info_pool ("cannot write section header to file %s, error %d, %s",
 			filename,
 			errno,
@@ -799,9 +1021,9 @@ create:
 		return -1;
 	}
 
-	/* Buffer for write 256 blocks at once */
+	/* Buffer for write 256 buckets at once */
 	if (nblocks > 256) {
-		buflen = sizeof (block) * 256;
+		buflen = sizeof (bucket) * 256;
 		buf = g_malloc0 (buflen);
 	}
 
@@ -824,7 +1046,7 @@ create:
 			nblocks -= 256;
 		}
 		else {
-			if (write (fd, &block, sizeof (block)) == -1) {
+			if (write (fd, &bucket, sizeof (bucket)) == -1) {
 				msg_info_pool ("cannot write block to file %s, error %d, %s",
 					filename,
 					errno,
@@ -949,35 +1171,71 @@ rspamd_mmaped_file_runtime (struct rspamd_task *task,
 }
 
 gboolean
-rspamd_mmaped_file_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
-		gint id,
-		gpointer p)
+rspamd_mmaped_file_process_tokens_batch (struct rspamd_task *task,
+		GPtrArray *tokens, const gint *ids, gpointer *runtimes, guint nrt)
 {
-	rspamd_mmaped_file_t *mf = p;
+	rspamd_mmaped_file_t *mf;
 	guint32 h1, h2;
 	rspamd_token_t *tok;
-	guint i;
+	guint i, j;
 
 	g_assert (tokens != NULL);
-	g_assert (p != NULL);
+	g_assert (runtimes != NULL);
+
+	/* Start loading cache lines of the first tokens */
+	for (j = 0; j < nrt; j++) {
+		mf = runtimes[j];
+
+		if (mf->bucketed && mf->map) {
+			for (i = 0; i < MIN (tokens->len, STATFILE_PREFETCH_DISTANCE); i++) {
+				rspamd_mmaped_file_prefetch_token (mf,
+						g_ptr_array_index (tokens, i));
+			}
+		}
+	}
 
 	for (i = 0; i < tokens->len; i++) {
 		tok = g_ptr_array_index (tokens, i);
 		memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
 		memcpy (&h2, ((guchar *)&tok->data) + sizeof (h1), sizeof (h2));
-		tok->values[id] = rspamd_mmaped_file_get_block (mf, h1, h2);
-	}
 
-	if (mf->cf->is_spam) {
-		task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+		for (j = 0; j < nrt; j++) {
+			mf = runtimes[j];
+
+			if (mf->bucketed && mf->map &&
+					i + STATFILE_PREFETCH_DISTANCE < tokens->len) {
+				rspamd_mmaped_file_prefetch_token (mf,
+						g_ptr_array_index (tokens, i + STATFILE_PREFETCH_DISTANCE));
+			}
+
+			tok->values[ids[j]] = rspamd_mmaped_file_get_block (mf, h1, h2);
+		}
 	}
-	else {
-		task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+
+	for (j = 0; j < nrt; j++) {
+		mf = runtimes[j];
+
+		if (mf->cf->is_spam) {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+		}
+		else {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+		}
 	}
 
 	return TRUE;
 }
 
+gboolean
+rspamd_mmaped_file_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
+		gint id,
+		gpointer p)
+{
+	g_assert (p != NULL);
+
+	return rspamd_mmaped_file_process_tokens_batch (task, tokens, &id, &p, 1);
+}
+
 gboolean
 rspamd_mmaped_file_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		gint id,
@@ -19,6 +19,9 @@
 #include "upstream.h"
 #include "lua/lua_common.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libcryptobox/cryptobox.h"
+#include "libutil/hash.h"
+#include "libserver/redis_pool.h"
 
 #ifdef WITH_HIREDIS
 #include "hiredis.h"
@@ -40,6 +43,8 @@ INIT_LOG_MODULE(stat_redis)
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
+#define REDIS_DEFAULT_TOKEN_CACHE_TTL 60
+#define REDIS_DEFAULT_TOKEN_CACHE_LEARNS 100
 
 struct redis_stat_ctx {
 	lua_State *L;
@@ -54,8 +59,18 @@ struct redis_stat_ctx {
 	gboolean store_tokens;
 	gboolean new_schema;
 	gboolean enable_signatures;
+	gboolean use_scripts;
 	guint expiry;
 	gint cbref_user;
+	/* Per worker cache of token values, NULL if disabled */
+	rspamd_lru_hash_t *token_cache;
+	guint token_cache_ttl;
+	guint token_cache_learns;
+};
+
+struct rspamd_redis_cached_token {
+	guint64 learned;
+	gfloat value;
 };
 
 enum rspamd_redis_connection_state {
@@ -73,6 +88,9 @@ struct redis_stat_runtime {
 	ev_timer timeout_event;
 	GArray *results;
 	GPtrArray *tokens;
+	/* Tokens requested from redis, tokens not found in the token cache */
+	GPtrArray *query_tokens;
+	guint64 cache_seed;
 	struct rspamd_statfile_config *stcf;
 	gchar *redis_object_expanded;
 	redisAsyncContext *redis;
@@ -80,6 +98,11 @@ struct redis_stat_runtime {
 	gint id;
 	gboolean has_event;
 	GError *err;
+	/* Arguments of the script call to resend it on NOSCRIPT */
+	rspamd_fstring_t *script_args;
+	guint script_nargs;
+	const gchar *script;
+	const gchar *script_sha;
 };
 
 /* Used to get statistics from redis */
@@ -107,6 +130,48 @@ struct rspamd_redis_stat_cbdata {
 
 static const gchar *M = "redis statistics";
 
+/*
+ * KEYS[1]: prefix, KEYS[2..]: token keys for the new schema,
+ * ARGV[1]: hash field ('' for the old schema),
+ * ARGV[2..]: token names for the old schema
+ */
+static const gchar *redis_classify_script =
+	"local field = ARGV[1]\n"
+	"local res = {}\n"
+	"if field == '' then\n"
+	"  for i = 2, #ARGV do res[i - 1] = redis.call('HGET', KEYS[1], ARGV[i]) end\n"
+	"else\n"
+	"  for i = 2, #KEYS do res[i - 1] = redis.call('HGET', KEYS[i], field) end\n"
+	"end\n"
+	"return res\n";
+
+/*
+ * KEYS[1]: prefix, KEYS[2..]: token keys for the new schema,
+ * ARGV[1]: hash field ('' for the old schema), ARGV[2]: increment command,
+ * ARGV[3]: learns key, ARGV[4]: learns increment, ARGV[5]: expiry,
+ * ARGV[6..]: values for the new schema or token and value pairs for the old one
+ */
+static const gchar *redis_learn_script =
+	"local field, cmd, expiry = ARGV[1], ARGV[2], tonumber(ARGV[5])\n"
+	"local n = 0\n"
+	"if field == '' then\n"
+	"  for i = 6, #ARGV, 2 do\n"
+	"    redis.call(cmd, KEYS[1], ARGV[i], ARGV[i + 1])\n"
+	"    n = n + 1\n"
+	"  end\n"
+	"else\n"
+	"  for i = 2, #KEYS do\n"
+	"    redis.call(cmd, KEYS[i], field, ARGV[i + 4])\n"
+	"    if expiry > 0 then redis.call('EXPIRE', KEYS[i], expiry) end\n"
+	"  end\n"
+	"  n = #KEYS - 1\n"
+	"end\n"
+	"redis.call('HINCRBY', KEYS[1], ARGV[3], ARGV[4])\n"
+	"return n\n";
+
+static gchar redis_classify_script_sha[RSPAMD_REDIS_SCRIPT_SHA_LEN];
+static gchar redis_learn_script_sha[RSPAMD_REDIS_SCRIPT_SHA_LEN];
+
 static GQuark
 rspamd_redis_stat_quark (void)
 {
@@ -635,6 +700,246 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 #pragma GCC diagnostic pop
 #endif
 
+static void
+rspamd_redis_script_arg (rspamd_fstring_t **out, const void *data, gsize len)
+{
+	rspamd_printf_fstring (out, "$%d\r\n", (gint)len);
+	*out = rspamd_fstring_append (*out, data, len);
+	*out = rspamd_fstring_append (*out, "\r\n", 2);
+}
+
+/*
+ * Token keys of the new schema are passed as KEYS, so the script touches
+ * only the declared keys; the old schema uses a single hash at the prefix
+ */
+static void
+rspamd_redis_script_prepare (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		GPtrArray *tokens,
+		gboolean learn,
+		gint idx,
+		gboolean intvals,
+		const gchar *learned_key,
+		gint learns_inc)
+{
+	rspamd_fstring_t *args;
+	rspamd_token_t *tok;
+	const gchar *prefix = rt->redis_object_expanded, *field;
+	gchar n0[64], n1[64];
+	gint l0, l1, prefix_len = strlen (prefix);
+	guint i, nkeys, nargs;
+	gboolean new_schema = rt->ctx->new_schema;
+
+	field = new_schema ? (rt->stcf->is_spam ? "S" : "H") : "";
+	nkeys = new_schema ? tokens->len + 1 : 1;
+	args = rspamd_fstring_sized_new (tokens->len * (prefix_len + 48) + 128);
+
+	l0 = rspamd_snprintf (n0, sizeof (n0), "%ud", nkeys);
+	rspamd_redis_script_arg (&args, n0, l0);
+	rspamd_redis_script_arg (&args, prefix, prefix_len);
+
+	if (new_schema) {
+		PTR_ARRAY_FOREACH (tokens, i, tok) {
+			l0 = rspamd_snprintf (n0, sizeof (n0), "%uL", tok->data);
+			rspamd_printf_fstring (&args, "$%d\r\n%*s_%*s\r\n",
+					prefix_len + 1 + l0, prefix_len, prefix, l0, n0);
+		}
+	}
+
+	rspamd_redis_script_arg (&args, field, strlen (field));
+	nargs = nkeys + 2;
+
+	if (learn) {
+		if (intvals) {
+			rspamd_redis_script_arg (&args, "HINCRBY", sizeof ("HINCRBY") - 1);
+		}
+		else {
+			rspamd_redis_script_arg (&args, "HINCRBYFLOAT",
+					sizeof ("HINCRBYFLOAT") - 1);
+		}
+
+		rspamd_redis_script_arg (&args, learned_key, strlen (learned_key));
+		rspamd_redis_script_arg (&args, n0,
+				rspamd_snprintf (n0, sizeof (n0), "%d", learns_inc));
+		rspamd_redis_script_arg (&args, n0,
+				rspamd_snprintf (n0, sizeof (n0), "%ud", rt->ctx->expiry));
+		nargs += 4;
+
+		PTR_ARRAY_FOREACH (tokens, i, tok) {
+			if (intvals) {
+				l1 = rspamd_snprintf (n1, sizeof (n1), "%L",
+						(gint64) tok->values[idx]);
+			}
+			else {
+				l1 = rspamd_snprintf (n1, sizeof (n1), "%f",
+						tok->values[idx]);
+			}
+
+			if (!new_schema) {
+				l0 = rspamd_snprintf (n0, sizeof (n0), "%uL", tok->data);
+				rspamd_redis_script_arg (&args, n0, l0);
+				nargs ++;
+			}
+
+			rspamd_redis_script_arg (&args, n1, l1);
+			nargs ++;
+		}
+
+		rt->script = redis_learn_script;
+		rt->script_sha = redis_learn_script_sha;
+	}
+	else {
+		if (!new_schema) {
+			PTR_ARRAY_FOREACH (tokens, i, tok) {
+				l0 = rspamd_snprintf (n0, sizeof (n0), "%uL", tok->data);
+				rspamd_redis_script_arg (&args, n0, l0);
+				nargs ++;
+			}
+		}
+
+		rt->script = redis_classify_script;
+		rt->script_sha = redis_classify_script_sha;
+	}
+
+	rt->script_nargs = nargs;
+	rt->script_args = args;
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)rspamd_fstring_free, args);
+}
+
+/*
+ * Calls the prepared script by its digest or, if Redis has not seen it yet,
+ * by its body
+ */
+static gint
+rspamd_redis_script_call (struct redis_stat_runtime *rt,
+		gboolean by_sha, redisCallbackFn *cb)
+{
+	rspamd_fstring_t *out;
+	gint ret;
+
+	out = rspamd_fstring_sized_new (rt->script_args->len + 128);
+
+	if (by_sha) {
+		rspamd_printf_fstring (&out, "*%d\r\n$7\r\nEVALSHA\r\n",
+				rt->script_nargs + 2);
+		rspamd_redis_script_arg (&out, rt->script_sha, strlen (rt->script_sha));
+	}
+	else {
+		rspamd_printf_fstring (&out, "*%d\r\n$4\r\nEVAL\r\n",
+				rt->script_nargs + 2);
+		rspamd_redis_script_arg (&out, rt->script, strlen (rt->script));
+	}
+
+	out = rspamd_fstring_append (out, rt->script_args->str,
+			rt->script_args->len);
+	ret = redisAsyncFormattedCommand (rt->redis, cb, rt, out->str, out->len);
+	rspamd_fstring_free (out);
+
+	return ret;
+}
+
+/* Resends the script by its body if Redis replied with NOSCRIPT */
+static gboolean
+rspamd_redis_script_retry (struct redis_stat_runtime *rt, redisReply *reply,
+		redisCallbackFn *cb)
+{
+	if (rt->script_args == NULL || reply->type != REDIS_REPLY_ERROR ||
+			reply->str == NULL || strncmp (reply->str, "NOSCRIPT", 8) != 0) {
+		return FALSE;
+	}
+
+	return rspamd_redis_script_call (rt, FALSE, cb) == REDIS_OK;
+}
+
+/* Workers cache tokens of all statfiles, so keys depend on the statfile */
+static inline guint64
+rspamd_redis_token_cache_key (struct redis_stat_runtime *rt,
+		rspamd_token_t *tok)
+{
+	return rspamd_cryptobox_fast_hash (&tok->data, sizeof (tok->data),
+			rt->cache_seed);
+}
+
+/*
+ * Resolves tokens from the token cache, returns tokens to be requested,
+ * `found` is set to the number of cached tokens known to redis
+ */
+static GPtrArray *
+rspamd_redis_token_cache_lookup (struct rspamd_task *task,
+		struct redis_stat_runtime *rt, guint *found)
+{
+	struct redis_stat_ctx *ctx = rt->ctx;
+	struct rspamd_redis_cached_token *cached;
+	GPtrArray *misses;
+	rspamd_token_t *tok;
+	time_t now = ev_now (task->event_loop);
+	guint64 key, hits = 0;
+	guint i;
+
+	*found = 0;
+	misses = g_ptr_array_sized_new (rt->tokens->len);
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard, misses);
+
+	PTR_ARRAY_FOREACH (rt->tokens, i, tok) {
+		key = rspamd_redis_token_cache_key (rt, tok);
+		cached = rspamd_lru_hash_lookup (ctx->token_cache, &key, now);
+
+		/* Values are stale if too many messages have been learned since */
+		if (cached && cached->learned <= rt->learned &&
+				rt->learned - cached->learned <= ctx->token_cache_learns) {
+			tok->values[rt->id] = cached->value;
+			hits ++;
+
+			/* Tokens missing in redis are cached as zero values */
+			if (cached->value != 0) {
+				(*found) ++;
+			}
+		}
+		else {
+			g_ptr_array_add (misses, tok);
+		}
+	}
+
+	/* Counters are shared, so the controller can show them */
+	if (ctx->stcf->shared_stat) {
+#ifndef HAVE_ATOMIC_BUILTINS
+		ctx->stcf->shared_stat->cache_hits += hits;
+		ctx->stcf->shared_stat->cache_misses += misses->len;
+#else
+		__atomic_add_fetch (&ctx->stcf->shared_stat->cache_hits,
+				hits, __ATOMIC_RELEASE);
+		__atomic_add_fetch (&ctx->stcf->shared_stat->cache_misses,
+				(guint64)misses->len, __ATOMIC_RELEASE);
+#endif
+	}
+
+	msg_debug_stat_redis ("%ud of %ud tokens for %s are found in cache",
+			rt->tokens->len - misses->len, rt->tokens->len,
+			rt->redis_object_expanded);
+
+	return misses;
+}
+
+static void
+rspamd_redis_token_cache_insert (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		rspamd_token_t *tok)
+{
+	struct rspamd_redis_cached_token *cached;
+	guint64 *key;
+
+	key = g_malloc (sizeof (*key));
+	*key = rspamd_redis_token_cache_key (rt, tok);
+	cached = g_malloc (sizeof (*cached));
+	cached->learned = rt->learned;
+	cached->value = tok->values[rt->id];
+
+	rspamd_lru_hash_insert (rt->ctx->token_cache, key, cached,
+			ev_now (task->event_loop), rt->ctx->token_cache_ttl);
+}
+
 static void
 rspamd_redis_store_stat_signature (struct rspamd_task *task,
 		struct redis_stat_runtime *rt,
@@ -1166,11 +1471,16 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	if (c->err == 0 && rt->has_event) {
 		if (r != NULL) {
+			if (rspamd_redis_script_retry (rt, reply, rspamd_redis_processed)) {
+				/* Wait for the reply of the script sent by body */
+				return;
+			}
+
 			if (reply->type == REDIS_REPLY_ARRAY) {
 
-				if (reply->elements == task->tokens->len) {
+				if (reply->elements == rt->query_tokens->len) {
 					for (i = 0; i < reply->elements; i ++) {
-						tok = g_ptr_array_index (task->tokens, i);
+						tok = g_ptr_array_index (rt->query_tokens, i);
 						elt = reply->element[i];
 
 						if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
@@ -1194,6 +1504,10 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 							tok->values[rt->id] = 0;
 						}
 
+						if (rt->ctx->token_cache) {
+							rspamd_redis_token_cache_insert (task, rt, tok);
+						}
+
 						processed ++;
 					}
 
@@ -1208,7 +1522,7 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 					msg_err_task_check ("got invalid length of reply vector from redis: "
 										"%d, expected: %d",
 							(gint)reply->elements,
-							(gint)task->tokens->len);
+							(gint)rt->query_tokens->len);
 				}
 			}
 			else {
@@ -1310,25 +1624,56 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 			}
 
 			if (rt->learned >= rt->stcf->clcf->min_learns && rt->learned > 0) {
-				rspamd_fstring_t *query = rspamd_redis_tokens_to_query (
-						task,
-						rt,
-						rt->tokens,
-						rt->ctx->new_schema ? "HGET" : "HMGET",
-						rt->redis_object_expanded, FALSE, -1,
-						rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
-				g_assert (query != NULL);
-				rspamd_mempool_add_destructor (task->task_pool,
-						(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
-
-				int ret = redisAsyncFormattedCommand (rt->redis,
-						rspamd_redis_processed, rt,
-						query->str, query->len);
+				int ret;
+				guint cache_found = 0;
+
+				rt->query_tokens = rt->tokens;
+
+				if (rt->ctx->token_cache) {
+					rt->query_tokens = rspamd_redis_token_cache_lookup (task, rt,
+							&cache_found);
+				}
+
+				if (rt->query_tokens->len == 0) {
+					/* All tokens are resolved from the cache */
+					if (cache_found > 0) {
+						if (rt->stcf->is_spam) {
+							task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+						}
+						else {
+							task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+						}
+					}
+
+					ret = REDIS_OK;
+				}
+				else if (rt->ctx->use_scripts) {
+					rspamd_redis_script_prepare (task, rt, rt->query_tokens, FALSE,
+							-1, FALSE, NULL, 0);
+					ret = rspamd_redis_script_call (rt, TRUE,
+							rspamd_redis_processed);
+				}
+				else {
+					rspamd_fstring_t *query = rspamd_redis_tokens_to_query (
+							task,
+							rt,
+							rt->query_tokens,
+							rt->ctx->new_schema ? "HGET" : "HMGET",
+							rt->redis_object_expanded, FALSE, -1,
+							rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+					g_assert (query != NULL);
+					rspamd_mempool_add_destructor (task->task_pool,
+							(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
+
+					ret = redisAsyncFormattedCommand (rt->redis,
+							rspamd_redis_processed, rt,
+							query->str, query->len);
+				}
 
 				if (ret != REDIS_OK) {
 					msg_err_task ("call to redis failed: %s", rt->redis->errstr);
 				}
-				else {
+				else if (rt->query_tokens->len > 0) {
 					/* Further is handled by rspamd_redis_processed */
 					final = FALSE;
 					/* Restart timeout */
@@ -1375,12 +1720,26 @@ static void
 rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	redisReply *reply = r;
 	struct rspamd_task *task;
 
 	task = rt->task;
 
+	if (c->err == 0 && reply != NULL && rt->has_event &&
+			rspamd_redis_script_retry (rt, reply, rspamd_redis_learned)) {
+		/* Wait for the reply of the script sent by body */
+		return;
+	}
+
 	if (c->err == 0) {
 		rspamd_upstream_ok (rt->selected);
+
+		if (reply != NULL && reply->type == REDIS_REPLY_ERROR && !rt->err) {
+			msg_err_task_check ("cannot learn tokens in %s: %s",
+					rt->redis_object_expanded, reply->str);
+			g_set_error (&rt->err, rspamd_redis_stat_quark (), EINVAL,
+					"cannot learn tokens: %s", reply->str);
+		}
 	}
 	else {
 		msg_err_task_check ("error getting reply from redis server %s: %s",
@@ -1495,6 +1854,48 @@ rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 	else {
 		backend->expiry = 0;
 	}
+
+	elt = ucl_object_lookup (obj, "scripts");
+	if (elt) {
+		backend->use_scripts = ucl_object_toboolean (elt);
+	}
+	else {
+		backend->use_scripts = FALSE;
+	}
+
+	if (backend->use_scripts && backend->store_tokens) {
+		msg_warn_config ("scripts are not compatible with store_tokens, "
+				"use plain commands for redis statistics");
+		backend->use_scripts = FALSE;
+	}
+
+	elt = ucl_object_lookup (obj, "token_cache_size");
+	if (elt && ucl_object_toint (elt) > 0) {
+		backend->token_cache = rspamd_lru_hash_new_full (ucl_object_toint (elt),
+				g_free, g_free, g_int64_hash, g_int64_equal);
+	}
+
+	elt = ucl_object_lookup (obj, "token_cache_ttl");
+	if (elt) {
+		backend->token_cache_ttl = ucl_object_toint (elt);
+	}
+	else {
+		backend->token_cache_ttl = REDIS_DEFAULT_TOKEN_CACHE_TTL;
+	}
+
+	elt = ucl_object_lookup (obj, "token_cache_learns");
+	if (elt) {
+		backend->token_cache_learns = ucl_object_toint (elt);
+	}
+	else {
+		backend->token_cache_learns = REDIS_DEFAULT_TOKEN_CACHE_LEARNS;
+	}
+
+	if (backend->use_scripts && redis_learn_script_sha[0] == '\0') {
+		rspamd_redis_script_sha (redis_classify_script,
+				redis_classify_script_sha);
+		rspamd_redis_script_sha (redis_learn_script, redis_learn_script_sha);
+	}
 }
 
 gpointer
@@ -1664,6 +2065,11 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	rt->ctx = ctx;
 	rt->stcf = stcf;
 	rt->redis_object_expanded = object_expanded;
+	/* Spam and ham statfiles share the prefix with the new schema */
+	rt->cache_seed = rspamd_cryptobox_fast_hash (object_expanded,
+			strlen (object_expanded),
+			rspamd_cryptobox_fast_hash (stcf->symbol, strlen (stcf->symbol),
+					rspamd_hash_seed ()));
 
 	addr = rspamd_upstream_addr_next (up);
 	g_assert (addr != NULL);
@@ -1710,6 +2116,10 @@ rspamd_redis_close (gpointer p)
 		luaL_unref (L, LUA_REGISTRYINDEX, ctx->conf_ref);
 	}
 
+	if (ctx->token_cache) {
+		rspamd_lru_hash_destroy (ctx->token_cache);
+	}
+
 	g_free (ctx);
 }
 
@@ -1807,6 +2217,17 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		}
 	}
 
+	if (rt->ctx->token_cache) {
+		guint64 key;
+		guint i;
+
+		/* Values of these tokens are going to change */
+		PTR_ARRAY_FOREACH (tokens, i, tok) {
+			key = rspamd_redis_token_cache_key (rt, tok);
+			rspamd_lru_hash_remove (rt->ctx->token_cache, &key);
+		}
+	}
+
 	/*
 	 * Add the current key to the set of learned keys
 	 */
@@ -1818,6 +2239,22 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 				rt->redis_object_expanded);
 	}
 
+	rt->id = id;
+
+	if (rt->ctx->use_scripts) {
+		/*
+		 * All increments are done by a single script call, the direction
+		 * of learning is deduced from the first token as below
+		 */
+		tok = g_ptr_array_index (task->tokens, 0);
+		rspamd_redis_script_prepare (task, rt, tokens, TRUE, id,
+				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER,
+				learned_key, tok->values[id] > 0 ? 1 : -1);
+		ret = rspamd_redis_script_call (rt, TRUE, rspamd_redis_learned);
+
+		goto sent;
+	}
+
 	if (rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER) {
 		redis_cmd = "HINCRBY";
 	}
@@ -1825,7 +2262,6 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		redis_cmd = "HINCRBYFLOAT";
 	}
 
-	rt->id = id;
 	query = rspamd_redis_tokens_to_query (task, rt, tokens,
 			redis_cmd, rt->redis_object_expanded, TRUE, id,
 			rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
@@ -1890,6 +2326,7 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	rspamd_mempool_add_destructor (task->task_pool,
 			(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
 
+sent:
 	if (ret == REDIS_OK) {
 
 		/* Add signature if needed */
@@ -1986,7 +2423,9 @@ rspamd_redis_get_stat (gpointer runtime,
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
 	struct rspamd_redis_stat_elt *st;
+	struct rspamd_statfile_shared_stat *shared_stat;
 	redisAsyncContext *redis;
+	guint64 hits, misses;
 
 	if (rt->ctx->stat_elt) {
 		st = rt->ctx->stat_elt->ud;
@@ -1998,6 +2437,30 @@ rspamd_redis_get_stat (gpointer runtime,
 		}
 
 		if (st->stat) {
+			shared_stat = rt->ctx->stcf->shared_stat;
+
+			if (rt->ctx->token_cache && shared_stat) {
+#ifndef HAVE_ATOMIC_BUILTINS
+				hits = shared_stat->cache_hits;
+				misses = shared_stat->cache_misses;
+#else
+				hits = __atomic_load_n (&shared_stat->cache_hits,
+						__ATOMIC_ACQUIRE);
+				misses = __atomic_load_n (&shared_stat->cache_misses,
+						__ATOMIC_ACQUIRE);
+#endif
+				ucl_object_replace_key (st->stat,
+						ucl_object_fromint (hits),
+						"token_cache_hits", 0, false);
+				ucl_object_replace_key (st->stat,
+						ucl_object_fromint (misses),
+						"token_cache_misses", 0, false);
+				ucl_object_replace_key (st->stat,
+						ucl_object_fromdouble (hits + misses > 0 ?
+								(gdouble)hits / (hits + misses) : 0.0),
+						"token_cache_hit_rate", 0, false);
+			}
+
 			return ucl_object_ref (st->stat);
 		}
 	}
@@ -54,7 +54,7 @@ static struct rspamd_stat_tokenizer stat_tokenizers[] = {
 	},
 };
 
-#define RSPAMD_STAT_BACKEND_ELT(nam, eltn) { \
+#define RSPAMD_STAT_BACKEND_FIELDS(nam, eltn) \
 		.name = #nam, \
 		.init = rspamd_##eltn##_init, \
 		.runtime = rspamd_##eltn##_runtime, \
@@ -67,11 +67,19 @@ static struct rspamd_stat_tokenizer stat_tokenizers[] = {
 		.dec_learns = rspamd_##eltn##_dec_learns, \
 		.get_stat = rspamd_##eltn##_get_stat, \
 		.load_tokenizer_config = rspamd_##eltn##_load_tokenizer_config, \
-		.close = rspamd_##eltn##_close \
+		.close = rspamd_##eltn##_close
+
+#define RSPAMD_STAT_BACKEND_ELT(nam, eltn) { \
+		RSPAMD_STAT_BACKEND_FIELDS(nam, eltn) \
+	}
+
+#define RSPAMD_STAT_BACKEND_ELT_BATCH(nam, eltn) { \
+		RSPAMD_STAT_BACKEND_FIELDS(nam, eltn), \
+		.process_tokens_batch = rspamd_##eltn##_process_tokens_batch \
 	}
 
 static struct rspamd_stat_backend stat_backends[] = {
-		RSPAMD_STAT_BACKEND_ELT(mmap, mmaped_file),
+		RSPAMD_STAT_BACKEND_ELT_BATCH(mmap, mmaped_file),
 		RSPAMD_STAT_BACKEND_ELT(sqlite3, sqlite3),
 #ifdef WITH_HIREDIS
 		RSPAMD_STAT_BACKEND_ELT(redis, redis)
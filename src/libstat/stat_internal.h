@@ -118,6 +118,13 @@ struct rspamd_stat_tokenizer *rspamd_stat_get_tokenizer (const gchar *name);
 
 struct rspamd_stat_cache *rspamd_stat_get_cache (const gchar *name);
 
+/*
+ * Resolves tokens of a task for all statfiles, statfiles of the same backend
+ * are resolved in one batch if the backend supports that
+ */
+void rspamd_stat_backends_process (struct rspamd_stat_ctx *st_ctx,
+		struct rspamd_task *task);
+
 struct rspamd_stat_async_elt *rspamd_stat_ctx_register_async (
 		rspamd_stat_async_handler handler, rspamd_stat_async_cleanup cleanup,
 		gpointer d, gdouble timeout);
@@ -235,30 +235,66 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 	}
 }
 
-static void
+void
 rspamd_stat_backends_process (struct rspamd_stat_ctx *st_ctx,
 		struct rspamd_task *task)
 {
-	guint i;
-	struct rspamd_statfile *st;
+	guint i, j, nrt;
+	struct rspamd_statfile *st, *other;
 	struct rspamd_classifier *cl;
-	gpointer bk_run;
+	gpointer bk_run, *runtimes;
+	gint *ids;
+	gboolean *done;
 
 	g_assert (task->stat_runtimes != NULL);
 
+	done = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (*done) * st_ctx->statfiles->len);
+	ids = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*ids) * st_ctx->statfiles->len);
+	runtimes = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*runtimes) * st_ctx->statfiles->len);
+
 	for (i = 0; i < st_ctx->statfiles->len; i++) {
 		st = g_ptr_array_index (st_ctx->statfiles, i);
 		cl = st->classifier;
 
-		if (cl->cfg->flags & RSPAMD_FLAG_CLASSIFIER_NO_BACKEND) {
+		if (done[i] || (cl->cfg->flags & RSPAMD_FLAG_CLASSIFIER_NO_BACKEND)) {
 			continue;
 		}
 
 		bk_run = g_ptr_array_index (task->stat_runtimes, i);
 
-		if (bk_run != NULL) {
+		if (bk_run == NULL) {
+			continue;
+		}
+
+		if (st->backend->process_tokens_batch == NULL) {
 			st->backend->process_tokens (task, task->tokens, i, bk_run);
+			continue;
+		}
+
+		/* Resolve tokens for all statfiles of this backend at once */
+		nrt = 0;
+
+		for (j = i; j < st_ctx->statfiles->len; j++) {
+			other = g_ptr_array_index (st_ctx->statfiles, j);
+
+			if (done[j] || other->backend != st->backend ||
+					(other->classifier->cfg->flags &
+					RSPAMD_FLAG_CLASSIFIER_NO_BACKEND) ||
+					g_ptr_array_index (task->stat_runtimes, j) == NULL) {
+				continue;
+			}
+
+			ids[nrt] = j;
+			runtimes[nrt] = g_ptr_array_index (task->stat_runtimes, j);
+			done[j] = TRUE;
+			nrt ++;
 		}
+
+		st->backend->process_tokens_batch (task, task->tokens, ids, runtimes,
+				nrt);
 	}
 }
 
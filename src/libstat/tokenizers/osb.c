@@ -254,11 +254,81 @@ rspamd_tokenizer_osb_is_compat (struct rspamd_tokenizer_runtime *rt)
 }
 #endif
 
-struct token_pipe_entry {
-	guint64 h;
-	rspamd_stat_token_t *t;
-};
+/* Number of words hashed at once */
+#define OSB_HASH_BATCH 64
+
+static inline guint64
+rspamd_tokenizer_osb_word_hash (struct rspamd_osb_tokenizer_config *osb_cf,
+		rspamd_stat_token_t *token, gboolean is_utf, gboolean has_prefix,
+		guint64 seed)
+{
+	const gchar *begin;
+	gsize len;
+	guint64 cur;
+
+	if (token->flags & RSPAMD_STAT_TOKEN_FLAG_TEXT) {
+		begin = token->stemmed.begin;
+		len = token->stemmed.len;
+	}
+	else {
+		begin = token->original.begin;
+		len = token->original.len;
+	}
+
+	if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
+		rspamd_ftok_t ftok;
+
+		ftok.begin = begin;
+		ftok.len = len;
+		cur = rspamd_fstrhash_lc (&ftok, is_utf);
+	}
+	else if (osb_cf->ht == RSPAMD_OSB_HASH_XXHASH) {
+		/* We know that the words are normalized */
+		cur = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+				begin, len, osb_cf->seed);
+	}
+	else {
+		rspamd_cryptobox_siphash ((guchar *)&cur, begin,
+				len, osb_cf->sk);
+
+		if (has_prefix) {
+			cur ^= seed;
+		}
+	}
 
+	return cur;
+}
+
+static inline void
+rspamd_tokenizer_osb_pair (rspamd_token_t *new_tok, gboolean compat,
+		guint64 h0, rspamd_stat_token_t *t0,
+		guint64 hi, rspamd_stat_token_t *ti,
+		guint i, guint flags)
+{
+	guint32 h1, h2;
+
+	new_tok->flags = flags;
+	new_tok->t1 = t0;
+	new_tok->t2 = ti;
+
+	if (compat) {
+		h1 = ((guint32)h0) * primes[0] + ((guint32)hi) * primes[i << 1];
+		h2 = ((guint32)h0) * primes[1] + ((guint32)hi) * primes[(i << 1) - 1];
+		memcpy ((guchar *)&new_tok->data, &h1, sizeof (h1));
+		memcpy (((guchar *)&new_tok->data) + sizeof (h1), &h2, sizeof (h2));
+	}
+	else {
+		new_tok->data = h0 * primes[0] + hi * primes[i << 1];
+	}
+
+	new_tok->window_idx = i;
+}
+
+/*
+ * Words hashes are computed in batches, so independent hash computations
+ * overlap, the window is a ring buffer instead of a shifted array and tokens
+ * of a batch are allocated as a single contiguous chunk
+ */
 gint
 rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 					  struct rspamd_task *task,
@@ -267,14 +337,15 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 					  const gchar *prefix,
 					  GPtrArray *result)
 {
-	rspamd_token_t *new_tok = NULL;
-	rspamd_stat_token_t *token;
 	struct rspamd_osb_tokenizer_config *osb_cf;
-	guint64 cur, seed;
-	struct token_pipe_entry *hashpipe;
-	guint32 h1, h2;
+	rspamd_stat_token_t *token, *batch_t[OSB_HASH_BATCH], **ring_t;
+	guint64 batch_h[OSB_HASH_BATCH], *ring_h, seed, h0;
+	guchar *chunk;
+	rspamd_token_t *new_tok;
 	gsize token_size;
-	guint processed = 0, i, w, window_size, token_flags = 0;
+	guint w, i, j, nbatch, window_size, pairs, token_flags = 0;
+	guint64 processed = 0, n;
+	gboolean compat;
 
 	if (words == NULL) {
 		return FALSE;
@@ -282,6 +353,8 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 
 	osb_cf = ctx->tkcf;
 	window_size = osb_cf->window_size;
+	compat = osb_cf->ht == RSPAMD_OSB_HASH_COMPAT;
+	pairs = MAX (window_size, 2) - 1;
 
 	if (prefix) {
 		seed = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
@@ -291,127 +364,99 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		seed = osb_cf->seed;
 	}
 
-	hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
-	for (i = 0; i < window_size; i++) {
-		hashpipe[i].h = 0xfe;
-		hashpipe[i].t = NULL;
-	}
+	ring_h = g_alloca (window_size * sizeof (ring_h[0]));
+	ring_t = g_alloca (window_size * sizeof (ring_t[0]));
 
 	token_size = sizeof (rspamd_token_t) +
 			sizeof (gdouble) * ctx->statfiles->len;
 	g_assert (token_size > 0);
 
-	for (w = 0; w < words->len; w ++) {
-		token = &g_array_index (words, rspamd_stat_token_t, w);
-		token_flags = token->flags;
-		const gchar *begin;
-		gsize len;
-
-		if (token->flags &
-			(RSPAMD_STAT_TOKEN_FLAG_STOP_WORD|RSPAMD_STAT_TOKEN_FLAG_SKIPPED)) {
-			/* Skip stop/skipped words */
-			continue;
-		}
-
-		if (token->flags & RSPAMD_STAT_TOKEN_FLAG_TEXT) {
-			begin = token->stemmed.begin;
-			len = token->stemmed.len;
-		}
-		else {
-			begin = token->original.begin;
-			len = token->original.len;
-		}
+	if (words->len > 0) {
+		token_flags = g_array_index (words, rspamd_stat_token_t,
+				words->len - 1).flags;
+	}
 
-		if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
-			rspamd_ftok_t ftok;
+	for (w = 0; w < words->len; ) {
+		/* Hash the next batch of words */
+		for (nbatch = 0; w < words->len && nbatch < OSB_HASH_BATCH; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
 
-			ftok.begin = begin;
-			ftok.len = len;
-			cur = rspamd_fstrhash_lc (&ftok, is_utf);
-		}
-		else {
-			/* We know that the words are normalized */
-			if (osb_cf->ht == RSPAMD_OSB_HASH_XXHASH) {
-				cur = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
-						begin, len, osb_cf->seed);
+			if (token->flags &
+				(RSPAMD_STAT_TOKEN_FLAG_STOP_WORD|RSPAMD_STAT_TOKEN_FLAG_SKIPPED)) {
+				/* Skip stop/skipped words */
+				continue;
 			}
-			else {
-				rspamd_cryptobox_siphash ((guchar *)&cur, begin,
-						len, osb_cf->sk);
 
-				if (prefix) {
-					cur ^= seed;
-				}
-			}
+			batch_t[nbatch] = token;
+			batch_h[nbatch] = rspamd_tokenizer_osb_word_hash (osb_cf, token,
+					is_utf, prefix != NULL, seed);
+			nbatch ++;
 		}
 
-		if (token_flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
-			new_tok = rspamd_mempool_alloc0 (task->task_pool, token_size);
-			new_tok->flags = token_flags;
-			new_tok->t1 = token;
-			new_tok->t2 = token;
-			new_tok->data = cur;
-			new_tok->window_idx = 0;
-			g_ptr_array_add (result, new_tok);
-
+		if (nbatch == 0) {
 			continue;
 		}
 
-#define ADD_TOKEN do {\
-    new_tok = rspamd_mempool_alloc0 (task->task_pool, token_size); \
-    new_tok->flags = token_flags; \
-    new_tok->t1 = hashpipe[0].t; \
-    new_tok->t2 = hashpipe[i].t; \
-    if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) { \
-        h1 = ((guint32)hashpipe[0].h) * primes[0] + \
-            ((guint32)hashpipe[i].h) * primes[i << 1]; \
-        h2 = ((guint32)hashpipe[0].h) * primes[1] + \
-            ((guint32)hashpipe[i].h) * primes[(i << 1) - 1]; \
-        memcpy((guchar *)&new_tok->data, &h1, sizeof (h1)); \
-        memcpy(((guchar *)&new_tok->data) + sizeof (h1), &h2, sizeof (h2)); \
-    } \
-    else { \
-        new_tok->data = hashpipe[0].h * primes[0] + hashpipe[i].h * primes[i << 1]; \
-    } \
-    new_tok->window_idx = i; \
-    g_ptr_array_add (result, new_tok); \
-  } while(0)
-
-		if (processed < window_size) {
-			/* Just fill a hashpipe */
-			++processed;
-			hashpipe[window_size - processed].h = cur;
-			hashpipe[window_size - processed].t = token;
-		}
-		else {
-			/* Shift hashpipe */
-			for (i = window_size - 1; i > 0; i--) {
-				hashpipe[i] = hashpipe[i - 1];
+		chunk = rspamd_mempool_alloc0 (task->task_pool,
+				token_size * nbatch * pairs);
+
+		for (j = 0; j < nbatch; j ++) {
+			token = batch_t[j];
+
+			if (token->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+				new_tok = (rspamd_token_t *)chunk;
+				chunk += token_size;
+				new_tok->flags = token->flags;
+				new_tok->t1 = token;
+				new_tok->t2 = token;
+				new_tok->data = batch_h[j];
+				new_tok->window_idx = 0;
+				g_ptr_array_add (result, new_tok);
+
+				continue;
 			}
-			hashpipe[0].h = cur;
-			hashpipe[0].t = token;
 
-			processed++;
+			n = processed ++;
+			ring_h[n % window_size] = batch_h[j];
+			ring_t[n % window_size] = token;
+
+			if (n < window_size) {
+				/* Just fill a window */
+				continue;
+			}
 
-			for (i = 1; i < window_size; i++) {
-				if (!(hashpipe[i].t->flags & RSPAMD_STAT_TOKEN_FLAG_EXCEPTION)) {
-					ADD_TOKEN;
+			for (i = 1; i < window_size; i ++) {
+				if (!(ring_t[(n - i) % window_size]->flags &
+						RSPAMD_STAT_TOKEN_FLAG_EXCEPTION)) {
+					new_tok = (rspamd_token_t *)chunk;
+					chunk += token_size;
+					rspamd_tokenizer_osb_pair (new_tok, compat,
+							batch_h[j], token,
+							ring_h[(n - i) % window_size],
+							ring_t[(n - i) % window_size],
+							i, token->flags);
+					g_ptr_array_add (result, new_tok);
 				}
 			}
 		}
 	}
 
+	/*
+	 * Short texts: pair the last but one word with the words before it,
+	 * exactly as the shifted window does
+	 */
 	if (processed > 1 && processed <= window_size) {
-		processed --;
-		memmove (hashpipe, &hashpipe[window_size - processed],
-				processed * sizeof (hashpipe[0]));
+		n = processed - 2;
+		h0 = ring_h[n];
 
-		for (i = 1; i < processed; i++) {
-			ADD_TOKEN;
+		for (i = 1; i < processed - 1; i ++) {
+			new_tok = rspamd_mempool_alloc0 (task->task_pool, token_size);
+			rspamd_tokenizer_osb_pair (new_tok, compat,
+					h0, ring_t[n], ring_h[n - i], ring_t[n - i],
+					i, token_flags);
+			g_ptr_array_add (result, new_tok);
 		}
 	}
 
-#undef ADD_TOKEN
-
 	return TRUE;
 }
@@ -22,6 +22,7 @@
 #include "stat_internal.h"
 #include "contrib/mumhash/mum.h"
 #include "libmime/lang_detection.h"
+#include "libutil/hash.h"
 #include "libstemmer.h"
 
 #include <unicode/utf8.h>
@@ -39,6 +40,23 @@ typedef gboolean (*token_get_function) (rspamd_stat_token_t * buf, gchar const *
 		rspamd_stat_token_t * token,
 		GList **exceptions, gsize *rl, gboolean check_signature);
 
+/* Number of stemmed words cached per language */
+#define STEMMER_CACHE_SIZE 8192
+/* Longest word that is converted by a single ucnv call */
+#define MAX_UCHARS_WORD 1024
+
+struct rspamd_stemmer_elt {
+	struct sb_stemmer *stem;
+	rspamd_lru_hash_t *cache; /* normalized -> stemmed, "" means no stem */
+};
+
+/* Properties of ASCII characters as they are computed by ICU predicates */
+enum rspamd_ascii_class {
+	RSPAMD_ASCII_KEEP = (1u << 0),
+	RSPAMD_ASCII_EMOJI = (1u << 1),
+	RSPAMD_ASCII_INVISIBLE = (1u << 2),
+};
+
 const gchar t_delimiters[256] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
 	1, 0, 0, 1, 0, 0, 0, 0, 0, 0,
@@ -678,9 +696,8 @@ rspamd_tokenize_meta_words (struct rspamd_task *task)
 			}
 		}
 
-		rspamd_normalize_words (task->meta_words, task->task_pool);
-		rspamd_stem_words (task->meta_words, task->task_pool, language,
-				task->lang_det);
+		rspamd_normalize_stem_words (task->meta_words, task->task_pool,
+				language, task->lang_det);
 
 		for (i = 0; i < task->meta_words->len; i++) {
 			tok = &g_array_index (task->meta_words, rspamd_stat_token_t, i);
@@ -757,17 +774,115 @@ rspamd_ucs32_to_normalised (rspamd_stat_token_t *tok,
 	tok->normalized.begin = dest;
 }
 
+static const guint8 *
+rspamd_get_ascii_classes (void)
+{
+	static guint8 classes[128];
+	static gboolean initialized = FALSE;
+	UChar32 t;
+
+	if (!initialized) {
+		for (t = 0; t < G_N_ELEMENTS (classes); t ++) {
+			if (u_isgraph (t)) {
+				UCharCategory cat;
+
+				cat = u_charType (t);
+#if U_ICU_VERSION_MAJOR_NUM >= 57
+				if (u_hasBinaryProperty (t, UCHAR_EMOJI)) {
+					classes[t] |= RSPAMD_ASCII_EMOJI;
+				}
+#endif
+
+				if ((cat >= U_UPPERCASE_LETTER && cat <= U_OTHER_NUMBER) ||
+						cat == U_CONNECTOR_PUNCTUATION ||
+						cat == U_MATH_SYMBOL ||
+						cat == U_CURRENCY_SYMBOL) {
+					classes[t] |= RSPAMD_ASCII_KEEP;
+				}
+			}
+			else {
+				classes[t] |= RSPAMD_ASCII_INVISIBLE;
+			}
+		}
+
+		initialized = TRUE;
+	}
+
+	return classes;
+}
+
+/*
+ * Converts and lowercases a word that has only ASCII characters, such words
+ * are always normalised, so ucnv and unorm2 passes are skipped; both unicode
+ * and normalized forms are placed in a single allocation
+ */
+static gboolean
+rspamd_normalize_ascii_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool)
+{
+	const guchar *p = (const guchar *)tok->original.begin;
+	const guint8 *classes;
+	UChar32 *ucs;
+	gchar *dest;
+	gsize i, n = 0;
+	guint8 cls;
+
+	if (tok->original.len > MAX_UCHARS_WORD) {
+		return FALSE;
+	}
+
+	for (i = 0; i < tok->original.len; i ++) {
+		if (p[i] & 0x80) {
+			return FALSE;
+		}
+	}
+
+	classes = rspamd_get_ascii_classes ();
+	ucs = rspamd_mempool_alloc (pool,
+			tok->original.len * sizeof (UChar32) + tok->original.len + 1);
+	dest = (gchar *)(ucs + tok->original.len);
+
+	for (i = 0; i < tok->original.len; i ++) {
+		cls = classes[p[i]];
+
+		if (cls & RSPAMD_ASCII_INVISIBLE) {
+			tok->flags |= RSPAMD_STAT_TOKEN_FLAG_INVISIBLE_SPACES;
+			continue;
+		}
+
+		if (cls & RSPAMD_ASCII_EMOJI) {
+			tok->flags |= RSPAMD_STAT_TOKEN_FLAG_EMOJI;
+		}
+
+		if (cls & RSPAMD_ASCII_KEEP) {
+			dest[n] = g_ascii_tolower (p[i]);
+			ucs[n] = (guchar)dest[n];
+			n ++;
+		}
+	}
+
+	dest[n] = '\0';
+	tok->unicode.begin = ucs;
+	tok->unicode.len = n;
+	tok->normalized.begin = dest;
+	tok->normalized.len = n;
+
+	return TRUE;
+}
+
 void
 rspamd_normalize_single_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool)
 {
 	UErrorCode uc_err = U_ZERO_ERROR;
 	UConverter *utf8_converter;
-	UChar tmpbuf[1024]; /* Assume that we have no longer words... */
+	UChar tmpbuf[MAX_UCHARS_WORD]; /* Assume that we have no longer words... */
 	gsize ulen;
 
-	utf8_converter = rspamd_get_utf8_converter ();
-
 	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UTF) {
+		if (rspamd_normalize_ascii_word (tok, pool)) {
+			return;
+		}
+
+		utf8_converter = rspamd_get_utf8_converter ();
 		ulen = ucnv_toUChars (utf8_converter,
 				tmpbuf,
 				G_N_ELEMENTS (tmpbuf),
@@ -869,89 +984,138 @@ rspamd_normalize_words (GArray *words, rspamd_mempool_t *pool)
 	}
 }
 
-void
-rspamd_stem_words (GArray *words, rspamd_mempool_t *pool,
-				   const gchar *language,
-				   struct rspamd_lang_detector *d)
+static struct rspamd_stemmer_elt *
+rspamd_get_stemmer (const gchar *language, rspamd_mempool_t *pool)
 {
 	static GHashTable *stemmers = NULL;
-	struct sb_stemmer *stem = NULL;
-	guint i;
-	rspamd_stat_token_t *tok;
-	gchar *dest;
-	gsize dlen;
+	struct rspamd_stemmer_elt *elt;
+
+	if (!language || language[0] == '\0') {
+		return NULL;
+	}
 
 	if (!stemmers) {
 		stemmers = g_hash_table_new (rspamd_strcase_hash,
 				rspamd_strcase_equal);
 	}
 
-	if (language && language[0] != '\0') {
-		stem = g_hash_table_lookup (stemmers, language);
-
-		if (stem == NULL) {
+	elt = g_hash_table_lookup (stemmers, language);
 
-			stem = sb_stemmer_new (language, "UTF_8");
+	if (elt == NULL) {
+		elt = g_malloc0 (sizeof (*elt));
+		elt->stem = sb_stemmer_new (language, "UTF_8");
 
-			if (stem == NULL) {
-				msg_debug_pool (
-						"<%s> cannot create lemmatizer for %s language",
-						language);
-				g_hash_table_insert (stemmers, g_strdup (language),
-						GINT_TO_POINTER (-1));
-			}
-			else {
-				g_hash_table_insert (stemmers, g_strdup (language),
-						stem);
-			}
-		}
-		else if (stem == GINT_TO_POINTER (-1)) {
+		if (elt->stem == NULL) {
 			/* Negative cache */
-			stem = NULL;
+			msg_debug_pool (
+					"<%s> cannot create lemmatizer for %s language",
+					language);
+		}
+		else {
+			elt->cache = rspamd_lru_hash_new_full (STEMMER_CACHE_SIZE,
+					g_free, g_free, rspamd_str_hash, rspamd_str_equal);
 		}
+
+		g_hash_table_insert (stemmers, g_strdup (language), elt);
 	}
-	for (i = 0; i < words->len; i++) {
-		tok = &g_array_index (words, rspamd_stat_token_t, i);
 
-		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UTF) {
-			if (stem) {
-				const gchar *stemmed = NULL;
+	return elt->stem ? elt : NULL;
+}
 
-				stemmed = sb_stemmer_stem (stem,
+static void
+rspamd_stem_single_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool,
+						 struct rspamd_stemmer_elt *stemmer,
+						 struct rspamd_lang_detector *d,
+						 time_t now)
+{
+	gchar *dest;
+	gsize dlen;
+
+	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UTF) {
+		if (stemmer && tok->normalized.len > 0) {
+			const gchar *stemmed = NULL;
+
+			/* Normalized words are always zero terminated */
+			stemmed = rspamd_lru_hash_lookup (stemmer->cache,
+					tok->normalized.begin, now);
+
+			if (stemmed == NULL) {
+				stemmed = sb_stemmer_stem (stemmer->stem,
 						tok->normalized.begin, tok->normalized.len);
+				stemmed = g_strdup (stemmed ? stemmed : "");
+				rspamd_lru_hash_insert (stemmer->cache,
+						g_strndup (tok->normalized.begin, tok->normalized.len),
+						(gpointer)stemmed, now, 0);
+			}
 
-				dlen = stemmed ? strlen (stemmed) : 0;
+			dlen = strlen (stemmed);
 
-				if (dlen > 0) {
-					dest = rspamd_mempool_alloc (pool, dlen + 1);
-					memcpy (dest, stemmed, dlen);
-					dest[dlen] = '\0';
-					tok->stemmed.len = dlen;
-					tok->stemmed.begin = dest;
-					tok->flags |= RSPAMD_STAT_TOKEN_FLAG_STEMMED;
-				}
-				else {
-					/* Fallback */
-					tok->stemmed.len = tok->normalized.len;
-					tok->stemmed.begin = tok->normalized.begin;
-				}
+			if (dlen > 0) {
+				dest = rspamd_mempool_alloc (pool, dlen + 1);
+				memcpy (dest, stemmed, dlen);
+				dest[dlen] = '\0';
+				tok->stemmed.len = dlen;
+				tok->stemmed.begin = dest;
+				tok->flags |= RSPAMD_STAT_TOKEN_FLAG_STEMMED;
 			}
 			else {
+				/* Fallback */
 				tok->stemmed.len = tok->normalized.len;
 				tok->stemmed.begin = tok->normalized.begin;
 			}
-
-			if (tok->stemmed.len > 0 && d != NULL &&
-				rspamd_language_detector_is_stop_word (d, tok->stemmed.begin, tok->stemmed.len)) {
-				tok->flags |= RSPAMD_STAT_TOKEN_FLAG_STOP_WORD;
-			}
 		}
 		else {
-			if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_TEXT) {
-				/* Raw text, lowercase */
-				tok->stemmed.len = tok->normalized.len;
-				tok->stemmed.begin = tok->normalized.begin;
-			}
+			tok->stemmed.len = tok->normalized.len;
+			tok->stemmed.begin = tok->normalized.begin;
+		}
+
+		if (tok->stemmed.len > 0 && d != NULL &&
+			rspamd_language_detector_is_stop_word (d, tok->stemmed.begin, tok->stemmed.len)) {
+			tok->flags |= RSPAMD_STAT_TOKEN_FLAG_STOP_WORD;
 		}
 	}
-}
\ No newline at end of file
+	else {
+		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_TEXT) {
+			/* Raw text, lowercase */
+			tok->stemmed.len = tok->normalized.len;
+			tok->stemmed.begin = tok->normalized.begin;
+		}
+	}
+}
+
+void
+rspamd_stem_words (GArray *words, rspamd_mempool_t *pool,
+				   const gchar *language,
+				   struct rspamd_lang_detector *d)
+{
+	struct rspamd_stemmer_elt *stemmer;
+	rspamd_stat_token_t *tok;
+	time_t now = time (NULL);
+	guint i;
+
+	stemmer = rspamd_get_stemmer (language, pool);
+
+	for (i = 0; i < words->len; i++) {
+		tok = &g_array_index (words, rspamd_stat_token_t, i);
+		rspamd_stem_single_word (tok, pool, stemmer, d, now);
+	}
+}
+
+void
+rspamd_normalize_stem_words (GArray *words, rspamd_mempool_t *pool,
+							 const gchar *language,
+							 struct rspamd_lang_detector *d)
+{
+	struct rspamd_stemmer_elt *stemmer;
+	rspamd_stat_token_t *tok;
+	time_t now = time (NULL);
+	guint i;
+
+	stemmer = rspamd_get_stemmer (language, pool);
+
+	for (i = 0; i < words->len; i++) {
+		tok = &g_array_index (words, rspamd_stat_token_t, i);
+		rspamd_normalize_single_word (tok, pool);
+		rspamd_stem_single_word (tok, pool, stemmer, d, now);
+	}
+}
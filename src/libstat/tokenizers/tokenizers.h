@@ -75,6 +75,11 @@ void rspamd_stem_words (GArray *words, rspamd_mempool_t *pool,
 						const gchar *language,
 						struct rspamd_lang_detector *d);
 
+/* Normalises and stems words in a single pass, language must be known */
+void rspamd_normalize_stem_words (GArray *words, rspamd_mempool_t *pool,
+								  const gchar *language,
+								  struct rspamd_lang_detector *d);
+
 void rspamd_tokenize_meta_words (struct rspamd_task *task);
 
 #ifdef  __cplusplus
@@ -65,14 +65,35 @@ struct rspamd_expression_elt {
 	gdouble value;
 };
 
+/*
+ * AST is compiled to a linear postfix program evaluated on a stack of values,
+ * logical operations jump to the end of the chain when their value is known
+ */
+enum rspamd_expression_insn_type {
+	INSN_ATOM = 0, /* push atom value */
+	INSN_LIMIT, /* push limit */
+	INSN_UNARY, /* apply to the top */
+	INSN_BINARY, /* pop two values, push result */
+	INSN_NARY, /* pop value, combine it with the accumulator on top */
+	INSN_JUMP_DONE, /* jump to `jump` if the accumulator on top is final */
+};
+
+struct rspamd_expression_insn {
+	enum rspamd_expression_insn_type type;
+	guint jump;
+	struct rspamd_expression_elt *elt;
+};
+
 struct rspamd_expression {
 	const struct rspamd_atom_subr *subr;
 	GArray *expressions;
 	GPtrArray *expression_stack;
 	GNode *ast;
+	GArray *code;
 	gchar *log_id;
 	guint next_resort;
 	guint evals;
+	guint max_stack;
 };
 
 struct rspamd_expr_process_data {
@@ -532,6 +553,9 @@ rspamd_expression_destroy (struct rspamd_expression *expr)
 		if (expr->ast) {
 			g_node_destroy (expr->ast);
 		}
+		if (expr->code) {
+			g_array_free (expr->code, TRUE);
+		}
 		if (expr->log_id) {
 			g_free (expr->log_id);
 		}
@@ -787,6 +811,103 @@ rspamd_expr_dup_elt (rspamd_mempool_t *pool, struct rspamd_expression_elt *elt)
 	return n;
 }
 
+static guint
+rspamd_expression_emit (struct rspamd_expression *e,
+		enum rspamd_expression_insn_type type,
+		struct rspamd_expression_elt *elt)
+{
+	struct rspamd_expression_insn insn;
+
+	insn.type = type;
+	insn.jump = 0;
+	insn.elt = elt;
+	g_array_append_val (e->code, insn);
+
+	return e->code->len - 1;
+}
+
+static void
+rspamd_expression_compile_node (struct rspamd_expression *e, GNode *node,
+		guint *depth)
+{
+	struct rspamd_expression_elt *elt = node->data;
+	GNode *cld;
+	GArray *jumps;
+	guint i;
+
+	switch (elt->type) {
+	case ELT_ATOM:
+	case ELT_LIMIT:
+		rspamd_expression_emit (e,
+				elt->type == ELT_ATOM ? INSN_ATOM : INSN_LIMIT, elt);
+		(*depth) ++;
+		e->max_stack = MAX (e->max_stack, *depth);
+		break;
+	case ELT_OP:
+		g_assert (node->children != NULL);
+
+		if (elt->p.op.op_flags & RSPAMD_EXPRESSION_NARY) {
+			jumps = g_array_new (FALSE, FALSE, sizeof (guint));
+
+			DL_FOREACH (node->children, cld) {
+				rspamd_expression_compile_node (e, cld, depth);
+
+				if (cld != node->children) {
+					rspamd_expression_emit (e, INSN_NARY, elt);
+					(*depth) --;
+				}
+
+				if (cld->next != NULL &&
+						(elt->p.op.op == OP_AND || elt->p.op.op == OP_OR)) {
+					i = rspamd_expression_emit (e, INSN_JUMP_DONE, elt);
+					g_array_append_val (jumps, i);
+				}
+			}
+
+			for (i = 0; i < jumps->len; i ++) {
+				g_array_index (e->code, struct rspamd_expression_insn,
+						g_array_index (jumps, guint, i)).jump = e->code->len;
+			}
+
+			g_array_free (jumps, TRUE);
+		}
+		else if (elt->p.op.op_flags & RSPAMD_EXPRESSION_BINARY) {
+			g_assert (node->children->next != NULL);
+			rspamd_expression_compile_node (e, node->children, depth);
+			rspamd_expression_compile_node (e, node->children->next, depth);
+			rspamd_expression_emit (e, INSN_BINARY, elt);
+			(*depth) --;
+		}
+		else if (elt->p.op.op_flags & RSPAMD_EXPRESSION_UNARY) {
+			rspamd_expression_compile_node (e, node->children, depth);
+			rspamd_expression_emit (e, INSN_UNARY, elt);
+		}
+		break;
+	}
+}
+
+/*
+ * Converts AST to the postfix program, must be called after each resort
+ */
+static void
+rspamd_expression_compile (struct rspamd_expression *e)
+{
+	guint depth = 0;
+
+	if (e->code == NULL) {
+		e->code = g_array_sized_new (FALSE, FALSE,
+				sizeof (struct rspamd_expression_insn),
+				e->expressions->len * 2);
+	}
+	else {
+		g_array_set_size (e->code, 0);
+	}
+
+	e->max_stack = 0;
+	rspamd_expression_compile_node (e, e->ast, &depth);
+	g_assert (depth == 1);
+}
+
 gboolean
 rspamd_parse_expression (const gchar *line, gsize len,
 		const struct rspamd_atom_subr *subr, gpointer subr_data,
@@ -1142,6 +1263,7 @@ rspamd_parse_expression (const gchar *line, gsize len,
 	/* Now set less expensive branches to be evaluated first */
 	g_node_traverse (e->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 			rspamd_ast_resort_traverse, NULL);
+	rspamd_expression_compile (e);
 
 	if (target) {
 		*target = e;
@@ -1291,6 +1413,108 @@ rspamd_ast_do_nary_op (struct rspamd_expression_elt *elt, gdouble val, gdouble a
 	return ret;
 }
 
+static gdouble
+rspamd_ast_process_atom (struct rspamd_expression *e,
+						 struct rspamd_expression_elt *elt,
+						 struct rspamd_expr_process_data *process_data)
+{
+	gdouble t1 = 0, t2, val;
+	gboolean calc_ticks = FALSE;
+
+	/*
+	 * Sometimes get ticks for this expression. 'Sometimes' here means
+	 * that we get lowest 5 bits of the counter `evals` and 5 bits
+	 * of some shifted address to provide some sort of jittering for
+	 * ticks evaluation
+	 */
+	if ((e->evals & 0x1F) == (GPOINTER_TO_UINT (elt) >> 4 & 0x1F)) {
+		calc_ticks = TRUE;
+		t1 = rspamd_get_ticks (TRUE);
+	}
+
+	val = process_data->process_closure (process_data->ud, elt->p.atom);
+
+	if (fabs (val) > 1e-9) {
+		elt->p.atom->hits ++;
+
+		if (process_data->trace) {
+			g_ptr_array_add (process_data->trace, elt->p.atom);
+		}
+	}
+
+	if (calc_ticks) {
+		t2 = rspamd_get_ticks (TRUE);
+		elt->p.atom->avg_ticks += ((t2 - t1) - elt->p.atom->avg_ticks) /
+				(e->evals);
+	}
+
+	return val;
+}
+
+static gdouble
+rspamd_expression_exec (struct rspamd_expression *e,
+						struct rspamd_expr_process_data *process_data)
+{
+	const struct rspamd_expression_insn *code, *insn;
+	gdouble stack_buf[32], *stack;
+	guint pc = 0, sp = 0, ninsns;
+	gdouble ret;
+
+	code = (const struct rspamd_expression_insn *)e->code->data;
+	ninsns = e->code->len;
+
+	if (e->max_stack <= G_N_ELEMENTS (stack_buf)) {
+		stack = stack_buf;
+	}
+	else {
+		stack = g_malloc (sizeof (gdouble) * e->max_stack);
+	}
+
+	while (pc < ninsns) {
+		insn = &code[pc ++];
+
+		switch (insn->type) {
+		case INSN_ATOM:
+			stack[sp ++] = rspamd_ast_process_atom (e, insn->elt, process_data);
+			msg_debug_expression ("atom: elt=%s; acc=%.1f",
+					insn->elt->p.atom->str, stack[sp - 1]);
+			break;
+		case INSN_LIMIT:
+			stack[sp ++] = insn->elt->p.lim;
+			break;
+		case INSN_UNARY:
+			stack[sp - 1] = rspamd_ast_do_unary_op (insn->elt, stack[sp - 1]);
+			break;
+		case INSN_BINARY:
+			stack[sp - 2] = rspamd_ast_do_binary_op (insn->elt, stack[sp - 2],
+					stack[sp - 1]);
+			sp --;
+			break;
+		case INSN_NARY:
+			stack[sp - 2] = rspamd_ast_do_nary_op (insn->elt, stack[sp - 1],
+					stack[sp - 2]);
+			sp --;
+			break;
+		case INSN_JUMP_DONE:
+			if (!(process_data->flags & RSPAMD_EXPRESSION_FLAG_NOOPT) &&
+					rspamd_ast_node_done (insn->elt, stack[sp - 1])) {
+				msg_debug_expression ("optimizer: done");
+				pc = insn->jump;
+			}
+			break;
+		}
+	}
+
+	g_assert (sp == 1);
+	ret = stack[0];
+
+	if (stack != stack_buf) {
+		g_free (stack);
+	}
+
+	return ret;
+}
+
 static gdouble
 rspamd_ast_process_node (struct rspamd_expression *e, GNode *node,
 						 struct rspamd_expr_process_data *process_data)
@@ -1298,8 +1522,7 @@ rspamd_ast_process_node (struct rspamd_expression *e, GNode *node,
 	struct rspamd_expression_elt *elt;
 	GNode *cld;
 	gdouble acc = NAN;
-	gdouble t1, t2, val;
-	gboolean calc_ticks = FALSE;
+	gdouble val;
 	const gchar *op_name = NULL;
 
 	elt = node->data;
@@ -1307,34 +1530,7 @@ rspamd_ast_process_node (struct rspamd_expression *e, GNode *node,
 	switch (elt->type) {
 	case ELT_ATOM:
 		if (!(elt->flags & RSPAMD_EXPR_FLAG_PROCESSED)) {
-
-			/*
-			 * Sometimes get ticks for this expression. 'Sometimes' here means
-			 * that we get lowest 5 bits of the counter `evals` and 5 bits
-			 * of some shifted address to provide some sort of jittering for
-			 * ticks evaluation
-			 */
-			if ((e->evals & 0x1F) == (GPOINTER_TO_UINT (node) >> 4 & 0x1F)) {
-				calc_ticks = TRUE;
-				t1 = rspamd_get_ticks (TRUE);
-			}
-
-			elt->value = process_data->process_closure (process_data->ud, elt->p.atom);
-
-			if (fabs (elt->value) > 1e-9) {
-				elt->p.atom->hits ++;
-
-				if (process_data->trace) {
-					g_ptr_array_add (process_data->trace, elt->p.atom);
-				}
-			}
-
-			if (calc_ticks) {
-				t2 = rspamd_get_ticks (TRUE);
-				elt->p.atom->avg_ticks += ((t2 - t1) - elt->p.atom->avg_ticks) /
-						(e->evals);
-			}
-
+			elt->value = rspamd_ast_process_atom (e, elt, process_data);
 			elt->flags |= RSPAMD_EXPR_FLAG_PROCESSED;
 		}
 
@@ -1446,11 +1642,16 @@ rspamd_process_expression_closure (struct rspamd_expression *expr,
 		*track = pd.trace;
 	}
 
-	ret = rspamd_ast_process_node (expr, expr->ast, &pd);
+	if (flags & RSPAMD_EXPRESSION_FLAG_TREE) {
+		ret = rspamd_ast_process_node (expr, expr->ast, &pd);
 
-	/* Cleanup */
-	g_node_traverse (expr->ast, G_IN_ORDER, G_TRAVERSE_ALL, -1,
-			rspamd_ast_cleanup_traverse, NULL);
+		/* Cleanup */
+		g_node_traverse (expr->ast, G_IN_ORDER, G_TRAVERSE_ALL, -1,
+				rspamd_ast_cleanup_traverse, NULL);
+	}
+	else {
+		ret = rspamd_expression_exec (expr, &pd);
+	}
 
 	/* Check if we need to resort */
 	if (expr->evals % expr->next_resort == 0) {
@@ -1463,6 +1664,7 @@ rspamd_process_expression_closure (struct rspamd_expression *expr,
 		/* Now set less expensive branches to be evaluated first */
 		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 				rspamd_ast_resort_traverse, NULL);
+		rspamd_expression_compile (expr);
 	}
 
 	return ret;
@@ -1582,6 +1784,38 @@ rspamd_expression_atom_foreach (struct rspamd_expression *expr,
 			rspamd_ast_atom_traverse, &data);
 }
 
+struct atom_foreach_full_cbdata {
+	rspamd_expression_atom_foreach_full_cb cb;
+	gpointer cbdata;
+};
+
+static gboolean
+rspamd_ast_atom_traverse_full (GNode *n, gpointer d)
+{
+	struct atom_foreach_full_cbdata *data = d;
+	struct rspamd_expression_elt *elt = n->data;
+
+	if (elt->type == ELT_ATOM) {
+		data->cb (elt->p.atom, data->cbdata);
+	}
+
+	return FALSE;
+}
+
+void
+rspamd_expression_atom_foreach_full (struct rspamd_expression *expr,
+		rspamd_expression_atom_foreach_full_cb cb, gpointer cbdata)
+{
+	struct atom_foreach_full_cbdata data;
+
+	g_assert (expr != NULL);
+
+	data.cb = cb;
+	data.cbdata = cbdata;
+	g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_ALL, -1,
+			rspamd_ast_atom_traverse_full, &data);
+}
+
 gboolean
 rspamd_expression_node_is_op (GNode *node, enum rspamd_expression_op op)
 {
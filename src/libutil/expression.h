@@ -27,6 +27,8 @@ extern "C" {
 #define RSPAMD_EXPRESSION_MAX_PRIORITY 1024
 
 #define RSPAMD_EXPRESSION_FLAG_NOOPT (1 << 0)
+/* Walk AST instead of executing the compiled program (for testing) */
+#define RSPAMD_EXPRESSION_FLAG_TREE (1 << 1)
 
 enum rspamd_expression_op {
 	OP_INVALID = 0,
@@ -157,6 +159,18 @@ typedef void (*rspamd_expression_atom_foreach_cb) (const rspamd_ftok_t *atom,
 void rspamd_expression_atom_foreach (struct rspamd_expression *expr,
 									 rspamd_expression_atom_foreach_cb cb, gpointer cbdata);
 
+typedef void (*rspamd_expression_atom_foreach_full_cb) (rspamd_expression_atom_t *atom,
+														gpointer ud);
+
+/**
+ * Calls `cb` for each parsed atom of the expression
+ * @param expr
+ * @param cb
+ * @param cbdata
+ */
+void rspamd_expression_atom_foreach_full (struct rspamd_expression *expr,
+										  rspamd_expression_atom_foreach_full_cb cb, gpointer cbdata);
+
 /**
  * Checks if a specified node in AST is the specified operation
  * @param node AST node packed in GNode container
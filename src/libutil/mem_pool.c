@@ -23,6 +23,7 @@
 #include "cryptobox.h"
 #include "contrib/uthash/utlist.h"
 #include "mem_pool_internal.h"
+#include "ucl.h"
 
 #ifdef WITH_JEMALLOC
 #include <jemalloc/jemalloc.h>
@@ -83,6 +84,43 @@ static rspamd_mempool_stat_t *mem_pool_stat = NULL;
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
 
+/*
+ * Normal chains and initial pool chunks are rounded up to power of two size
+ * classes, on pool destruction they are kept in per-process freelists, so
+ * the next pools (e.g. for the next task) reuse memory that is already
+ * faulted in instead of returning it to the system allocator
+ */
+#define MEMPOOL_BLOCK_MIN_SHIFT 12 /* 4Kb */
+#define MEMPOOL_BLOCK_CLASSES 13 /* up to 16Mb */
+#define MEMPOOL_BLOCK_CACHE_MAX (32 * 1024 * 1024)
+
+struct rspamd_mempool_free_block {
+	struct rspamd_mempool_free_block *next;
+};
+
+static struct rspamd_mempool_free_block *free_blocks[MEMPOOL_BLOCK_CLASSES];
+static gsize free_blocks_size = 0;
+
+/*
+ * Allocation sites accounting, enabled by RSPAMD_MEMPOOL_SITES environment
+ * variable; sites are stored in a shared memory table keyed by the address of
+ * the location string, so all processes forked from the main one account in
+ * the same table
+ */
+#define MEMPOOL_SITES_MAX 8192
+
+struct rspamd_mempool_site {
+	gpointer key;
+	gint ready;
+	gchar loc[ENTRY_LEN];
+	gsize bytes;
+	gsize allocs;
+	gsize wasted;
+	gsize destructors;
+};
+
+static struct rspamd_mempool_site *mempool_sites = NULL;
+
 /**
  * Function that return free space in pool page
  * @param x pool page struct
@@ -144,6 +182,203 @@ RSPAMD_DESTRUCTOR (rspamd_mempool_entries_dtor)
 	mempool_entries = NULL;
 }
 
+RSPAMD_DESTRUCTOR (rspamd_mempool_blocks_dtor)
+{
+	struct rspamd_mempool_free_block *blk;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (free_blocks); i ++) {
+		while (free_blocks[i]) {
+			blk = free_blocks[i];
+			free_blocks[i] = blk->next;
+			free (blk);
+		}
+	}
+
+	free_blocks_size = 0;
+}
+
+static inline gint
+rspamd_mempool_block_class (gsize size)
+{
+	gint cls = 0;
+
+	if (always_malloc) {
+		/* Do not hide allocations from valgrind */
+		return -1;
+	}
+
+	while (((gsize)1 << (MEMPOOL_BLOCK_MIN_SHIFT + cls)) < size) {
+		cls ++;
+
+		if (cls >= MEMPOOL_BLOCK_CLASSES) {
+			return -1;
+		}
+	}
+
+	return cls;
+}
+
+/**
+ * Allocates a block of memory for a chain, reusing a cached block if possible
+ * @param size requested size, set to the real size of the block
+ */
+static gpointer
+rspamd_mempool_block_alloc (gsize *size)
+{
+	struct rspamd_mempool_free_block *blk;
+	gpointer map;
+	gint cls, ret;
+
+	cls = rspamd_mempool_block_class (*size);
+
+	if (cls >= 0) {
+		*size = (gsize)1 << (MEMPOOL_BLOCK_MIN_SHIFT + cls);
+		blk = free_blocks[cls];
+
+		if (blk) {
+			free_blocks[cls] = blk->next;
+			free_blocks_size -= *size;
+			g_atomic_int_inc (&mem_pool_stat->chunks_reused);
+
+			return blk;
+		}
+	}
+#ifdef HAVE_MALLOC_SIZE
+	else {
+		*size = MAX (*size, sys_alloc_size (*size));
+	}
+#endif
+
+	ret = posix_memalign (&map, MIN_MEM_ALIGNMENT, *size);
+
+	if (ret != 0 || map == NULL) {
+		g_error ("%s: failed to allocate %"G_GSIZE_FORMAT" bytes: %d - %s",
+				G_STRLOC, *size, ret, strerror (errno));
+		abort ();
+	}
+
+	return map;
+}
+
+static void
+rspamd_mempool_block_free (gpointer p, gsize size)
+{
+	struct rspamd_mempool_free_block *blk = p;
+	gint cls;
+
+	cls = rspamd_mempool_block_class (size);
+
+	if (cls >= 0 && ((gsize)1 << (MEMPOOL_BLOCK_MIN_SHIFT + cls)) == size &&
+			free_blocks_size + size <= MEMPOOL_BLOCK_CACHE_MAX) {
+		blk->next = free_blocks[cls];
+		free_blocks[cls] = blk;
+		free_blocks_size += size;
+	}
+	else {
+		free (p); /* Not g_free as we use system allocator */
+	}
+}
+
+static void
+rspamd_mempool_sites_init (void)
+{
+	gpointer map;
+	gsize len = sizeof (struct rspamd_mempool_site) * MEMPOOL_SITES_MAX;
+
+#if defined(HAVE_MMAP_ANON)
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+			-1, 0);
+#elif defined(HAVE_MMAP_ZERO)
+	gint fd;
+
+	fd = open ("/dev/zero", O_RDWR);
+	g_assert (fd != -1);
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+#else
+#       error No mmap methods are defined
+#endif
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes for allocation sites, "
+				"accounting is disabled", len);
+		return;
+	}
+
+	memset (map, 0, len);
+	mempool_sites = map;
+}
+
+static struct rspamd_mempool_site *
+rspamd_mempool_get_site (const gchar *loc)
+{
+	struct rspamd_mempool_site *site;
+	guint i, idx;
+
+	if (loc == NULL) {
+		return NULL;
+	}
+
+	idx = rspamd_cryptobox_fast_hash (&loc, sizeof (loc), 0) % MEMPOOL_SITES_MAX;
+
+	for (i = 0; i < MEMPOOL_SITES_MAX; i ++) {
+		site = &mempool_sites[(idx + i) % MEMPOOL_SITES_MAX];
+
+		if (g_atomic_pointer_get (&site->key) == loc) {
+			return g_atomic_int_get (&site->ready) ? site : NULL;
+		}
+
+		if (g_atomic_pointer_get (&site->key) == NULL &&
+				g_atomic_pointer_compare_and_exchange (&site->key, NULL,
+						(gpointer)loc)) {
+			rspamd_strlcpy (site->loc, loc, sizeof (site->loc));
+			g_atomic_int_set (&site->ready, 1);
+
+			return site;
+		}
+
+		if (g_atomic_pointer_get (&site->key) == loc) {
+			/* Claimed concurrently by another process */
+			return NULL;
+		}
+	}
+
+	/* Table is full */
+	return NULL;
+}
+
+static inline void
+rspamd_mempool_site_alloc (const gchar *loc, gsize size)
+{
+	struct rspamd_mempool_site *site = rspamd_mempool_get_site (loc);
+
+	if (site) {
+		g_atomic_pointer_add (&site->bytes, size);
+		g_atomic_pointer_add (&site->allocs, 1);
+	}
+}
+
+static inline void
+rspamd_mempool_site_wasted (const gchar *loc, gsize size)
+{
+	struct rspamd_mempool_site *site = rspamd_mempool_get_site (loc);
+
+	if (site) {
+		g_atomic_pointer_add (&site->wasted, size);
+	}
+}
+
+static inline void
+rspamd_mempool_site_destructor (const gchar *loc)
+{
+	struct rspamd_mempool_site *site = rspamd_mempool_get_site (loc);
+
+	if (site) {
+		g_atomic_pointer_add (&site->destructors, 1);
+	}
+}
+
 static inline struct rspamd_mempool_entry_point *
 rspamd_mempool_get_entry (const gchar *loc)
 {
@@ -166,8 +401,7 @@ static struct _pool_chain *
 rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 {
 	struct _pool_chain *chain;
-	gsize total_size = size + sizeof (struct _pool_chain) + MIN_MEM_ALIGNMENT,
-			optimal_size = 0;
+	gsize total_size = size + sizeof (struct _pool_chain) + MIN_MEM_ALIGNMENT;
 	gpointer map;
 
 	g_assert (size > 0);
@@ -214,18 +448,7 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, total_size);
 	}
 	else {
-#ifdef HAVE_MALLOC_SIZE
-		optimal_size = sys_alloc_size (total_size);
-#endif
-		total_size = MAX (total_size, optimal_size);
-		gint ret = posix_memalign (&map, MIN_MEM_ALIGNMENT, total_size);
-
-		if (ret != 0 || map == NULL) {
-			g_error ("%s: failed to allocate %"G_GSIZE_FORMAT" bytes: %d - %s",
-					G_STRLOC, total_size, ret, strerror (errno));
-			abort ();
-		}
-
+		map = rspamd_mempool_block_alloc (&total_size);
 		chain = map;
 		chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, total_size);
@@ -326,11 +549,16 @@ rspamd_mempool_new_ (gsize size, const gchar *tag, gint flags, const gchar *loc)
 		if (g_slice != NULL) {
 			always_malloc = TRUE;
 		}
+
+		if (getenv ("RSPAMD_MEMPOOL_SITES") != NULL) {
+			rspamd_mempool_sites_init ();
+		}
+
 		env_checked = TRUE;
 	}
 
 	struct rspamd_mempool_entry_point *entry = rspamd_mempool_get_entry (loc);
-	gsize total_size;
+	gsize total_size, block_size;
 
 	if (size == 0 && entry) {
 		size = entry->cur_suggestion;
@@ -355,15 +583,10 @@ rspamd_mempool_new_ (gsize size, const gchar *tag, gint flags, const gchar *loc)
 	 * memory chunk
 	 */
 	guchar *mem_chunk;
-	gint ret = posix_memalign ((void **)&mem_chunk, MIN_MEM_ALIGNMENT,
-			total_size);
 	gsize priv_offset;
 
-	if (ret != 0 || mem_chunk == NULL) {
-		g_error ("%s: failed to allocate %"G_GSIZE_FORMAT" bytes: %d - %s",
-				G_STRLOC, total_size, ret, strerror (errno));
-		abort ();
-	}
+	block_size = total_size;
+	mem_chunk = rspamd_mempool_block_alloc (&block_size);
 
 	/* Set memory layout */
 	new_pool = (rspamd_mempool_t *)mem_chunk;
@@ -388,6 +611,7 @@ rspamd_mempool_new_ (gsize size, const gchar *tag, gint flags, const gchar *loc)
 
 	new_pool->priv->entry = entry;
 	new_pool->priv->elt_len = size;
+	new_pool->priv->block_len = block_size;
 	new_pool->priv->flags = flags;
 
 	if (tag) {
@@ -420,7 +644,8 @@ rspamd_mempool_new_ (gsize size, const gchar *tag, gint flags, const gchar *loc)
 						sizeof (struct rspamd_mempool_specific) +
 						sizeof (struct _pool_chain);
 
-	nchain->slice_size = size;
+	/* The first chain also gets the rest of the rounded block */
+	size += block_size - total_size;
 	nchain->begin = unaligned;
 	nchain->slice_size = size;
 	nchain->pos = align_ptr (unaligned, MIN_MEM_ALIGNMENT);
@@ -478,6 +703,10 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 			rspamd_mempool_notify_alloc_ (pool, size, loc);
 		}
 
+		if (G_UNLIKELY (mempool_sites != NULL)) {
+			rspamd_mempool_site_alloc (loc, size);
+		}
+
 		if (always_malloc && pool_type != RSPAMD_MEMPOOL_SHARED) {
 			void *ptr;
 
@@ -503,6 +732,10 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 		if (cur == NULL || free < size) {
 			if (free < size) {
 				pool->priv->wasted_memory += free;
+
+				if (G_UNLIKELY (mempool_sites != NULL)) {
+					rspamd_mempool_site_wasted (loc, free);
+				}
 			}
 
 			/* Allocate new chain element */
@@ -634,6 +867,11 @@ rspamd_mempool_add_destructor_full (rspamd_mempool_t * pool,
 
 	POOL_MTX_LOCK ();
 	cur = rspamd_mempool_alloc_ (pool, sizeof (*cur), line);
+
+	if (G_UNLIKELY (mempool_sites != NULL)) {
+		rspamd_mempool_site_destructor (line);
+	}
+
 	cur->func = func;
 	cur->data = data;
 	cur->function = function;
@@ -899,7 +1137,7 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 				else {
 					/* The last pool is special, it is a part of the initial chunk */
 					if (cur->next != NULL) {
-						free (cur); /* Not g_free as we use system allocator */
+						rspamd_mempool_block_free (cur, len);
 					}
 				}
 			}
@@ -908,7 +1146,7 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 
 	g_atomic_int_inc (&mem_pool_stat->pools_freed);
 	POOL_MTX_UNLOCK ();
-	free (pool); /* allocated by posix_memalign */
+	rspamd_mempool_block_free (pool, pool->priv->block_len);
 }
 
 void
@@ -922,20 +1160,119 @@ rspamd_mempool_stat (rspamd_mempool_stat_t * st)
 		st->chunks_allocated = mem_pool_stat->chunks_allocated;
 		st->chunks_freed = mem_pool_stat->chunks_freed;
 		st->oversized_chunks = mem_pool_stat->oversized_chunks;
+		st->chunks_reused = mem_pool_stat->chunks_reused;
 	}
 }
 
 void
 rspamd_mempool_stat_reset (void)
 {
+	guint i;
+
 	if (mem_pool_stat != NULL) {
 		memset (mem_pool_stat, 0, sizeof (rspamd_mempool_stat_t));
 	}
+
+	if (mempool_sites != NULL) {
+		for (i = 0; i < MEMPOOL_SITES_MAX; i ++) {
+			mempool_sites[i].bytes = 0;
+			mempool_sites[i].allocs = 0;
+			mempool_sites[i].wasted = 0;
+			mempool_sites[i].destructors = 0;
+		}
+	}
+}
+
+static gint
+rspamd_mempool_sites_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_mempool_site *s1 = *(const struct rspamd_mempool_site **)a,
+			*s2 = *(const struct rspamd_mempool_site **)b;
+
+	/* Inverse order */
+	if (s1->bytes > s2->bytes) {
+		return -1;
+	}
+	else if (s1->bytes < s2->bytes) {
+		return 1;
+	}
+
+	return 0;
+}
+
+ucl_object_t *
+rspamd_mempool_sites_ucl (void)
+{
+	GHashTable *by_loc;
+	GPtrArray *sorted;
+	struct rspamd_mempool_site *site, *agg;
+	ucl_object_t *top, *obj;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+
+	if (mempool_sites == NULL) {
+		return top;
+	}
+
+	/* The same location can be represented by different strings */
+	by_loc = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			NULL, g_free);
+	sorted = g_ptr_array_new ();
+
+	for (i = 0; i < MEMPOOL_SITES_MAX; i ++) {
+		site = &mempool_sites[i];
+
+		if (!g_atomic_int_get (&site->ready)) {
+			continue;
+		}
+
+		agg = g_hash_table_lookup (by_loc, site->loc);
+
+		if (agg == NULL) {
+			agg = g_malloc0 (sizeof (*agg));
+			memcpy (agg->loc, site->loc, sizeof (agg->loc));
+			g_hash_table_insert (by_loc, agg->loc, agg);
+			g_ptr_array_add (sorted, agg);
+		}
+
+		agg->bytes += site->bytes;
+		agg->allocs += site->allocs;
+		agg->wasted += site->wasted;
+		agg->destructors += site->destructors;
+	}
+
+	g_ptr_array_sort (sorted, rspamd_mempool_sites_cmp);
+
+	for (i = 0; i < sorted->len; i ++) {
+		agg = g_ptr_array_index (sorted, i);
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (agg->loc),
+				"loc", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (agg->bytes),
+				"bytes", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (agg->allocs),
+				"count", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (agg->wasted),
+				"wasted", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (agg->destructors),
+				"destructors", 0, false);
+		ucl_array_append (top, obj);
+	}
+
+	g_ptr_array_free (sorted, TRUE);
+	g_hash_table_unref (by_loc);
+
+	return top;
 }
 
 gsize
 rspamd_mempool_suggest_size_ (const char *loc)
 {
+	/*
+	 * Entry points statistics are collected by rspamd_mempool_new_ location,
+	 * so we let it select the size of the first chain
+	 */
 	return 0;
 }
 
@@ -1290,6 +1627,138 @@ rspamd_mempool_glist_append (rspamd_mempool_t *pool, GList *l, gpointer p)
 	return l;
 }
 
+rspamd_mempool_array_t *
+rspamd_mempool_array_new (rspamd_mempool_t *pool, guint elt_size,
+		guint reserved)
+{
+	rspamd_mempool_array_t *ar;
+
+	g_assert (elt_size > 0);
+
+	ar = rspamd_mempool_alloc (pool, sizeof (*ar));
+	ar->pool = pool;
+	ar->elt_size = elt_size;
+	ar->len = 0;
+	ar->allocated = MAX (reserved, 4);
+	ar->data = rspamd_mempool_alloc (pool, (gsize)ar->allocated * elt_size);
+
+	return ar;
+}
+
+gpointer
+rspamd_mempool_array_append (rspamd_mempool_array_t *ar, gconstpointer elt)
+{
+	guchar *dst;
+	gpointer ndata;
+
+	if (ar->len == ar->allocated) {
+		/* Old storage stays in the pool until it is destroyed */
+		ndata = rspamd_mempool_alloc (ar->pool,
+				(gsize)ar->allocated * 2 * ar->elt_size);
+		memcpy (ndata, ar->data, (gsize)ar->len * ar->elt_size);
+		ar->data = ndata;
+		ar->allocated *= 2;
+	}
+
+	dst = ((guchar *)ar->data) + (gsize)ar->len * ar->elt_size;
+
+	if (elt) {
+		memcpy (dst, elt, ar->elt_size);
+	}
+	else {
+		memset (dst, 0, ar->elt_size);
+	}
+
+	ar->len ++;
+
+	return dst;
+}
+
+rspamd_mempool_hash_set_t *
+rspamd_mempool_hash_set_new (rspamd_mempool_t *pool, GHashFunc hash,
+		GEqualFunc equal, guint reserved)
+{
+	rspamd_mempool_hash_set_t *set;
+	guint nbuckets = 8;
+
+	/* Keep load factor below 3/4 */
+	while (nbuckets * 3 < reserved * 4) {
+		nbuckets *= 2;
+	}
+
+	set = rspamd_mempool_alloc (pool, sizeof (*set));
+	set->pool = pool;
+	set->hash = hash;
+	set->equal = equal;
+	set->nbuckets = nbuckets;
+	set->nelts = 0;
+	set->buckets = rspamd_mempool_alloc0 (pool, sizeof (gpointer) * nbuckets);
+
+	return set;
+}
+
+static gpointer *
+rspamd_mempool_hash_set_find (gpointer *buckets, guint nbuckets,
+		GHashFunc hash, GEqualFunc equal, gconstpointer key)
+{
+	guint mask = nbuckets - 1, i;
+
+	i = hash (key) & mask;
+
+	/* Load factor guarantees that there is an empty bucket */
+	while (buckets[i] != NULL && !equal (buckets[i], key)) {
+		i = (i + 1) & mask;
+	}
+
+	return &buckets[i];
+}
+
+gpointer
+rspamd_mempool_hash_set_lookup (rspamd_mempool_hash_set_t *set,
+		gconstpointer key)
+{
+	return *rspamd_mempool_hash_set_find (set->buckets, set->nbuckets,
+			set->hash, set->equal, key);
+}
+
+gboolean
+rspamd_mempool_hash_set_add (rspamd_mempool_hash_set_t *set, gpointer elt)
+{
+	gpointer *slot, *nbuckets;
+	guint i;
+
+	g_assert (elt != NULL);
+
+	if ((set->nelts + 1) * 4 > set->nbuckets * 3) {
+		nbuckets = rspamd_mempool_alloc0 (set->pool,
+				sizeof (gpointer) * set->nbuckets * 2);
+
+		for (i = 0; i < set->nbuckets; i ++) {
+			if (set->buckets[i] != NULL) {
+				slot = rspamd_mempool_hash_set_find (nbuckets,
+						set->nbuckets * 2, set->hash, set->equal,
+						set->buckets[i]);
+				*slot = set->buckets[i];
+			}
+		}
+
+		set->buckets = nbuckets;
+		set->nbuckets *= 2;
+	}
+
+	slot = rspamd_mempool_hash_set_find (set->buckets, set->nbuckets,
+			set->hash, set->equal, elt);
+
+	if (*slot != NULL) {
+		return FALSE;
+	}
+
+	*slot = elt;
+	set->nelts ++;
+
+	return TRUE;
+}
+
 gsize
 rspamd_mempool_get_used_size (rspamd_mempool_t *pool)
 {
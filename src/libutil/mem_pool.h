@@ -40,6 +40,7 @@ extern "C" {
 #endif
 
 struct f_str_s;
+struct ucl_object_s;
 
 #ifdef __has_attribute
 #  if __has_attribute(alloc_size)
@@ -129,6 +130,7 @@ typedef struct memory_pool_stat_s {
 	guint chunks_freed;                 /**< chunks freed										*/
 	guint oversized_chunks;             /**< oversized chunks									*/
 	guint fragmented_size;                /**< fragmentation size								*/
+	guint chunks_reused;                /**< chunks reused from the freelist					*/
 } rspamd_mempool_stat_t;
 
 
@@ -330,8 +332,17 @@ void rspamd_mempool_stat (rspamd_mempool_stat_t *st);
 void rspamd_mempool_stat_reset (void);
 
 /**
- * Get optimal pool size based on page size for this system
- * @return size of memory page in system
+ * Get allocation sites statistics aggregated over all pools of all
+ * processes, requires RSPAMD_MEMPOOL_SITES environment variable to be set
+ * when rspamd starts
+ * @return ucl array of sites sorted by allocated bytes
+ */
+struct ucl_object_s *rspamd_mempool_sites_ucl (void);
+
+/**
+ * Get optimal pool size for the call site
+ * @return zero, so the first chain is sized from the allocation statistics
+ * of the pool's entry point
  */
 #define rspamd_mempool_suggest_size() rspamd_mempool_suggest_size_(G_STRLOC)
 
@@ -387,6 +398,80 @@ GList *rspamd_mempool_glist_prepend (rspamd_mempool_t *pool,
 GList *rspamd_mempool_glist_append (rspamd_mempool_t *pool,
 									GList *l, gpointer p) G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Growable array that is allocated entirely from the memory pool, so it
+ * requires no destructor; storage is reallocated from the pool when array
+ * grows, so the pool holds at most twice of the final array size
+ */
+typedef struct rspamd_mempool_array_s {
+	gpointer data;
+	guint len;
+	guint allocated;
+	guint elt_size;
+	rspamd_mempool_t *pool;
+} rspamd_mempool_array_t;
+
+#define rspamd_mempool_array_index(ar, type, i) (((type *)(ar)->data)[(i)])
+
+/**
+ * Create new array in the memory pool
+ * @param pool memory pool object
+ * @param elt_size size of an element
+ * @param reserved number of elements to preallocate
+ * @return new array
+ */
+rspamd_mempool_array_t *rspamd_mempool_array_new (rspamd_mempool_t *pool,
+												  guint elt_size, guint reserved);
+
+/**
+ * Append element to the array
+ * @param ar array
+ * @param elt element to copy, if NULL then the new element is zeroed
+ * @return pointer to the new element
+ */
+gpointer rspamd_mempool_array_append (rspamd_mempool_array_t *ar,
+									  gconstpointer elt);
+
+/**
+ * Hash set of non-NULL pointers that is allocated entirely from the memory
+ * pool using open addressing
+ */
+typedef struct rspamd_mempool_hash_set_s {
+	gpointer *buckets;
+	GHashFunc hash;
+	GEqualFunc equal;
+	guint nbuckets;
+	guint nelts;
+	rspamd_mempool_t *pool;
+} rspamd_mempool_hash_set_t;
+
+/**
+ * Create new hash set in the memory pool
+ * @param pool memory pool object
+ * @param hash hash function for elements
+ * @param equal equality function for elements
+ * @param reserved number of elements to preallocate
+ * @return new hash set
+ */
+rspamd_mempool_hash_set_t *rspamd_mempool_hash_set_new (rspamd_mempool_t *pool,
+														GHashFunc hash,
+														GEqualFunc equal,
+														guint reserved);
+
+/**
+ * Find an element equal to `key` in the hash set
+ * @return element or NULL if it is not found
+ */
+gpointer rspamd_mempool_hash_set_lookup (rspamd_mempool_hash_set_t *set,
+										 gconstpointer key);
+
+/**
+ * Add element to the hash set, element is not copied
+ * @return TRUE if element has been added, FALSE if an equal element exists
+ */
+gboolean rspamd_mempool_hash_set_add (rspamd_mempool_hash_set_t *set,
+									  gpointer elt);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -73,6 +73,7 @@ struct rspamd_mempool_specific {
 	khash_t(rspamd_mempool_vars_hash) *variables;
 	struct rspamd_mempool_entry_point *entry;
 	gsize elt_len;                            /**< size of an element						*/
+	gsize block_len;                          /**< size of the initial memory block			*/
 	gsize used_memory;
 	guint wasted_memory;
 	gint flags;
@@ -2621,6 +2621,7 @@ lua_config_add_composite (lua_State * L)
 				g_hash_table_insert (cfg->composite_symbols,
 						(gpointer)name,
 						composite);
+				cfg->composites_version ++;
 
 				if (new) {
 					rspamd_symcache_add_symbol (cfg->cache, name,
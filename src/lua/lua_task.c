@@ -4447,7 +4447,7 @@ lua_push_symbol_result (lua_State *L,
 
 		if (s->options) {
 			lua_pushstring (L, "options");
-			lua_createtable (L, kh_size (s->options), 0);
+			lua_createtable (L, s->options->nelts, 0);
 
 			DL_FOREACH (s->opts_head, opt) {
 				lua_pushlstring (L, opt->option, opt->optlen);
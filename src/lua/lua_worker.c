@@ -142,6 +142,8 @@ lua_worker_get_stat (lua_State *L)
 		ucl_object_insert_key (top,
 				ucl_object_fromint (
 						mem_st.oversized_chunks), "chunks_oversized", 0, false);
+		ucl_object_insert_key (top,
+				ucl_object_fromint (mem_st.chunks_reused), "chunks_reused", 0, false);
 
 		ucl_object_push_lua (L, top, true);
 		ucl_object_unref (top);
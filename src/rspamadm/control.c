@@ -85,7 +85,9 @@ rspamadm_control_help (gboolean full_help, const struct rspamadm_command *cmd)
 				"reresolve - resolve upstreams addresses\n"
 				"recompile - recompile hyperscan regexes\n"
 				"fuzzystat - show fuzzy statistics\n"
-				"fuzzysync - immediately sync fuzzy database to storage\n";
+				"fuzzysync - immediately sync fuzzy database to storage\n"
+				"mempool - show memory pools allocation sites (requires\n"
+				"  RSPAMD_MEMPOOL_SITES environment variable for rspamd)\n";
 	}
 	else {
 		help_str = "Manage rspamd main control interface";
@@ -218,6 +220,9 @@ rspamadm_control (gint argc, gchar **argv, const struct rspamadm_command *_cmd)
 			g_ascii_strcasecmp (cmd, "fuzzy_sync") == 0) {
 		path = "/fuzzysync";
 	}
+	else if (g_ascii_strcasecmp (cmd, "mempool") == 0) {
+		path = "/mempool";
+	}
 	else {
 		rspamd_fprintf (stderr, "unknown command: %s\n", cmd);
 		exit (1);
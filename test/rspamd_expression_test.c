@@ -0,0 +1,174 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libutil/expression.h"
+#include "ottery.h"
+#include "tests.h"
+
+/*
+ * Compares AST and compiled program evaluation on meta rules shaped like
+ * the ones imported from SpamAssassin rules
+ */
+static const guint nrules = 64;
+static const guint ninputs = 256;
+static const guint niters = 200;
+
+static rspamd_expression_atom_t *
+rspamd_expression_test_parse (const gchar *line, gsize len,
+		rspamd_mempool_t *pool, gpointer ud, GError **err)
+{
+	rspamd_expression_atom_t *atom;
+	gsize alen;
+
+	alen = strcspn (line, "; \t()><!|&+\n");
+
+	if (alen == 0 || alen > len) {
+		g_set_error (err, g_quark_from_static_string ("expression-test"),
+				100, "invalid atom: %s", line);
+		return NULL;
+	}
+
+	atom = rspamd_mempool_alloc0 (pool, sizeof (*atom));
+	atom->str = line;
+	atom->len = alen;
+	/* __SA_<num> */
+	atom->data = GUINT_TO_POINTER (strtoul (line + 5, NULL, 10));
+
+	return atom;
+}
+
+static gdouble
+rspamd_expression_test_process (gpointer ud, rspamd_expression_atom_t *atom)
+{
+	const guint8 *input = ud;
+
+	return input[GPOINTER_TO_UINT (atom->data)];
+}
+
+static gint
+rspamd_expression_test_priority (rspamd_expression_atom_t *atom)
+{
+	return 0;
+}
+
+static const struct rspamd_atom_subr test_subr = {
+	.parse = rspamd_expression_test_parse,
+	.process = rspamd_expression_test_process,
+	.priority = rspamd_expression_test_priority,
+	.destroy = NULL
+};
+
+static gdouble
+rspamd_expression_test_run (struct rspamd_expression *expr, guint8 **inputs,
+		gint flags, gdouble *sum)
+{
+	gdouble t1, t2;
+	guint i, j;
+
+	*sum = 0;
+	t1 = rspamd_get_virtual_ticks ();
+
+	for (i = 0; i < niters; i ++) {
+		for (j = 0; j < ninputs; j ++) {
+			*sum += rspamd_process_expression (expr, flags, inputs[j]);
+		}
+	}
+
+	t2 = rspamd_get_virtual_ticks ();
+
+	return t2 - t1;
+}
+
+void
+rspamd_expression_test_func (void)
+{
+	rspamd_mempool_t *pool;
+	struct rspamd_expression *expr;
+	GString *line;
+	GError *err = NULL;
+	guint8 **inputs;
+	guint i, j, natoms, base;
+	gdouble t_tree, t_code, r_tree, r_code, sum_tree, sum_code;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "expression", 0);
+	line = g_string_new (NULL);
+
+	/* meta RULE (__A && !__B && (__C || __D)) || (__E + __F + __G > 1) || ... */
+	for (i = 0; i < nrules; i ++) {
+		base = i * 7;
+
+		if (i > 0) {
+			g_string_append (line, " || ");
+		}
+
+		rspamd_printf_gstring (line,
+				"(__SA_%ud && !__SA_%ud && (__SA_%ud || __SA_%ud)) || "
+				"(__SA_%ud + __SA_%ud + __SA_%ud > 1)",
+				base, base + 1, base + 2, base + 3, base + 4, base + 5, base + 6);
+	}
+
+	natoms = nrules * 7;
+
+	if (!rspamd_parse_expression (line->str, line->len, &test_subr, NULL, pool,
+			&err, &expr)) {
+		msg_err ("cannot parse expression: %e", err);
+		g_assert_not_reached ();
+	}
+
+	/* Mostly negative inputs as most rules do not match */
+	inputs = g_malloc (sizeof (*inputs) * ninputs);
+
+	for (i = 0; i < ninputs; i ++) {
+		inputs[i] = g_malloc (natoms);
+
+		for (j = 0; j < natoms; j ++) {
+			inputs[i][j] = (ottery_rand_range (99) < 10) ? 1 : 0;
+		}
+	}
+
+	/* Compare results first */
+	for (i = 0; i < ninputs; i ++) {
+		r_tree = rspamd_process_expression (expr, RSPAMD_EXPRESSION_FLAG_TREE,
+				inputs[i]);
+		r_code = rspamd_process_expression (expr, 0, inputs[i]);
+		g_assert (r_tree == r_code);
+
+		r_tree = rspamd_process_expression (expr,
+				RSPAMD_EXPRESSION_FLAG_TREE|RSPAMD_EXPRESSION_FLAG_NOOPT,
+				inputs[i]);
+		r_code = rspamd_process_expression (expr, RSPAMD_EXPRESSION_FLAG_NOOPT,
+				inputs[i]);
+		g_assert (r_tree == r_code);
+	}
+
+	t_tree = rspamd_expression_test_run (expr, inputs,
+			RSPAMD_EXPRESSION_FLAG_TREE, &sum_tree);
+	t_code = rspamd_expression_test_run (expr, inputs, 0, &sum_code);
+	g_assert (sum_tree == sum_code);
+
+	msg_notice ("expression of %ud atoms, %ud evaluations: "
+			"tree: %1.5f, compiled: %1.5f, ratio: %.2f",
+			natoms, niters * ninputs, t_tree, t_code,
+			t_code > 0 ? t_tree / t_code : 0.0);
+
+	for (i = 0; i < ninputs; i ++) {
+		g_free (inputs[i]);
+	}
+
+	g_free (inputs);
+	g_string_free (line, TRUE);
+	rspamd_mempool_delete (pool);
+}
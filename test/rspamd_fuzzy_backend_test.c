@@ -0,0 +1,222 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_wire.h"
+#include "libserver/fuzzy_backend/fuzzy_backend_memory.h"
+#include "ottery.h"
+#include "tests.h"
+
+/*
+ * Checks exact and shingle matches in the in-memory fuzzy backend, both in
+ * writable tables and in the mapped snapshot
+ */
+static const guint nhashes = 50000;
+static const gint64 expire = 86400;
+
+static void
+rspamd_fuzzy_backend_test_cmd (struct rspamd_fuzzy_shingle_cmd *cmd,
+		guint flag, gint value)
+{
+	guint i;
+
+	memset (cmd, 0, sizeof (*cmd));
+	cmd->basic.cmd = FUZZY_WRITE;
+	cmd->basic.flag = flag;
+	cmd->basic.value = value;
+	cmd->basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+	ottery_rand_bytes (cmd->basic.digest, sizeof (cmd->basic.digest));
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		cmd->sgl.hashes[i] = ottery_rand_uint64 ();
+	}
+}
+
+static void
+rspamd_fuzzy_backend_test_check (struct rspamd_fuzzy_backend_memory *bk,
+		struct rspamd_fuzzy_shingle_cmd *cmds)
+{
+	struct rspamd_fuzzy_shingle_cmd probe;
+	struct rspamd_fuzzy_reply rep;
+	guint i, j;
+
+	for (i = 0; i < nhashes; i ++) {
+		rep = rspamd_fuzzy_backend_memory_check (bk, &cmds[i].basic, expire);
+		g_assert (rep.v1.prob == 1.0);
+		g_assert_cmpint (rep.v1.value, ==, 1);
+		g_assert_cmpuint (rep.v1.flag, ==, 1);
+	}
+
+	/* Most of shingles are the same */
+	for (i = 0; i < nhashes; i += 100) {
+		rspamd_fuzzy_backend_test_cmd (&probe, 1, 1);
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE * 3 / 4; j ++) {
+			probe.sgl.hashes[j] = cmds[i].sgl.hashes[j];
+		}
+
+		rep = rspamd_fuzzy_backend_memory_check (bk, &probe.basic, expire);
+		g_assert (rep.v1.prob == 0.75);
+		g_assert_cmpint (rep.v1.value, ==, 1);
+		g_assert (memcmp (rep.digest, cmds[i].basic.digest,
+				sizeof (rep.digest)) == 0);
+	}
+
+	/* Not enough shingles */
+	rspamd_fuzzy_backend_test_cmd (&probe, 1, 1);
+
+	for (j = 0; j < RSPAMD_SHINGLE_SIZE / 4; j ++) {
+		probe.sgl.hashes[j] = cmds[0].sgl.hashes[j];
+	}
+
+	rep = rspamd_fuzzy_backend_memory_check (bk, &probe.basic, expire);
+	g_assert (rep.v1.prob < 0.5);
+	g_assert_cmpint (rep.v1.value, ==, 0);
+}
+
+void
+rspamd_fuzzy_backend_test_func (void)
+{
+	struct rspamd_fuzzy_backend_memory *bk;
+	struct rspamd_fuzzy_shingle_cmd *cmds, dup, probe;
+	struct rspamd_fuzzy_reply rep;
+	struct ev_loop *loop;
+	gchar *fname;
+	GError *err = NULL;
+	gdouble t1, t2;
+	guint i;
+
+	fname = g_strdup_printf ("%s/rspamd-test-fuzzy-%d.snapshot",
+			g_get_tmp_dir (), (gint)getpid ());
+	unlink (fname);
+
+	bk = rspamd_fuzzy_backend_memory_open (fname, 600.0, NULL, NULL, &err);
+	g_assert (bk != NULL);
+
+	cmds = g_malloc (sizeof (*cmds) * nhashes);
+
+	for (i = 0; i < nhashes; i ++) {
+		rspamd_fuzzy_backend_test_cmd (&cmds[i], 1, 1);
+		g_assert (rspamd_fuzzy_backend_memory_add (bk, &cmds[i].basic));
+	}
+
+	rspamd_fuzzy_backend_memory_finish_update (bk, "local", TRUE);
+	g_assert_cmpuint (rspamd_fuzzy_backend_memory_count (bk), ==, nhashes);
+	g_assert_cmpint (rspamd_fuzzy_backend_memory_version (bk, "local"), ==, 1);
+
+	t1 = rspamd_get_virtual_ticks ();
+	rspamd_fuzzy_backend_test_check (bk, cmds);
+	t2 = rspamd_get_virtual_ticks ();
+
+	msg_notice ("checked %ud hashes: %1.5f", nhashes, t2 - t1);
+
+	/* Weight is increased for the same flag and reset for another one */
+	rspamd_fuzzy_backend_memory_add (bk, &cmds[0].basic);
+	rep = rspamd_fuzzy_backend_memory_check (bk, &cmds[0].basic, expire);
+	g_assert_cmpint (rep.v1.value, ==, 2);
+	cmds[0].basic.flag = 2;
+	rspamd_fuzzy_backend_memory_add (bk, &cmds[0].basic);
+	rep = rspamd_fuzzy_backend_memory_check (bk, &cmds[0].basic, expire);
+	g_assert_cmpint (rep.v1.value, ==, 1);
+	g_assert_cmpuint (rep.v1.flag, ==, 2);
+	cmds[0].basic.flag = 1;
+	rspamd_fuzzy_backend_memory_add (bk, &cmds[0].basic);
+
+	/* Deleted hashes do not match neither directly nor by shingles */
+	g_assert (rspamd_fuzzy_backend_memory_del (bk, &cmds[nhashes - 1].basic));
+	rep = rspamd_fuzzy_backend_memory_check (bk, &cmds[nhashes - 1].basic,
+			expire);
+	g_assert (rep.v1.prob == 0.0);
+	cmds[nhashes - 1].basic.digest[0] ++;
+	rep = rspamd_fuzzy_backend_memory_check (bk, &cmds[nhashes - 1].basic,
+			expire);
+	g_assert (rep.v1.prob == 0.0);
+	cmds[nhashes - 1].basic.digest[0] --;
+	g_assert (rspamd_fuzzy_backend_memory_add (bk, &cmds[nhashes - 1].basic));
+
+	/* Snapshot is written on close and mapped on open */
+	rspamd_fuzzy_backend_memory_close (bk);
+	t1 = rspamd_get_virtual_ticks ();
+	bk = rspamd_fuzzy_backend_memory_open (fname, 600.0, NULL, NULL, &err);
+	t2 = rspamd_get_virtual_ticks ();
+	g_assert (bk != NULL);
+	msg_notice ("mapped %Hz hashes: %1.5f",
+			rspamd_fuzzy_backend_memory_count (bk), t2 - t1);
+
+	g_assert_cmpuint (rspamd_fuzzy_backend_memory_count (bk), ==, nhashes);
+	g_assert_cmpint (rspamd_fuzzy_backend_memory_version (bk, "local"), ==, 1);
+	t1 = rspamd_get_virtual_ticks ();
+	rspamd_fuzzy_backend_test_check (bk, cmds);
+	t2 = rspamd_get_virtual_ticks ();
+	msg_notice ("checked %ud mapped hashes: %1.5f", nhashes, t2 - t1);
+
+	/* The first update builds tables from the snapshot */
+	g_assert (rspamd_fuzzy_backend_memory_del (bk, &cmds[nhashes - 1].basic));
+	g_assert_cmpuint (rspamd_fuzzy_backend_memory_count (bk), ==, nhashes - 1);
+	g_assert (rspamd_fuzzy_backend_memory_add (bk, &cmds[nhashes - 1].basic));
+	g_assert_cmpint (rspamd_fuzzy_backend_memory_version (bk, "local"), ==, 1);
+	rspamd_fuzzy_backend_test_check (bk, cmds);
+	rspamd_fuzzy_backend_memory_close (bk);
+
+	/* Snapshot written by a child process is mapped on open */
+	bk = rspamd_fuzzy_backend_memory_open (fname, 0.0, NULL, NULL, &err);
+	g_assert (bk != NULL);
+	g_assert (rspamd_fuzzy_backend_memory_del (bk, &cmds[nhashes - 1].basic));
+	g_assert (rspamd_fuzzy_backend_memory_sync (bk, 0, FALSE));
+	/* Waits for the child, there is nothing to write after it */
+	rspamd_fuzzy_backend_memory_close (bk);
+	bk = rspamd_fuzzy_backend_memory_open (fname, 600.0, NULL, NULL, &err);
+	g_assert (bk != NULL);
+	g_assert_cmpuint (rspamd_fuzzy_backend_memory_count (bk), ==, nhashes - 1);
+	rep = rspamd_fuzzy_backend_memory_check (bk, &cmds[nhashes - 1].basic,
+			expire);
+	g_assert (rep.v1.prob == 0.0);
+	rspamd_fuzzy_backend_memory_close (bk);
+
+	/* Updates are applied to tables being built, the newest hash owns shingles */
+	loop = ev_loop_new (EVFLAG_AUTO);
+	bk = rspamd_fuzzy_backend_memory_open (fname, 600.0, loop, NULL, &err);
+	g_assert (bk != NULL);
+	memcpy (&dup, &cmds[0], sizeof (dup));
+	ottery_rand_bytes (dup.basic.digest, sizeof (dup.basic.digest));
+	g_assert (rspamd_fuzzy_backend_memory_add (bk, &dup.basic));
+	g_assert (rspamd_fuzzy_backend_memory_del (bk, &cmds[1].basic));
+	g_assert_cmpuint (rspamd_fuzzy_backend_memory_count (bk), ==, nhashes - 1);
+
+	for (i = 0; i < 2; i ++) {
+		rep = rspamd_fuzzy_backend_memory_check (bk, &cmds[0].basic, expire);
+		g_assert (rep.v1.prob == 1.0);
+		rep = rspamd_fuzzy_backend_memory_check (bk, &cmds[1].basic, expire);
+		g_assert (rep.v1.prob == 0.0);
+		memcpy (&probe, &dup, sizeof (probe));
+		probe.basic.digest[0] ++;
+		rep = rspamd_fuzzy_backend_memory_check (bk, &probe.basic, expire);
+		g_assert (rep.v1.prob == 1.0);
+		g_assert (memcmp (rep.digest, dup.basic.digest, sizeof (rep.digest)) == 0);
+
+		/* Close finishes the build, the snapshot keeps shingles owners */
+		rspamd_fuzzy_backend_memory_close (bk);
+		bk = rspamd_fuzzy_backend_memory_open (fname, 600.0, NULL, NULL, &err);
+		g_assert (bk != NULL);
+		g_assert_cmpuint (rspamd_fuzzy_backend_memory_count (bk), ==,
+				nhashes - 1);
+	}
+
+	rspamd_fuzzy_backend_memory_close (bk);
+	ev_loop_destroy (loop);
+	unlink (fname);
+	g_free (fname);
+	g_free (cmds);
+}
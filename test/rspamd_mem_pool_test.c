@@ -33,7 +33,51 @@ rspamd_mem_pool_test_func ()
 	g_assert (strncmp (tmp2, TEST2_BUF, sizeof (TEST2_BUF)) == 0);
 	g_assert (strncmp (tmp3, TEST_BUF, sizeof (TEST_BUF)) == 0);
 
+	/* Pool-native containers */
+	rspamd_mempool_array_t *ar;
+	rspamd_mempool_hash_set_t *set;
+	guint i, *pi;
+
+	ar = rspamd_mempool_array_new (pool, sizeof (guint), 0);
+	set = rspamd_mempool_hash_set_new (pool, g_int_hash, g_int_equal, 0);
+
+	for (i = 0; i < 1000; i ++) {
+		rspamd_mempool_array_append (ar, &i);
+		pi = rspamd_mempool_alloc (pool, sizeof (*pi));
+		*pi = i;
+		g_assert (rspamd_mempool_hash_set_add (set, pi));
+	}
+
+	g_assert_cmpuint (ar->len, ==, 1000);
+	g_assert_cmpuint (set->nelts, ==, 1000);
+
+	for (i = 0; i < 1000; i ++) {
+		g_assert_cmpuint (rspamd_mempool_array_index (ar, guint, i), ==, i);
+		pi = rspamd_mempool_hash_set_lookup (set, &i);
+		g_assert (pi != NULL && *pi == i);
+		g_assert (!rspamd_mempool_hash_set_add (set, &i));
+	}
+
+	i = 1000;
+	g_assert (rspamd_mempool_hash_set_lookup (set, &i) == NULL);
+
 	rspamd_mempool_delete (pool);
 	rspamd_mempool_stat (&st);
 
+	/* Chains of the deleted pools are reused by the next pools */
+	if (getenv ("VALGRIND") == NULL) {
+		guint reused = st.chunks_reused;
+
+		for (i = 0; i < 2; i ++) {
+			pool = rspamd_mempool_new (4096, NULL, 0);
+			tmp = rspamd_mempool_alloc (pool, 4096);
+			tmp2 = rspamd_mempool_alloc (pool, 8192);
+			memset (tmp, 0, 4096);
+			memset (tmp2, 0, 8192);
+			rspamd_mempool_delete (pool);
+		}
+
+		rspamd_mempool_stat (&st);
+		g_assert_cmpuint (st.chunks_reused, >=, reused + 2);
+	}
 }
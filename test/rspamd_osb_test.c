@@ -0,0 +1,443 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/task.h"
+#include "libstat/stat_internal.h"
+#include "libstat/tokenizers/tokenizers.h"
+#include "ottery.h"
+#include "tests.h"
+#include <math.h>
+
+extern struct rspamd_main *rspamd_main;
+extern struct ev_loop *event_loop;
+
+/*
+ * Compares batched and reference OSB tokenizers on a text corpus: a file
+ * from RSPAMD_TEST_CORPUS environment variable or a generated text with
+ * Zipf-like words distribution. Set RSPAMD_TEST_BENCHMARK to compare
+ * timings on a large corpus.
+ */
+static const guint nvocabulary = 5000;
+static guint nwords = 10000;
+static guint niters = 1;
+
+/* Mirrors the private tokenizer config and primes from osb.c */
+static const int rspamd_osb_test_primes[] = {
+	1, 7,
+	3, 13,
+	5, 29,
+	11, 51,
+	23, 101,
+	47, 203,
+	97, 407,
+	197, 817,
+	397, 1637,
+	797, 3277,
+};
+
+enum rspamd_osb_test_hash_type {
+	RSPAMD_OSB_TEST_HASH_COMPAT = 0,
+	RSPAMD_OSB_TEST_HASH_XXHASH,
+	RSPAMD_OSB_TEST_HASH_SIPHASH
+};
+
+struct rspamd_osb_test_config {
+	guchar magic[8];
+	gshort version;
+	gshort window_size;
+	enum rspamd_osb_test_hash_type ht;
+	guint64 seed;
+	rspamd_sipkey_t sk;
+};
+
+struct rspamd_osb_test_pipe_entry {
+	guint64 h;
+	rspamd_stat_token_t *t;
+};
+
+/*
+ * Reference tokenizer that allocates and hashes tokens one by one, it is the
+ * tokenizer from before batching and must not be changed along with osb.c
+ */
+static gint
+rspamd_osb_test_reference (struct rspamd_stat_ctx *ctx,
+		struct rspamd_task *task,
+		GArray *words,
+		gboolean is_utf,
+		const gchar *prefix,
+		GPtrArray *result)
+{
+	rspamd_token_t *new_tok = NULL;
+	rspamd_stat_token_t *token;
+	struct rspamd_osb_test_config *osb_cf;
+	guint64 cur, seed;
+	struct rspamd_osb_test_pipe_entry *hashpipe;
+	guint32 h1, h2;
+	gsize token_size;
+	guint processed = 0, i, w, window_size, token_flags = 0;
+
+	if (words == NULL) {
+		return FALSE;
+	}
+
+	osb_cf = ctx->tkcf;
+	window_size = osb_cf->window_size;
+
+	if (prefix) {
+		seed = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+				prefix, strlen (prefix), osb_cf->seed);
+	}
+	else {
+		seed = osb_cf->seed;
+	}
+
+	hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
+	for (i = 0; i < window_size; i++) {
+		hashpipe[i].h = 0xfe;
+		hashpipe[i].t = NULL;
+	}
+
+	token_size = sizeof (rspamd_token_t) +
+			sizeof (gdouble) * ctx->statfiles->len;
+	g_assert (token_size > 0);
+
+	for (w = 0; w < words->len; w ++) {
+		token = &g_array_index (words, rspamd_stat_token_t, w);
+		token_flags = token->flags;
+		const gchar *begin;
+		gsize len;
+
+		if (token->flags &
+			(RSPAMD_STAT_TOKEN_FLAG_STOP_WORD|RSPAMD_STAT_TOKEN_FLAG_SKIPPED)) {
+			/* Skip stop/skipped words */
+			continue;
+		}
+
+		if (token->flags & RSPAMD_STAT_TOKEN_FLAG_TEXT) {
+			begin = token->stemmed.begin;
+			len = token->stemmed.len;
+		}
+		else {
+			begin = token->original.begin;
+			len = token->original.len;
+		}
+
+		if (osb_cf->ht == RSPAMD_OSB_TEST_HASH_COMPAT) {
+			rspamd_ftok_t ftok;
+
+			ftok.begin = begin;
+			ftok.len = len;
+			cur = rspamd_fstrhash_lc (&ftok, is_utf);
+		}
+		else {
+			/* We know that the words are normalized */
+			if (osb_cf->ht == RSPAMD_OSB_TEST_HASH_XXHASH) {
+				cur = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+						begin, len, osb_cf->seed);
+			}
+			else {
+				rspamd_cryptobox_siphash ((guchar *)&cur, begin,
+						len, osb_cf->sk);
+
+				if (prefix) {
+					cur ^= seed;
+				}
+			}
+		}
+
+		if (token_flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+			new_tok = rspamd_mempool_alloc0 (task->task_pool, token_size);
+			new_tok->flags = token_flags;
+			new_tok->t1 = token;
+			new_tok->t2 = token;
+			new_tok->data = cur;
+			new_tok->window_idx = 0;
+			g_ptr_array_add (result, new_tok);
+
+			continue;
+		}
+
+#define ADD_TOKEN do {\
+    new_tok = rspamd_mempool_alloc0 (task->task_pool, token_size); \
+    new_tok->flags = token_flags; \
+    new_tok->t1 = hashpipe[0].t; \
+    new_tok->t2 = hashpipe[i].t; \
+    if (osb_cf->ht == RSPAMD_OSB_TEST_HASH_COMPAT) { \
+        h1 = ((guint32)hashpipe[0].h) * rspamd_osb_test_primes[0] + \
+            ((guint32)hashpipe[i].h) * rspamd_osb_test_primes[i << 1]; \
+        h2 = ((guint32)hashpipe[0].h) * rspamd_osb_test_primes[1] + \
+            ((guint32)hashpipe[i].h) * rspamd_osb_test_primes[(i << 1) - 1]; \
+        memcpy((guchar *)&new_tok->data, &h1, sizeof (h1)); \
+        memcpy(((guchar *)&new_tok->data) + sizeof (h1), &h2, sizeof (h2)); \
+    } \
+    else { \
+        new_tok->data = hashpipe[0].h * rspamd_osb_test_primes[0] + hashpipe[i].h * rspamd_osb_test_primes[i << 1]; \
+    } \
+    new_tok->window_idx = i; \
+    g_ptr_array_add (result, new_tok); \
+  } while(0)
+
+		if (processed < window_size) {
+			/* Just fill a hashpipe */
+			++processed;
+			hashpipe[window_size - processed].h = cur;
+			hashpipe[window_size - processed].t = token;
+		}
+		else {
+			/* Shift hashpipe */
+			for (i = window_size - 1; i > 0; i--) {
+				hashpipe[i] = hashpipe[i - 1];
+			}
+			hashpipe[0].h = cur;
+			hashpipe[0].t = token;
+
+			processed++;
+
+			for (i = 1; i < window_size; i++) {
+				if (!(hashpipe[i].t->flags & RSPAMD_STAT_TOKEN_FLAG_EXCEPTION)) {
+					ADD_TOKEN;
+				}
+			}
+		}
+	}
+
+	if (processed > 1 && processed <= window_size) {
+		processed --;
+		memmove (hashpipe, &hashpipe[window_size - processed],
+				processed * sizeof (hashpipe[0]));
+
+		for (i = 1; i < processed; i++) {
+			ADD_TOKEN;
+		}
+	}
+
+#undef ADD_TOKEN
+
+	return TRUE;
+}
+
+static void
+rspamd_osb_test_add_word (GArray *words, const gchar *begin, gsize len)
+{
+	rspamd_stat_token_t tok;
+	guint r;
+
+	memset (&tok, 0, sizeof (tok));
+	tok.original.begin = begin;
+	tok.original.len = len;
+	tok.normalized = tok.original;
+	tok.stemmed = tok.original;
+	tok.flags = RSPAMD_STAT_TOKEN_FLAG_TEXT;
+
+	r = ottery_rand_range (99);
+
+	if (r < 2) {
+		tok.flags |= RSPAMD_STAT_TOKEN_FLAG_STOP_WORD;
+	}
+	else if (r < 3) {
+		tok.flags |= RSPAMD_STAT_TOKEN_FLAG_EXCEPTION;
+	}
+	else if (r < 4) {
+		tok.flags = RSPAMD_STAT_TOKEN_FLAG_META|RSPAMD_STAT_TOKEN_FLAG_UNIGRAM;
+	}
+
+	g_array_append_val (words, tok);
+}
+
+static GArray *
+rspamd_osb_test_corpus (rspamd_mempool_t *pool)
+{
+	GArray *words;
+	const gchar *fname, *p, *end, *c;
+	gchar **vocabulary, *text;
+	gsize len;
+	guint i, j, wlen;
+
+	words = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_stat_token_t),
+			nwords);
+	fname = g_getenv ("RSPAMD_TEST_CORPUS");
+
+	if (fname && g_file_get_contents (fname, &text, &len, NULL)) {
+		rspamd_mempool_add_destructor (pool, g_free, text);
+		p = text;
+		end = text + len;
+
+		while (p < end) {
+			while (p < end && g_ascii_isspace (*p)) {
+				p ++;
+			}
+
+			c = p;
+
+			while (p < end && !g_ascii_isspace (*p)) {
+				p ++;
+			}
+
+			if (p > c) {
+				rspamd_osb_test_add_word (words, c, p - c);
+			}
+		}
+
+		msg_notice ("loaded %ud words from %s", words->len, fname);
+
+		return words;
+	}
+
+	vocabulary = rspamd_mempool_alloc (pool, sizeof (*vocabulary) * nvocabulary);
+
+	for (i = 0; i < nvocabulary; i ++) {
+		wlen = ottery_rand_range (10) + 2;
+		vocabulary[i] = rspamd_mempool_alloc (pool, wlen + 1);
+
+		for (j = 0; j < wlen; j ++) {
+			vocabulary[i][j] = 'a' + ottery_rand_range (25);
+		}
+
+		vocabulary[i][wlen] = '\0';
+	}
+
+	for (i = 0; i < nwords; i ++) {
+		/* Frequent words have small indexes */
+		j = (guint)pow (nvocabulary, ottery_rand_range (10000) / 10000.0) - 1;
+		rspamd_osb_test_add_word (words, vocabulary[j], strlen (vocabulary[j]));
+	}
+
+	return words;
+}
+
+/* Tokens of each run are allocated in a separate task pool */
+static gdouble
+rspamd_osb_test_run (struct rspamd_stat_ctx *ctx, struct rspamd_task **ptask,
+		GArray *words, gboolean batch, GPtrArray **result)
+{
+	gdouble t1, t2, total = 0;
+	guint i;
+
+	for (i = 0; i < niters; i ++) {
+		if (*result) {
+			g_ptr_array_free (*result, TRUE);
+		}
+
+		if (*ptask) {
+			rspamd_task_free (*ptask);
+		}
+
+		*ptask = rspamd_task_new (NULL, rspamd_main->cfg, NULL, NULL,
+				event_loop, FALSE);
+		*result = g_ptr_array_sized_new (words->len * 4);
+
+		t1 = rspamd_get_virtual_ticks ();
+
+		if (batch) {
+			rspamd_tokenizer_osb (ctx, *ptask, words, FALSE, NULL, *result);
+		}
+		else {
+			rspamd_osb_test_reference (ctx, *ptask, words, FALSE, NULL,
+					*result);
+		}
+
+		t2 = rspamd_get_virtual_ticks ();
+		total += t2 - t1;
+	}
+
+	return total;
+}
+
+static void
+rspamd_osb_test_compare (GPtrArray *r1, GPtrArray *r2)
+{
+	rspamd_token_t *t1, *t2;
+	guint i;
+
+	g_assert_cmpuint (r1->len, ==, r2->len);
+
+	for (i = 0; i < r1->len; i ++) {
+		t1 = g_ptr_array_index (r1, i);
+		t2 = g_ptr_array_index (r2, i);
+
+		g_assert (t1->data == t2->data);
+		g_assert_cmpuint (t1->window_idx, ==, t2->window_idx);
+		g_assert_cmpuint (t1->flags, ==, t2->flags);
+		g_assert (t1->t1 == t2->t1);
+		g_assert (t1->t2 == t2->t2);
+	}
+}
+
+void
+rspamd_osb_test_func (void)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_stat_ctx ctx;
+	struct rspamd_task *task, *t_simple_task = NULL, *t_batch_task = NULL;
+	GArray *words, *short_words;
+	GPtrArray *r_simple = NULL, *r_batch = NULL;
+	gdouble t_simple, t_batch;
+	gboolean bench = g_getenv ("RSPAMD_TEST_BENCHMARK") != NULL;
+	guint i;
+
+	if (bench) {
+		nwords = 200000;
+		niters = 20;
+	}
+
+	task = rspamd_task_new (NULL, cfg, NULL, NULL, event_loop, FALSE);
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.statfiles = g_ptr_array_new ();
+	ctx.tkcf = rspamd_tokenizer_osb_get_config (task->task_pool, NULL, NULL);
+
+	/* Texts shorter than the window are handled separately */
+	for (i = 0; i < 8; i ++) {
+		short_words = g_array_new (FALSE, FALSE, sizeof (rspamd_stat_token_t));
+
+		while (short_words->len < i) {
+			rspamd_osb_test_add_word (short_words, "word", 4);
+		}
+
+		r_simple = g_ptr_array_new ();
+		r_batch = g_ptr_array_new ();
+		rspamd_osb_test_reference (&ctx, task, short_words, FALSE, NULL,
+				r_simple);
+		rspamd_tokenizer_osb (&ctx, task, short_words, FALSE, NULL, r_batch);
+		rspamd_osb_test_compare (r_simple, r_batch);
+		g_ptr_array_free (r_simple, TRUE);
+		g_ptr_array_free (r_batch, TRUE);
+		g_array_free (short_words, TRUE);
+	}
+
+	r_simple = NULL;
+	r_batch = NULL;
+	words = rspamd_osb_test_corpus (task->task_pool);
+
+	t_simple = rspamd_osb_test_run (&ctx, &t_simple_task, words, FALSE,
+			&r_simple);
+	t_batch = rspamd_osb_test_run (&ctx, &t_batch_task, words, TRUE, &r_batch);
+	rspamd_osb_test_compare (r_simple, r_batch);
+
+	if (bench) {
+		msg_notice ("tokenized %ud words into %ud tokens %ud times: "
+				"simple: %1.5f, batch: %1.5f",
+				words->len, r_batch->len, niters, t_simple, t_batch);
+	}
+
+	g_ptr_array_free (r_simple, TRUE);
+	g_ptr_array_free (r_batch, TRUE);
+	g_array_free (words, TRUE);
+	g_ptr_array_free (ctx.statfiles, TRUE);
+	rspamd_task_free (t_simple_task);
+	rspamd_task_free (t_batch_task);
+	rspamd_task_free (task);
+}
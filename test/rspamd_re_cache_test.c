@@ -0,0 +1,128 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/task.h"
+#include "libserver/re_cache.h"
+#include "libmime/message.h"
+#include "tests.h"
+
+extern struct rspamd_main *rspamd_main;
+extern struct ev_loop *event_loop;
+
+/*
+ * Checks that regexp results shared between workers are keyed by the whole
+ * message and that a shared hit is not rescanned
+ */
+static const gchar *msg_foo =
+		"From: <test@example.com>\r\n"
+		"Subject: shared results\r\n"
+		"X-Test: foo\r\n"
+		"\r\n"
+		"foo bar foo\r\n";
+/* Differs in a header not covered by the message digest only */
+static const gchar *msg_bar =
+		"From: <test@example.com>\r\n"
+		"Subject: shared results\r\n"
+		"X-Test: bar\r\n"
+		"\r\n"
+		"foo bar foo\r\n";
+
+struct rspamd_re_cache_test_res {
+	gint hdr;
+	gint body;
+	gint body_more;
+};
+
+static void
+rspamd_re_cache_test_run (struct rspamd_config *cfg,
+		const gchar *msg,
+		rspamd_regexp_t *hdr_re,
+		rspamd_regexp_t *body_re,
+		rspamd_regexp_t *body_more_re,
+		struct rspamd_re_cache_test_res *res)
+{
+	struct rspamd_task *task;
+
+	task = rspamd_task_new (NULL, cfg, NULL, NULL, event_loop, FALSE);
+	task->msg.begin = msg;
+	task->msg.len = strlen (msg);
+	g_assert (rspamd_message_parse (task));
+
+	res->hdr = rspamd_re_cache_process (task, hdr_re, RSPAMD_RE_HEADER,
+			"X-Test", sizeof ("X-Test") - 1, FALSE);
+	res->body = rspamd_re_cache_process (task, body_re, RSPAMD_RE_BODY,
+			NULL, 0, FALSE);
+	/* Regexp not checked before is scanned after the shared hit */
+	res->body_more = rspamd_re_cache_process (task, body_more_re,
+			RSPAMD_RE_BODY, NULL, 0, FALSE);
+	/* Results must not be accumulated by the second scan */
+	g_assert_cmpint (rspamd_re_cache_process (task, body_re, RSPAMD_RE_BODY,
+			NULL, 0, FALSE), ==, res->body);
+
+	rspamd_task_free (task);
+}
+
+void
+rspamd_re_cache_test_func (void)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_re_cache *cache, *saved_cache;
+	struct rspamd_re_cache_test_res first, shared, other;
+	rspamd_regexp_t *hdr_re, *body_re, *body_more_re;
+	guint saved_size;
+	guint64 hits = 0;
+
+	cache = rspamd_re_cache_new ();
+	hdr_re = rspamd_re_cache_add (cache, rspamd_regexp_new ("foo", NULL, NULL),
+			RSPAMD_RE_HEADER, "X-Test", sizeof ("X-Test") - 1);
+	body_re = rspamd_re_cache_add (cache, rspamd_regexp_new ("foo", NULL, NULL),
+			RSPAMD_RE_BODY, NULL, 0);
+	body_more_re = rspamd_re_cache_add (cache,
+			rspamd_regexp_new ("bar", NULL, NULL),
+			RSPAMD_RE_BODY, NULL, 0);
+
+	saved_cache = cfg->re_cache;
+	saved_size = cfg->re_cache_shared_size;
+	cfg->re_cache = cache;
+	cfg->re_cache_shared_size = 64;
+	rspamd_re_cache_init (cache, cfg);
+
+	rspamd_re_cache_test_run (cfg, msg_foo, hdr_re, body_re, body_more_re,
+			&first);
+	g_assert_cmpint (first.hdr, ==, 1);
+	g_assert_cmpint (first.body, >, 0);
+	g_assert_cmpint (first.body_more, >, 0);
+
+	/* The same message is loaded from the shared cache */
+	rspamd_re_cache_test_run (cfg, msg_foo, hdr_re, body_re, body_more_re,
+			&shared);
+	g_assert (rspamd_re_cache_get_shared_stat (cache, &hits, NULL));
+	g_assert_cmpuint (hits, ==, 1);
+	g_assert_cmpint (shared.hdr, ==, first.hdr);
+	g_assert_cmpint (shared.body, ==, first.body);
+	g_assert_cmpint (shared.body_more, ==, first.body_more);
+
+	/* Message with other headers does not reuse results */
+	rspamd_re_cache_test_run (cfg, msg_bar, hdr_re, body_re, body_more_re,
+			&other);
+	g_assert (rspamd_re_cache_get_shared_stat (cache, &hits, NULL));
+	g_assert_cmpuint (hits, ==, 1);
+	g_assert_cmpint (other.hdr, ==, 0);
+
+	cfg->re_cache = saved_cache;
+	cfg->re_cache_shared_size = saved_size;
+	rspamd_re_cache_unref (cache);
+}
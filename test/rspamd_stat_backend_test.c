@@ -0,0 +1,462 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/task.h"
+#include "libstat/stat_api.h"
+#include "libstat/stat_internal.h"
+#include "libstat/backends/backends.h"
+#include "ottery.h"
+#include "tests.h"
+
+extern struct rspamd_main *rspamd_main;
+extern struct ev_loop *event_loop;
+
+/*
+ * Checks that statfiles of a backend are resolved in one batch that gives
+ * the same values as resolving them per statfile, and that old and resized
+ * statfiles keep their tokens. Set RSPAMD_TEST_BENCHMARK to compare timings
+ * on large messages.
+ */
+#define NSTATFILES 4
+/* Plus statfiles of a backend without batches, without backend or runtime */
+#define NSLOTS (NSTATFILES + 3)
+static const gint mmap_ids[NSTATFILES] = {0, 2, 4, 6};
+static const gint plain_id = 1, no_backend_id = 3, no_runtime_id = 5;
+
+static guint nmessages = 4;
+static guint ntokens = 512;
+static guint nlearned = 2048;
+static gsize statfile_size = 1024 * 1024;
+static guint nbatches, nplain;
+
+static gpointer
+rspamd_stat_backend_test_statfile (struct rspamd_config *cfg,
+		struct rspamd_classifier_config *clcf,
+		const gchar *fname, gboolean is_spam)
+{
+	struct rspamd_statfile_config *stcf;
+	struct rspamd_statfile *st;
+	gpointer bk;
+
+	stcf = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*stcf));
+	stcf->symbol = is_spam ? "BAYES_SPAM" : "BAYES_HAM";
+	stcf->is_spam = is_spam;
+	stcf->clcf = clcf;
+	stcf->opts = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (stcf->opts, ucl_object_fromstring (fname),
+			"filename", 0, false);
+	ucl_object_insert_key (stcf->opts, ucl_object_fromint (statfile_size),
+			"size", 0, false);
+
+	st = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*st));
+	st->stcf = stcf;
+
+	unlink (fname);
+	bk = rspamd_mmaped_file_init (NULL, cfg, st);
+	g_assert (bk != NULL);
+
+	return bk;
+}
+
+/* Statfile version 1.2 layout, see mmaped_file.c */
+struct rspamd_stat_backend_test_header {
+	u_char magic[3];
+	u_char version[2];
+	u_char padding[3];
+	guint64 create_time;
+	guint64 revision;
+	guint64 rev_time;
+	guint64 used_blocks;
+	guint64 total_blocks;
+	guint64 tokenizer_conf_len;
+	u_char unused[231];
+};
+
+struct rspamd_stat_backend_test_section {
+	guint64 code;
+	guint64 length;
+};
+
+struct rspamd_stat_backend_test_block {
+	guint32 hash1;
+	guint32 hash2;
+	double value;
+};
+
+static const guint old_blocks = 4096;
+
+static rspamd_token_t *
+rspamd_stat_backend_test_token (guint64 data)
+{
+	rspamd_token_t *tok;
+
+	tok = g_malloc0 (sizeof (*tok) + sizeof (float) * NSLOTS);
+	tok->data = data;
+
+	return tok;
+}
+
+static GPtrArray *
+rspamd_stat_backend_test_tokens (guint64 *learned)
+{
+	GPtrArray *tokens;
+	guint i;
+
+	tokens = g_ptr_array_new_full (ntokens, g_free);
+
+	for (i = 0; i < ntokens; i ++) {
+		/* Most tokens of a message are known */
+		if (ottery_rand_range (9) < 7) {
+			g_ptr_array_add (tokens, rspamd_stat_backend_test_token (
+					learned[ottery_rand_range (nlearned - 1)]));
+		}
+		else {
+			g_ptr_array_add (tokens, rspamd_stat_backend_test_token (
+					ottery_rand_uint64 ()));
+		}
+	}
+
+	return tokens;
+}
+
+/*
+ * Writes a statfile of version 1.2 with the specified tokens learned
+ */
+static void
+rspamd_stat_backend_test_old_file (const gchar *fname, guint64 *learned,
+		guint nold)
+{
+	struct rspamd_stat_backend_test_header hdr;
+	struct rspamd_stat_backend_test_section section;
+	struct rspamd_stat_backend_test_block *blocks, *block;
+	guint32 h1, h2;
+	guint i, pos;
+	FILE *f;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, "rsd", sizeof (hdr.magic));
+	memcpy (hdr.version, "12", sizeof (hdr.version));
+	hdr.revision = 10;
+	hdr.used_blocks = nold;
+	hdr.total_blocks = old_blocks;
+	section.code = 1;
+	section.length = old_blocks;
+	blocks = g_malloc0 (sizeof (*blocks) * old_blocks);
+
+	for (i = 0; i < nold; i ++) {
+		memcpy (&h1, (guchar *)&learned[i], sizeof (h1));
+		memcpy (&h2, ((guchar *)&learned[i]) + sizeof (h1), sizeof (h2));
+		pos = h1 % old_blocks;
+
+		while (blocks[pos].hash1 != 0) {
+			pos = (pos + 1) % old_blocks;
+		}
+
+		block = &blocks[pos];
+		block->hash1 = h1;
+		block->hash2 = h2;
+		block->value = i + 1;
+	}
+
+	f = fopen (fname, "w");
+	g_assert (f != NULL);
+	g_assert (fwrite (&hdr, sizeof (hdr), 1, f) == 1);
+	g_assert (fwrite (&section, sizeof (section), 1, f) == 1);
+	g_assert (fwrite (blocks, sizeof (*blocks), old_blocks, f) == old_blocks);
+	fclose (f);
+	g_free (blocks);
+}
+
+static void
+rspamd_stat_backend_test_check_learned (struct rspamd_task *task,
+		gpointer bk, guint64 *learned, guint nold)
+{
+	GPtrArray *tokens;
+	rspamd_token_t *tok;
+	guint i;
+
+	tokens = g_ptr_array_new_full (nold, g_free);
+
+	for (i = 0; i < nold; i ++) {
+		g_ptr_array_add (tokens, rspamd_stat_backend_test_token (learned[i]));
+	}
+
+	rspamd_mmaped_file_process_tokens (task, tokens, 0, bk);
+
+	for (i = 0; i < nold; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+		g_assert_cmpfloat (tok->values[0], ==, i + 1);
+	}
+
+	g_assert_cmpuint (rspamd_mmaped_file_total_learns (task, bk, NULL), ==, 10);
+	g_ptr_array_free (tokens, TRUE);
+}
+
+/*
+ * Checks that a statfile of version 1.2 is converted to buckets when it is
+ * resized and that resized files keep their tokens
+ */
+static void
+rspamd_stat_backend_test_reindex (struct rspamd_config *cfg,
+		struct rspamd_classifier_config *clcf,
+		struct rspamd_task *task,
+		guint64 *learned)
+{
+	struct rspamd_statfile_config *stcf;
+	struct rspamd_statfile *st;
+	gpointer bk;
+	gchar *fname;
+	guint nold = old_blocks / 4;
+
+	fname = g_strdup_printf ("%s/rspamd-test-old-%d.bayes",
+			g_get_tmp_dir (), (gint)getpid ());
+	rspamd_stat_backend_test_old_file (fname, learned, nold);
+
+	stcf = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*stcf));
+	stcf->symbol = "BAYES_SPAM";
+	stcf->is_spam = TRUE;
+	stcf->clcf = clcf;
+	stcf->opts = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (stcf->opts, ucl_object_fromstring (fname),
+			"filename", 0, false);
+	ucl_object_insert_key (stcf->opts, ucl_object_fromint (statfile_size),
+			"size", 0, false);
+	st = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*st));
+	st->stcf = stcf;
+
+	/* Version 1.2 is converted */
+	bk = rspamd_mmaped_file_init (NULL, cfg, st);
+	g_assert (bk != NULL);
+	rspamd_stat_backend_test_check_learned (task, bk, learned, nold);
+	rspamd_mmaped_file_close (bk);
+
+	/* Version 1.3 is resized */
+	ucl_object_replace_key (stcf->opts, ucl_object_fromint (statfile_size * 2),
+			"size", 0, false);
+	bk = rspamd_mmaped_file_init (NULL, cfg, st);
+	g_assert (bk != NULL);
+	rspamd_stat_backend_test_check_learned (task, bk, learned, nold);
+	rspamd_mmaped_file_close (bk);
+
+	unlink (fname);
+	g_free (fname);
+}
+
+static gboolean
+rspamd_stat_backend_test_batch (struct rspamd_task *task, GPtrArray *tokens,
+		const gint *ids, gpointer *runtimes, guint nrt)
+{
+	nbatches ++;
+	g_assert_cmpuint (nrt, ==, NSTATFILES);
+
+	return rspamd_mmaped_file_process_tokens_batch (task, tokens, ids,
+			runtimes, nrt);
+}
+
+static gboolean
+rspamd_stat_backend_test_plain (struct rspamd_task *task, GPtrArray *tokens,
+		gint id, gpointer ctx)
+{
+	rspamd_token_t *tok;
+	guint i;
+
+	nplain ++;
+
+	PTR_ARRAY_FOREACH (tokens, i, tok) {
+		tok->values[id] = id + 100;
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_stat_backend_test_func (void)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_classifier_config *clcf, *nobk_clcf;
+	struct rspamd_tokenizer_config *tkcf;
+	struct rspamd_stat_backend mmap_bk, plain_bk;
+	struct rspamd_classifier cl, nobk_cl;
+	struct rspamd_statfile sts[NSLOTS];
+	struct rspamd_stat_ctx st_ctx;
+	struct rspamd_task *task;
+	GPtrArray *learn, *message;
+	rspamd_token_t *tok;
+	gpointer runtimes[NSTATFILES];
+	gchar *fnames[NSTATFILES];
+	guint64 *learned;
+	gfloat *single;
+	gdouble t1, t_single = 0, t_batch = 0;
+	gboolean bench = g_getenv ("RSPAMD_TEST_BENCHMARK") != NULL;
+	guint i, j, k, nfound;
+
+	if (bench) {
+		nmessages = 50;
+		ntokens = 12000;
+		nlearned = 200000;
+		statfile_size = 32 * 1024 * 1024;
+	}
+
+	tkcf = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*tkcf));
+	tkcf->name = "osb";
+	clcf = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*clcf));
+	clcf->tokenizer = tkcf;
+	nobk_clcf = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*nobk_clcf));
+	nobk_clcf->tokenizer = tkcf;
+	nobk_clcf->flags |= RSPAMD_FLAG_CLASSIFIER_NO_BACKEND;
+
+	memset (&mmap_bk, 0, sizeof (mmap_bk));
+	mmap_bk.name = "mmap";
+	mmap_bk.process_tokens = rspamd_mmaped_file_process_tokens;
+	mmap_bk.process_tokens_batch = rspamd_stat_backend_test_batch;
+	memset (&plain_bk, 0, sizeof (plain_bk));
+	plain_bk.name = "plain";
+	plain_bk.process_tokens = rspamd_stat_backend_test_plain;
+
+	memset (&cl, 0, sizeof (cl));
+	cl.cfg = clcf;
+	memset (&nobk_cl, 0, sizeof (nobk_cl));
+	nobk_cl.cfg = nobk_clcf;
+
+	memset (&st_ctx, 0, sizeof (st_ctx));
+	st_ctx.statfiles = g_ptr_array_new ();
+	memset (sts, 0, sizeof (sts));
+
+	for (i = 0; i < NSLOTS; i ++) {
+		sts[i].id = i;
+		sts[i].classifier = (gint)i == no_backend_id ? &nobk_cl : &cl;
+		sts[i].backend = (gint)i == plain_id ? &plain_bk : &mmap_bk;
+		g_ptr_array_add (st_ctx.statfiles, &sts[i]);
+	}
+
+	for (j = 0; j < NSTATFILES; j ++) {
+		fnames[j] = g_strdup_printf ("%s/rspamd-test-%ud-%d.bayes",
+				g_get_tmp_dir (), j, (gint)getpid ());
+		runtimes[j] = rspamd_stat_backend_test_statfile (cfg, clcf, fnames[j],
+				j % 2 == 0);
+	}
+
+	task = rspamd_task_new (NULL, cfg, NULL, NULL, event_loop, FALSE);
+	task->stat_runtimes = g_ptr_array_sized_new (NSLOTS);
+	g_ptr_array_set_size (task->stat_runtimes, NSLOTS);
+
+	for (j = 0; j < NSTATFILES; j ++) {
+		g_ptr_array_index (task->stat_runtimes, mmap_ids[j]) = runtimes[j];
+	}
+
+	/* Must be skipped by its classifier flag, not by a missing runtime */
+	g_ptr_array_index (task->stat_runtimes, no_backend_id) = runtimes[0];
+	g_ptr_array_index (task->stat_runtimes, plain_id) = runtimes[0];
+	g_ptr_array_index (task->stat_runtimes, no_runtime_id) = NULL;
+
+	learned = g_malloc (sizeof (*learned) * nlearned);
+	single = g_malloc (sizeof (*single) * ntokens * NSTATFILES);
+
+	for (i = 0; i < nlearned; i ++) {
+		learned[i] = ottery_rand_uint64 ();
+	}
+
+	/* Each statfile learns its own subset with its own values */
+	for (j = 0; j < NSTATFILES; j ++) {
+		learn = g_ptr_array_new_full (nlearned, g_free);
+
+		for (i = 0; i < nlearned; i ++) {
+			if (i % (j + 1) == 0) {
+				tok = rspamd_stat_backend_test_token (learned[i]);
+				tok->values[mmap_ids[j]] = i % 17 + j + 1;
+				g_ptr_array_add (learn, tok);
+			}
+		}
+
+		rspamd_mmaped_file_learn_tokens (task, learn, mmap_ids[j], runtimes[j]);
+		g_ptr_array_free (learn, TRUE);
+	}
+
+	for (i = 0; i < nmessages; i ++) {
+		message = rspamd_stat_backend_test_tokens (learned);
+		t1 = rspamd_get_virtual_ticks ();
+
+		for (j = 0; j < NSTATFILES; j ++) {
+			rspamd_mmaped_file_process_tokens (task, message, mmap_ids[j],
+					runtimes[j]);
+		}
+
+		t_single += rspamd_get_virtual_ticks () - t1;
+
+		for (k = 0, nfound = 0; k < ntokens; k ++) {
+			tok = g_ptr_array_index (message, k);
+
+			for (j = 0; j < NSTATFILES; j ++) {
+				single[k * NSTATFILES + j] = tok->values[mmap_ids[j]];
+				nfound += tok->values[mmap_ids[j]] > 0 ? 1 : 0;
+			}
+
+			for (j = 0; j < NSLOTS; j ++) {
+				tok->values[j] = -1;
+			}
+		}
+
+		/* Make sure we compare something besides zeroes */
+		g_assert_cmpuint (nfound, >, 0);
+
+		nbatches = 0;
+		nplain = 0;
+		task->tokens = message;
+		t1 = rspamd_get_virtual_ticks ();
+		rspamd_stat_backends_process (&st_ctx, task);
+		t_batch += rspamd_get_virtual_ticks () - t1;
+		task->tokens = NULL;
+
+		/* All mmap statfiles are resolved at once */
+		g_assert_cmpuint (nbatches, ==, 1);
+		g_assert_cmpuint (nplain, ==, 1);
+
+		for (k = 0; k < ntokens; k ++) {
+			tok = g_ptr_array_index (message, k);
+
+			for (j = 0; j < NSTATFILES; j ++) {
+				g_assert (single[k * NSTATFILES + j] == tok->values[mmap_ids[j]]);
+			}
+
+			g_assert (tok->values[plain_id] == plain_id + 100);
+			g_assert (tok->values[no_backend_id] == -1);
+			g_assert (tok->values[no_runtime_id] == -1);
+		}
+
+		g_ptr_array_free (message, TRUE);
+	}
+
+	if (bench) {
+		msg_notice ("classified %ud messages of %ud tokens with %d statfiles: "
+				"per statfile: %.3f, batched: %.3f",
+				nmessages, ntokens, NSTATFILES, t_single, t_batch);
+	}
+
+	rspamd_stat_backend_test_reindex (cfg, clcf, task, learned);
+
+	g_free (learned);
+	g_free (single);
+	g_ptr_array_free (task->stat_runtimes, TRUE);
+	task->stat_runtimes = NULL;
+	rspamd_task_free (task);
+	g_ptr_array_free (st_ctx.statfiles, TRUE);
+
+	for (j = 0; j < NSTATFILES; j ++) {
+		rspamd_mmaped_file_close (runtimes[j]);
+		unlink (fnames[j]);
+		g_free (fnames[j]);
+	}
+}
@@ -0,0 +1,129 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/task.h"
+#include "libserver/rspamd_symcache.h"
+#include "tests.h"
+
+extern struct rspamd_main *rspamd_main;
+extern struct ev_loop *event_loop;
+
+/*
+ * Checks that all symbols run after their dependencies, set
+ * RSPAMD_TEST_BENCHMARK to measure the overhead on a large cache
+ */
+static guint nsymbols = 100;
+static guint ntasks = 10;
+/* Each n-th symbol depends on the previous one */
+static const guint dep_ratio = 10;
+
+static guint calls = 0;
+/* Task number when a symbol has been called last time, starting from 1 */
+static guint *called_in;
+
+static void
+rspamd_symcache_test_noop (struct rspamd_task *task,
+		struct rspamd_symcache_item *item,
+		gpointer ud)
+{
+	guint i = GPOINTER_TO_UINT (ud), cur = calls / nsymbols + 1;
+
+	if (i > 0 && i % dep_ratio == 0) {
+		g_assert_cmpuint (called_in[i - 1], ==, cur);
+	}
+
+	g_assert_cmpuint (called_in[i], <, cur);
+	called_in[i] = cur;
+	calls ++;
+	rspamd_symcache_finalize_item (task, item);
+}
+
+static gdouble
+rspamd_symcache_test_run (struct rspamd_config *cfg,
+		struct rspamd_symcache *cache)
+{
+	struct rspamd_task *task;
+	gdouble t1, t2;
+	guint i;
+
+	t1 = rspamd_get_virtual_ticks ();
+
+	for (i = 0; i < ntasks; i ++) {
+		task = rspamd_task_new (NULL, cfg, NULL, NULL, event_loop, FALSE);
+		task->s = rspamd_session_create (task->task_pool, NULL, NULL, NULL,
+				task);
+		task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
+
+		g_assert (rspamd_symcache_process_symbols (task, cache,
+				RSPAMD_TASK_STAGE_FILTERS));
+		g_assert_cmpuint (calls, ==, nsymbols * (i + 1));
+		rspamd_task_free (task);
+	}
+
+	t2 = rspamd_get_virtual_ticks ();
+
+	return t2 - t1;
+}
+
+void
+rspamd_symcache_test_func (void)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_symcache *cache, *saved_cache;
+	gboolean bench = g_getenv ("RSPAMD_TEST_BENCHMARK") != NULL;
+	gchar name[64];
+	gint id;
+	guint i;
+	gdouble t;
+
+	if (bench) {
+		nsymbols = 3000;
+		ntasks = 1000;
+	}
+
+	cache = rspamd_symcache_new (cfg);
+	called_in = g_malloc0 (sizeof (*called_in) * nsymbols);
+
+	for (i = 0; i < nsymbols; i ++) {
+		rspamd_snprintf (name, sizeof (name), "SYMCACHE_TEST_%ud", i);
+		id = rspamd_symcache_add_symbol (cache, name, 0,
+				rspamd_symcache_test_noop, GUINT_TO_POINTER (i),
+				SYMBOL_TYPE_NORMAL, -1);
+		g_assert (id >= 0);
+
+		if (i > 0 && i % dep_ratio == 0) {
+			rspamd_snprintf (name, sizeof (name), "SYMCACHE_TEST_%ud", i - 1);
+			rspamd_symcache_add_dependency (cache, id, name, -1);
+		}
+	}
+
+	saved_cache = cfg->cache;
+	cfg->cache = cache;
+	rspamd_symcache_init (cache);
+
+	t = rspamd_symcache_test_run (cfg, cache);
+	g_assert (calls == nsymbols * ntasks);
+
+	if (bench) {
+		msg_notice ("symcache overhead: %ud symbols, %ud tasks, "
+				"total: %1.5f, per task: %1.5f ms",
+				nsymbols, ntasks, t, t * 1000.0 / (gdouble)ntasks);
+	}
+
+	cfg->cache = saved_cache;
+	rspamd_symcache_destroy (cache);
+	g_free (called_in);
+}
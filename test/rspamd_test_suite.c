@@ -83,6 +83,12 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/heap", rspamd_heap_test_func);
 	g_test_add_func ("/rspamd/lua_pcall", rspamd_lua_lua_pcall_vs_resume_test_func);
+	g_test_add_func ("/rspamd/symcache", rspamd_symcache_test_func);
+	g_test_add_func ("/rspamd/expression", rspamd_expression_test_func);
+	g_test_add_func ("/rspamd/stat_backend", rspamd_stat_backend_test_func);
+	g_test_add_func ("/rspamd/osb", rspamd_osb_test_func);
+	g_test_add_func ("/rspamd/fuzzy_backend", rspamd_fuzzy_backend_test_func);
+	g_test_add_func ("/rspamd/re_cache", rspamd_re_cache_test_func);
 
 #if 0
 	g_test_add_func ("/rspamd/http", rspamd_http_test_func);
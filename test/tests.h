@@ -44,6 +44,18 @@ void rspamd_heap_test_func (void);
 
 void rspamd_lua_lua_pcall_vs_resume_test_func (void);
 
+void rspamd_symcache_test_func (void);
+
+void rspamd_expression_test_func (void);
+
+void rspamd_stat_backend_test_func (void);
+
+void rspamd_osb_test_func (void);
+
+void rspamd_fuzzy_backend_test_func (void);
+
+void rspamd_re_cache_test_func (void);
+
 #ifdef  __cplusplus
 }
 #endif